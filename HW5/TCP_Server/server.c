@@ -12,6 +12,9 @@
 #include<errno.h>
 #include<signal.h>
 
+#include "framer/line_framer.h"
+#include "timeout/recv_timeout.h"
+
 #define BACKLOG 20
 #define BUFF_SIZE 4096
 #define ACCOUNT_FILE "account.txt"
@@ -34,15 +37,7 @@ typedef struct {
     char* username;
 } Session;
 
-/**
- * @struct ClientConn
- * @brief Structure to store client connection with leftover buffer
- */
-typedef struct {
-    int sockfd;
-    char leftover[BUFF_SIZE];
-    int leftover_len;
-} ClientConn;
+RecvTimeoutConfig timeouts = {RECV_TIMEOUT_IDLE, RECV_TIMEOUT_HANDSHAKE, RECV_TIMEOUT_LOGIN};
 
 /**
  * @function sig_chld
@@ -119,61 +114,6 @@ int load_account(const char* inputUsername, Account* acc){
     return foundUser; 
 }
 
-/**
- * @function recv_until_delim
- * @brief Receive data from socket until delimiter is encountered.
- *
- * @param client Pointer to ClientConn structure containing socket and leftover buffer.
- * @param out_buf Buffer to store the received message (without delimiter).
- * @param max_len Maximum size of out_buf.
- * @param delim Delimiter string to search for (e.g., "\r\n").
- * @return Number of bytes in the message (excluding delimiter), 0 if connection closed, -1 on error.
- *
- * @details
- *  - First checks if there's leftover data from previous recv() calls.
- *  - Continuously receives data from socket until delimiter is found.
- *  - Extracts one complete message and stores remainder in client->leftover.
- *  - Null-terminates the message in out_buf.
- *  - Handles buffer overflow by limiting bytes received to max_len.
- *  - Supports pipelined messages (multiple messages in one TCP packet).
- */
-int recv_until_delim(ClientConn *client, char *out_buf, int max_len, const char *delim) {
-    char temp_buf[BUFF_SIZE];
-    int total_len = 0;
-
-    if (client->leftover_len > 0) {
-        memcpy(out_buf, client->leftover, client->leftover_len);
-        total_len = client->leftover_len;
-        client->leftover_len = 0;
-    }
-
-    while (1) {
-        char *delim_pos = strstr(out_buf, delim);
-        if (delim_pos) {
-            int msg_len = delim_pos - out_buf; 
-            out_buf[msg_len] = '\0';
-
-            int remain_len = total_len - (msg_len + strlen(delim));
-            if (remain_len > 0) {
-                memcpy(client->leftover, delim_pos + strlen(delim), remain_len);
-                client->leftover_len = remain_len;
-            }
-            return msg_len;
-        }
-
-        int bytes_recv = recv(client->sockfd, temp_buf, sizeof(temp_buf), 0);
-        if (bytes_recv <= 0)
-            return bytes_recv; 
-
-        if (total_len + bytes_recv >= max_len)
-            bytes_recv = max_len - total_len - 1;
-
-        memcpy(out_buf + total_len, temp_buf, bytes_recv);
-        total_len += bytes_recv;
-        out_buf[total_len] = '\0';
-    }
-}
-
 /**
  * @function send_response
  * @brief Send response message to client with format: "CODE\r\n".
@@ -303,6 +243,38 @@ void process_bye_command(Session* session, int sockfd){
     }
 }
 
+/**
+ * @function read_command
+ * @brief Receive the next command line, every recv() bounded by the connection deadlines.
+ *
+ * @param framer LineFramer of the connection.
+ * @param timeout Deadlines of the connection.
+ * @param sockfd Socket descriptor of the client.
+ * @param logged_in 1 if the session is logged in.
+ * @param line Set to the line, as by line_framer_read_line().
+ * @param len Set to the line length.
+ * @return As line_framer_read_line(); -1 with recv_timeout_expired() naming
+ *         the timeout when a deadline passed.
+ *
+ * @details
+ *  - Serves buffered lines without touching the socket.
+ *  - Re-arms the timeout before each recv() with the time left to the
+ *    nearest deadline. line_framer_read_line() may call recv() several
+ *    times for one line, and each call would get the full timeout again,
+ *    so a client trickling bytes without CRLF was never closed.
+ */
+int read_command(LineFramer* framer, RecvTimeout* timeout, int sockfd, int logged_in,
+                 char** line, size_t* len){
+    while(1){
+        int ret = line_framer_next(framer, line, len);
+        if(ret != 0) return ret;
+
+        if(recv_timeout_arm(timeout, sockfd, logged_in) == -1) return -1;
+        ssize_t n = line_framer_fill(framer, sockfd);
+        if(n <= 0) return (int)n;
+    }
+}
+
 /**
  * @function handle_client
  * @brief Handle client connection and process commands.
@@ -312,24 +284,29 @@ void process_bye_command(Session* session, int sockfd){
  * @param client_port Client port number.
  *
  * @details
- *  - Initializes ClientConn and Session structures.
+ *  - Initializes a LineFramer and the Session structure.
  *  - Sends initial 100 response code (connection successful).
  *  - Enters main loop to receive and process commands.
- *  - Uses recv_until_delim() to receive messages with "\r\n" delimiter.
+ *  - Uses read_command() to receive messages with "\r\n" delimiter.
  *  - Parses command using sscanf() to extract command name and arguments.
  *  - Supports commands: USER, POST, BYE.
- *  - Sends 300 for unknown commands.
- *  - Breaks loop when client disconnects (recv returns <= 0).
+ *  - Sends 300 for unknown commands and for an empty line; the old
+ *    recv_until_delim() returned 0 for an empty line, which ended the
+ *    connection as if the client had closed it.
+ *  - Breaks loop when client disconnects, on error or on a line longer than BUFF_SIZE - 1.
+ *  - Closes connections that complete no command within the idle timeout, send no
+ *    command within the handshake timeout or do not log in within the login timeout.
  *  - Frees session->username and closes socket before returning.
  */
 void handle_client(int sockfd, char* client_ip, int client_port){
-    char buff[BUFF_SIZE];
-    int received_bytes;
+    char* buff;
+    size_t buff_len;
     Session session;
-    ClientConn client;
+    LineFramer framer;
+    RecvTimeout timeout;
     
-    client.sockfd = sockfd;
-    client.leftover_len = 0;
+    line_framer_init(&framer, BUFF_SIZE - 1, "\r\n");
+    recv_timeout_init(&timeout, &timeouts);
     
     session.logged_in = 0;
     session.username = malloc(1);
@@ -344,11 +321,13 @@ void handle_client(int sockfd, char* client_ip, int client_port){
     send_response(sockfd, "100");//Connection successful
     
     while(1){
-        received_bytes = recv_until_delim(&client, buff, BUFF_SIZE, "\r\n");
-        if(received_bytes <= 0){
-            printf("Client [%s:%d] disconnected\n", client_ip, client_port);
+        if(read_command(&framer, &timeout, sockfd, session.logged_in, &buff, &buff_len) <= 0){
+            const char* expired = recv_timeout_expired(&timeout);
+            if(expired) printf("Client [%s:%d] closed after %s timeout\n", client_ip, client_port, expired);
+            else printf("Client [%s:%d] disconnected\n", client_ip, client_port);
             break;
         }
+        recv_timeout_command(&timeout);
         
         printf("Received: [%s:%d] %s\n", client_ip, client_port, buff);
         
@@ -372,16 +351,31 @@ void handle_client(int sockfd, char* client_ip, int client_port){
             send_response(sockfd, "300");//Unknown message type
     }
     free(session.username);
+    line_framer_destroy(&framer);
     close(sockfd);
 }
 
 int main(int argc, char* argv[]){
-    if(argc != 2){
-        fprintf(stderr,"Usage: ./server Port_Number\n");
+    int opt_char;
+    while((opt_char = getopt(argc, argv, "t:")) != -1){
+        switch(opt_char){
+            case 't':
+                if(recv_timeout_parse(&timeouts, optarg) == -1){
+                    fprintf(stderr, "Invalid timeouts for -t: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr,"Usage: ./server [-t idle=300,handshake=30,login=120] Port_Number\n");
+                exit(1);
+        }
+    }
+    if(optind != argc - 1){
+        fprintf(stderr,"Usage: ./server [-t idle=300,handshake=30,login=120] Port_Number\n");
         exit(1); 
     }
     
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
     
     int listen_sock, conn_sock;
     struct sockaddr_in server_addr;
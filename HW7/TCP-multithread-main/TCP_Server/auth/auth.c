@@ -104,15 +104,22 @@ int processUSER(char *username, int *logged_in, int *current_index,
 
 /**
  * @brief Process POST command
+ * - description
+ *   Appends the article to the post log and waits until its group commit
+ *   is on disk: 120 is only returned for a durable post. Posts from
+ *   other client threads waiting at the same time share the fdatasync.
+ * @return 120 when stored, 221 when not logged in, 500 when the log
+ *         rejected or failed to store it
  */
-int processPOST(char *content, int logged_in)
+int processPOST(PostLog *posts, const char *username, char *content, int logged_in)
 {
-    (void)content; // Suppress unused parameter warning
-
     if (!logged_in)
         return 221; // not logged in
 
-    // Here you can add logic to save the post to a file or database
+    uint64_t lsn = post_log_append(posts, username, content, strlen(content));
+    if (lsn == 0 || post_log_wait(posts, lsn) == -1)
+        return 500; // not stored
+
     return 120; // post successful
 }
 
@@ -5,6 +5,7 @@
 #include <pthread.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include "postlog/post_log.h"
 
 // Forward declaration
 typedef struct Session Session;
@@ -25,7 +26,7 @@ int processUSER(char *username, int *logged_in, int *current_index,
                 int sockfd, Session *sessions, int max_sessions,
                 pthread_mutex_t *session_mutex);
 
-int processPOST(char *content, int logged_in);
+int processPOST(PostLog *posts, const char *username, char *content, int logged_in);
 
 int processBYE(int *logged_in, int sockfd, Session *sessions, int max_sessions, pthread_mutex_t *session_mutex);
 
@@ -6,15 +6,22 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <pthread.h>
+#include <errno.h>
 
 #define MAX_BUFFER 4096
 
 /**
  * @brief Handle protocol communication with session management
+ * - description
+ *   Closes the connection when no complete command arrives within the idle
+ *   timeout, none within the handshake timeout or it does not log in in time.
+ *   POST replies 120 only once the article is durable in the post log.
  */
 void handle_protocol_with_session(int sockfd, User users[], int user_count,
                                   void *sessions_void, int max_sessions,
-                                  pthread_mutex_t *session_mutex)
+                                  pthread_mutex_t *session_mutex,
+                                  const RecvTimeoutConfig *timeouts,
+                                  PostLog *posts)
 {
     // Cast void* to Session*
     Session *sessions = (Session *)sessions_void;
@@ -26,10 +33,15 @@ void handle_protocol_with_session(int sockfd, User users[], int user_count,
     int buffer_len = 0;
     int len;
 
+    RecvTimeout timeout;
+    recv_timeout_init(&timeout, timeouts);
+
     // Send welcome message per protocol
     send(sockfd, "100 Welcome to server\n", strlen("100 Welcome to server\n"), 0);
 
-    while ((len = recv(sockfd, buffer + buffer_len, MAX_BUFFER - buffer_len - 1, 0)) > 0)
+    // Each read waits at most until the nearest idle/handshake/login deadline
+    while (recv_timeout_arm(&timeout, sockfd, logged_in) == 0 &&
+           (len = recv(sockfd, buffer + buffer_len, MAX_BUFFER - buffer_len - 1, 0)) > 0)
     {
         buffer_len += len;
         buffer[buffer_len] = '\0';
@@ -49,6 +61,7 @@ void handle_protocol_with_session(int sockfd, User users[], int user_count,
             }
 
             printf("[Client %d Command] %s\n", sockfd, buffer);
+            recv_timeout_command(&timeout);
 
             char cmd[10] = {0};
             char arg[512] = {0};
@@ -82,7 +95,8 @@ void handle_protocol_with_session(int sockfd, User users[], int user_count,
             }
             else if (strcmp(cmd, "POST") == 0)
             {
-                int code = processPOST(arg, logged_in);
+                const char *author = current_user_index >= 0 ? users[current_user_index].name : "";
+                int code = processPOST(posts, author, arg, logged_in);
 
                 if (code == 120)
                 {
@@ -96,6 +110,8 @@ void handle_protocol_with_session(int sockfd, User users[], int user_count,
                 }
                 else if (code == 221)
                     sprintf(res, "221 You must login first\n");
+                else if (code == 500)
+                    sprintf(res, "500 Post could not be stored\n");
                 else
                     sprintf(res, "300 Undefined command\n");
 
@@ -131,5 +147,9 @@ void handle_protocol_with_session(int sockfd, User users[], int user_count,
         }
     }
 
-    printf("[Client %d] Disconnected.\n", sockfd);
+    const char *expired = recv_timeout_expired(&timeout);
+    if (expired)
+        printf("[Client %d] Closed after %s timeout.\n", sockfd, expired);
+    else
+        printf("[Client %d] Disconnected.\n", sockfd);
 }
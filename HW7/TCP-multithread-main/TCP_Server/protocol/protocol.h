@@ -4,7 +4,8 @@
 #include <pthread.h>
 #include "../user/user.h"
 #include "../auth/auth.h"
+#include "timeout/recv_timeout.h"
 
-void handle_protocol_with_session(int sockfd, User users[], int user_count, void *sessions, int max_sessions, pthread_mutex_t *session_mutex);
+void handle_protocol_with_session(int sockfd, User users[], int user_count, void *sessions, int max_sessions, pthread_mutex_t *session_mutex, const RecvTimeoutConfig *timeouts, PostLog *posts);
 
 #endif
\ No newline at end of file
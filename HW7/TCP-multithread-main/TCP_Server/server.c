@@ -23,6 +23,12 @@ int session_count = 0;
 User users[MAX_USERS];
 int user_count = 0;
 
+RecvTimeoutConfig timeouts = {RECV_TIMEOUT_IDLE, RECV_TIMEOUT_HANDSHAKE, RECV_TIMEOUT_LOGIN};
+
+PostLog post_log;
+const char *post_dir = "posts";
+unsigned post_delay_us = POST_LOG_DEFAULT_DELAY_US;
+
 /**
  * @brief Find session index by socket descriptor
  * @return Session index if found, -1 otherwise
@@ -181,7 +187,7 @@ void *client_handler(void *arg)
 
     // Handle protocol
     handle_protocol_with_session(connfd, users, user_count,
-                                 sessions, MAX_SESSIONS, &session_mutex);
+                                 sessions, MAX_SESSIONS, &session_mutex, &timeouts, &post_log);
 
     // Remove session after client disconnects
     remove_session(connfd);
@@ -191,6 +197,28 @@ void *client_handler(void *arg)
     return NULL;
 }
 
+/**
+ * @brief Parse "dir[,max_delay_us]" for -P
+ * @return 0 on success, -1 on an empty directory or a bad delay
+ */
+int parse_post_log(char *spec)
+{
+    char *comma = strchr(spec, ',');
+    if (comma)
+    {
+        char *end;
+        long delay = strtol(comma + 1, &end, 10);
+        if (end == comma + 1 || *end != '\0' || delay < 0 || delay > 1000000)
+            return -1;
+        post_delay_us = (unsigned)delay;
+        *comma = '\0';
+    }
+    if (*spec == '\0')
+        return -1;
+    post_dir = spec;
+    return 0;
+}
+
 /**
  * @brief TCP Server Application with Multi-threading
  * - description
@@ -200,13 +228,37 @@ void *client_handler(void *arg)
  */
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    int opt_char;
+    while ((opt_char = getopt(argc, argv, "t:P:")) != -1)
+    {
+        switch (opt_char)
+        {
+        case 't':
+            if (recv_timeout_parse(&timeouts, optarg) == -1)
+            {
+                printf("Invalid timeouts for -t: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            if (parse_post_log(optarg) == -1)
+            {
+                printf("Invalid post log for -P: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            printf("Usage: %s [-t idle=300,handshake=30,login=120] [-P posts_dir[,max_delay_us]] <Server_Port>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1)
     {
-        printf("Usage: %s <Server_Port>\n", argv[0]);
+        printf("Usage: %s [-t idle=300,handshake=30,login=120] [-P posts_dir[,max_delay_us]] <Server_Port>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    int PORT = atoi(argv[1]);
+    int PORT = atoi(argv[optind]);
     if (PORT <= 0)
     {
         printf("Invalid port number.\n");
@@ -223,6 +275,19 @@ int main(int argc, char *argv[])
     // Initialize sessions
     memset(sessions, 0, sizeof(sessions));
 
+    // Open the post log; concurrent POSTs share one fdatasync per group commit
+    if (post_log_open(&post_log, post_dir, post_delay_us) == -1 ||
+        post_log_start(&post_log, NULL, NULL) == -1)
+    {
+        perror("post log error");
+        exit(EXIT_FAILURE);
+    }
+    if (post_log.recovered || post_log.truncated)
+    {
+        printf("Post log: recovered %llu posts, cut %llu torn bytes\n",
+               (unsigned long long)post_log.recovered, (unsigned long long)post_log.truncated);
+    }
+
     int listen_sock, *conn_sock;
     struct sockaddr_in server_addr, client_addr;
     pthread_t tid;
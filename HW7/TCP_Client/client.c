@@ -153,6 +153,7 @@ int recv_until_delim(ClientConn *client, char *out_buf, int max_len, const char
  *    + 221: Not logged in
  *    + 300: Unknown message type
  *    + 500: Internal server error
+ *    + 503: Server busy, command not run
  *  - Prints "Connection lost!" if recv returns <= 0.
  *  - Returns 0 on connection loss, 1 otherwise.
  */
@@ -182,6 +183,8 @@ int handle_server_response(ClientConn* client, char* buff) {
             printf("[Server] 300 Unknown message type\n");
         else if(strcmp(code, "500") == 0)
             printf("[Server] 500 Internal server error\n");
+        else if(strcmp(code, "503") == 0)
+            printf("[Server] 503 Server busy, try again later\n");
         else
             printf("[Server] Unknown response: %s\n", code);
         
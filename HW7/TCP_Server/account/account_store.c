@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+#include "account_store.h"
+#include "../log/log.h"
+
+/*
+ * Readers never lock. The store keeps two snapshot slots; current says
+ * which one is live and readers[i] counts readers inside slot i. A
+ * reader registers in a slot, then confirms the slot is still current
+ * before touching it. The reloader (one at a time, reload_mutex) builds
+ * the new snapshot in the other slot, waiting for late readers of that
+ * slot to leave before freeing what was there, then flips current.
+ */
+static AccountSnapshot* snapshots[2];
+static atomic_int readers[2];
+static atomic_int current = 0;
+static pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char account_path[PATH_MAX];
+
+static uint32_t hash_username(const char* s){
+    uint32_t h = 2166136261u;
+    while(*s){
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+static void snapshot_free(AccountSnapshot* snap){
+    if(!snap) return;
+    for(size_t i = 0; i <= snap->mask; i++){
+        free(snap->table[i].username);
+    }
+    free(snap->table);
+    free(snap);
+}
+
+/**
+ * @function snapshot_insert
+ * @brief Add an account unless the username is already present
+ *
+ * @return 0 on success (or duplicate), -1 if out of memory
+ *
+ * @note The first line for a username wins, as with the old file scan
+ */
+static int snapshot_insert(AccountSnapshot* snap, const char* username, int status){
+    uint32_t hash = hash_username(username);
+    size_t i = hash & snap->mask;
+
+    while(snap->table[i].hash){
+        if(snap->table[i].hash == hash && strcmp(snap->table[i].username, username) == 0){
+            return 0;
+        }
+        i = (i + 1) & snap->mask;
+    }
+
+    snap->table[i].username = strdup(username);
+    if(!snap->table[i].username) return -1;
+    snap->table[i].status = status;
+    snap->table[i].hash = hash;
+    snap->count++;
+    return 0;
+}
+
+/**
+ * @function snapshot_grow
+ * @brief Double the table so it stays at most half full
+ */
+static int snapshot_grow(AccountSnapshot* snap){
+    size_t old_size = snap->mask + 1;
+    Account* old_table = snap->table;
+
+    snap->table = calloc(old_size * 2, sizeof(Account));
+    if(!snap->table){
+        snap->table = old_table;
+        return -1;
+    }
+    snap->mask = old_size * 2 - 1;
+
+    for(size_t i = 0; i < old_size; i++){
+        if(!old_table[i].hash) continue;
+        size_t j = old_table[i].hash & snap->mask;
+        while(snap->table[j].hash) j = (j + 1) & snap->mask;
+        snap->table[j] = old_table[i];
+    }
+    free(old_table);
+    return 0;
+}
+
+/**
+ * @function snapshot_load
+ * @brief Read the account file into a new snapshot
+ *
+ * @return New snapshot, NULL if the file cannot be read or memory runs out
+ *
+ * @details
+ *  - Line format: "username status" (space or tab separated)
+ *  - Lines without both fields are skipped
+ */
+static AccountSnapshot* snapshot_load(const char* path){
+    FILE* f = fopen(path, "r");
+    if(!f) return NULL;
+
+    AccountSnapshot* snap = calloc(1, sizeof(AccountSnapshot));
+    if(snap){
+        snap->mask = 63;
+        snap->table = calloc(snap->mask + 1, sizeof(Account));
+        if(!snap->table){
+            free(snap);
+            snap = NULL;
+        }
+    }
+
+    char* line = NULL;
+    size_t lineSize = 0;
+    while(snap && getline(&line, &lineSize, f) > 0){
+        char* username = strtok(line, " \t\r\n");
+        char* statusStr = strtok(NULL, " \t\r\n");
+        if(!username || !statusStr) continue;
+
+        if((snap->count + 1) * 2 > snap->mask + 1 && snapshot_grow(snap) == -1){
+            snapshot_free(snap);
+            snap = NULL;
+            break;
+        }
+        if(snapshot_insert(snap, username, atoi(statusStr)) == -1){
+            snapshot_free(snap);
+            snap = NULL;
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return snap;
+}
+
+/**
+ * @function account_store_init
+ * @brief Remember the account file and load the first snapshot
+ *
+ * @param path Account file path
+ * @return 0 if loaded, -1 if the file could not be read (lookups then
+ *         fail until a reload succeeds)
+ */
+int account_store_init(const char* path){
+    strncpy(account_path, path, sizeof(account_path) - 1);
+    account_path[sizeof(account_path) - 1] = '\0';
+    return account_store_reload();
+}
+
+/**
+ * @function account_store_reload
+ * @brief Re-read the account file and publish it as the current snapshot
+ *
+ * @return 0 on success, -1 if the file could not be read; the previous
+ *         snapshot then stays in use
+ *
+ * @details
+ *  - The file is parsed before anything is published, so readers see
+ *    either the old or the new index, never a partial one
+ *  - The inactive slot still holds the snapshot before the current one;
+ *    it is freed once readers that raced with the last flip have left
+ *
+ * @thread_safety Reloads are serialized by reload_mutex; lookups may run
+ *                concurrently
+ */
+int account_store_reload(void){
+    AccountSnapshot* snap = snapshot_load(account_path);
+    if(!snap){
+        LOG(LOG_ERROR, "Cannot load account file %s: %s", account_path, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&reload_mutex);
+    int next = 1 - atomic_load(&current);
+    while(atomic_load(&readers[next]) != 0){
+        sched_yield();
+    }
+    snapshot_free(snapshots[next]);
+    snapshots[next] = snap;
+    atomic_store(&current, next);
+    pthread_mutex_unlock(&reload_mutex);
+
+    LOG(LOG_INFO, "[ACCOUNTS] Loaded %zu accounts from %s", snap->count, account_path);
+    return 0;
+}
+
+/**
+ * @function account_store_lookup
+ * @brief Find an account in the current snapshot
+ *
+ * @param username Username to look up (case-sensitive)
+ * @param status Set to the account status when found
+ * @return 1 if found, 0 if not found, -1 if no snapshot is loaded
+ *
+ * @thread_safety Lock-free: two atomic updates of the slot's reader
+ *                count, then an O(1) expected hash probe
+ */
+int account_store_lookup(const char* username, int* status){
+    int slot;
+
+    while(1){
+        slot = atomic_load(&current);
+        atomic_fetch_add(&readers[slot], 1);
+        if(atomic_load(&current) == slot) break;
+        atomic_fetch_sub(&readers[slot], 1);
+    }
+
+    AccountSnapshot* snap = snapshots[slot];
+    int result = -1;
+
+    if(snap){
+        uint32_t hash = hash_username(username);
+        size_t i = hash & snap->mask;
+        result = 0;
+        while(snap->table[i].hash){
+            if(snap->table[i].hash == hash && strcmp(snap->table[i].username, username) == 0){
+                *status = snap->table[i].status;
+                result = 1;
+                break;
+            }
+            i = (i + 1) & snap->mask;
+        }
+    }
+
+    atomic_fetch_sub(&readers[slot], 1);
+    return result;
+}
+
+/**
+ * @function watch_thread
+ * @brief Reload the account file when it changes or on SIGHUP
+ *
+ * @details
+ *  - inotify watches the file's directory, so both in-place writes
+ *    (IN_CLOSE_WRITE) and editors that rename a new file over the old
+ *    one (IN_MOVED_TO) are seen
+ *  - SIGHUP arrives through a signalfd
+ */
+static void* watch_thread(void* arg){
+    int* fds = arg;
+    int inotify_fd = fds[0];
+    int signal_fd = fds[1];
+    free(fds);
+
+    const char* slash = strrchr(account_path, '/');
+    const char* file_name = slash ? slash + 1 : account_path;
+
+    struct pollfd pfds[2] = {
+        {inotify_fd, POLLIN, 0},
+        {signal_fd, POLLIN, 0}
+    };
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while(1){
+        if(poll(pfds, 2, -1) == -1){
+            if(errno != EINTR) perror("poll() error");
+            continue;
+        }
+
+        int changed = 0;
+        if(inotify_fd >= 0 && (pfds[0].revents & POLLIN)){
+            ssize_t n = read(inotify_fd, events, sizeof(events));
+            for(char* p = events; n > 0 && p < events + n; ){
+                struct inotify_event* ev = (struct inotify_event*)p;
+                if(ev->len > 0 && strcmp(ev->name, file_name) == 0) changed = 1;
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+        if(pfds[1].revents & POLLIN){
+            struct signalfd_siginfo info;
+            if(read(signal_fd, &info, sizeof(info)) == sizeof(info)){
+                LOG(LOG_INFO, "[ACCOUNTS] SIGHUP received");
+                changed = 1;
+            }
+        }
+
+        if(changed) account_store_reload();
+    }
+    return NULL;
+}
+
+/**
+ * @function account_store_watch
+ * @brief Start the thread that keeps the index in sync with the file
+ *
+ * @return 0 on success, -1 on failure
+ *
+ * @note Blocks SIGHUP in the calling thread, so call it from main()
+ *       before other threads are created: they inherit the mask and the
+ *       signal is only delivered through the signalfd
+ * @note If inotify is unavailable the thread still serves SIGHUP
+ */
+int account_store_watch(void){
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    if(pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) return -1;
+
+    int* fds = malloc(2 * sizeof(int));
+    if(!fds) return -1;
+
+    fds[1] = signalfd(-1, &mask, SFD_CLOEXEC);
+    if(fds[1] == -1){
+        free(fds);
+        return -1;
+    }
+
+    char dir[PATH_MAX];
+    const char* slash = strrchr(account_path, '/');
+    if(!slash){
+        strcpy(dir, ".");
+    } else if(slash == account_path){
+        strcpy(dir, "/");
+    } else {
+        memcpy(dir, account_path, slash - account_path);
+        dir[slash - account_path] = '\0';
+    }
+
+    fds[0] = inotify_init1(IN_CLOEXEC);
+    if(fds[0] != -1 && inotify_add_watch(fds[0], dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1){
+        perror("inotify_add_watch() error");
+        close(fds[0]);
+        fds[0] = -1;
+    }
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, watch_thread, fds) != 0){
+        if(fds[0] != -1) close(fds[0]);
+        close(fds[1]);
+        free(fds);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef ACCOUNT_STORE_H
+#define ACCOUNT_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @struct Account
+ * @brief One account loaded from the account file
+ *
+ * @member username Username (owned by the snapshot)
+ * @member status Account status (1 = active, 0 = locked)
+ * @member hash Hash of username, 0 marks an empty table slot
+ */
+typedef struct {
+    char* username;
+    int status;
+    uint32_t hash;
+} Account;
+
+/**
+ * @struct AccountSnapshot
+ * @brief Immutable hash index of the account file at one point in time
+ *
+ * @member table Open-addressing table (linear probing)
+ * @member mask Table size - 1 (size is a power of two, at least 2 * count)
+ * @member count Number of accounts
+ */
+typedef struct {
+    Account* table;
+    size_t mask;
+    size_t count;
+} AccountSnapshot;
+
+int account_store_init(const char* path);
+int account_store_reload(void);
+int account_store_lookup(const char* username, int* status);
+int account_store_watch(void);
+
+#endif
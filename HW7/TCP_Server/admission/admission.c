@@ -0,0 +1,109 @@
+#include <stdatomic.h>
+
+#include "admission.h"
+
+/*
+ * CoDel-style overload detector for the work queue. Workers report the
+ * sojourn time (queued -> dequeued) of every item; good_ns is the last
+ * time one of them was under target, or the queue was seen empty. Short
+ * bursts that the workers absorb keep refreshing it; only a standing
+ * queue, where every item for a whole interval waited longer than the
+ * target, lets it fall behind by more than interval_ns.
+ *
+ * Unlike CoDel's sqrt control law the server sheds every new command
+ * while overloaded: dropping a packet halves a TCP sender's rate, but a
+ * rejected command only removes itself, so pacing the sheds would leave
+ * the queue standing.
+ */
+static uint64_t target_ns = 0;
+static uint64_t interval_ns = 0;
+static unsigned max_inflight = 0;
+
+static _Alignas(64) atomic_ullong good_ns;
+static _Alignas(64) atomic_long inflight;
+
+/**
+ * @function admission_configure
+ * @brief Set the limits before any thread uses them
+ *
+ * @param target Acceptable queue sojourn time, 0 disables overload detection
+ * @param interval How long the sojourn must stay above target
+ * @param max Most commands queued or running at once, 0 for no limit
+ * @param now_ns Current time (metrics_now_ns())
+ */
+void admission_configure(uint64_t target, uint64_t interval, unsigned max, uint64_t now_ns){
+    target_ns = target;
+    interval_ns = interval;
+    max_inflight = max;
+    atomic_store(&good_ns, now_ns);
+    atomic_store(&inflight, 0);
+}
+
+/**
+ * @function admission_observe
+ * @brief Worker side: report how long a dequeued item waited
+ *
+ * @note good_ns is only rewritten when it is more than interval/16 old,
+ *       so workers draining a healthy queue do not bounce its cache line
+ */
+void admission_observe(uint64_t sojourn_ns, uint64_t now_ns){
+    if(!target_ns || sojourn_ns >= target_ns) return;
+
+    uint64_t good = atomic_load_explicit(&good_ns, memory_order_relaxed);
+    if(now_ns > good + interval_ns / 16){
+        atomic_store_explicit(&good_ns, now_ns, memory_order_relaxed);
+    }
+}
+
+/**
+ * @function admission_over_target
+ * @brief 1 when no item has waited less than target for a whole interval
+ *
+ * @note An idle queue also stops producing samples: the caller confirms
+ *       with the queue depth and calls admission_drained() when it is 0
+ */
+int admission_over_target(uint64_t now_ns){
+    if(!target_ns) return 0;
+    uint64_t good = atomic_load_explicit(&good_ns, memory_order_relaxed);
+    return now_ns > good && now_ns - good > interval_ns;
+}
+
+/**
+ * @function admission_drained
+ * @brief The work queue was seen empty: the standing queue is gone
+ */
+void admission_drained(uint64_t now_ns){
+    atomic_store_explicit(&good_ns, now_ns, memory_order_relaxed);
+}
+
+/**
+ * @function admission_inflight_full
+ * @brief 1 when max_inflight commands are already queued or running
+ *
+ * @note A soft limit: loops check and enqueue without reserving, so
+ *       concurrent loops may overshoot it by one command each
+ */
+int admission_inflight_full(void){
+    return max_inflight &&
+           atomic_load_explicit(&inflight, memory_order_relaxed) >= (long)max_inflight;
+}
+
+/**
+ * @function admission_enqueued
+ * @brief Count a command handed to the work queue (only with a limit set)
+ */
+void admission_enqueued(void){
+    if(max_inflight) atomic_fetch_add_explicit(&inflight, 1, memory_order_relaxed);
+}
+
+/**
+ * @function admission_done
+ * @brief Count a command finished or cancelled by a worker
+ */
+void admission_done(void){
+    if(max_inflight) atomic_fetch_sub_explicit(&inflight, 1, memory_order_relaxed);
+}
+
+long admission_inflight(void){
+    return atomic_load_explicit(&inflight, memory_order_relaxed);
+}
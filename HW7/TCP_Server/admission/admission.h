@@ -0,0 +1,15 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+
+void admission_configure(uint64_t target, uint64_t interval, unsigned max, uint64_t now_ns);
+void admission_observe(uint64_t sojourn_ns, uint64_t now_ns);
+int admission_over_target(uint64_t now_ns);
+void admission_drained(uint64_t now_ns);
+int admission_inflight_full(void);
+void admission_enqueued(void);
+void admission_done(void);
+long admission_inflight(void);
+
+#endif
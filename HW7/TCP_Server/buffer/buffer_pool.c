@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "buffer_pool.h"
+
+/*
+ * Chunks are carved out of slabs of BUFFER_SLAB_CHUNKS that are never
+ * freed; released chunks go back on a free list and are reused. Large
+ * chunks are allocated one by one and freed by their last unref.
+ */
+static BufferChunk* free_chunks = NULL;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @function buffer_chunk_alloc
+ * @brief Take a chunk from the pool
+ *
+ * @return Chunk with refs = 1 (the caller's reference), NULL if out of memory
+ *
+ * @details
+ *  - Pops the free list; when it is empty a new slab (headers and
+ *    payload in two allocations) is allocated and all but one of its
+ *    chunks are pushed on the free list
+ *  - Chunks are taken once per BUFFER_CHUNK_SIZE bytes of client input,
+ *    so the pool mutex is not on the per-command path
+ *
+ * @thread_safety Free list is protected by pool_mutex
+ */
+BufferChunk* buffer_chunk_alloc(void){
+    BufferChunk* chunk;
+
+    pthread_mutex_lock(&pool_mutex);
+    if(!free_chunks){
+        BufferChunk* slab = malloc(BUFFER_SLAB_CHUNKS * sizeof(BufferChunk));
+        char* payload = malloc((size_t)BUFFER_SLAB_CHUNKS * BUFFER_CHUNK_SIZE);
+        if(!slab || !payload){
+            free(slab);
+            free(payload);
+            pthread_mutex_unlock(&pool_mutex);
+            return NULL;
+        }
+        for(int i = 0; i < BUFFER_SLAB_CHUNKS; i++){
+            slab[i].size = BUFFER_CHUNK_SIZE;
+            slab[i].data = payload + (size_t)i * BUFFER_CHUNK_SIZE;
+        }
+        for(int i = 1; i < BUFFER_SLAB_CHUNKS; i++){
+            slab[i].next_free = free_chunks;
+            free_chunks = &slab[i];
+        }
+        chunk = &slab[0];
+    } else {
+        chunk = free_chunks;
+        free_chunks = chunk->next_free;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    atomic_init(&chunk->refs, 1);
+    chunk->next_free = NULL;
+    return chunk;
+}
+
+/**
+ * @function buffer_chunk_alloc_large
+ * @brief Allocate a chunk bigger than the pooled ones
+ *
+ * @param size Payload bytes wanted
+ * @return Chunk with refs = 1, NULL if out of memory; a pooled chunk
+ *         when size fits in BUFFER_CHUNK_SIZE
+ *
+ * @details For the rare input unit that does not fit a pooled chunk (a
+ *          long binary frame); the chunk bypasses the free list and is
+ *          freed by buffer_chunk_unref()
+ */
+BufferChunk* buffer_chunk_alloc_large(size_t size){
+    if(size <= BUFFER_CHUNK_SIZE) return buffer_chunk_alloc();
+
+    BufferChunk* chunk = malloc(sizeof(BufferChunk) + size);
+    if(!chunk) return NULL;
+
+    atomic_init(&chunk->refs, 1);
+    chunk->next_free = NULL;
+    chunk->size = size;
+    chunk->data = (char*)(chunk + 1);
+    return chunk;
+}
+
+/**
+ * @function buffer_chunk_ref
+ * @brief Take another reference to a chunk
+ */
+void buffer_chunk_ref(BufferChunk* chunk){
+    atomic_fetch_add_explicit(&chunk->refs, 1, memory_order_relaxed);
+}
+
+/**
+ * @function buffer_chunk_unref
+ * @brief Drop a reference; the last one returns the chunk to the pool
+ *
+ * @note NULL is accepted and ignored; a large chunk is freed instead
+ */
+void buffer_chunk_unref(BufferChunk* chunk){
+    if(!chunk) return;
+    if(atomic_fetch_sub_explicit(&chunk->refs, 1, memory_order_acq_rel) != 1) return;
+    if(chunk->size > BUFFER_CHUNK_SIZE){
+        free(chunk);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    chunk->next_free = free_chunks;
+    free_chunks = chunk;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/**
+ * @function buffer_slice_data
+ * @brief Start of the slice's bytes (NUL-terminated)
+ */
+const char* buffer_slice_data(BufferSlice slice){
+    return slice.chunk->data + slice.offset;
+}
@@ -0,0 +1,52 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define BUFFER_CHUNK_SIZE 16384
+#define BUFFER_SLAB_CHUNKS 64
+
+/**
+ * @struct BufferChunk
+ * @brief Reference-counted receive buffer taken from the slab pool
+ *
+ * @member refs Owners of the chunk: the session reading into it plus one
+ *              per queued or running command that points into it
+ * @member next_free Free list link while the chunk is unused
+ * @member size Bytes of payload: BUFFER_CHUNK_SIZE for pooled chunks,
+ *              more for one taken with buffer_chunk_alloc_large()
+ * @member data Payload
+ */
+typedef struct BufferChunk {
+    atomic_int refs;
+    struct BufferChunk* next_free;
+    size_t size;
+    char* data;
+} BufferChunk;
+
+/**
+ * @struct BufferSlice
+ * @brief A NUL-terminated line inside a chunk
+ *
+ * @member chunk Chunk holding the bytes (NULL for an empty slice)
+ * @member offset Offset of the first byte in chunk->data
+ * @member length Line length, terminating NUL excluded
+ *
+ * @note A slice does not own a reference by itself; whoever stores it
+ *       takes one with buffer_chunk_ref() and drops it when done.
+ */
+typedef struct {
+    BufferChunk* chunk;
+    uint32_t offset;
+    uint32_t length;
+} BufferSlice;
+
+BufferChunk* buffer_chunk_alloc(void);
+BufferChunk* buffer_chunk_alloc_large(size_t size);
+void buffer_chunk_ref(BufferChunk* chunk);
+void buffer_chunk_unref(BufferChunk* chunk);
+const char* buffer_slice_data(BufferSlice slice);
+
+#endif
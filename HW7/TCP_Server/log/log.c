@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+
+/**
+ * @struct LogRecord
+ * @brief One formatted message, newline included
+ */
+typedef struct {
+    uint16_t len;
+    char text[LOG_RECORD_SIZE - sizeof(uint16_t)];
+} LogRecord;
+
+/**
+ * @struct LogRing
+ * @brief Single-producer/single-consumer ring owned by one thread
+ *
+ * @member head Next record the flusher reads (written by the flusher)
+ * @member tail Next record the owner writes (written by the owner)
+ * @member dropped Messages discarded because the ring was full
+ * @member reported Value of dropped already reported by the flusher
+ * @member records Ring storage
+ */
+typedef struct {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    atomic_ulong dropped;
+    unsigned long reported;
+    LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
+atomic_int log_level = LOG_DEBUG;
+static unsigned sample_rate = 1;
+
+static LogRing* rings[LOG_MAX_THREADS];
+static atomic_int ring_count = 0;
+static pthread_mutex_t register_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local LogRing* thread_ring = NULL;
+static _Thread_local int thread_unregistered = 0;
+static _Thread_local unsigned sample_counter = 0;
+
+static pthread_t flusher;
+static atomic_int running = 0;
+
+static const char* level_names[] = {"error", "warn", "info", "debug"};
+
+/**
+ * @function log_set_level
+ * @brief Change the level at runtime; takes effect on the next message
+ */
+void log_set_level(LogLevel level){
+    atomic_store(&log_level, level);
+}
+
+/**
+ * @function log_parse_level
+ * @brief Map "error", "warn", "info" or "debug" to a LogLevel
+ *
+ * @return The level, -1 for an unknown name
+ */
+int log_parse_level(const char* name){
+    for(int i = 0; i <= LOG_DEBUG; i++){
+        if(strcmp(name, level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * @function log_set_sample_rate
+ * @brief Keep one in rate LOG_SAMPLED() messages per thread (1 = all)
+ *
+ * @note Set before log_init(); the rate is read without synchronization
+ */
+void log_set_sample_rate(unsigned rate){
+    sample_rate = rate ? rate : 1;
+}
+
+/**
+ * @function log_sample
+ * @brief Per-thread 1-in-N decision for LOG_SAMPLED()
+ */
+int log_sample(void){
+    if(sample_rate == 1) return 1;
+    return ++sample_counter % sample_rate == 0;
+}
+
+/**
+ * @function ring_for_thread
+ * @brief The calling thread's ring, registered on first use
+ *
+ * @return Ring, or NULL once LOG_MAX_THREADS rings exist (messages of
+ *         that thread are then dropped)
+ */
+static LogRing* ring_for_thread(void){
+    if(thread_ring || thread_unregistered) return thread_ring;
+
+    LogRing* ring = aligned_alloc(64, sizeof(LogRing));
+    if(ring){
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->dropped, 0);
+        ring->reported = 0;
+    }
+
+    pthread_mutex_lock(&register_mutex);
+    int count = atomic_load(&ring_count);
+    if(ring && count < LOG_MAX_THREADS){
+        rings[count] = ring;
+        atomic_store(&ring_count, count + 1);
+        thread_ring = ring;
+    } else {
+        free(ring);
+        thread_unregistered = 1;
+    }
+    pthread_mutex_unlock(&register_mutex);
+    return thread_ring;
+}
+
+/**
+ * @function log_write
+ * @brief Format a message into the calling thread's ring
+ *
+ * @details
+ *  - Never blocks and never calls into stdio: the message is formatted
+ *    with vsnprintf() straight into a ring record and published with a
+ *    release store; the flusher thread does the write()
+ *  - A newline is appended; messages longer than a record are cut
+ *  - When the ring is full the message is dropped and counted
+ *
+ * @note Use through LOG() / LOG_SAMPLED(), which check the level first
+ */
+void log_write(LogLevel level, const char* fmt, ...){
+    (void)level;
+    LogRing* ring = ring_for_thread();
+    if(!ring) return;
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if(tail - head >= LOG_RING_SIZE){
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogRecord* rec = &ring->records[tail % LOG_RING_SIZE];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(rec->text, sizeof(rec->text) - 1, fmt, args);
+    va_end(args);
+
+    if(len < 0) len = 0;
+    if(len > (int)sizeof(rec->text) - 2) len = sizeof(rec->text) - 2;
+    rec->text[len++] = '\n';
+    rec->len = len;
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static void write_all(const char* data, size_t len){
+    while(len > 0){
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * @function drain_rings
+ * @brief Copy every published record to stdout
+ *
+ * @return Number of records written
+ *
+ * @details
+ *  - Records are batched into one buffer per write(), so a burst of
+ *    messages costs a handful of syscalls on the flusher thread only
+ *  - Order is kept per thread; lines of different threads interleave
+ *    in ring order
+ */
+static size_t drain_rings(void){
+    static char out[65536];
+    size_t out_len = 0;
+    size_t written = 0;
+    int count = atomic_load(&ring_count);
+
+    for(int i = 0; i < count; i++){
+        LogRing* ring = rings[i];
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        for(; head != tail; head++){
+            LogRecord* rec = &ring->records[head % LOG_RING_SIZE];
+            if(out_len + rec->len > sizeof(out)){
+                write_all(out, out_len);
+                out_len = 0;
+            }
+            memcpy(out + out_len, rec->text, rec->len);
+            out_len += rec->len;
+            written++;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        unsigned long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if(dropped != ring->reported && out_len + 64 <= sizeof(out)){
+            out_len += snprintf(out + out_len, 64, "[LOG] %lu messages dropped\n", dropped - ring->reported);
+            ring->reported = dropped;
+        }
+    }
+
+    if(out_len > 0) write_all(out, out_len);
+    return written;
+}
+
+static void* flusher_main(void* arg){
+    (void)arg;
+    struct timespec pause = {0, LOG_FLUSH_INTERVAL_MS * 1000000L};
+
+    while(atomic_load(&running)){
+        if(drain_rings() == 0) nanosleep(&pause, NULL);
+    }
+    drain_rings();
+    return NULL;
+}
+
+/**
+ * @function log_init
+ * @brief Start the flusher thread
+ *
+ * @return 0 on success, -1 if the thread could not be created
+ *
+ * @details
+ *  - stdout is flushed first, so earlier printf() output comes before
+ *    anything written by the flusher
+ *  - The flusher sleeps LOG_FLUSH_INTERVAL_MS when all rings are empty
+ */
+int log_init(void){
+    fflush(stdout);
+    atomic_store(&running, 1);
+    if(pthread_create(&flusher, NULL, flusher_main, NULL) != 0){
+        atomic_store(&running, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @function log_shutdown
+ * @brief Stop the flusher after writing what is still queued
+ */
+void log_shutdown(void){
+    if(!atomic_exchange(&running, 0)) return;
+    pthread_join(flusher, NULL);
+}
@@ -0,0 +1,48 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define LOG_RING_SIZE 4096
+#define LOG_RECORD_SIZE 256
+#define LOG_MAX_THREADS 128
+#define LOG_FLUSH_INTERVAL_MS 1
+
+/**
+ * @enum LogLevel
+ * @brief Message severity; a message is kept if its level <= log_level
+ */
+typedef enum {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+} LogLevel;
+
+extern atomic_int log_level;
+
+/*
+ * The level is checked before the arguments are formatted, so disabled
+ * messages cost one relaxed load.
+ */
+#define LOG(level, ...) do { \
+    if((int)(level) <= atomic_load_explicit(&log_level, memory_order_relaxed)) \
+        log_write((level), __VA_ARGS__); \
+} while(0)
+
+/* Like LOG(), but only every log_sample_rate-th call per thread is kept */
+#define LOG_SAMPLED(level, ...) do { \
+    if((int)(level) <= atomic_load_explicit(&log_level, memory_order_relaxed) && log_sample()) \
+        log_write((level), __VA_ARGS__); \
+} while(0)
+
+int log_init(void);
+void log_shutdown(void);
+void log_set_level(LogLevel level);
+int log_parse_level(const char* name);
+void log_set_sample_rate(unsigned rate);
+int log_sample(void);
+void log_write(LogLevel level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "metrics.h"
+#include "../log/log.h"
+
+/**
+ * @struct MetricsBuf
+ * @brief Growable text buffer used to render a scrape
+ */
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} MetricsBuf;
+
+/**
+ * @struct Gauge
+ * @brief Value read from the server at scrape time
+ */
+typedef struct {
+    const char* name;
+    const char* help;
+    long (*read)(void);
+} Gauge;
+
+static MetricsShard* shards[METRICS_MAX_THREADS];
+static atomic_int shard_count = 0;
+static pthread_mutex_t register_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local MetricsShard* thread_shard = NULL;
+static _Thread_local int thread_unregistered = 0;
+
+static Gauge gauges[METRICS_MAX_GAUGES];
+static int gauge_count = 0;
+
+static const char* counter_names[METRIC_COUNTER_COUNT][2] = {
+    {"tcp_server_accepts_total", "Connections accepted"},
+    {"tcp_server_rejects_total", "Connections refused at accept time"},
+    {"tcp_server_disconnects_total", "Connections closed"},
+    {"tcp_server_received_bytes_total", "Bytes of complete command lines received"},
+    {"tcp_server_sent_bytes_total", "Bytes written to client sockets"},
+    {"tcp_server_work_queue_full_total", "Commands deferred because the work queue was full"},
+    {"tcp_server_work_items_cancelled_total", "Queued commands dropped because their session had closed"},
+    {"tcp_server_timeouts_total", "Connections closed by the idle, handshake or login timeout"},
+    {"tcp_server_commands_shed_total", "Commands answered 503 by admission control instead of being run"}
+};
+
+static const char* command_names[CMD_TYPE_COUNT] = {"USER", "POST", "BYE", "GET", "LIST", "other"};
+
+static const char* stage_names[STAGE_COUNT] = {"throttled", "queued", "ordered", "output", "total"};
+
+static const char* response_codes[RESPONSE_CODE_COUNT] = {
+    "100", "110", "120", "130", "140", "150", "211", "212", "213", "221", "240", "300", "500",
+    "503", "other"
+};
+
+/* Bucket bounds (seconds) exported for the latency histograms */
+static const double latency_bounds[] = {
+    0.000001, 0.0000025, 0.000005, 0.00001, 0.000025, 0.00005, 0.0001,
+    0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1,
+    0.25, 0.5, 1, 2.5
+};
+
+static const double latency_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+/**
+ * @function metrics_now_ns
+ * @brief Monotonic clock in nanoseconds
+ */
+uint64_t metrics_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @function shard_for_thread
+ * @brief The calling thread's shard, registered on first use
+ *
+ * @return Shard, or NULL once METRICS_MAX_THREADS shards exist (updates
+ *         of that thread are then lost)
+ */
+static MetricsShard* shard_for_thread(void){
+    if(thread_shard || thread_unregistered) return thread_shard;
+
+    MetricsShard* shard = aligned_alloc(64, sizeof(MetricsShard));
+    if(shard) memset(shard, 0, sizeof(MetricsShard));
+
+    pthread_mutex_lock(&register_mutex);
+    int count = atomic_load(&shard_count);
+    if(shard && count < METRICS_MAX_THREADS){
+        shards[count] = shard;
+        atomic_store(&shard_count, count + 1);
+        thread_shard = shard;
+    } else {
+        free(shard);
+        thread_unregistered = 1;
+    }
+    pthread_mutex_unlock(&register_mutex);
+    return thread_shard;
+}
+
+/* Single-writer increment: a plain load and store, no lock prefix */
+static inline void bump(atomic_ullong* value, uint64_t n){
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * @function metrics_add
+ * @brief Add n to a counter of the calling thread
+ */
+void metrics_add(MetricCounter counter, uint64_t n){
+    MetricsShard* shard = shard_for_thread();
+    if(shard) bump(&shard->counters[counter], n);
+}
+
+/**
+ * @function hist_index
+ * @brief Bucket of a value in the log-linear layout
+ */
+static int hist_index(uint64_t value){
+    if(value < HIST_SUB_BUCKETS) return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    if(msb > HIST_MAX_MSB) return HIST_BUCKETS - 1;
+    return (msb - 3) * HIST_SUB_BUCKETS + (int)((value >> (msb - 4)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/**
+ * @function hist_upper
+ * @brief Exclusive upper bound of a bucket
+ */
+static uint64_t hist_upper(int index){
+    if(index < HIST_SUB_BUCKETS) return (uint64_t)index + 1;
+    int group = index / HIST_SUB_BUCKETS;
+    int sub = index % HIST_SUB_BUCKETS;
+    return ((uint64_t)(HIST_SUB_BUCKETS + sub + 1)) << (group - 1);
+}
+
+/**
+ * @function metrics_command
+ * @brief Count one processed command and record how long it took
+ *
+ * @param type Command type
+ * @param latency_ns Processing time in nanoseconds
+ */
+void metrics_command(CommandType type, uint64_t latency_ns){
+    MetricsShard* shard = shard_for_thread();
+    if(!shard) return;
+    Histogram* hist = &shard->command_latency[type];
+    bump(&hist->buckets[hist_index(latency_ns)], 1);
+    bump(&hist->sum, latency_ns);
+}
+
+/**
+ * @function metrics_stage
+ * @brief Record the time one command spent in a pipeline stage
+ */
+void metrics_stage(Stage stage, uint64_t latency_ns){
+    MetricsShard* shard = shard_for_thread();
+    if(!shard) return;
+    Histogram* hist = &shard->stage_latency[stage];
+    bump(&hist->buckets[hist_index(latency_ns)], 1);
+    bump(&hist->sum, latency_ns);
+}
+
+/**
+ * @function metrics_response
+ * @brief Count one response by its code
+ */
+void metrics_response(const char* code){
+    MetricsShard* shard = shard_for_thread();
+    if(!shard) return;
+    int i = 0;
+    while(i < RESPONSE_CODE_COUNT - 1 && strcmp(code, response_codes[i]) != 0) i++;
+    bump(&shard->responses[i], 1);
+}
+
+/**
+ * @function metrics_register_gauge
+ * @brief Export a value read by a callback at scrape time
+ *
+ * @param name Metric name (static string)
+ * @param help HELP text (static string)
+ * @param read Returns the current value; called from the admin thread
+ * @return 0 on success, -1 if METRICS_MAX_GAUGES are registered
+ *
+ * @note Register before metrics_start_admin()
+ */
+int metrics_register_gauge(const char* name, const char* help, long (*read)(void)){
+    if(gauge_count >= METRICS_MAX_GAUGES) return -1;
+    gauges[gauge_count++] = (Gauge){name, help, read};
+    return 0;
+}
+
+static void buf_printf(MetricsBuf* buf, const char* fmt, ...){
+    while(1){
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+        va_end(args);
+        if(n < 0) return;
+        if(buf->len + n < buf->cap){
+            buf->len += n;
+            return;
+        }
+        size_t cap = buf->cap * 2 + n;
+        char* data = realloc(buf->data, cap);
+        if(!data) return;
+        buf->data = data;
+        buf->cap = cap;
+    }
+}
+
+/**
+ * @function render_histogram
+ * @brief Write one summed latency histogram in Prometheus text format
+ *
+ * @details
+ *  - The fine buckets are folded into the fixed latency_bounds, so the
+ *    exported bucket set never changes between scrapes; a fine bucket
+ *    counts toward a bound when its upper edge is at or below it
+ *  - Quantiles are estimated from the fine buckets by render_quantiles()
+ */
+static void render_histogram(MetricsBuf* buf, const char* name, const char* label,
+                             const uint64_t* buckets, uint64_t sum){
+    uint64_t total = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++) total += buckets[i];
+
+    int b = 0;
+    uint64_t cumulative = 0;
+    for(size_t k = 0; k < sizeof(latency_bounds) / sizeof(latency_bounds[0]); k++){
+        uint64_t bound_ns = (uint64_t)(latency_bounds[k] * 1e9 + 0.5);
+        while(b < HIST_BUCKETS && hist_upper(b) <= bound_ns) cumulative += buckets[b++];
+        buf_printf(buf, "%s_bucket{%s,le=\"%g\"} %llu\n",
+                   name, label, latency_bounds[k], (unsigned long long)cumulative);
+    }
+    buf_printf(buf, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, label, (unsigned long long)total);
+    buf_printf(buf, "%s_sum{%s} %.9f\n", name, label, sum / 1e9);
+    buf_printf(buf, "%s_count{%s} %llu\n", name, label, (unsigned long long)total);
+}
+
+/**
+ * @function render_quantiles
+ * @brief Write latency_quantiles of a histogram; each is the upper edge
+ *        of the fine bucket holding the rank, so at most 6.25% high
+ */
+static void render_quantiles(MetricsBuf* buf, const char* name, const char* label, const uint64_t* buckets){
+    uint64_t total = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++) total += buckets[i];
+    if(total == 0) return;
+
+    for(size_t q = 0; q < sizeof(latency_quantiles) / sizeof(latency_quantiles[0]); q++){
+        uint64_t rank = (uint64_t)(latency_quantiles[q] * total);
+        if(rank >= total) rank = total - 1;
+        uint64_t seen = 0;
+        int i = 0;
+        for(; i < HIST_BUCKETS; i++){
+            seen += buckets[i];
+            if(seen > rank) break;
+        }
+        buf_printf(buf, "%s{%s,quantile=\"%g\"} %.9f\n",
+                   name, label, latency_quantiles[q], hist_upper(i) / 1e9);
+    }
+}
+
+/**
+ * @function sum_histogram
+ * @brief Add one shard histogram into a bucket array
+ */
+static void sum_histogram(Histogram* hist, uint64_t* buckets, uint64_t* sum){
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        buckets[i] += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+    }
+    *sum += atomic_load_explicit(&hist->sum, memory_order_relaxed);
+}
+
+/**
+ * @function render_family
+ * @brief Write a labelled set of histograms and their quantile gauges
+ */
+static void render_family(MetricsBuf* buf, const char* name, const char* help, const char* key,
+                          const char** values, int count, uint64_t (*buckets)[HIST_BUCKETS],
+                          const uint64_t* sums){
+    char label[64];
+
+    buf_printf(buf, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for(int i = 0; i < count; i++){
+        snprintf(label, sizeof(label), "%s=\"%s\"", key, values[i]);
+        render_histogram(buf, name, label, buckets[i], sums[i]);
+    }
+
+    buf_printf(buf, "# HELP %s_quantile %s, quantiles since start (upper bucket edge)\n"
+                    "# TYPE %s_quantile gauge\n", name, help, name);
+    for(int i = 0; i < count; i++){
+        char qname[128];
+        snprintf(label, sizeof(label), "%s=\"%s\"", key, values[i]);
+        snprintf(qname, sizeof(qname), "%s_quantile", name);
+        render_quantiles(buf, qname, label, buckets[i]);
+    }
+}
+
+/**
+ * @function metrics_render
+ * @brief Sum every shard and format the scrape body
+ *
+ * @note Only called from the admin thread, so the bucket arrays are static
+ */
+static void metrics_render(MetricsBuf* buf){
+    static uint64_t command_buckets[CMD_TYPE_COUNT][HIST_BUCKETS];
+    static uint64_t stage_buckets[STAGE_COUNT][HIST_BUCKETS];
+    uint64_t counters[METRIC_COUNTER_COUNT] = {0};
+    uint64_t responses[RESPONSE_CODE_COUNT] = {0};
+    uint64_t command_sums[CMD_TYPE_COUNT] = {0};
+    uint64_t stage_sums[STAGE_COUNT] = {0};
+    memset(command_buckets, 0, sizeof(command_buckets));
+    memset(stage_buckets, 0, sizeof(stage_buckets));
+
+    int count = atomic_load(&shard_count);
+    for(int s = 0; s < count; s++){
+        MetricsShard* shard = shards[s];
+        for(int i = 0; i < METRIC_COUNTER_COUNT; i++){
+            counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+        }
+        for(int i = 0; i < RESPONSE_CODE_COUNT; i++){
+            responses[i] += atomic_load_explicit(&shard->responses[i], memory_order_relaxed);
+        }
+        for(int c = 0; c < CMD_TYPE_COUNT; c++){
+            sum_histogram(&shard->command_latency[c], command_buckets[c], &command_sums[c]);
+        }
+        for(int c = 0; c < STAGE_COUNT; c++){
+            sum_histogram(&shard->stage_latency[c], stage_buckets[c], &stage_sums[c]);
+        }
+    }
+
+    for(int i = 0; i < METRIC_COUNTER_COUNT; i++){
+        buf_printf(buf, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                   counter_names[i][0], counter_names[i][1], counter_names[i][0],
+                   counter_names[i][0], (unsigned long long)counters[i]);
+    }
+
+    buf_printf(buf, "# HELP tcp_server_responses_total Responses sent, by code\n"
+                    "# TYPE tcp_server_responses_total counter\n");
+    for(int i = 0; i < RESPONSE_CODE_COUNT; i++){
+        buf_printf(buf, "tcp_server_responses_total{code=\"%s\"} %llu\n",
+                   response_codes[i], (unsigned long long)responses[i]);
+    }
+
+    for(int i = 0; i < gauge_count; i++){
+        buf_printf(buf, "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n",
+                   gauges[i].name, gauges[i].help, gauges[i].name, gauges[i].name, gauges[i].read());
+    }
+
+    render_family(buf, "tcp_server_command_duration_seconds", "Command processing time, by command",
+                  "cmd", command_names, CMD_TYPE_COUNT, command_buckets, command_sums);
+    render_family(buf, "tcp_server_stage_duration_seconds", "Time commands spent in each pipeline stage",
+                  "stage", stage_names, STAGE_COUNT, stage_buckets, stage_sums);
+}
+
+static void send_all(int fd, const char* data, size_t len){
+    while(len > 0){
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * @function serve_scrape
+ * @brief Answer one HTTP request on an admin connection
+ *
+ * @details
+ *  - Reads up to the end of the request headers; only the request line
+ *    is looked at
+ *  - GET /metrics (or /) returns the text exposition format; anything
+ *    else gets 404. The connection is closed after the reply (HTTP/1.0)
+ */
+static void serve_scrape(int fd){
+    char req[2048];
+    size_t len = 0;
+    while(len < sizeof(req) - 1){
+        ssize_t n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+        len += n;
+        req[len] = '\0';
+        if(strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+    }
+    req[len] = '\0';
+
+    if(strncmp(req, "GET /metrics ", 13) != 0 && strncmp(req, "GET / ", 6) != 0){
+        const char* reply = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(fd, reply, strlen(reply));
+        return;
+    }
+
+    MetricsBuf body = {malloc(16384), 0, 16384};
+    if(!body.data) return;
+    body.data[0] = '\0';
+    metrics_render(&body);
+
+    char header[160];
+    int hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.len);
+    send_all(fd, header, hlen);
+    send_all(fd, body.data, body.len);
+    free(body.data);
+}
+
+/**
+ * @function admin_thread
+ * @brief Serve scrapes one connection at a time
+ *
+ * @note Scrapes are rare and cheap, so a blocking loop on its own thread
+ *       keeps all admin traffic off the event loops
+ */
+static void* admin_thread(void* arg){
+    int listen_fd = (int)(intptr_t)arg;
+    struct timeval timeout = {2, 0};
+
+    while(1){
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(fd == -1){
+            if(errno != EINTR) LOG(LOG_WARN, "[METRICS] accept() error: %s", strerror(errno));
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_scrape(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * @function metrics_start_admin
+ * @brief Listen on the admin port and start the scrape thread
+ *
+ * @param port TCP port for the Prometheus endpoint
+ * @return 0 on success, -1 on failure
+ *
+ * @note SO_REUSEPORT lets a server started for a hot upgrade (-U) bind
+ *       the port while the old process still serves it
+ */
+int metrics_start_admin(int port){
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1){
+        perror("socket() error");
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1){
+        perror("metrics bind()/listen() error");
+        close(fd);
+        return -1;
+    }
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, admin_thread, (void*)(intptr_t)fd) != 0){
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,103 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define METRICS_MAX_THREADS 256
+#define METRICS_MAX_GAUGES 16
+#define HIST_SUB_BUCKETS 16
+#define HIST_MAX_MSB 39
+#define HIST_BUCKETS ((HIST_MAX_MSB - 3) * HIST_SUB_BUCKETS + HIST_SUB_BUCKETS)
+
+/**
+ * @enum MetricCounter
+ * @brief Monotonic counters kept per thread and summed on scrape
+ */
+typedef enum {
+    METRIC_ACCEPTS,
+    METRIC_REJECTS,
+    METRIC_DISCONNECTS,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_QUEUE_FULL,
+    METRIC_ITEMS_CANCELLED,
+    METRIC_TIMEOUTS,
+    METRIC_SHED,
+    METRIC_COUNTER_COUNT
+} MetricCounter;
+
+/**
+ * @enum CommandType
+ * @brief Command label for the processing latency histograms
+ */
+typedef enum {
+    CMD_USER,
+    CMD_POST,
+    CMD_BYE,
+    CMD_GET,
+    CMD_LIST,
+    CMD_OTHER,
+    CMD_TYPE_COUNT
+} CommandType;
+
+/**
+ * @enum Stage
+ * @brief Pipeline stages timed for every command
+ *
+ * @note Service time (start -> reply appended) is the per-command
+ *       latency histogram; these cover the waits around it
+ */
+typedef enum {
+    STAGE_THROTTLED,    /* framed by the loop -> queued (work queue was full) */
+    STAGE_QUEUED,       /* queued -> taken by a worker */
+    STAGE_ORDERED,      /* taken -> started (earlier command of the session still running) */
+    STAGE_OUTPUT,       /* first unsent reply appended -> output buffer drained to the socket */
+    STAGE_TOTAL,        /* framed by the loop -> reply appended */
+    STAGE_COUNT
+} Stage;
+
+#define RESPONSE_CODE_COUNT 15
+
+/**
+ * @struct Histogram
+ * @brief Log-linear (HDR-style) histogram of nanosecond values
+ *
+ * @member buckets Values below 16 have one bucket each; above, every
+ *                 power of two is split into HIST_SUB_BUCKETS buckets,
+ *                 so a bucket is at most 1/16 (6.25%) wide relative to
+ *                 its lower bound
+ * @member sum Sum of recorded values
+ *
+ * @note Values at or above 2^(HIST_MAX_MSB + 1) ns land in the last bucket
+ */
+typedef struct {
+    atomic_ullong buckets[HIST_BUCKETS];
+    atomic_ullong sum;
+} Histogram;
+
+/**
+ * @struct MetricsShard
+ * @brief All metrics written by one thread
+ *
+ * @note Only the owning thread writes a shard, with relaxed load/store
+ *       pairs instead of locked read-modify-writes; the scraper reads
+ *       every shard with relaxed loads. Shards are cache-line aligned so
+ *       threads never share a line.
+ */
+typedef struct {
+    _Alignas(64) atomic_ullong counters[METRIC_COUNTER_COUNT];
+    atomic_ullong responses[RESPONSE_CODE_COUNT];
+    Histogram command_latency[CMD_TYPE_COUNT];
+    Histogram stage_latency[STAGE_COUNT];
+} MetricsShard;
+
+uint64_t metrics_now_ns(void);
+void metrics_add(MetricCounter counter, uint64_t n);
+void metrics_command(CommandType type, uint64_t latency_ns);
+void metrics_stage(Stage stage, uint64_t latency_ns);
+void metrics_response(const char* code);
+int metrics_register_gauge(const char* name, const char* help, long (*read)(void));
+int metrics_start_admin(int port);
+
+#endif
@@ -0,0 +1,72 @@
+#include "bin_protocol.h"
+
+/**
+ * @function bin_get_u32
+ * @brief Read a big-endian uint32
+ */
+static uint32_t bin_get_u32(const char* data){
+    const unsigned char* p = (const unsigned char*)data;
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * @function bin_get_u64
+ * @brief Read a big-endian uint64
+ */
+uint64_t bin_get_u64(const char* data){
+    return (uint64_t)bin_get_u32(data) << 32 | bin_get_u32(data + 4);
+}
+
+/**
+ * @function bin_put_u16
+ * @brief Write a big-endian uint16
+ */
+void bin_put_u16(char* out, uint16_t value){
+    out[0] = (char)(value >> 8);
+    out[1] = (char)value;
+}
+
+/**
+ * @function bin_put_u32
+ * @brief Write a big-endian uint32
+ */
+void bin_put_u32(char* out, uint32_t value){
+    bin_put_u16(out, (uint16_t)(value >> 16));
+    bin_put_u16(out + 2, (uint16_t)value);
+}
+
+/**
+ * @function bin_put_u64
+ * @brief Write a big-endian uint64
+ */
+void bin_put_u64(char* out, uint64_t value){
+    bin_put_u32(out, (uint32_t)(value >> 32));
+    bin_put_u32(out + 4, (uint32_t)value);
+}
+
+/**
+ * @function bin_header_decode
+ * @brief Parse the BIN_HEADER_SIZE bytes at data
+ *
+ * @note The framer has already checked magic and length
+ */
+void bin_header_decode(const char* data, BinHeader* header){
+    const unsigned char* p = (const unsigned char*)data;
+    header->magic = p[0];
+    header->opcode = p[1];
+    header->flags = (uint16_t)(p[2] << 8 | p[3]);
+    header->id = bin_get_u32(data + 4);
+    header->length = bin_get_u32(data + BIN_LENGTH_AT);
+}
+
+/**
+ * @function bin_header_encode
+ * @brief Write a header to out (BIN_HEADER_SIZE bytes)
+ */
+void bin_header_encode(char* out, uint8_t opcode, uint16_t flags, uint32_t id, uint32_t length){
+    out[0] = (char)BIN_MAGIC;
+    out[1] = (char)opcode;
+    bin_put_u16(out + 2, flags);
+    bin_put_u32(out + 4, id);
+    bin_put_u32(out + BIN_LENGTH_AT, length);
+}
@@ -0,0 +1,67 @@
+#ifndef BIN_PROTOCOL_H
+#define BIN_PROTOCOL_H
+
+#include <stdint.h>
+
+#define BIN_MAGIC 0xB7
+#define BIN_HEADER_SIZE 12
+#define BIN_LENGTH_AT 8
+#define BIN_REPLY 0x80
+#define BIN_FLAG_ANY_ORDER 0x0001
+#define BIN_MAX_PAYLOAD 65535   /* a full POST_LOG_MAX_FIELD article */
+
+/**
+ * @enum BinOpcode
+ * @brief Commands of the binary protocol, with their request payloads
+ *
+ * @member BIN_OP_USER Username bytes
+ * @member BIN_OP_POST Article bytes (any content, CR/LF/NUL included)
+ * @member BIN_OP_BYE Empty
+ * @member BIN_OP_GET Post id (uint64)
+ * @member BIN_OP_LIST Count (uint8, 0 for the default), then username bytes
+ *
+ * @note A reply carries the request's opcode | BIN_REPLY and its id.
+ *       Payloads: 140 (GET) id uint64, time_ns uint64, user_len uint16,
+ *       user, article (rest of the frame); 150 (LIST) count uint32, then
+ *       per post id uint64, length uint32, article. Other replies are empty
+ */
+typedef enum {
+    BIN_OP_USER = 1,
+    BIN_OP_POST,
+    BIN_OP_BYE,
+    BIN_OP_GET,
+    BIN_OP_LIST
+} BinOpcode;
+
+/**
+ * @struct BinHeader
+ * @brief Fixed header in front of every binary frame (network byte order on the wire)
+ *
+ * @member magic BIN_MAGIC; a text command never starts with it, so the
+ *         first byte of a connection tells the two protocols apart
+ * @member opcode BinOpcode, | BIN_REPLY in replies
+ * @member flags In requests BIN_FLAG_ANY_ORDER (the reply may overtake
+ *         replies to earlier requests) or 0; the reply code (110, 221, ...)
+ *         in replies
+ * @member id Chosen by the client, echoed in the reply
+ * @member length Payload bytes after the header
+ *
+ * @note The text greeting "100\r\n" is sent before the client's first
+ *       byte is seen; binary clients skip those 5 bytes
+ */
+typedef struct {
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t flags;
+    uint32_t id;
+    uint32_t length;
+} BinHeader;
+
+void bin_header_decode(const char* data, BinHeader* header);
+void bin_header_encode(char* out, uint8_t opcode, uint16_t flags, uint32_t id, uint32_t length);
+uint64_t bin_get_u64(const char* data);
+void bin_put_u16(char* out, uint16_t value);
+void bin_put_u32(char* out, uint32_t value);
+void bin_put_u64(char* out, uint64_t value);
+
+#endif
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mpmc_queue.h"
+
+/**
+ * @struct Cell
+ * @brief Header stored at the start of every ring slot
+ *
+ * @member seq Slot sequence: == pos when free for the producer of pos,
+ *             == pos + 1 when it holds the element published at pos
+ */
+typedef struct {
+    atomic_size_t seq;
+} Cell;
+
+static Cell* cell_at(MpmcQueue* q, size_t pos){
+    return (Cell*)(q->cells + (pos & q->mask) * q->stride);
+}
+
+static void* cell_data(Cell* cell){
+    return (unsigned char*)cell + sizeof(Cell);
+}
+
+/**
+ * @function mpmc_queue_init
+ * @brief Allocate a queue able to hold at least capacity elements
+ *
+ * @param q Queue to initialize
+ * @param capacity Requested capacity, rounded up to a power of two (min 2)
+ * @param elem_size Size of one element in bytes
+ * @return 0 on success, -1 on allocation failure
+ */
+int mpmc_queue_init(MpmcQueue* q, size_t capacity, size_t elem_size){
+    size_t cap = 2;
+    while(cap < capacity) cap <<= 1;
+
+    q->elem_size = elem_size;
+    q->stride = (sizeof(Cell) + elem_size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    q->mask = cap - 1;
+    q->cells = aligned_alloc(CACHE_LINE_SIZE, cap * q->stride);
+    if(!q->cells) return -1;
+
+    for(size_t i = 0; i < cap; i++){
+        atomic_init(&cell_at(q, i)->seq, i);
+    }
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    return 0;
+}
+
+/**
+ * @function mpmc_queue_destroy
+ * @brief Release the ring storage
+ */
+void mpmc_queue_destroy(MpmcQueue* q){
+    free(q->cells);
+    q->cells = NULL;
+}
+
+/**
+ * @function mpmc_queue_try_push
+ * @brief Copy one element into the queue without blocking
+ *
+ * @param q Queue
+ * @param elem Element to copy (elem_size bytes)
+ * @return 0 on success, -1 if the queue is full
+ *
+ * @details
+ *  - Claims enqueue_pos with a CAS once the slot's sequence shows it free
+ *  - Publishes the element by storing seq = pos + 1 with release order
+ */
+int mpmc_queue_try_push(MpmcQueue* q, const void* elem){
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    Cell* cell;
+
+    while(1){
+        cell = cell_at(q, pos);
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if(diff == 0){
+            if(atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(diff < 0){
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    memcpy(cell_data(cell), elem, q->elem_size);
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * @function mpmc_queue_try_pop
+ * @brief Copy the oldest element out of the queue without blocking
+ *
+ * @param q Queue
+ * @param elem Destination buffer (elem_size bytes)
+ * @return 0 on success, -1 if no published element is available
+ *
+ * @note May return -1 while a producer that claimed the head slot has
+ *       not finished publishing, even if later slots are already filled.
+ */
+int mpmc_queue_try_pop(MpmcQueue* q, void* elem){
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    Cell* cell;
+
+    while(1){
+        cell = cell_at(q, pos);
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if(diff == 0){
+            if(atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(diff < 0){
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    memcpy(elem, cell_data(cell), q->elem_size);
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * @function mpmc_queue_try_pop_if
+ * @brief mpmc_queue_try_pop() that leaves the oldest element unless accept() takes it
+ *
+ * @param q Queue
+ * @param elem Destination buffer (elem_size bytes)
+ * @param accept Called with a copy of the oldest element; nonzero claims it
+ * @return 0 if the element was claimed, -1 if the queue is empty or the
+ *         oldest element was refused
+ *
+ * @details
+ *  - The element is copied out before the claim: a producer can only
+ *    reuse the cell after it was claimed, so if the CAS succeeds the
+ *    copy accept() looked at is the element that was taken
+ *  - If another consumer claims it first the copy may be stale, and the
+ *    next element is judged instead
+ */
+int mpmc_queue_try_pop_if(MpmcQueue* q, void* elem, int (*accept)(const void* elem)){
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    Cell* cell;
+
+    while(1){
+        cell = cell_at(q, pos);
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if(diff == 0){
+            memcpy(elem, cell_data(cell), q->elem_size);
+            size_t seen = pos;
+            if(!accept(elem)){
+                pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+                if(pos == seen) return -1;
+                continue;
+            }
+            if(atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                     memory_order_acquire, memory_order_relaxed))
+                break;
+        } else if(diff < 0){
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * @function mpmc_queue_capacity
+ * @brief Number of slots in the ring
+ */
+size_t mpmc_queue_capacity(const MpmcQueue* q){
+    return q->mask + 1;
+}
+
+/**
+ * @function mpmc_queue_size
+ * @brief Approximate number of queued elements (exact when quiescent)
+ */
+size_t mpmc_queue_size(MpmcQueue* q){
+    size_t head = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    return tail >= head ? tail - head : 0;
+}
@@ -0,0 +1,41 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE_SIZE 64
+
+/**
+ * @struct MpmcQueue
+ * @brief Bounded lock-free multi-producer/multi-consumer ring of fixed-size elements
+ *
+ * @member cells Ring storage, one cache-line aligned cell per slot
+ * @member mask capacity - 1 (capacity is a power of two)
+ * @member elem_size Size of one element in bytes
+ * @member stride Distance between two cells in bytes
+ * @member enqueue_pos Next position to be claimed by a producer
+ * @member dequeue_pos Next position to be claimed by a consumer
+ *
+ * @note Each cell carries a sequence number that tells producers and
+ *       consumers whether the slot is free or holds a published element,
+ *       so neither side needs a lock (D. Vyukov's bounded MPMC design).
+ */
+typedef struct {
+    unsigned char* cells;
+    size_t mask;
+    size_t elem_size;
+    size_t stride;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+} MpmcQueue;
+
+int mpmc_queue_init(MpmcQueue* q, size_t capacity, size_t elem_size);
+void mpmc_queue_destroy(MpmcQueue* q);
+int mpmc_queue_try_push(MpmcQueue* q, const void* elem);
+int mpmc_queue_try_pop(MpmcQueue* q, void* elem);
+int mpmc_queue_try_pop_if(MpmcQueue* q, void* elem, int (*accept)(const void* elem));
+size_t mpmc_queue_capacity(const MpmcQueue* q);
+size_t mpmc_queue_size(MpmcQueue* q);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
@@ -12,154 +13,461 @@
 #include <pthread.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
-#define BACKLOG 128
-#define BUFF_SIZE 4096
+#include "session/session.h"
+#include "worker/worker_pool.h"
+#include "buffer/buffer_pool.h"
+#include "account/account_store.h"
+#include "log/log.h"
+#include "metrics/metrics.h"
+#include "timer/timer_wheel.h"
+#include "timeout/recv_timeout.h"
+#include "postlog/post_log.h"
+#include "postlog/post_index.h"
+#include "admission/admission.h"
+#include "uring/uring.h"
+#include "upgrade/upgrade.h"
+#include "protocol/bin_protocol.h"
+
+#define BACKLOG 4096
+#define ACCEPT_BUDGET 256
 #define ACCOUNT_FILE "account.txt"
+#define DEFAULT_POST_DIR "posts"
 #define INITIAL_POLL_SIZE 64
+#define DEFAULT_LIST_COUNT 10
+#define REQUEST_TAG_MAX 32
+#define MAX_EPOLL_EVENTS 256
+#define MAX_EVENT_LOOPS 64
+#define DEFAULT_WORK_QUEUE_SIZE 16384
+#define DEFAULT_WORKERS 10
+#define DEFAULT_SCALE_TARGET_US 1000
+#define SCALE_INTERVAL_MS 250
+#define OUTPUT_HIGH_WATER 65536
+#define OUTPUT_LOW_WATER 16384
+#define INTEREST_READ 1
+#define INTEREST_WRITE 2
+#define TIMER_TICK_MS 100
+#define DEFAULT_SHED_INTERVAL_MS 100
+#define URING_ENTRIES 512
+#define URING_CQ_ENTRIES 8192
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 16384
+#define URING_BGID 0
+#define URING_OP_MASK 7
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_CANCEL 3
+#define URING_OP_ACCEPT 4
+#define URING_OP_WAKE 5
+#define DEFAULT_SESSION_RESERVE 1024
+#define UPGRADE_POLL_MS 10
+#define UPGRADE_DRAIN_MS 5000
+
+static const char greeting[] = "100\r\n";
 
 /**
- * @struct Account
- * @brief Structure to store account information loaded from file
+ * @struct WorkItem
+ * @brief Structure representing a work item in the thread pool queue
  * 
- * @member username Dynamically allocated username string
- * @member status Account status (1 = active, 0 = locked)
+ * @member session Handle of the session that generated this work
+ * @member seq Per-session sequence number, commands of a session run in seq order
+ * @member line The command, in place in the receive chunk it arrived in
+ * @member recv_ns When the loop framed the line (metrics_now_ns())
+ * @member enqueue_ns When the item entered the work queue
+ * @member shed 1 when the command is to be answered 503 instead of run
+ *             (shed while overloaded behind commands still in flight)
+ * 
+ * @note Used in producer-consumer pattern between main thread and worker threads
+ * @note The handle, not a raw pointer, is queued: if the client disconnects
+ *       before a worker gets to the item, session_acquire() fails and the
+ *       item is dropped without touching the recycled session
+ * @note The item holds a reference to line.chunk, dropped by the worker,
+ *       so the command is never copied between the loop and the workers
+ * @note seq is unused for an unordered (tagged) command
  */
 typedef struct {
-    char* username;
-    int status;
-} Account;
+    SessionHandle session;
+    uint32_t seq;
+    int unordered;
+    BufferSlice line;
+    uint64_t recv_ns;
+    uint64_t enqueue_ns;
+    int shed;
+} WorkItem;
 
 /**
- * @struct Session
- * @brief Structure to store client session state with integrated buffer management
- * 
- * @member logged_in Flag indicating if user is authenticated (1 = logged in, 0 = not)
- * @member username Dynamically allocated username (empty string if not logged in)
- * @member sockfd Socket file descriptor for this client connection
- * @member client_ip Client IP address in dotted-decimal notation
- * @member client_port Client port number
- * @member active Flag indicating if session is active (1 = active, 0 = disconnected)
- * @member leftover Buffer to store incomplete data from previous recv() calls
- * @member leftover_len Length of data stored in leftover buffer
- * @member session_lock Mutex for protecting session state during command processing
+ * @struct Request
+ * @brief The command a handler answers, so that its replies are addressed to it
+ *
+ * @member session Session that sent the command
+ * @member binary 1 if it came as a binary frame: replies are frames too
+ * @member opcode BinOpcode of the frame
+ * @member id Request id of the frame, echoed in every reply
+ * @member tag Text request id after '#' (tag_len bytes, in the command
+ *         line), echoed in front of the reply; NULL if untagged
+ * @member tag_len Length of tag
+ * @member unordered 1 if the reply may overtake earlier ones (tagged, or
+ *         a binary frame with BIN_FLAG_ANY_ORDER)
+ */
+typedef struct {
+    Session* session;
+    int binary;
+    uint8_t opcode;
+    uint32_t id;
+    const char* tag;
+    size_t tag_len;
+    int unordered;
+} Request;
+
+/**
+ * @struct CommitWaiter
+ * @brief Session with a reply parked until a post log record is durable
  * 
- * @note In this event-driven architecture, each session manages its own receive buffer
+ * @member session Handle of the session (it may close meanwhile)
+ * @member lsn Post log record the session's reply 120 waits for
  */
 typedef struct {
-    int logged_in;
-    char* username;
-    int sockfd;
-    char client_ip[INET_ADDRSTRLEN];
-    int client_port;
-    int active;
-    char leftover[BUFF_SIZE];
-    int leftover_len;
-    pthread_mutex_t session_lock;
-} Session;
+    SessionHandle session;
+    uint64_t lsn;
+} CommitWaiter;
 
 /**
- * @struct WorkItem
- * @brief Structure representing a work item in the thread pool queue
+ * @enum IoBackend
+ * @brief Readiness notification mechanism used by the main event loop
+ *
+ * @member BACKEND_EPOLL Edge-triggered epoll, cost per wakeup is O(ready fds)
+ * @member BACKEND_POLL Level-triggered poll() over poll_fds, cost per wakeup is O(connections)
+ * @member BACKEND_URING io_uring completions: multishot accept and receive into
+ *         provided buffers, sends submitted in the same io_uring_enter() as the wait
+ */
+typedef enum {
+    BACKEND_EPOLL,
+    BACKEND_POLL,
+    BACKEND_URING
+} IoBackend;
+
+const char* backend_names[] = { "epoll", "poll", "io_uring" };
+
+/**
+ * @enum UpgradeState
+ * @brief Progress of a hot upgrade (-U), set by the upgrade thread and the loops
+ *
+ * @member UPGRADE_IDLE No successor process connected
+ * @member UPGRADE_HANDOFF Loops stop accepting and hand their sessions to the successor
+ * @member UPGRADE_FAILED The handoff connection broke; loops take their sessions back
+ * @member UPGRADE_FINISHED Everything was handed off, the loops return and the process exits
+ */
+typedef enum {
+    UPGRADE_IDLE,
+    UPGRADE_HANDOFF,
+    UPGRADE_FAILED,
+    UPGRADE_FINISHED
+} UpgradeState;
+
+/**
+ * @struct AdoptedSession
+ * @brief Connection received from the previous server process, waiting for its loop
+ *
+ * @member msg State sent by the previous process
+ * @member payload Username, unframed input and unsent output (lengths in msg)
+ * @member fd Client socket
+ */
+typedef struct {
+    UpgradeMsg msg;
+    char* payload;
+    int fd;
+} AdoptedSession;
+
+/**
+ * @struct EventLoop
+ * @brief One accept + read event loop with its own listener and connection table
  * 
- * @member session Pointer to the session that generated this work
- * @member message The command message to be processed
+ * @member id Loop index (0 .. num_loops-1)
+ * @member listen_sock This loop's listening socket (SO_REUSEPORT, non-blocking)
+ * @member epoll_fd epoll instance (BACKEND_EPOLL only, -1 otherwise)
+ * @member poll_fds pollfd array, slot 0 is listen_sock
+ * @member sessions Session pointers parallel to poll_fds (NULL for the listener)
+ * @member poll_size Allocated capacity of poll_fds/sessions
+ * @member poll_count Number of used slots (kept dense by swap-removal)
+ * @member fd_index Maps a client sockfd to its slot in poll_fds/sessions, -1 if unused
+ * @member fd_index_size Allocated length of fd_index
+ * @member sessions_mutex Protects poll_fds/sessions/poll_count
+ * @member cpu CPU this loop's thread is pinned to, -1 if not pinned
+ * @member thread Thread running the loop
+ * @member wakeup_fd eventfd written by workers when queue space frees up
+ * @member throttled Sessions whose input is paused by backpressure (loop thread only);
+ *         NULL marks an entry whose session was dropped
+ * @member throttled_count Number of entries in throttled, NULL ones included
+ * @member throttled_size Allocated capacity of throttled
+ * @member has_throttled Non-zero while throttled_count > 0, read by workers
+ * @member flush_lock Protects flush_list/flush_count/flush_size
+ * @member flush_list Sessions with new output queued by workers
+ * @member flush_count Number of entries in flush_list
+ * @member flush_size Allocated capacity of flush_list
+ * @member wheel Timing wheel holding every session's timeout timer
+ * @member now_tick Tick (TIMER_TICK_MS) read after the last poll/epoll wakeup
+ * @member ring io_uring instance (BACKEND_URING only)
+ * @member wake_count Target of the ring's pending read of wakeup_fd
+ * @member accept_more 1 when accept_clients() stopped at ACCEPT_BUDGET
+ *         with connections possibly still queued (loop thread only)
+ * @member accept_armed 1 while the ring's multishot accept is in flight (io_uring)
+ * @member handoff 1 while handing sessions to a successor process, 2 once
+ *         all are handed off (loop thread only, see run_handoff())
+ * @member handed_count Sessions handed off and parked until the successor confirms
+ * @member handoff_deadline_ns When sessions still busy are dropped instead
+ * @member upgrade_seen Last failed upgrade attempt this loop recovered from
+ * @member adopt_lock Protects adopt_list/adopt_count/adopt_size
+ * @member adopt_list Sessions taken over from the previous process, not yet registered
+ * @member adopt_count Number of entries in adopt_list
+ * @member adopt_size Allocated capacity of adopt_list
  * 
- * @note Used in producer-consumer pattern between main thread and worker threads
+ * @note With SO_REUSEPORT the kernel spreads new connections across the
+ *       listeners, so each loop only ever sees its own clients
  */
-typedef struct {
-    Session* session;
-    char message[BUFF_SIZE];
-} WorkItem;
+struct EventLoop {
+    int id;
+    int listen_sock;
+    int epoll_fd;
+    struct pollfd* poll_fds;
+    Session** sessions;
+    int poll_size;
+    int poll_count;
+    int* fd_index;
+    int fd_index_size;
+    pthread_mutex_t sessions_mutex;
+    int cpu;
+    pthread_t thread;
+    int wakeup_fd;
+    Session** throttled;
+    int throttled_count;
+    int throttled_size;
+    atomic_int has_throttled;
+    pthread_mutex_t flush_lock;
+    SessionHandle* flush_list;
+    int flush_count;
+    int flush_size;
+    TimerWheel wheel;
+    uint64_t now_tick;
+    Uring ring;
+    uint64_t wake_count;
+    int accept_more;
+    int accept_armed;
+    int handoff;
+    int handed_count;
+    uint64_t handoff_deadline_ns;
+    unsigned upgrade_seen;
+    pthread_mutex_t adopt_lock;
+    AdoptedSession* adopt_list;
+    int adopt_count;
+    int adopt_size;
+};
 
-struct pollfd* poll_fds = NULL;
-Session** sessions = NULL;
-int poll_size = 0;
-int poll_count = 0;
-pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
-int active_connections = 0;
+IoBackend io_backend = BACKEND_EPOLL;
+EventLoop event_loops[MAX_EVENT_LOOPS];
+int num_loops = 1;
+int loop_cpus[MAX_EVENT_LOOPS];
+int loop_cpu_count = 0;
+int min_workers = DEFAULT_WORKERS;
+int max_workers = DEFAULT_WORKERS;
+uint64_t scale_target_ns = (uint64_t)DEFAULT_SCALE_TARGET_US * 1000;
+int worker_cpus[CPU_SETSIZE];
+int worker_cpu_count = 0;
+atomic_int active_connections = 0;
 
-pthread_t worker_threads[10];
-WorkItem work_queue[100];
-int queue_front = 0, queue_rear = 0, queue_count = 0;
-pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+WorkerPool worker_pool;
+size_t work_queue_size = DEFAULT_WORK_QUEUE_SIZE;
+uint64_t slow_threshold_ns = 0;
+uint64_t idle_timeout_ticks = RECV_TIMEOUT_IDLE * 1000 / TIMER_TICK_MS;
+uint64_t handshake_timeout_ticks = RECV_TIMEOUT_HANDSHAKE * 1000 / TIMER_TICK_MS;
+uint64_t login_timeout_ticks = RECV_TIMEOUT_LOGIN * 1000 / TIMER_TICK_MS;
+int max_connections = 0;
+atomic_int shedding = 0;
+const char* upgrade_path = NULL;
+int upgrade_sock = -1;
+atomic_int upgrade_state = UPGRADE_IDLE;
+atomic_uint upgrade_attempt = 0;
+atomic_int upgrade_pending = 0;
+atomic_int upgrade_resumed = 0;
+PostLog post_log;
+PostIndex post_index;
+atomic_ullong indexed_lsn = 0;
+const char* post_dir = DEFAULT_POST_DIR;
+unsigned post_delay_us = POST_LOG_DEFAULT_DELAY_US;
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+CommitWaiter* commit_waiters = NULL;
+int commit_count = 0;
+int commit_size = 0;
 
 /**
- * @function load_account
- * @brief Load account information from the account file
+ * @function wake_loop
+ * @brief Make a loop's wakeup_fd readable so it runs handle_wakeup()
+ */
+void wake_loop(EventLoop* loop){
+    uint64_t one = 1;
+    if(write(loop->wakeup_fd, &one, sizeof(one)) == -1 && errno != EAGAIN){
+        perror("write(wakeup_fd) error");
+    }
+}
+
+/**
+ * @function queue_flush
+ * @brief Put a session on its loop's flush list
  * 
- * @param inputUsername The username to search for
- * @param acc Pointer to Account structure to populate with found data
- * @return 1 if account found, 0 if not found, -1 on error
+ * @param session Session with new data in its output buffer
  * 
  * @details
- *  - Opens ACCOUNT_FILE ("account.txt") for reading
- *  - Reads file line by line using getline()
- *  - Expected line format: "username status" (space or tab separated)
- *  - Compares username with inputUsername (case-sensitive)
- *  - If found, uses strdup() to allocate and copy username
- *  - Status values: 1 = active account, 0 = locked account
- *  - Caller must free acc->username if return value is 1
- * 
- * @note No file locking - potential race condition if file is modified concurrently
- * @warning Memory leak if caller doesn't free acc->username on success
+ *  - flush_queued makes sure a session is listed at most once
+ *  - The list holds session handles, so a session closed before the loop
+ *    gets to it is skipped safely
+ *  - Only the push that makes the list non-empty wakes the loop
  */
-int load_account(const char* inputUsername, Account* acc){
-    FILE* f = fopen(ACCOUNT_FILE, "r");
-    if(!f){
-        perror("Cannot open account file");
-        return -1;
-    }
-    
-    char* line = NULL;
-    size_t lineSize = 0;
-    int foundUser = 0;
-    
-    while (getline(&line, &lineSize, f) > 0){
-        char* username = strtok(line, " \t\n");
-        char* statusStr = strtok(NULL, " \t\n");
-        
-        if (username && statusStr) {
-            int status = atoi(statusStr);
-            if (strcmp(username, inputUsername) == 0) {
-                acc->username = strdup(inputUsername);
-                if (!acc->username) {
-                    fclose(f);
-                    free(line);
-                    return -1;
-                }
-                acc->status = status;
-                foundUser = 1;
-                break;
-            }
+void queue_flush(Session* session){
+    if(atomic_exchange(&session->flush_queued, 1)) return;
+
+    EventLoop* loop = session->loop;
+    int was_empty;
+
+    pthread_mutex_lock(&loop->flush_lock);
+    if(loop->flush_count >= loop->flush_size){
+        int new_size = loop->flush_size ? loop->flush_size * 2 : INITIAL_POLL_SIZE;
+        SessionHandle* grown = realloc(loop->flush_list, new_size * sizeof(SessionHandle));
+        if(!grown){
+            perror("realloc flush_list failed");
+            atomic_store(&session->flush_queued, 0);
+            pthread_mutex_unlock(&loop->flush_lock);
+            return;
         }
+        loop->flush_list = grown;
+        loop->flush_size = new_size;
     }
-    free(line);
-    fclose(f);
-    return foundUser; 
+    was_empty = loop->flush_count == 0;
+    loop->flush_list[loop->flush_count++] = session_handle(session);
+    pthread_mutex_unlock(&loop->flush_lock);
+
+    if(was_empty) wake_loop(loop);
 }
 
 /**
- * @function send_response
- * @brief Send response code to client in protocol format
+ * @function reply_tag
+ * @brief Start a text reply with "#TAG " if the request was tagged
+ *
+ * @param out Room for at least REQUEST_TAG_MAX + 2 bytes
+ * @return Bytes written (0 for an untagged request)
+ *
+ * @note A reply of several lines (LIST) is tagged on its first line;
+ *       the others follow it without anything in between
+ */
+int reply_tag(const Request* req, char* out){
+    if(!req->tag) return 0;
+    out[0] = '#';
+    memcpy(out + 1, req->tag, req->tag_len);
+    out[req->tag_len + 1] = ' ';
+    return (int)req->tag_len + 2;
+}
+
+/**
+ * @function settle_reply
+ * @brief Park the reply appended since mark if it may not go out yet
+ *
+ * @param req Command the reply answers
+ * @param mark Taken (under out_lock) before the reply was appended
+ * @param lsn Post log record the reply confirms (120), 0 for none
+ *
+ * @details
+ *  - A 120 waits for its record's group commit
+ *  - The reply of an untagged command also waits while an earlier
+ *    ordered reply is parked; a tagged reply does not, so it never sits
+ *    behind another command's commit
+ *  - Everything else stays in the output buffer, which is never held
+ *    back; flush_output() releases parked replies (session_out_release())
+ *
+ * @note Caller holds out_lock
+ */
+void settle_reply(const Request* req, const OutMark* mark, uint64_t lsn){
+    Session* session = req->session;
+    int ordered = !req->unordered;
+
+    if(lsn <= post_log_durable(&post_log)) lsn = 0;
+    if(lsn == 0 && !(ordered && session->held_ordered > 0)) return;
+    if(session_out_park(session, mark, lsn, ordered) == -1){
+        perror("session_out_park() error");
+    }
+}
+
+/**
+ * @function respond
+ * @brief Queue a response code for the client in protocol format
  * 
- * @param sockfd Socket descriptor to send to
+ * @param req Command being answered
  * @param code Response code string (e.g., "100", "110", "211")
+ * @param lsn Post log record that must be durable before the code goes
+ *        out (POST's 120), 0 for none
  * 
  * @details
- *  - Formats response as "CODE\r\n" (CRLF-terminated)
- *  - Sends complete response using send()
- *  - Prints error message if send() fails but doesn't close connection
- *  - Thread-safe: assumes exclusive access to socket within session lock
+ *  - Formats response as "CODE\r\n" (CRLF-terminated), "#TAG CODE\r\n"
+ *    for a tagged request, or for a binary request as a frame header
+ *    with the code in flags and no payload
+ *  - Only appends it to the session's output buffer; run_work_item()
+ *    decides when the buffer is handed to the loop with queue_flush(), so
+ *    replies to pipelined commands leave in one send()
+ *  - Never blocks on the socket, so a client that reads slowly cannot
+ *    stall the worker thread that produced the reply
+ *  - Thread-safe: output buffer has its own lock (session->out_lock)
+ *  - Counted per code in the calling thread's metrics shard
  * 
  * @protocol Response format: "CODE\r\n" where CODE is a 3-digit status code
  */
+void respond(const Request* req, const char* code, uint64_t lsn){
+    Session* session = req->session;
+    char response[REQUEST_TAG_MAX + 16];
+    OutMark mark;
+    int len;
+
+    if(req->binary){
+        bin_header_encode(response, req->opcode | BIN_REPLY, (uint16_t)atoi(code), req->id, 0);
+        len = BIN_HEADER_SIZE;
+    } else {
+        len = reply_tag(req, response);
+        len += snprintf(response + len, sizeof(response) - len, "%s\r\n", code);
+    }
+    pthread_mutex_lock(&session->out_lock);
+    session_out_mark(session, &mark);
+    int failed = session_out_append_locked(session, response, len) == -1;
+    if(!failed) settle_reply(req, &mark, lsn);
+    pthread_mutex_unlock(&session->out_lock);
+    if(failed){
+        perror("session_out_append() error");
+        return;
+    }
+    metrics_response(code);
+}
+
+/**
+ * @function send_response
+ * @brief respond() for a code that needs no post log record
+ */
+void send_response(const Request* req, const char* code){
+    respond(req, code, 0);
+}
 
-void send_response(int sockfd, const char* code){
-    char response[BUFF_SIZE];
-    snprintf(response, BUFF_SIZE, "%s\r\n", code);
-    if(send(sockfd, response, strlen(response), 0) == -1){
+/**
+ * @function send_direct
+ * @brief Best-effort reply on a socket that has no session (rejections)
+ * 
+ * @param sockfd Non-blocking socket
+ * @param code Response code string
+ */
+void send_direct(int sockfd, const char* code){
+    char response[16];
+    int len = snprintf(response, sizeof(response), "%s\r\n", code);
+    if(send(sockfd, response, len, MSG_NOSIGNAL | MSG_DONTWAIT) == -1){
         perror("send() error");
     }
 }
@@ -168,107 +476,389 @@ void send_response(int sockfd, const char* code){
  * @function process_user_command
  * @brief Process USER command for user authentication
  * 
- * @param session Pointer to Session structure tracking login state
+ * @param req Command being answered (its session tracks login state)
  * @param arg Username argument from USER command
  * 
  * @details
- *  - Acquires session->session_lock for thread-safe access
  *  - Validation checks (in order):
  *    1. Already logged in ? sends 213
  *    2. Empty username ? sends 300
- *  - Calls load_account() to verify username exists and get status
+ *  - Looks the username up in the in-memory account index
+ *    (account_store_lookup(), lock-free, no file access) without
+ *    holding session_lock, so a slow lookup does not stall the session's
+ *    other (tagged) commands; login state is checked again before it
+ *    is set
  *  - Response codes based on account state:
  *    + Account not found ? 212
  *    + Account locked (status=0) ? 211
+ *    + No memory to copy the username ? 500, the session stays logged out
  *    + Success ? 110
- *  - On success:
- *    + Sets session->logged_in = 1
- *    + Stores username in session
- *  - Releases lock before returning
+ *  - On success, under session_lock:
+ *    + Sets session->logged_in = 1 and session->got_login = 1
+ *    + Stores username in session (never NULL while logged in: POST
+ *      passes it to post_log_append())
  * 
  * @protocol USER <username>\r\n
  * @thread_safety Protected by session-level lock (session_lock)
  * @note Improvement over old version: per-session locking instead of global only
  */
-void process_user_command(Session* session, const char* arg){
+void process_user_command(const Request* req, const char* arg){
+    Session* session = req->session;
     pthread_mutex_lock(&session->session_lock);
-    int sockfd = session->sockfd;
+    int logged_in = session->logged_in;
+    pthread_mutex_unlock(&session->session_lock);
     
-    if(session->logged_in){
-        send_response(sockfd, "213");
-        pthread_mutex_unlock(&session->session_lock);
+    if(logged_in){
+        send_response(req, "213");
         return;
     }
     
     if(strlen(arg) == 0){
-        send_response(sockfd, "300");
-        pthread_mutex_unlock(&session->session_lock);
+        send_response(req, "300");
         return;
     }
     
-    Account acc = {NULL, 0};
-    int result = load_account(arg, &acc);
+    int status = 0;
+    int result = account_store_lookup(arg, &status);
             
     if(result == 1){
-        if(acc.status == 0){
-            send_response(sockfd, "211");
-            free(acc.username);
-            pthread_mutex_unlock(&session->session_lock);
+        if(status == 0){
+            send_response(req, "211");
             return;
         }
         
+        pthread_mutex_lock(&session->session_lock);
+        if(session->logged_in){
+            send_response(req, "213");
+            pthread_mutex_unlock(&session->session_lock);
+            return;
+        }
+        char* username = strdup(arg);
+        if(!username){
+            send_response(req, "500");
+            pthread_mutex_unlock(&session->session_lock);
+            return;
+        }
         session->logged_in = 1;
+        session->got_login = 1;
         if(session->username) free(session->username);
-        session->username = strdup(acc.username);
-        send_response(sockfd, "110");
-        free(acc.username);
+        session->username = username;
+        send_response(req, "110");
+        pthread_mutex_unlock(&session->session_lock);
     }
     else if(result == 0){
-        send_response(sockfd, "212");
+        send_response(req, "212");
     }
     else{
-        send_response(sockfd, "500");
+        send_response(req, "500");
     }
-    pthread_mutex_unlock(&session->session_lock);
+}
+
+/**
+ * @function wait_for_commit
+ * @brief Have the session flushed once post log record lsn is durable
+ * 
+ * @details
+ *  - The waiter list is walked by commit_done() after every group commit
+ *  - A commit that completes before the waiter is listed is not missed:
+ *    run_work_item() queues a flush after the command anyway, and that
+ *    flush already sees the record durable
+ */
+void wait_for_commit(Session* session, uint64_t lsn){
+    pthread_mutex_lock(&commit_lock);
+    if(commit_count >= commit_size){
+        int new_size = commit_size ? commit_size * 2 : INITIAL_POLL_SIZE;
+        CommitWaiter* grown = realloc(commit_waiters, new_size * sizeof(CommitWaiter));
+        if(!grown){
+            perror("realloc commit_waiters failed");
+            pthread_mutex_unlock(&commit_lock);
+            return;
+        }
+        commit_waiters = grown;
+        commit_size = new_size;
+    }
+    commit_waiters[commit_count].session = session_handle(session);
+    commit_waiters[commit_count].lsn = lsn;
+    commit_count++;
+    pthread_mutex_unlock(&commit_lock);
+}
+
+/**
+ * @function commit_done
+ * @brief Post log callback after each group commit: release held replies
+ * 
+ * @param ctx Unused
+ * @param durable_lsn Last record on disk
+ * @param failed 1 once the log failed; every waiter is flushed, and
+ *        flush_output() closes the sessions whose reply can never be
+ *        confirmed
+ * 
+ * @details
+ *  - Runs on the committer thread; sessions are queued on their loop's
+ *    flush list like a worker's reply
+ *  - The read index takes in the new records first, so a post is
+ *    visible to GET/LIST before its 120 goes out
+ */
+void commit_done(void* ctx, uint64_t durable_lsn, int failed){
+    (void)ctx;
+    post_index_refresh(&post_index);
+    atomic_store(&indexed_lsn, durable_lsn);
+    pthread_mutex_lock(&commit_lock);
+    for(int i = commit_count - 1; i >= 0; i--){
+        if(!failed && commit_waiters[i].lsn > durable_lsn) continue;
+
+        Session* session = session_acquire(commit_waiters[i].session);
+        if(session){
+            queue_flush(session);
+            session_release(session);
+        }
+        commit_waiters[i] = commit_waiters[--commit_count];
+    }
+    pthread_mutex_unlock(&commit_lock);
 }
 
 /**
  * @function process_post_command
  * @brief Process POST command for posting articles
  * 
- * @param session Pointer to Session structure tracking login state
+ * @param req Command being answered (its session tracks login state)
+ * @param body Article (a binary POST may contain any byte)
+ * @param len Article length
  * 
  * @details
  *  - Acquires session->session_lock for thread-safe access
  *  - Checks authentication state:
  *    + Not logged in ? sends 221
- *    + Logged in ? sends 120
- *  - Does not validate article content or length
- *  - Does not persist article data (stub implementation)
+ *    + Logged in ? appends the article to the post log and sends 120,
+ *      or 500 if the log rejected it (failed, or a field too long)
+ *  - The worker does not wait for the disk: the 120 is parked until the
+ *    record's group commit is durable (settle_reply()), and commit_done()
+ *    then queues the flush. Later untagged replies of the session are
+ *    parked behind it, so request order is kept; tagged ones are not
  *  - Releases lock before returning
  * 
- * @protocol POST\r\n
+ * @protocol POST <article>\r\n
  * @thread_safety Protected by session-level lock
- * @note This is a minimal implementation - production version would handle article data
  */
-void process_post_command(Session* session){
+void process_post_command(const Request* req, const char* body, size_t len){
+    Session* session = req->session;
     pthread_mutex_lock(&session->session_lock);
-    int sockfd = session->sockfd;
     
     if(!session->logged_in){
-        send_response(sockfd, "221");
+        send_response(req, "221");
+        pthread_mutex_unlock(&session->session_lock);
+        return;
     }
-    else{
-        send_response(sockfd, "120");
+
+    uint64_t lsn = post_log_append(&post_log, session->username, body, len);
+    if(lsn == 0){
+        send_response(req, "500");
+        pthread_mutex_unlock(&session->session_lock);
+        return;
     }
+
+    pthread_mutex_lock(&session->out_lock);
+    if(lsn > session->post_lsn) session->post_lsn = lsn;
+    pthread_mutex_unlock(&session->out_lock);
+    respond(req, "120", lsn);
+    wait_for_commit(session, lsn);
     pthread_mutex_unlock(&session->session_lock);
 }
 
+/**
+ * @function append_text_body
+ * @brief Queue an article inside a text reply line
+ *
+ * @note Caller holds out_lock
+ *
+ * @details
+ *  - Normally queued as a reference into the post log mapping, so
+ *    sendmsg() takes it from there without a copy
+ *  - An article posted in binary may contain CR or LF; text clients get
+ *    a copy with those turned into spaces, so the reply stays one line
+ */
+int append_text_body(Session* session, const char* body, size_t len){
+    if(!memchr(body, '\r', len) && !memchr(body, '\n', len)){
+        return session_out_append_ref_locked(session, body, len);
+    }
+
+    char* copy = malloc(len);
+    if(!copy) return -1;
+    for(size_t i = 0; i < len; i++){
+        copy[i] = body[i] == '\r' || body[i] == '\n' ? ' ' : body[i];
+    }
+    int ret = session_out_append_locked(session, copy, len);
+    free(copy);
+    return ret;
+}
+
+/**
+ * @function await_own_posts
+ * @brief Make the session's own posts readable before it reads
+ *
+ * @details
+ *  - A GET/LIST pipelined right behind a POST of the same session runs
+ *    before that post's group commit, and would miss it even though its
+ *    reply goes out after the 120
+ *  - Such a reader waits for the commit and brings the index up to
+ *    date itself (commit_done() may not have got to it yet); readers
+ *    without a pending post of their own never wait
+ *  - Tagged readers never wait: their reply may come before the 120
+ *    anyway, so a client reading its own post waits for the 120 first
+ */
+void await_own_posts(const Request* req){
+    Session* session = req->session;
+    if(req->unordered) return;
+
+    pthread_mutex_lock(&session->out_lock);
+    uint64_t lsn = session->post_lsn;
+    pthread_mutex_unlock(&session->out_lock);
+
+    if(lsn <= atomic_load(&indexed_lsn)) return;
+    if(post_log_wait(&post_log, lsn) == 0) post_index_refresh(&post_index);
+}
+
+/**
+ * @function process_get_command
+ * @brief Process GET command: one post by id
+ *
+ * @param req Command being answered
+ * @param id Post id (as LIST reports it)
+ *
+ * @details
+ *  - Found ? sends "140 <id> <user> <article>" (binary: id, time, user
+ *    and article in the 140 frame); the article is not copied
+ *  - Unknown id ? sends 240
+ *  - Out of memory while appending ? the partial reply is rolled back
+ *    (session_out_rollback()) and 500 sent instead
+ *  - No login needed; the post comes from the read index (post_index_get())
+ *
+ * @protocol GET <id>\r\n
+ */
+void process_get_command(const Request* req, uint64_t id){
+    Session* session = req->session;
+    char head[64 + BUFF_SIZE];
+    PostView view;
+    int len;
+
+    await_own_posts(req);
+    if(!post_index_get(&post_index, id, &view)){
+        send_response(req, "240");
+        return;
+    }
+
+    if(req->binary){
+        size_t user_len = view.user_len < BUFF_SIZE ? view.user_len : BUFF_SIZE;
+        bin_header_encode(head, req->opcode | BIN_REPLY, 140, req->id,
+                          (uint32_t)(18 + user_len + view.body_len));
+        bin_put_u64(head + BIN_HEADER_SIZE, view.id);
+        bin_put_u64(head + BIN_HEADER_SIZE + 8, view.time_ns);
+        bin_put_u16(head + BIN_HEADER_SIZE + 16, (uint16_t)user_len);
+        memcpy(head + BIN_HEADER_SIZE + 18, view.user, user_len);
+        len = BIN_HEADER_SIZE + 18 + (int)user_len;
+    } else {
+        len = reply_tag(req, head);
+        len += snprintf(head + len, sizeof(head) - len, "140 %llu %.*s ", (unsigned long long)view.id,
+                        (int)view.user_len, view.user);
+        if((size_t)len >= sizeof(head)) len = sizeof(head) - 1;
+    }
+
+    OutMark mark;
+    pthread_mutex_lock(&session->out_lock);
+    session_out_mark(session, &mark);
+    int failed = session_out_append_locked(session, head, len) == -1;
+    if(!failed && req->binary) failed = session_out_append_ref_locked(session, view.body, view.body_len) == -1;
+    if(!failed && !req->binary){
+        failed = append_text_body(session, view.body, view.body_len) == -1 ||
+                 session_out_append_locked(session, "\r\n", 2) == -1;
+    }
+    if(failed) session_out_rollback(session, &mark);
+    else settle_reply(req, &mark, 0);
+    pthread_mutex_unlock(&session->out_lock);
+    if(failed){
+        perror("session_out_append() error");
+        send_response(req, "500");
+        return;
+    }
+    metrics_response("140");
+}
+
+/**
+ * @function process_list_command
+ * @brief Process LIST command: a user's latest posts
+ *
+ * @param req Command being answered
+ * @param user Author
+ * @param max Posts wanted, 1 to POST_INDEX_LIST_MAX
+ *
+ * @details
+ *  - Sends "150 <count>", then one "<id> <article>" line per post,
+ *    newest first (count 0 for a user without posts); binary: one 150
+ *    frame with the count and every post
+ *  - The whole reply is appended under one out_lock hold, so a tagged
+ *    command finishing meanwhile cannot split it
+ *  - Articles are not copied
+ *  - Out of memory while appending ? the partial reply is rolled back
+ *    and 500 sent instead, so the client never gets fewer posts than
+ *    the count promised
+ *  - No login needed
+ *
+ * @protocol LIST <user> [n]\r\n
+ */
+void process_list_command(const Request* req, const char* user, int max){
+    Session* session = req->session;
+    PostView views[POST_INDEX_LIST_MAX];
+    char head[REQUEST_TAG_MAX + 32];
+    int failed = 0;
+    int len;
+
+    await_own_posts(req);
+    int count = post_index_list(&post_index, user, views, max);
+    if(req->binary){
+        size_t total = 4;
+        for(int i = 0; i < count; i++) total += 12 + views[i].body_len;
+        bin_header_encode(head, req->opcode | BIN_REPLY, 150, req->id, (uint32_t)total);
+        bin_put_u32(head + BIN_HEADER_SIZE, (uint32_t)count);
+        len = BIN_HEADER_SIZE + 4;
+    } else {
+        len = reply_tag(req, head);
+        len += snprintf(head + len, sizeof(head) - len, "150 %d\r\n", count);
+    }
+
+    OutMark mark;
+    pthread_mutex_lock(&session->out_lock);
+    session_out_mark(session, &mark);
+    failed = session_out_append_locked(session, head, len) == -1;
+
+    for(int i = 0; i < count && !failed; i++){
+        if(req->binary){
+            bin_put_u64(head, views[i].id);
+            bin_put_u32(head + 8, (uint32_t)views[i].body_len);
+            failed = session_out_append_locked(session, head, 12) == -1 ||
+                     session_out_append_ref_locked(session, views[i].body, views[i].body_len) == -1;
+        } else {
+            len = snprintf(head, sizeof(head), "%llu ", (unsigned long long)views[i].id);
+            failed = session_out_append_locked(session, head, len) == -1 ||
+                     append_text_body(session, views[i].body, views[i].body_len) == -1 ||
+                     session_out_append_locked(session, "\r\n", 2) == -1;
+        }
+    }
+    if(failed) session_out_rollback(session, &mark);
+    else settle_reply(req, &mark, 0);
+    pthread_mutex_unlock(&session->out_lock);
+    if(failed){
+        perror("session_out_append() error");
+        send_response(req, "500");
+        return;
+    }
+    metrics_response("150");
+}
+
 /**
  * @function process_bye_command
  * @brief Process BYE command for user logout
  * 
- * @param session Pointer to Session structure tracking login state
+ * @param req Command being answered (its session tracks login state)
  * 
  * @details
  *  - Acquires session->session_lock for thread-safe access
@@ -277,7 +867,7 @@ void process_post_command(Session* session){
  *    + Logged in ? sends 130 and resets session state
  *  - On logout:
  *    + Sets session->logged_in = 0
- *    + Frees old username and allocates empty string
+ *    + Frees the username (NULL until the next successful USER)
  *  - Does NOT close socket connection (client remains connected)
  *  - Releases lock before returning
  * 
@@ -285,28 +875,29 @@ void process_post_command(Session* session){
  * @thread_safety Protected by session-level lock
  * @note Connection stays alive - client can login again with USER command
  */
-void process_bye_command(Session* session){
+void process_bye_command(const Request* req){
+    Session* session = req->session;
     pthread_mutex_lock(&session->session_lock);
-    int sockfd = session->sockfd;
     
     if(!session->logged_in){
-        send_response(sockfd, "221");
+        send_response(req, "221");
     }
     else{
-        send_response(sockfd, "130");
+        send_response(req, "130");
         session->logged_in = 0;
-        if(session->username) free(session->username);
-        session->username = strdup("");
+        free(session->username);
+        session->username = NULL;
     }
     pthread_mutex_unlock(&session->session_lock);
 }
 
 /**
- * @function process_command
- * @brief Parse and dispatch command to appropriate handler
+ * @function process_text_command
+ * @brief Parse and dispatch a text command to the appropriate handler
  * 
- * @param session Pointer to Session that sent the command
+ * @param req Command being answered
  * @param buffer Command string (already stripped of \r\n delimiter)
+ * @return Command type, for the per-command metrics
  * 
  * @details
  *  - Parses command into command name and arguments:
@@ -317,17 +908,24 @@ void process_bye_command(Session* session){
  *  - Dispatches to appropriate handler:
  *    + "USER" ? process_user_command()
  *    + "POST" ? process_post_command()
+ *    + "GET" ? process_get_command() (id in decimal)
+ *    + "LIST" ? process_list_command() (user, optional count)
  *    + "BYE" ? process_bye_command()
- *    + Unknown ? sends 300
+ *    + Unknown, or malformed GET/LIST arguments ? sends 300
+ *    + An empty line ? sends 300 (before the line framer an empty line
+ *      read like a closed connection and ended the session)
  *  - Called from worker thread context
  * 
  * @protocol Format: "COMMAND [ARGUMENTS]\r\n"
  * @thread_safety Called by worker threads with session already validated
  * @improvement Over old version: uppercase conversion, better parsing
  */
-void process_command(Session* session, const char* buffer){
+CommandType process_text_command(const Request* req, const char* buffer){
     char cmd[20];
     char arg[BUFF_SIZE];
+    char user[BUFF_SIZE];
+    char extra;
+    char* end;
     arg[0] = '\0';
     
     char* space_ptr = strchr(buffer, ' ');
@@ -349,212 +947,565 @@ void process_command(Session* session, const char* buffer){
     }
 
     if(strcmp(cmd, "USER") == 0) {
-        process_user_command(session, arg);
+        process_user_command(req, arg);
+        return CMD_USER;
     } else if(strcmp(cmd, "POST") == 0) {
-        process_post_command(session);
+        process_post_command(req, arg, strlen(arg));
+        return CMD_POST;
+    } else if(strcmp(cmd, "GET") == 0) {
+        errno = 0;
+        unsigned long long id = strtoull(arg, &end, 10);
+        if(!isdigit((unsigned char)arg[0]) || *end != '\0' || errno == ERANGE){
+            send_response(req, "300");
+        } else {
+            process_get_command(req, id);
+        }
+        return CMD_GET;
+    } else if(strcmp(cmd, "LIST") == 0) {
+        int max = DEFAULT_LIST_COUNT;
+        int fields = sscanf(arg, "%4095s %d %c", user, &max, &extra);
+        if(fields < 1 || fields > 2 || max < 1 || max > POST_INDEX_LIST_MAX){
+            send_response(req, "300");
+        } else {
+            process_list_command(req, user, max);
+        }
+        return CMD_LIST;
     } else if(strcmp(cmd, "BYE") == 0) {
-        process_bye_command(session);
-    } else {
-        send_response(session->sockfd, "300");
+        process_bye_command(req);
+        return CMD_BYE;
     }
+    send_response(req, "300");
+    return CMD_OTHER;
 }
 
 /**
- * @function enqueue_work
- * @brief Add work item to thread pool queue for processing
+ * @function binary_name
+ * @brief Copy a username from a binary payload into a C string
+ *
+ * @return 0 on success, -1 if it is too long or contains a NUL byte
+ */
+int binary_name(const char* data, size_t len, char* name, size_t size){
+    if(len >= size || memchr(data, '\0', len)) return -1;
+    memcpy(name, data, len);
+    name[len] = '\0';
+    return 0;
+}
+
+/**
+ * @function process_binary_command
+ * @brief Dispatch a binary frame to the appropriate handler
  * 
- * @param session Pointer to Session that generated the work
- * @param message Command message to be processed
+ * @param req Command being answered (opcode and id from the header)
+ * @param payload Bytes after the header, not NUL-terminated
+ * @param len Payload length
+ * @return Command type, for the per-command metrics
  * 
  * @details
- *  - Acquires queue_mutex for thread-safe queue access
- *  - Checks if queue has space (max 100 items)
- *  - If space available:
- *    + Creates WorkItem with session pointer and message copy
- *    + Adds to circular buffer at queue_rear position
- *    + Advances queue_rear (wraps around at 100)
- *    + Increments queue_count
- *    + Signals queue_cond to wake waiting worker thread
- *  - If queue full: silently drops the work item
- *  - Releases queue_mutex
- * 
- * @architecture Producer-Consumer pattern
- * @producer Main thread (poll loop) enqueues work
- * @consumer Worker threads dequeue and process
- * @note Non-blocking: drops work if queue full (potential message loss under extreme load)
+ *  - Same handlers as the text protocol, without parsing: GET takes the
+ *    id as a uint64, LIST a count byte (0 for the default) and the name,
+ *    POST the article as is, so it may hold CR, LF or NUL bytes
+ *  - Unknown opcode or malformed payload ? 300 frame
+ */
+CommandType process_binary_command(const Request* req, const char* payload, size_t len){
+    char name[BUFF_SIZE];
+
+    switch(req->opcode){
+    case BIN_OP_USER:
+        if(binary_name(payload, len, name, sizeof(name)) == -1) break;
+        process_user_command(req, name);
+        return CMD_USER;
+    case BIN_OP_POST:
+        process_post_command(req, payload, len);
+        return CMD_POST;
+    case BIN_OP_GET:
+        if(len != 8) break;
+        process_get_command(req, bin_get_u64(payload));
+        return CMD_GET;
+    case BIN_OP_LIST: {
+        int max = len > 0 ? (uint8_t)payload[0] : 0;
+        if(len < 2 || max > POST_INDEX_LIST_MAX ||
+           binary_name(payload + 1, len - 1, name, sizeof(name)) == -1) break;
+        process_list_command(req, name, max ? max : DEFAULT_LIST_COUNT);
+        return CMD_LIST;
+    }
+    case BIN_OP_BYE:
+        process_bye_command(req);
+        return CMD_BYE;
+    }
+    send_response(req, "300");
+    return CMD_OTHER;
+}
+
+/**
+ * @function text_tag
+ * @brief Length of the "#TAG " prefix of a text command
+ *
+ * @param line Command line (NUL-terminated)
+ * @return Length of TAG: 1 to REQUEST_TAG_MAX bytes above ' ' after '#',
+ *         followed by a space; 0 if the line is not tagged
+ *
+ * @note A malformed tag leaves the line untagged, and as a command
+ *       starting with '#' it is answered 300 in order
+ */
+size_t text_tag(const char* line){
+    if(line[0] != '#') return 0;
+
+    size_t len = 0;
+    while(len <= REQUEST_TAG_MAX && (unsigned char)line[len + 1] > ' ') len++;
+    if(len == 0 || len > REQUEST_TAG_MAX || line[len + 1] != ' ') return 0;
+    return len;
+}
+
+/**
+ * @function request_unordered
+ * @brief Whether a framed command may complete out of order
+ *
+ * @return 1 for a tagged text command ("#TAG COMMAND ...") or a binary
+ *         frame with BIN_FLAG_ANY_ORDER, 0 otherwise
  */
-void enqueue_work(Session* session, const char* message){
-    pthread_mutex_lock(&queue_mutex);
-    if(queue_count < 100){
-        work_queue[queue_rear].session = session;
-        strncpy(work_queue[queue_rear].message, message, BUFF_SIZE - 1);
-        work_queue[queue_rear].message[BUFF_SIZE - 1] = '\0';
-        queue_rear = (queue_rear + 1) % 100;
-        queue_count++;
-        pthread_cond_signal(&queue_cond);
+int request_unordered(Session* session, BufferSlice line){
+    const char* data = buffer_slice_data(line);
+    if(session->framer.mode == LINE_FRAMER_FRAMES){
+        BinHeader header;
+        bin_header_decode(data, &header);
+        return (header.flags & BIN_FLAG_ANY_ORDER) != 0;
     }
-    pthread_mutex_unlock(&queue_mutex);
+    return text_tag(data) != 0;
 }
 
 /**
- * @function worker_thread
- * @brief Worker thread function that processes commands from work queue
+ * @function request_init
+ * @brief Describe the command in line for its handlers and replies
  * 
- * @param arg Unused (void* for pthread compatibility)
- * @return NULL (never returns - runs indefinitely)
- * 
- * @details
- *  - Runs infinite loop waiting for work
- *  - Acquires queue_mutex and waits on queue_cond if queue empty
- *  - When work available:
- *    + Dequeues WorkItem from queue_front
- *    + Advances queue_front (circular buffer wraps at 100)
- *    + Decrements queue_count
- *    + Releases queue_mutex
- *  - Validates session is still active before processing
- *  - Calls process_command() to handle the command
- *  - Loops back to wait for next work item
+ * @param req Filled in
+ * @param session Session that sent it
+ * @param line Framed command: a text line, or a whole binary frame
  * 
- * @architecture
- *  - Thread pool: 10 worker threads compete for work
- *  - Circular buffer: 100-slot queue managed by front/rear pointers
- *  - Condition variable: efficient sleeping when no work available
- *  - Session validation: prevents use-after-free if session disconnected
+ * @note The session's framing is settled by its first byte, before the
+ *       first command is framed, and never changes afterwards
+ */
+void request_init(Request* req, Session* session, BufferSlice line){
+    req->session = session;
+    req->binary = session->framer.mode == LINE_FRAMER_FRAMES;
+    req->opcode = 0;
+    req->id = 0;
+    req->tag = NULL;
+    req->tag_len = 0;
+    if(req->binary){
+        BinHeader header;
+        bin_header_decode(buffer_slice_data(line), &header);
+        req->opcode = header.opcode;
+        req->id = header.id;
+        req->unordered = (header.flags & BIN_FLAG_ANY_ORDER) != 0;
+    } else {
+        req->tag_len = text_tag(buffer_slice_data(line));
+        if(req->tag_len) req->tag = buffer_slice_data(line) + 1;
+        req->unordered = req->tag != NULL;
+    }
+}
+
+/**
+ * @function process_command
+ * @brief Run one framed command, text or binary
  * 
- * @thread_safety
- *  - Queue access protected by queue_mutex
- *  - Session access protected by session->session_lock (in command handlers)
+ * @return Command type, for the per-command metrics
  * 
- * @performance Benefits of thread pool:
- *  - Avoids thread creation/destruction overhead
- *  - Bounded resource usage (10 threads max)
- *  - Better for high-frequency, short-lived tasks
+ * @protocol Text commands may start with "#TAG " (TAG: up to
+ *           REQUEST_TAG_MAX characters, no spaces); the reply then starts
+ *           with the same "#TAG " and may come before the replies to
+ *           earlier commands. Untagged replies keep their order among
+ *           themselves. A command that depends on another (POST after
+ *           USER) is sent once the other's reply is in
  */
-void* worker_thread(void* arg){
-    (void)arg;
-    while(1){
-        pthread_mutex_lock(&queue_mutex);
-        while(queue_count == 0){
-            pthread_cond_wait(&queue_cond, &queue_mutex);
-        }
-        
-        WorkItem item = work_queue[queue_front];
-        queue_front = (queue_front + 1) % 100;
-        queue_count--;
-        pthread_mutex_unlock(&queue_mutex);
-        
-        if(item.session && item.session->active){
-            process_command(item.session, item.message);
-        }
+CommandType process_command(const Request* req, BufferSlice line){
+    const char* data = buffer_slice_data(line);
+    if(req->binary){
+        return process_binary_command(req, data + BIN_HEADER_SIZE, line.length - BIN_HEADER_SIZE);
     }
-    return NULL;
+    return process_text_command(req, req->tag ? req->tag + req->tag_len + 1 : data);
 }
 
 /**
- * @function find_session_by_sockfd
- * @brief Find session by socket file descriptor
+ * @function work_home
+ * @brief Worker the session's next command is queued on
  * 
- * @param sockfd Socket descriptor to search for
- * @return Pointer to Session if found, NULL if not found
+ * @param session Session owned by the calling loop
+ * @return Worker index for worker_pool_submit()
  * 
  * @details
- *  - Acquires sessions_mutex for thread-safe array access
- *  - Linear search through sessions array up to poll_count
- *  - Compares session->sockfd with target sockfd
- *  - Returns pointer to matched session or NULL
- *  - Releases sessions_mutex before returning
- * 
- * @thread_safety Protected by sessions_mutex
- * @warning Returned pointer may become invalid if session is removed
- * @note Caller should check session->active before using returned pointer
+ *  - The home follows the pool size (slot modulo active workers), but it
+ *    only moves while none of the session's commands are in flight:
+ *    run_work_item() waits for the session's earlier commands, and with
+ *    them split over two queues a worker could wait on an item stuck
+ *    behind another waiting worker
+ *  - The pool size is compared first, so session_lock is only taken
+ *    after the autoscaler resized the pool
  */
-Session* find_session_by_sockfd(int sockfd){
-    pthread_mutex_lock(&sessions_mutex);
-    for(int i = 0; i < poll_count; i++){
-        if(sessions[i] && sessions[i]->sockfd == sockfd){
-            Session* s = sessions[i];
-            pthread_mutex_unlock(&sessions_mutex);
-            return s;
-        }
+int work_home(Session* session){
+    int active = worker_pool_active(&worker_pool);
+    if(session->work_home_active == active) return session->work_home;
+
+    pthread_mutex_lock(&session->session_lock);
+    int idle = session->done_seq == atomic_load(&session->next_seq);
+    pthread_mutex_unlock(&session->session_lock);
+
+    if(idle){
+        session->work_home = session->slot % active;
+        session->work_home_active = active;
     }
-    pthread_mutex_unlock(&sessions_mutex);
-    return NULL;
+    return session->work_home;
 }
 
 /**
- * @function recv_until_delim
- * @brief Receive data from socket until delimiter is encountered
+ * @function enqueue_work
+ * @brief Add work item to the session's home worker queue
  * 
- * @param session Pointer to Session (contains sockfd and leftover buffer)
- * @param out_buf Buffer to store extracted message (without delimiter)
- * @param max_len Maximum size of out_buf
- * @param delim Delimiter string to search for (typically "\r\n")
- * @return Number of bytes in message (excluding delimiter), 0 if connection closed, -1 on error
+ * @param session Pointer to Session that generated the work
+ * @param line Command to be processed, in place in its receive chunk
+ * @param recv_ns When the loop framed the line
+ * @param shed 1 to have the worker answer 503 in order instead of running it
+ * @return 0 if queued, -1 if the home queue is full
  * 
  * @details
- *  - First checks session->leftover buffer for data from previous recv()
- *  - Loops receiving data until delimiter found:
- *    1. Searches for delimiter using strstr()
- *    2. If found:
- *       - Extracts message up to delimiter into out_buf
- *       - Null-terminates message
- *       - Saves remaining data after delimiter into leftover buffer
- *       - Returns message length
- *    3. If not found:
- *       - Receives more data from socket
- *       - Appends to out_buf
- *       - Continues loop
- *  - Handles connection closure (recv returns 0 or -1)
- *  - Prevents buffer overflow by limiting recv size
+ *  - Builds a WorkItem with a generation-counted session handle, the
+ *    session's next sequence number and the line slice; the item takes
+ *    its own chunk reference, the line itself is not copied
+ *  - A tagged command (request_unordered()) takes no sequence number
+ *    and is counted in session->unordered instead
+ *  - Submits it to the session's home worker (work_home()), so the
+ *    commands of a session in flight all sit on one run queue
+ *  - next_seq (or unordered) only advances when the item was queued
+ *  - On failure nothing is queued: the caller keeps the message and
+ *    applies backpressure (see throttle_session())
  * 
- * @protocol Supports pipelined messages (multiple commands in one TCP packet)
- * @buffer_management Uses session->leftover to store incomplete data between calls
- * @note Not thread-safe - assumes single thread receiving from each socket
+ * @architecture Producer-Consumer pattern
+ * @producer Event loop threads enqueue work
+ * @consumer Worker threads run their own queue and steal when idle
+ * @note Lock-free: producers and consumers only contend on atomic
+ *       positions of the per-worker rings, not on a shared mutex
  */
-int recv_until_delim(Session* session, char* out_buf, int max_len, const char* delim){
-    char temp_buf[BUFF_SIZE];
-    int total_len = 0;
+int enqueue_work(Session* session, BufferSlice line, uint64_t recv_ns, int shed){
+    WorkItem item;
+    item.session = session_handle(session);
+    item.unordered = request_unordered(session, line);
+    item.seq = item.unordered ? 0 : session->next_seq;
+    item.line = line;
+    item.recv_ns = recv_ns;
+    item.enqueue_ns = metrics_now_ns();
+    item.shed = shed;
+
+    buffer_chunk_ref(line.chunk);
+    if(worker_pool_submit(&worker_pool, work_home(session), &item) == -1){
+        buffer_chunk_unref(line.chunk);
+        return -1;
+    }
+    if(item.unordered) atomic_fetch_add(&session->unordered, 1);
+    else session->next_seq++;
+    admission_enqueued();
+    return 0;
+}
 
-    if(session->leftover_len > 0){
-        memcpy(out_buf, session->leftover, session->leftover_len);
-        total_len = session->leftover_len;
-        session->leftover_len = 0;
+/**
+ * @function overloaded
+ * @brief Whether new connections and commands should be turned away
+ * 
+ * @param now_ns Current time (metrics_now_ns())
+ * @return 1 while the work queue has stood above the -O target for a
+ *         whole interval, 0 otherwise (always 0 without -O)
+ * 
+ * @details
+ *  - The sojourn clock only advances when workers dequeue, so an
+ *    over-target reading is confirmed against the queue depth: an empty
+ *    queue means the backlog is gone and resets the controller
+ *  - Entering and leaving the overloaded state is logged once
+ */
+int overloaded(uint64_t now_ns){
+    int over = admission_over_target(now_ns);
+    if(over && worker_pool_depth(&worker_pool) == 0){
+        admission_drained(now_ns);
+        over = 0;
     }
 
-    while(1){
-        char* delim_pos = strstr(out_buf, delim);
-        if(delim_pos){
-            int msg_len = delim_pos - out_buf;
-            out_buf[msg_len] = '\0';
-
-            int remain_len = total_len - (msg_len + strlen(delim));
-            if(remain_len > 0){
-                memcpy(session->leftover, delim_pos + strlen(delim), remain_len);
-                session->leftover_len = remain_len;
-            }
-            return msg_len;
+    if(over != atomic_load_explicit(&shedding, memory_order_relaxed) &&
+       atomic_exchange(&shedding, over) != over){
+        if(over){
+            LOG(LOG_WARN, "[OVERLOAD] Work queue delay above target, shedding new connections and commands "
+                   "[queue depth %zu]", worker_pool_depth(&worker_pool));
+        } else {
+            LOG(LOG_WARN, "[OVERLOAD] Work queue delay back under target, admitting work again");
         }
+    }
+    return over;
+}
+
+/**
+ * @function shed_command
+ * @brief Answer a command with 503 (busy) instead of running it
+ * 
+ * @param session Session owned by the calling loop
+ * @param line The command
+ * @param recv_ns When the loop framed the line
+ * @return 0 if answered or queued for an answer, -1 if the home queue
+ *         is full (the caller throttles the session as usual)
+ * 
+ * @details
+ *  - With no untagged command of the session in flight, or for a tagged
+ *    command, the reply is appended right away from the loop thread,
+ *    without touching the work queue
+ *  - Otherwise it must not overtake earlier replies, so the command is
+ *    queued marked shed and the worker answers 503 in sequence
+ */
+int shed_command(Session* session, BufferSlice line, uint64_t recv_ns){
+    metrics_add(METRIC_SHED, 1);
+
+    pthread_mutex_lock(&session->session_lock);
+    int idle = session->done_seq == atomic_load(&session->next_seq) ||
+               request_unordered(session, line);
+    pthread_mutex_unlock(&session->session_lock);
 
-        int bytes_recv = recv(session->sockfd, temp_buf, sizeof(temp_buf), 0);
-        if(bytes_recv <= 0)
-            return bytes_recv;
+    if(!idle) return enqueue_work(session, line, recv_ns, 1);
 
-        if(total_len + bytes_recv >= max_len)
-            bytes_recv = max_len - total_len - 1;
+    Request req;
+    request_init(&req, session, line);
+    send_response(&req, "503");
+    queue_flush(session);
+    return 0;
+}
 
-        memcpy(out_buf + total_len, temp_buf, bytes_recv);
-        total_len += bytes_recv;
-        out_buf[total_len] = '\0';
+/**
+ * @function wake_throttled_loops
+ * @brief Tell event loops with paused sessions that queue space is available
+ * 
+ * @details
+ *  - Called by a worker after each dequeue
+ *  - Only loops whose has_throttled flag is set get an eventfd write, and
+ *    the flag is cleared first so one burst of dequeues wakes a loop once
+ */
+void wake_throttled_loops(){
+    for(int i = 0; i < num_loops; i++){
+        EventLoop* loop = &event_loops[i];
+        if(atomic_load_explicit(&loop->has_throttled, memory_order_relaxed) &&
+           atomic_exchange(&loop->has_throttled, 0)){
+            wake_loop(loop);
+        }
     }
 }
 
 /**
- * @function expand_poll_arrays
- * @brief Dynamically expand poll_fds and sessions arrays when capacity reached
+ * @function record_stages
+ * @brief Record the stage times of a finished command, logging it if slow
+ * 
+ * @param session Session the command belongs to
+ * @param item The command's work item (recv and enqueue stamps)
+ * @param type Command type returned by process_command()
+ * @param dequeue_ns When a worker took the item
+ * @param start_ns When processing started (after waiting for order)
+ * @param done_ns When its reply was appended
  * 
  * @details
- *  - Doubles the size of both arrays (new_size = poll_size * 2)
- *  - Reallocates poll_fds array with realloc()
+ *  - The waits go to the stage histograms, processing time to the
+ *    per-command histogram
+ *  - Commands slower than slow_threshold_ns (-T) from framing to reply
+ *    get a [SLOW] line with the per-stage split and the current work
+ *    queue depth, so a high percentile can be traced to backpressure,
+ *    queueing behind the workers, per-session ordering or the handler
+ *  - The command is quoted (first 40 bytes) for text requests; a binary
+ *    frame is named by its opcode and payload length instead, its bytes
+ *    are not printable
+ *  - The output stage is recorded by flush_output(), per batch
+ */
+void record_stages(Session* session, WorkItem* item, CommandType type,
+                   uint64_t dequeue_ns, uint64_t start_ns, uint64_t done_ns){
+    metrics_stage(STAGE_THROTTLED, item->enqueue_ns - item->recv_ns);
+    metrics_stage(STAGE_QUEUED, dequeue_ns - item->enqueue_ns);
+    metrics_stage(STAGE_ORDERED, start_ns - dequeue_ns);
+    metrics_command(type, done_ns - start_ns);
+    metrics_stage(STAGE_TOTAL, done_ns - item->recv_ns);
+
+    if(slow_threshold_ns && done_ns - item->recv_ns > slow_threshold_ns){
+        char what[48];
+        if(session->framer.mode == LINE_FRAMER_FRAMES){
+            BinHeader header;
+            bin_header_decode(buffer_slice_data(item->line), &header);
+            snprintf(what, sizeof(what), "binary op %u, %u bytes", header.opcode, header.length);
+        } else {
+            snprintf(what, sizeof(what), "\"%.*s\"",
+                     (int)(item->line.length < 40 ? item->line.length : 40), buffer_slice_data(item->line));
+        }
+        LOG(LOG_WARN, "[SLOW] %s:%d %s took %lluus: throttled %lluus, queued %lluus, "
+               "ordered %lluus, service %lluus [queue depth %zu]",
+               session->client_ip, session->client_port, what,
+               (unsigned long long)(done_ns - item->recv_ns) / 1000,
+               (unsigned long long)(item->enqueue_ns - item->recv_ns) / 1000,
+               (unsigned long long)(dequeue_ns - item->enqueue_ns) / 1000,
+               (unsigned long long)(start_ns - dequeue_ns) / 1000,
+               (unsigned long long)(done_ns - start_ns) / 1000,
+               worker_pool_depth(&worker_pool));
+    }
+}
+
+/**
+ * @function work_item_runnable
+ * @brief Steal filter: can this item run without waiting on its session?
+ *
+ * @param arg WorkItem at the head of another worker's queue
+ * @return 1 if an idle worker may take it, 0 to leave it to its home worker
+ *
+ * @details
+ *  - Tagged items and items of a closed session never wait
+ *  - An ordered item is runnable once every earlier command of its
+ *    session is done (done_seq == seq); a thief that took it earlier
+ *    would only sleep on order_cond while the home worker's queue stalls
+ *    behind it
+ */
+int work_item_runnable(const void* arg){
+    const WorkItem* item = arg;
+    if(item->unordered) return 1;
+
+    Session* session = session_acquire(item->session);
+    if(!session) return 1;
+
+    pthread_mutex_lock(&session->session_lock);
+    int runnable = !session->active || session->done_seq == item->seq;
+    pthread_mutex_unlock(&session->session_lock);
+    session_release(session);
+    return runnable;
+}
+
+/**
+ * @function run_work_item
+ * @brief Worker pool handler: run one queued command
+ * 
+ * @param arg WorkItem taken from a worker's own queue or stolen from another
+ * 
+ * @details
+ *  - Wakes event loops that paused a session because a queue was full
+ *  - Reports the item's queue sojourn time to the admission controller
+ *    and to the pool's autoscaler
+ *  - Acquires the session from its handle; a stale handle (client gone)
+ *    cancels the item without dereferencing freed state
+ *  - Waits on order_cond until all earlier commands of the session have
+ *    run: the home worker can dequeue an item while its predecessor is
+ *    still running on a thief, and replies must stay in request order.
+ *    Thieves only take items that are runnable already (see
+ *    work_item_runnable()), so the wait is never theirs and is bounded
+ *    by one command. Tagged commands skip the wait (and never hold
+ *    others up): their replies carry the tag and may overtake, so a slow
+ *    command does not block the ones behind it
+ *  - Calls process_command(), or replies 503 to an item shed by the
+ *    loop, and advances done_seq
+ *  - Stamps dequeue, start and completion and hands them to
+ *    record_stages() with the loop's recv and enqueue stamps
+ *  - Queues the session for a flush unless a later command of the
+ *    session is already queued: with pipelined input the replies pile up
+ *    in the output buffer and the loop writes them with a single send()
+ *    once the batch is done. next_seq only advances after a successful
+ *    submit, so a larger next_seq proves a later item will flush. A
+ *    tagged command always queues its flush
+ * 
+ * @architecture
+ *  - Thread pool: -W min..max workers, each with its own bounded ring,
+ *    resized by the pool's autoscaler from the measured queue wait
+ *  - Session affinity: a session's commands are queued on one home worker
+ *  - Work stealing: idle workers take runnable items from other workers'
+ *    rings
+ * 
+ * @thread_safety
+ *  - Queue access is lock-free (atomic ring positions)
+ *  - Session access protected by session->session_lock (in command handlers)
+ */
+void run_work_item(void* arg){
+    WorkItem* item = arg;
+    uint64_t dequeue_ns = metrics_now_ns();
+
+    wake_throttled_loops();
+    admission_observe(dequeue_ns - item->enqueue_ns, dequeue_ns);
+    worker_pool_note_wait(dequeue_ns - item->enqueue_ns);
+
+    Session* session = session_acquire(item->session);
+    if(!session){
+        metrics_add(METRIC_ITEMS_CANCELLED, 1);
+        buffer_chunk_unref(item->line.chunk);
+        admission_done();
+        return;
+    }
+
+    pthread_mutex_lock(&session->session_lock);
+    while(!item->unordered && session->active && session->done_seq != item->seq){
+        pthread_cond_wait(&session->order_cond, &session->session_lock);
+    }
+    int active = session->active;
+    pthread_mutex_unlock(&session->session_lock);
+
+    Request req;
+    request_init(&req, session, item->line);
+    if(active && item->shed){
+        send_response(&req, "503");
+    } else if(active){
+        uint64_t start_ns = metrics_now_ns();
+        CommandType type = process_command(&req, item->line);
+        record_stages(session, item, type, dequeue_ns, start_ns, metrics_now_ns());
+    } else {
+        metrics_add(METRIC_ITEMS_CANCELLED, 1);
+    }
+
+    if(item->unordered){
+        atomic_fetch_sub(&session->unordered, 1);
+    } else {
+        pthread_mutex_lock(&session->session_lock);
+        session->done_seq = item->seq + 1;
+        pthread_cond_broadcast(&session->order_cond);
+        pthread_mutex_unlock(&session->session_lock);
+    }
+
+    if(active && (item->unordered ||
+                  (int32_t)(atomic_load(&session->next_seq) - (item->seq + 1)) <= 0)){
+        queue_flush(session);
+    }
+
+    buffer_chunk_unref(item->line.chunk);
+    session_release(session);
+    admission_done();
+}
+
+/**
+ * @function find_session_by_sockfd
+ * @brief Find session by socket file descriptor
+ * 
+ * @param loop Event loop whose connection table is searched
+ * @param sockfd Socket descriptor to search for
+ * @return Pointer to Session if found, NULL if not found
+ * 
+ * @details
+ *  - Acquires loop->sessions_mutex for thread-safe array access
+ *  - O(1) lookup through loop->fd_index
+ *  - Returns pointer to matched session or NULL
+ *  - Releases sessions_mutex before returning
+ * 
+ * @thread_safety Protected by sessions_mutex
+ * @warning Returned pointer is only safe on the loop thread; other threads
+ *          must go through session_handle()/session_acquire()
+ */
+Session* find_session_by_sockfd(EventLoop* loop, int sockfd){
+    Session* s = NULL;
+
+    pthread_mutex_lock(&loop->sessions_mutex);
+    if(sockfd >= 0 && sockfd < loop->fd_index_size && loop->fd_index[sockfd] >= 0){
+        s = loop->sessions[loop->fd_index[sockfd]];
+    }
+    pthread_mutex_unlock(&loop->sessions_mutex);
+    return s;
+}
+
+/**
+ * @function expand_poll_arrays
+ * @brief Dynamically expand poll_fds and sessions arrays when capacity reached
+ * 
+ * @param loop Event loop whose arrays are expanded
+ * 
+ * @details
+ *  - Doubles the size of both arrays (new_size = poll_size * 2)
+ *  - Reallocates poll_fds array with realloc()
  *  - Reallocates sessions array with realloc()
  *  - Initializes new slots:
  *    + sessions[i] = NULL
@@ -564,289 +1515,2793 @@ int recv_until_delim(Session* session, char* out_buf, int max_len, const char* d
  *  - Prints expansion message for monitoring
  * 
  * @error_handling If realloc fails, prints error and returns without changing arrays
- * @thread_safety Must be called with sessions_mutex locked
+ * @thread_safety Must be called with loop->sessions_mutex locked
  * @scalability Allows server to handle growing number of connections dynamically
  * @note Exponential growth (doubling) provides O(log n) reallocations over time
  */
-void expand_poll_arrays(){
-    int new_size = poll_size * 2;
+void expand_poll_arrays(EventLoop* loop){
+    int new_size = loop->poll_size * 2;
     
-    struct pollfd* new_poll_fds = realloc(poll_fds, new_size * sizeof(struct pollfd));
+    struct pollfd* new_poll_fds = realloc(loop->poll_fds, new_size * sizeof(struct pollfd));
     if(!new_poll_fds){
         perror("realloc poll_fds failed");
         return;
     }
-    poll_fds = new_poll_fds;
+    loop->poll_fds = new_poll_fds;
     
-    Session** new_sessions = realloc(sessions, new_size * sizeof(Session*));
+    Session** new_sessions = realloc(loop->sessions, new_size * sizeof(Session*));
     if(!new_sessions){
         perror("realloc sessions failed");
         return;
     }
-    sessions = new_sessions;
+    loop->sessions = new_sessions;
     
-    for(int i = poll_size; i < new_size; i++){
-        sessions[i] = NULL;
-        poll_fds[i].fd = -1;
-        poll_fds[i].events = 0;
+    for(int i = loop->poll_size; i < new_size; i++){
+        loop->sessions[i] = NULL;
+        loop->poll_fds[i].fd = -1;
+        loop->poll_fds[i].events = 0;
     }
     
-    poll_size = new_size;
-    printf("[EXPAND] Poll arrays expanded to %d slots\n", poll_size);
+    loop->poll_size = new_size;
+    LOG(LOG_INFO, "[EXPAND] Loop %d poll arrays expanded to %d slots", loop->id, loop->poll_size);
+}
+
+/**
+ * @function expand_fd_index
+ * @brief Grow loop->fd_index so that fd is a valid position
+ * 
+ * @param loop Event loop owning the index
+ * @param fd Descriptor about to be inserted
+ * @return 0 on success, -1 if realloc failed
+ * 
+ * @details
+ *  - Grows to max(fd + 1, 2 * fd_index_size); new entries are set to -1
+ * 
+ * @thread_safety Must be called with loop->sessions_mutex locked
+ */
+int expand_fd_index(EventLoop* loop, int fd){
+    if(fd < loop->fd_index_size) return 0;
+
+    int new_size = loop->fd_index_size * 2;
+    if(new_size < fd + 1) new_size = fd + 1;
+
+    int* new_index = realloc(loop->fd_index, new_size * sizeof(int));
+    if(!new_index){
+        perror("realloc fd_index failed");
+        return -1;
+    }
+    for(int i = loop->fd_index_size; i < new_size; i++){
+        new_index[i] = -1;
+    }
+    loop->fd_index = new_index;
+    loop->fd_index_size = new_size;
+    return 0;
 }
 
 /**
  * @function add_to_poll
  * @brief Add new client connection to poll array and create session
  * 
+ * @param loop Event loop that accepted the connection
  * @param sockfd Socket file descriptor of new connection
  * @param ip Client IP address string
  * @param port Client port number
- * @return 0 on success, -1 on failure
+ * @return Pointer to the new Session on success, NULL on failure
  * 
  * @details
- *  - Acquires sessions_mutex for thread-safe array modification
+ *  - Acquires loop->sessions_mutex for thread-safe array modification
  *  - Checks if array is full and calls expand_poll_arrays() if needed
- *  - Allocates and initializes new Session structure:
+ *  - Grows loop->fd_index so it covers sockfd
+ *  - Fails if the arrays could not be expanded
+ *  - Takes a Session slot from the pool (session_create) and initializes it:
  *    + logged_in = 0 (not authenticated)
- *    + username = "" (empty string)
+ *    + username = NULL (not logged in)
  *    + sockfd, client_ip, client_port set from parameters
  *    + active = 1
- *    + leftover_len = 0
- *    + Initializes session_lock mutex
+ *    + loop = owning event loop
  *  - Adds to poll arrays at position poll_count:
  *    + poll_fds[poll_count].fd = sockfd
  *    + poll_fds[poll_count].events = POLLIN (monitor for readable data)
  *    + sessions[poll_count] = new_session
+ *    + fd_index[sockfd] = poll_count
  *  - Increments poll_count and active_connections
- *  - Releases sessions_mutex
+ *  - Releases loop->sessions_mutex
  * 
- * @thread_safety Protected by sessions_mutex
+ * @thread_safety Protected by loop->sessions_mutex
  * @scalability Automatically expands arrays when full
- * @note Session pointer remains valid until removed by remove_from_poll()
+ * @note Session pointer remains valid on the loop thread until removed by
+ *       remove_from_poll(); workers use handles instead
  */
-int add_to_poll(int sockfd, const char* ip, int port){
-    pthread_mutex_lock(&sessions_mutex);
+Session* add_to_poll(EventLoop* loop, int sockfd, const char* ip, int port){
+    pthread_mutex_lock(&loop->sessions_mutex);
     
-    if(poll_count >= poll_size){
-        expand_poll_arrays();
+    if(loop->poll_count >= loop->poll_size){
+        expand_poll_arrays(loop);
+        if(loop->poll_count >= loop->poll_size){
+            pthread_mutex_unlock(&loop->sessions_mutex);
+            return NULL;
+        }
+    }
+
+    if(expand_fd_index(loop, sockfd) == -1){
+        pthread_mutex_unlock(&loop->sessions_mutex);
+        return NULL;
     }
     
-    Session* new_session = malloc(sizeof(Session));
+    Session* new_session = session_create();
     if(!new_session){
-        pthread_mutex_unlock(&sessions_mutex);
-        return -1;
+        pthread_mutex_unlock(&loop->sessions_mutex);
+        return NULL;
     }
     
     new_session->logged_in = 0;
-    new_session->username = strdup("");
+    new_session->username = NULL;
     new_session->sockfd = sockfd;
     strncpy(new_session->client_ip, ip, INET_ADDRSTRLEN);
     new_session->client_port = port;
     new_session->active = 1;
-    new_session->leftover_len = 0;
-    pthread_mutex_init(&new_session->session_lock, NULL);
+    new_session->loop = loop;
+    new_session->pending.chunk = NULL;
+    new_session->throttled = 0;
+    line_framer_detect_frames(&new_session->framer, BIN_MAGIC, BIN_HEADER_SIZE, BIN_LENGTH_AT,
+                              BIN_MAX_PAYLOAD);
     
-    poll_fds[poll_count].fd = sockfd;
-    poll_fds[poll_count].events = POLLIN;
-    sessions[poll_count] = new_session;
-    poll_count++;
+    loop->poll_fds[loop->poll_count].fd = sockfd;
+    loop->poll_fds[loop->poll_count].events = POLLIN;
+    loop->sessions[loop->poll_count] = new_session;
+    loop->fd_index[sockfd] = loop->poll_count;
+    loop->poll_count++;
     active_connections++;
     
-    pthread_mutex_unlock(&sessions_mutex);
-    return 0;
+    pthread_mutex_unlock(&loop->sessions_mutex);
+    return new_session;
 }
 
 /**
  * @function remove_from_poll
  * @brief Remove session from poll array and free resources
  * 
+ * @param loop Event loop owning the arrays
  * @param index Index in poll_fds/sessions arrays to remove
  * 
  * @details
- *  - Acquires sessions_mutex for thread-safe array modification
+ *  - Acquires loop->sessions_mutex for thread-safe array modification
  *  - Validates index is within bounds
- *  - Cleans up session resources:
- *    + Destroys session_lock mutex
- *    + Frees username string
- *    + Frees session structure
- *  - Compacts arrays by shifting elements:
- *    + Moves poll_fds[i+1..poll_count-1] down by one position
- *    + Moves sessions[i+1..poll_count-1] down by one position
+ *  - Closes the session (session_close): bumps its generation so queued
+ *    work is cancelled, and drops the loop's reference; socket, username
+ *    and pending command are freed once no worker holds the session
+ *  - Keeps arrays dense by swap-removal:
+ *    + Moves the last poll_fds/sessions entry into the freed slot
+ *    + Updates fd_index for the moved session, clears it for the removed one
  *  - Decrements poll_count and active_connections
- *  - Releases sessions_mutex
+ *  - Releases loop->sessions_mutex
  * 
- * @thread_safety Protected by sessions_mutex
+ * @thread_safety Protected by loop->sessions_mutex
  * @note Called when client disconnects or connection error occurs
- * @warning After this function, all session pointers in work queue become invalid
- * @algorithm Array compaction: O(n) time complexity where n = number of connections
+ * @note A poll loop walking the arrays can remove slot i and continue with
+ *       i--: the entry moved into slot i came from the unvisited tail
+ * @note Raw session pointers held by the loop are invalid after this call
+ * @algorithm Swap-removal: O(1) regardless of the number of connections
  */
-void remove_from_poll(int index){
-    pthread_mutex_lock(&sessions_mutex);
+void remove_from_poll(EventLoop* loop, int index){
+    pthread_mutex_lock(&loop->sessions_mutex);
     
-    if(index < 0 || index >= poll_count){
-        pthread_mutex_unlock(&sessions_mutex);
+    if(index < 0 || index >= loop->poll_count){
+        pthread_mutex_unlock(&loop->sessions_mutex);
         return;
     }
     
-    Session* session = sessions[index];
+    Session* session = loop->sessions[index];
     if(session){
-        pthread_mutex_destroy(&session->session_lock);
-        if(session->username) free(session->username);
-        free(session);
+        loop->fd_index[session->sockfd] = -1;
     }
     
-    for(int i = index; i < poll_count - 1; i++){
-        poll_fds[i] = poll_fds[i + 1];
-        sessions[i] = sessions[i + 1];
+    int last = loop->poll_count - 1;
+    if(index != last){
+        loop->poll_fds[index] = loop->poll_fds[last];
+        loop->sessions[index] = loop->sessions[last];
+        if(loop->sessions[index]){
+            loop->fd_index[loop->sessions[index]->sockfd] = index;
+        }
     }
+    loop->poll_fds[last].fd = -1;
+    loop->poll_fds[last].events = 0;
+    loop->sessions[last] = NULL;
     
-    poll_count--;
+    loop->poll_count--;
     active_connections--;
     
-    pthread_mutex_unlock(&sessions_mutex);
+    pthread_mutex_unlock(&loop->sessions_mutex);
+
+    if(session) session_close(session);
 }
 
-int main(int argc, char* argv[]){
-    if(argc != 2){
-        printf("Usage: ./server Port_Number\n");
-        return 1;
+/**
+ * @function find_session_index
+ * @brief Find the poll array index that holds a session
+ * 
+ * @param loop Event loop owning the session
+ * @param session Session to look up
+ * @return Index into poll_fds/sessions, or -1 if the session is not registered
+ * 
+ * @details
+ *  - Acquires loop->sessions_mutex and reads fd_index[session->sockfd], O(1)
+ *  - Used by the epoll loop, which identifies clients by Session pointer
+ *    instead of by array position
+ * 
+ * @thread_safety Protected by loop->sessions_mutex
+ */
+int find_session_index(EventLoop* loop, Session* session){
+    int index = -1;
+
+    pthread_mutex_lock(&loop->sessions_mutex);
+    int fd = session->sockfd;
+    if(fd >= 0 && fd < loop->fd_index_size && loop->fd_index[fd] >= 0 &&
+       loop->sessions[loop->fd_index[fd]] == session){
+        index = loop->fd_index[fd];
     }
+    pthread_mutex_unlock(&loop->sessions_mutex);
+    return index;
+}
 
-    int port = atoi(argv[1]);
-    int listen_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t sin_size;
+/**
+ * @function set_nonblocking
+ * @brief Put a socket into O_NONBLOCK mode
+ * 
+ * @param sockfd Socket descriptor
+ * @return 0 on success, -1 on failure
+ */
+int set_nonblocking(int sockfd){
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if(flags == -1) return -1;
+    return fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+}
 
-    struct rlimit rl;
-    getrlimit(RLIMIT_NOFILE, &rl);
-    
-    rl.rlim_cur = rl.rlim_max;
-    if(setrlimit(RLIMIT_NOFILE, &rl) == 0){
-        getrlimit(RLIMIT_NOFILE, &rl);
+/**
+ * @function uring_tag
+ * @brief user_data of a session's io_uring request: the pointer plus the operation
+ *
+ * @note Sessions are pointer-aligned, so the low bits carry URING_OP_*;
+ *       accept and the wakeup read use the bare operation (NULL session)
+ */
+uint64_t uring_tag(Session* session, int op){
+    return (uint64_t)(uintptr_t)session | op;
+}
+
+/**
+ * @function uring_arm_recv
+ * @brief Start a multishot receive into the loop's provided buffers
+ *
+ * @param session Session owned by the calling loop
+ * @return 0 on success, -1 if no submission entry was available
+ *
+ * @note The request holds a session reference until its final
+ *       completion (one without IORING_CQE_F_MORE), so the slot cannot
+ *       be recycled under it
+ */
+int uring_arm_recv(Session* session){
+    struct io_uring_sqe* sqe = uring_get_sqe(&session->loop->ring);
+    if(!sqe) return -1;
+
+    atomic_fetch_add(&session->refs, 1);
+    uring_prep_recv_multishot(sqe, session->sockfd, URING_BGID, uring_tag(session, URING_OP_RECV));
+    session->recv_armed = 1;
+    return 0;
+}
+
+/**
+ * @function uring_cancel_recv
+ * @brief Stop a session's multishot receive so input can be paused
+ *
+ * @note Bytes completed before the cancel lands go to the receive
+ *       stash; the final completion re-arms if input was resumed meanwhile
+ */
+void uring_cancel_recv(Session* session){
+    struct io_uring_sqe* sqe = uring_get_sqe(&session->loop->ring);
+    if(!sqe){
+        perror("io_uring cancel error");
+        return;
+    }
+    uring_prep_cancel(sqe, uring_tag(session, URING_OP_RECV), uring_tag(NULL, URING_OP_CANCEL));
+    session->recv_cancel = 1;
+}
+
+/**
+ * @function uring_arm_accept
+ * @brief Start the loop's multishot accept on its listening socket
+ */
+void uring_arm_accept(EventLoop* loop){
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring);
+    if(!sqe){
+        perror("io_uring accept error");
+        return;
+    }
+    uring_prep_accept_multishot(sqe, loop->listen_sock, uring_tag(NULL, URING_OP_ACCEPT));
+    loop->accept_armed = 1;
+}
+
+/**
+ * @function update_interest
+ * @brief Register the events a session currently needs with the backend
+ * 
+ * @param session Session owned by the calling loop
+ * 
+ * @details
+ *  - INTEREST_READ unless input is paused (work queue full, output
+ *    above the high-water mark, or the loop is handing off its sessions)
+ *  - INTEREST_WRITE while buffered output waits for socket space
+ *  - Only touches the backend when the set changed
+ *  - epoll: EPOLL_CTL_MOD with EPOLLIN | EPOLLRDHUP and/or EPOLLOUT, always
+ *    edge-triggered; re-arming reports readiness that arrived meanwhile
+ *  - poll: events become POLLIN and/or POLLOUT; with neither the slot's fd
+ *    is stored as ~sockfd, which poll() ignores, so POLLHUP cannot spin
+ *  - io_uring: READ arms the multishot receive, losing it cancels the
+ *    receive; WRITE needs nothing, a send waits in the kernel by itself
+ */
+void update_interest(Session* session){
+    EventLoop* loop = session->loop;
+    unsigned interest = 0;
+
+    if(!session->throttled && !session->out_paused && !loop->handoff) interest |= INTEREST_READ;
+    if(session->want_write) interest |= INTEREST_WRITE;
+    if(interest == session->interest) return;
+    session->interest = interest;
+
+    if(io_backend == BACKEND_EPOLL){
+        struct epoll_event ev;
+        ev.events = EPOLLET;
+        if(interest & INTEREST_READ) ev.events |= EPOLLIN | EPOLLRDHUP;
+        if(interest & INTEREST_WRITE) ev.events |= EPOLLOUT;
+        ev.data.ptr = session;
+        if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, session->sockfd, &ev) == -1){
+            perror("epoll_ctl() error");
+        }
+    } else if(io_backend == BACKEND_URING){
+        if((interest & INTEREST_READ) && !session->recv_armed){
+            if(uring_arm_recv(session) == -1) perror("io_uring recv error");
+        } else if(!(interest & INTEREST_READ) && session->recv_armed && !session->recv_cancel){
+            uring_cancel_recv(session);
+        }
     } else {
-        printf("Warning: Could not increase FD limit\n");
+        int index = find_session_index(loop, session);
+        if(index >= 0){
+            short events = 0;
+            if(interest & INTEREST_READ) events |= POLLIN;
+            if(interest & INTEREST_WRITE) events |= POLLOUT;
+            loop->poll_fds[index].events = events;
+            loop->poll_fds[index].fd = events ? session->sockfd : ~session->sockfd;
+        }
     }
+}
 
-    poll_size = INITIAL_POLL_SIZE;
-    poll_fds = calloc(poll_size, sizeof(struct pollfd));
-    sessions = calloc(poll_size, sizeof(Session*));
-    
-    if(!poll_fds || !sessions){
-        perror("Failed to allocate initial arrays");
-        exit(1);
+/**
+ * @function arm_throttle_wakeup
+ * @brief Ask workers for a wakeup once a throttled session's home queue has room again
+ * 
+ * @param loop Loop with at least one throttled session
+ * @param homes Bit mask of the home workers whose queues were found full
+ * 
+ * @details
+ *  - Sets has_throttled, then re-checks those queues: if workers drained
+ *    one before they could see the flag, the loop wakes itself instead
+ *  - Room on other workers does not count: the pending commands can only
+ *    go to their home queues, and waking for them would spin the loop
+ *    until a home worker dequeues
+ */
+void arm_throttle_wakeup(EventLoop* loop, unsigned long long homes){
+    atomic_store(&loop->has_throttled, 1);
+    if(worker_pool_has_room(&worker_pool, homes)){
+        wake_loop(loop);
     }
-    
-    for(int i = 0; i < poll_size; i++){
-        poll_fds[i].fd = -1;
-        sessions[i] = NULL;
+}
+
+/**
+ * @function push_throttled
+ * @brief Append a session to loop->throttled, growing the array as needed
+ * 
+ * @return 0 on success, -1 if the array could not be grown
+ * 
+ * @note The entry's index is kept in session->throttled_at, so
+ *       drop_client() can clear it without searching the list
+ */
+int push_throttled(EventLoop* loop, Session* session){
+    if(loop->throttled_count >= loop->throttled_size){
+        int new_size = loop->throttled_size ? loop->throttled_size * 2 : INITIAL_POLL_SIZE;
+        Session** grown = realloc(loop->throttled, new_size * sizeof(Session*));
+        if(!grown){
+            perror("realloc throttled failed");
+            return -1;
+        }
+        loop->throttled = grown;
+        loop->throttled_size = new_size;
     }
+    session->throttled_at = loop->throttled_count;
+    loop->throttled[loop->throttled_count++] = session;
+    return 0;
+}
+
+/**
+ * @function throttle_session
+ * @brief Pause reading from a session whose command did not fit in the queue
+ * 
+ * @param session Session that produced the command
+ * @param line Command that could not be queued
+ * @param recv_ns When the command was framed, kept for the stage times
+ * 
+ * @details
+ *  - Keeps the command in session->pending, with its own chunk reference
+ *  - Stops input notifications with update_interest()
+ *  - Appends the session to loop->throttled and arms the wakeup
+ *  - Nothing is dropped: the client's remaining input waits in the
+ *    session line framer and the kernel socket buffer
+ */
+void throttle_session(Session* session, BufferSlice line, uint64_t recv_ns){
+    EventLoop* loop = session->loop;
 
-    for(int i = 0; i < 10; i++){
-        pthread_create(&worker_threads[i], NULL, worker_thread, NULL);
-        pthread_detach(worker_threads[i]);
+    metrics_add(METRIC_QUEUE_FULL, 1);
+    buffer_chunk_ref(line.chunk);
+    session->pending = line;
+    session->pending_recv_ns = recv_ns;
+    session->throttled = 1;
+    update_interest(session);
+    push_throttled(loop, session);
+    arm_throttle_wakeup(loop, 1ULL << work_home(session));
+}
+
+/**
+ * @function next_client_line
+ * @brief Next command line from a client, whichever backend delivers the bytes
+ *
+ * @return As line_framer_read_line()
+ *
+ * @note epoll and poll receive on demand; with io_uring the bytes were
+ *       already received by the ring and wait in the framer or rx_stash
+ * @note A session taken over from the previous process (adopt_session())
+ *       may also start with bytes in rx_stash; they are framed before
+ *       anything is read from the socket
+ */
+int next_client_line(Session* session, char** line, size_t* len){
+    if(io_backend == BACKEND_URING) return session_rx_next(session, line, len);
+    if(session->rx_stash_off < session->rx_stash_len){
+        int ret = session_rx_next(session, line, len);
+        if(ret != -1 || errno != EAGAIN) return ret;
     }
+    return line_framer_read_line(&session->framer, session->sockfd, line, len);
+}
 
-    if((listen_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1){
-        perror("socket() error");
-        exit(1);
+/**
+ * @function handle_client_input
+ * @brief Read every complete command currently available from a client
+ * 
+ * @param session Session whose socket is readable
+ * @return 0 if the connection is still open, -1 if it must be closed
+ * 
+ * @details
+ *  - Calls next_client_line() until the socket reports EAGAIN, so
+ *    the socket is fully drained as edge-triggered epoll requires
+ *  - Each complete line is logged and handed to enqueue_work() as a
+ *    slice of the session's receive chunk, without a copy
+ *  - When the chunk is full (or on the first read) session_rx_refill()
+ *    attaches a new one from the buffer pool
+ *  - A line longer than the configured maximum (-l) closes the connection,
+ *    as does a binary frame with more than BIN_MAX_PAYLOAD payload bytes
+ *    or one that does not start with BIN_MAGIC
+ *  - The session's first byte picks the protocol (BIN_MAGIC: binary
+ *    frames, anything else: text lines); a frame is queued whole, like
+ *    a line
+ *  - While overloaded (-O) or with -I commands already in flight the
+ *    line is shed with a 503 instead (shed_command())
+ *  - If the work queue is full the line is kept and the session is
+ *    throttled: reading stops until resume_throttled() finds room
+ *  - Does not read while input is paused (throttled, output above the
+ *    high-water mark, or during a handoff); the data stays in the socket
+ *    until resumed
+ *  - A partial trailing line stays in session->framer for the next call
+ *  - Each complete line stamps input_tick for the idle timeout; partial
+ *    lines do not count, so a client trickling bytes still times out
+ */
+int handle_client_input(Session* session){
+    char* line;
+    size_t len;
+
+    while(!session->throttled && !session->out_paused && !session->loop->handoff){
+        int ret = next_client_line(session, &line, &len);
+
+        if(ret == 1){
+            BufferSlice slice;
+            slice.chunk = session->rx_chunk;
+            slice.offset = line - session->rx_chunk->data;
+            slice.length = len;
+
+            uint64_t recv_ns = metrics_now_ns();
+            session->input_tick = session->loop->now_tick;
+            session->got_command = 1;
+            int binary = session->framer.mode == LINE_FRAMER_FRAMES;
+            metrics_add(METRIC_BYTES_IN, len + (binary ? 0 : session->framer.delim_len));
+            LOG_SAMPLED(LOG_DEBUG, "[RECEIVED] %s:%d: %.*s", 
+                   session->client_ip, session->client_port,
+                   binary ? 0 : (int)len, binary ? "" : line);
+            int queued = admission_inflight_full() || overloaded(recv_ns)
+                         ? shed_command(session, slice, recv_ns)
+                         : enqueue_work(session, slice, recv_ns, 0);
+            if(queued == -1){
+                throttle_session(session, slice, recv_ns);
+                return 0;
+            }
+            continue;
+        }
+        if(ret == -1 && errno == ENOBUFS){
+            if(session_rx_refill(session) == -1) return -1;
+            continue;
+        }
+        if(ret == -1 && errno == EINTR) continue;
+        if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if(ret == -1 && errno == EMSGSIZE && session->framer.mode == LINE_FRAMER_FRAMES){
+            LOG(LOG_WARN, "[REJECT] Binary frame payload longer than %zu bytes from %s:%d",
+                   session->framer.frame_max, session->client_ip, session->client_port);
+        } else if(ret == -1 && errno == EMSGSIZE){
+            LOG(LOG_WARN, "[REJECT] Line longer than %zu bytes from %s:%d",
+                   session->framer.max_line, session->client_ip, session->client_port);
+        }
+        if(ret == -1 && errno == EPROTO){
+            LOG(LOG_WARN, "[REJECT] Binary frame without magic byte from %s:%d",
+                   session->client_ip, session->client_port);
+        }
+        return -1;
     }
+    return 0;
+}
 
-    int opt = 1;
-    if(setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1){
-        perror("setsockopt() error");
-        exit(1);
+/**
+ * @function record_output_wait
+ * @brief Record how long drained output waited for the socket
+ *
+ * @param session Session whose output buffer just drained
+ * @param waited_ns Time since its oldest byte was appended
+ * @param sent Bytes sent by the drain, for the slow log
+ */
+void record_output_wait(Session* session, uint64_t waited_ns, size_t sent){
+    metrics_stage(STAGE_OUTPUT, waited_ns);
+    if(slow_threshold_ns && waited_ns > slow_threshold_ns){
+        LOG(LOG_WARN, "[SLOW] %s:%d output waited %lluus for the socket (%zu bytes sent)",
+               session->client_ip, session->client_port,
+               (unsigned long long)waited_ns / 1000, sent);
     }
+}
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+/**
+ * @function pace_input
+ * @brief Pause or resume reading from a client by its output backlog
+ *
+ * @param session Session owned by the calling loop
+ * @param pending Output bytes not yet written to the socket
+ * @param held Bytes of replies parked for a post log commit
+ * @return 0 if the connection is still usable, -1 if it must be closed
+ *
+ * @details
+ *  - Above OUTPUT_HIGH_WATER bytes (pending and held) reading from the
+ *    client is paused; it resumes once the backlog drops to
+ *    OUTPUT_LOW_WATER and handle_client_input() then drains what
+ *    arrived meanwhile
+ *  - want_write is set while pending bytes remain, so the loop waits for
+ *    POLLOUT; parked replies are flushed by commit_done() instead
+ */
+int pace_input(Session* session, size_t pending, size_t held){
+    int was_paused = session->out_paused;
+    if(pending + held > OUTPUT_HIGH_WATER) session->out_paused = 1;
+    else if(pending + held <= OUTPUT_LOW_WATER) session->out_paused = 0;
+    session->want_write = pending > 0;
+    update_interest(session);
 
-    if(bind(listen_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1){
-        perror("bind() error");
-        exit(1);
+    if(was_paused && !session->out_paused){
+        return handle_client_input(session);
     }
+    return 0;
+}
 
-    if(listen(listen_sock, BACKLOG) == -1){
-        perror("listen() error");
-        exit(1);
+/**
+ * @function uring_flush
+ * @brief flush_output() for the io_uring backend
+ *
+ * @details
+ *  - At most one send per session is in flight, from tx_data, which
+ *    only the loop touches; when it is empty out_data is swapped in
+ *    under out_lock, so workers append to the other buffer meanwhile
+ *    and nothing is copied
+ *  - The send is only queued: it leaves with the loop's next
+ *    io_uring_enter(), together with every other reply of the round
+ *  - Its completion (uring_send_done()) calls flush_output() again for
+ *    the remainder or for output appended in the meantime
+ *  - Parked replies that may go out now are moved into out_data first
+ *    (session_out_release())
+ *  - Buffers with references (GET/LIST bodies in the post log mapping)
+ *    go out with one IORING_OP_SENDMSG over tx_iov instead of a send
+ */
+int uring_flush(Session* session){
+    pthread_mutex_lock(&session->out_lock);
+    if(session_out_release(session, post_log_durable(&post_log)) == -1){
+        perror("session_out_release() error");
+    }
+    int held = session->held_count > 0;
+    size_t held_bytes = session->held_bytes;
+    if(!session->send_armed && session->tx_off == session->tx_len &&
+       session->tx_refs.count == 0 &&
+       (session->out_off < session->out_len || session->out_refs.count > 0)){
+        char* data = session->tx_data;
+        size_t cap = session->tx_cap;
+        session->tx_data = session->out_data;
+        session->tx_cap = session->out_cap;
+        session->tx_off = session->out_off;
+        session->tx_len = session->out_len;
+        session->tx_since_ns = session->out_since_ns;
+        session->out_data = data;
+        session->out_cap = cap;
+        session->out_off = 0;
+        session->out_len = 0;
+        OutRefs refs = session->tx_refs;
+        session->tx_refs = session->out_refs;
+        session->out_refs = refs;
     }
+    size_t pending = session->tx_len - session->tx_off + session->tx_refs.bytes +
+                     session->out_len - session->out_off + session->out_refs.bytes;
+    pthread_mutex_unlock(&session->out_lock);
 
-    printf("Server started at port %d\n", port);
+    if(!session->send_armed && session->tx_refs.count > 0){
+        if(!session->tx_iov){
+            session->tx_iov = malloc(OUTPUT_MAX_IOV * sizeof(struct iovec));
+            if(!session->tx_iov) return -1;
+        }
+        struct io_uring_sqe* sqe = uring_get_sqe(&session->loop->ring);
+        if(!sqe) return -1;
 
-    poll_fds[0].fd = listen_sock;
-    poll_fds[0].events = POLLIN;
-    poll_count = 1;
+        memset(&session->tx_msg, 0, sizeof(session->tx_msg));
+        session->tx_msg.msg_iov = session->tx_iov;
+        session->tx_msg.msg_iovlen = out_refs_iov(&session->tx_refs, session->tx_data, session->tx_off,
+                                                  session->tx_len, session->tx_iov, OUTPUT_MAX_IOV);
+        atomic_fetch_add(&session->refs, 1);
+        uring_prep_sendmsg(sqe, session->sockfd, &session->tx_msg, uring_tag(session, URING_OP_SEND));
+        session->send_armed = 1;
+    } else if(!session->send_armed && session->tx_off < session->tx_len){
+        struct io_uring_sqe* sqe = uring_get_sqe(&session->loop->ring);
+        if(!sqe) return -1;
 
-    while(1){
-        int ret = poll(poll_fds, poll_count, -1);
-        
-        if(ret == -1){
-            perror("poll() error");
+        atomic_fetch_add(&session->refs, 1);
+        uring_prep_send(sqe, session->sockfd, session->tx_data + session->tx_off,
+                        session->tx_len - session->tx_off, uring_tag(session, URING_OP_SEND));
+        session->send_armed = 1;
+    }
+    if(held && post_log_failed(&post_log)) return -1;
+    return pace_input(session, pending, held_bytes);
+}
+
+/**
+ * @function flush_output
+ * @brief Write as much buffered output as the socket accepts
+ * 
+ * @param session Session owned by the calling loop
+ * @return 0 if the connection is still usable, -1 if it must be closed
+ * 
+ * @details
+ *  - Non-blocking sendmsg() of out_data[out_off .. out_len) under
+ *    out_lock, with the referenced bytes (out_refs) in between, so a
+ *    GET/LIST body goes from the post log mapping straight to the socket
+ *  - When the buffer drains, the time since its oldest byte was appended
+ *    is recorded as the output stage (slow clients, POLLOUT waits)
+ *  - Input is paused and resumed by the remaining backlog (pace_input())
+ *  - Parked replies (a 120 waiting for its group commit, and the
+ *    untagged replies behind it) are moved into the buffer once they may
+ *    go out; commit_done() queues the flush for them. If the post log
+ *    failed they can never be confirmed and the connection is closed
+ *    instead
+ *  - The io_uring backend submits a send instead (uring_flush())
+ */
+int flush_output(Session* session){
+    int failed = 0;
+    uint64_t waited_ns = 0;
+    size_t sent = 0;
+
+    if(io_backend == BACKEND_URING) return uring_flush(session);
+
+    pthread_mutex_lock(&session->out_lock);
+    if(session_out_release(session, post_log_durable(&post_log)) == -1){
+        perror("session_out_release() error");
+    }
+    int held = session->held_count > 0;
+    size_t held_bytes = session->held_bytes;
+    int had_output = session->out_off < session->out_len || session->out_refs.count > 0;
+    while(session->out_off < session->out_len || session->out_refs.count > 0){
+        struct iovec iov[OUTPUT_MAX_IOV];
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = out_refs_iov(&session->out_refs, session->out_data, session->out_off,
+                                      session->out_len, iov, OUTPUT_MAX_IOV);
+        ssize_t n = sendmsg(session->sockfd, &msg, MSG_NOSIGNAL);
+        if(n > 0){
+            out_refs_consume(&session->out_refs, &session->out_off, n);
+            sent += n;
             continue;
         }
-        
-        for(int i = 0; i < poll_count; i++){
-            if(poll_fds[i].revents & POLLIN){
-                
-                if(poll_fds[i].fd == listen_sock){
-                    sin_size = sizeof(client_addr);
-                    int new_sock = accept(listen_sock, (struct sockaddr*)&client_addr, &sin_size);
-                    
-                    if(new_sock == -1){
-                        perror("accept() error");
-                        continue;
-                    }
-
-                    char client_ip[INET_ADDRSTRLEN];
-                    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-                    int client_port = ntohs(client_addr.sin_port);
-
-                    if(add_to_poll(new_sock, client_ip, client_port) == 0){
-                        printf("[CONNECT] New client from %s:%d (socket %d) [Active: %d]\n", 
-                               client_ip, client_port, new_sock, active_connections);
-                        send_response(new_sock, "100");
-                    } else {
-                        printf("[REJECT] Failed to add client %s:%d\n", client_ip, client_port);
-                        send_response(new_sock, "500");
-                        close(new_sock);
-                    }
-                }
-                else{
-                    Session* session = sessions[i];
-                    if(!session) continue;
-
-                    char buff[BUFF_SIZE];
-                    
-                    while(1){
-                    	int bytes = recv_until_delim(session, buff, BUFF_SIZE, "\r\n");
-
-	                    if(bytes <= 0){
-	                        printf("[DISCONNECT] Client %s:%d (socket %d) disconnected [Active: %d]\n",
-	                               session->client_ip, session->client_port, 
-	                               session->sockfd, active_connections - 1);
-	                        
-	                        close(session->sockfd);
-	                        session->active = 0;
-	                        remove_from_poll(i);
-	                        i--;
-	                    }
-	                    else{
-	                        printf("[RECEIVED] %s:%d: %s\n", 
-	                               session->client_ip, session->client_port, buff);
-	                        enqueue_work(session, buff);
-	                    }
-	                    
-	                    if (session->leftover_len == 0) break;
-					} 
-                }
-            }
-        }
+        if(n == -1 && errno == EINTR) continue;
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        failed = 1;
+        break;
     }
+    if(session->out_off == session->out_len && session->out_refs.count == 0){
+        if(had_output) waited_ns = metrics_now_ns() - session->out_since_ns;
+        session->out_off = 0;
+        session->out_len = 0;
+    }
+    size_t pending = session->out_len - session->out_off + session->out_refs.bytes;
+    pthread_mutex_unlock(&session->out_lock);
+
+    if(sent) metrics_add(METRIC_BYTES_OUT, sent);
+    if(failed || (held && post_log_failed(&post_log))) return -1;
+
+    if(waited_ns) record_output_wait(session, waited_ns, sent);
+    return pace_input(session, pending, held_bytes);
+}
 
-    close(listen_sock);
-    free(poll_fds);
-    free(sessions);
+/**
+ * @function close_client
+ * @brief Log a disconnect, shut the connection down and mark the session inactive
+ * 
+ * @param session Session being torn down
+ * 
+ * @details
+ *  - Removes the socket from the loop's epoll instance and shuts it down
+ *    in both directions, so the peer sees the connection end right away
+ *    (with io_uring the shutdown also ends the session's pending receive
+ *    and send, whose completions drop their session references)
+ *  - The descriptor itself is closed by the last session_release(): a
+ *    worker still replying on it can never hit a reused fd number
+ *  - Wakes workers waiting for this session's command order, they skip
+ *    their command once active is 0
+ *  - Disarms the session's timeout timer
+ * 
+ * @note Caller still has to remove the session with remove_from_poll().
+ */
+void close_client(Session* session){
+    metrics_add(METRIC_DISCONNECTS, 1);
+    timer_wheel_cancel(&session->loop->wheel, &session->timer);
+    LOG(LOG_INFO, "[DISCONNECT] Client %s:%d (socket %d) disconnected [Active: %d]",
+           session->client_ip, session->client_port, 
+           session->sockfd, active_connections - 1);
+    if(io_backend == BACKEND_EPOLL){
+        epoll_ctl(session->loop->epoll_fd, EPOLL_CTL_DEL, session->sockfd, NULL);
+    }
+    shutdown(session->sockfd, SHUT_RDWR);
+
+    pthread_mutex_lock(&session->session_lock);
+    session->active = 0;
+    pthread_cond_broadcast(&session->order_cond);
+    pthread_mutex_unlock(&session->session_lock);
+}
+
+/**
+ * @function drop_client
+ * @brief close_client() followed by remove_from_poll() for the session's slot
+ * 
+ * @details
+ *  - A session can now fail while throttled (its pending output hit an
+ *    error), so it is also taken off loop->throttled: its entry is found
+ *    through session->throttled_at and cleared (dropped from the end
+ *    when it is the last one), keeping the order of the remaining
+ *    entries without a scan or memmove()
+ *  - Both steps are O(1), so closing a connection costs the same however
+ *    many sessions the loop holds
+ * 
+ * @note In the poll loop the session sits at the current index, so the
+ *       caller continues the walk with i--
+ */
+void drop_client(Session* session){
+    EventLoop* loop = session->loop;
+
+    if(session->throttled){
+        int at = session->throttled_at;
+        if(at < loop->throttled_count && loop->throttled[at] == session){
+            loop->throttled[at] = NULL;
+            while(loop->throttled_count > 0 && !loop->throttled[loop->throttled_count - 1]){
+                loop->throttled_count--;
+            }
+        }
+        session->throttled = 0;
+    }
+    close_client(session);
+    remove_from_poll(loop, find_session_index(loop, session));
+}
+
+/**
+ * @function current_tick
+ * @brief Monotonic time in TIMER_TICK_MS ticks
+ */
+uint64_t current_tick(){
+    return metrics_now_ns() / (TIMER_TICK_MS * 1000000ull);
+}
+
+/**
+ * @function session_deadline
+ * @brief Earliest tick at which one of the session's timeouts expires
+ * 
+ * @param session Session owned by the calling loop
+ * @param reason Set to the name of the timeout that gives the deadline
+ * @return Deadline tick, TIMER_NEVER when no timeout applies
+ * 
+ * @details
+ *  - idle: input_tick + idle timeout, for every session
+ *  - handshake: accept_tick + handshake timeout, until the first
+ *    complete command arrives
+ *  - login: accept_tick + login timeout, until USER first succeeds
+ *    (a client that logs out with BYE is left to the idle timeout)
+ *  - A timeout of 0 is disabled
+ */
+uint64_t session_deadline(Session* session, const char** reason){
+    uint64_t deadline = TIMER_NEVER;
+    *reason = "";
+
+    if(idle_timeout_ticks){
+        deadline = session->input_tick + idle_timeout_ticks;
+        *reason = "idle";
+    }
+    if(handshake_timeout_ticks && !session->got_command &&
+       session->accept_tick + handshake_timeout_ticks < deadline){
+        deadline = session->accept_tick + handshake_timeout_ticks;
+        *reason = "handshake";
+    }
+    if(login_timeout_ticks && session->accept_tick + login_timeout_ticks < deadline){
+        pthread_mutex_lock(&session->session_lock);
+        int got_login = session->got_login;
+        pthread_mutex_unlock(&session->session_lock);
+        if(!got_login){
+            deadline = session->accept_tick + login_timeout_ticks;
+            *reason = "login";
+        }
+    }
+    return deadline;
+}
+
+/**
+ * @function arm_session_timer
+ * @brief (Re)arm the session's timer for its current deadline
+ */
+void arm_session_timer(Session* session){
+    const char* reason;
+    uint64_t deadline = session_deadline(session, &reason);
+
+    if(deadline == TIMER_NEVER){
+        timer_wheel_cancel(&session->loop->wheel, &session->timer);
+    } else {
+        timer_wheel_add(&session->loop->wheel, &session->timer, deadline);
+    }
+}
+
+/**
+ * @function expire_session
+ * @brief Timing wheel callback: close the session or push its timer out
+ * 
+ * @param node The session's timer
+ * @param arg Owning EventLoop
+ * 
+ * @details
+ *  - Activity never touches the wheel: handle_client_input() only
+ *    stamps input_tick. When the timer fires the deadline is recomputed
+ *    and, if the client was active (or logged in) meanwhile, the timer
+ *    is simply re-armed. Arm and cancel stay O(1) and busy sessions
+ *    cost one wheel operation per timeout period, not per command.
+ *  - An expired session is logged, counted and dropped like any other
+ *    closed connection
+ */
+void expire_session(TimerNode* node, void* arg){
+    EventLoop* loop = arg;
+    Session* session = (Session*)((char*)node - offsetof(Session, timer));
+    const char* reason;
+    uint64_t deadline = session_deadline(session, &reason);
+
+    if(deadline > loop->now_tick){
+        if(deadline != TIMER_NEVER) timer_wheel_add(&loop->wheel, node, deadline);
+        return;
+    }
+
+    LOG(LOG_INFO, "[TIMEOUT] Client %s:%d (socket %d) closed after %s timeout",
+           session->client_ip, session->client_port, session->sockfd, reason);
+    metrics_add(METRIC_TIMEOUTS, 1);
+    drop_client(session);
+}
+
+/**
+ * @function run_timers
+ * @brief Refresh loop->now_tick and fire the timers that are due
+ * 
+ * @note Called after each poll/epoll wakeup, once the ready events
+ *       have been handled
+ */
+void run_timers(EventLoop* loop){
+    loop->now_tick = current_tick();
+    timer_wheel_advance(&loop->wheel, loop->now_tick, expire_session, loop);
+}
+
+/**
+ * @function wait_timeout
+ * @brief Milliseconds the loop may block in poll/epoll_wait
+ * 
+ * @return Time until the wheel's next tick worth processing, -1 (block
+ *         indefinitely) when no timer is armed, 0 while accept_clients()
+ *         has connections left over from its last budget, at most
+ *         UPGRADE_POLL_MS during a handoff (run_handoff() polls sessions)
+ */
+int wait_timeout(EventLoop* loop){
+    if(loop->handoff) return UPGRADE_POLL_MS;
+    if(loop->accept_more) return 0;
+
+    uint64_t next = timer_wheel_next_tick(&loop->wheel);
+    if(next == TIMER_NEVER) return -1;
+
+    uint64_t now_ms = metrics_now_ns() / 1000000;
+    uint64_t due_ms = next * TIMER_TICK_MS;
+    return due_ms > now_ms ? (int)(due_ms - now_ms) : 0;
+}
+
+/**
+ * @function send_greeting
+ * @brief Write the 100 greeting to a new client from a static buffer
+ * 
+ * @return 0 on success, -1 if the connection must be closed
+ * 
+ * @details
+ *  - A fresh socket's send buffer is empty, so one send() takes the
+ *    whole greeting and nothing is copied into the output buffer; only
+ *    a short write falls back to session_out_append() + flush_output()
+ *  - Also used by the io_uring backend: no send is in flight yet, so
+ *    the greeting cannot overtake a reply
+ */
+int send_greeting(Session* session){
+    size_t len = sizeof(greeting) - 1;
+    ssize_t n = send(session->sockfd, greeting, len, MSG_NOSIGNAL);
+
+    if(n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+    if(n < 0) n = 0;
+    metrics_add(METRIC_BYTES_OUT, n);
+    if((size_t)n == len) return 0;
+
+    if(session_out_append(session, greeting + n, len - n) == -1) return -1;
+    return flush_output(session);
+}
+
+/**
+ * @function admit_client
+ * @brief Set up a session for a just-accepted connection and greet it
+ * 
+ * @param loop Event loop that accepted the connection
+ * @param new_sock Accepted socket
+ * @param client_addr Peer address
+ * 
+ * @details
+ *  - The socket (non-blocking from accept4()) is registered with add_to_poll()
+ *  - With the epoll backend the socket is also added to loop->epoll_fd with
+ *    EPOLLIN | EPOLLRDHUP | EPOLLET and data.ptr pointing at its Session;
+ *    with io_uring its multishot receive is armed
+ *  - Past -C connections, or while overloaded (-O), the connection is
+ *    refused with 500 before any session is set up
+ *  - Arms the session's timeout timer (see session_deadline())
+ *  - The 100 greeting is written straight from the loop thread
+ *    (send_greeting()); 500 is sent and the socket closed on failure
+ *    (once the session exists its socket is closed by the last
+ *    session_release())
+ */
+void admit_client(EventLoop* loop, int new_sock, const struct sockaddr_in* client_addr){
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr->sin_addr, client_ip, INET_ADDRSTRLEN);
+    int client_port = ntohs(client_addr->sin_port);
+
+    if((max_connections && active_connections >= max_connections) ||
+       overloaded(metrics_now_ns())){
+        metrics_add(METRIC_REJECTS, 1);
+        LOG_SAMPLED(LOG_WARN, "[REJECT] Server busy, refusing client %s:%d [Active: %d]",
+               client_ip, client_port, active_connections);
+        send_direct(new_sock, "500");
+        close(new_sock);
+        return;
+    }
+
+    Session* session = add_to_poll(loop, new_sock, client_ip, client_port);
+
+    if(session && io_backend == BACKEND_EPOLL){
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = session;
+        if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, new_sock, &ev) == -1){
+            perror("epoll_ctl() error");
+            LOG(LOG_WARN, "[REJECT] Failed to add client %s:%d", client_ip, client_port);
+            metrics_add(METRIC_REJECTS, 1);
+            send_direct(new_sock, "500");
+            session->active = 0;
+            remove_from_poll(loop, find_session_index(loop, session));
+            return;
+        }
+    }
+    if(session && io_backend == BACKEND_URING && uring_arm_recv(session) == -1){
+        perror("io_uring recv error");
+        LOG(LOG_WARN, "[REJECT] Failed to add client %s:%d", client_ip, client_port);
+        metrics_add(METRIC_REJECTS, 1);
+        send_direct(new_sock, "500");
+        session->active = 0;
+        remove_from_poll(loop, find_session_index(loop, session));
+        return;
+    }
+
+    if(session){
+        metrics_add(METRIC_ACCEPTS, 1);
+        session->interest = INTEREST_READ;
+        session->accept_tick = loop->now_tick;
+        session->input_tick = loop->now_tick;
+        arm_session_timer(session);
+        LOG(LOG_INFO, "[CONNECT] New client from %s:%d (socket %d, loop %d) [Active: %d]", 
+               client_ip, client_port, new_sock, loop->id, active_connections);
+        if(send_greeting(session) == -1){
+            drop_client(session);
+            return;
+        }
+        metrics_response("100");
+    } else {
+        metrics_add(METRIC_REJECTS, 1);
+        LOG(LOG_WARN, "[REJECT] Failed to add client %s:%d", client_ip, client_port);
+        send_direct(new_sock, "500");
+        close(new_sock);
+    }
+}
+
+/**
+ * @function accept_clients
+ * @brief Accept the connections pending on a loop's listening socket
+ * 
+ * @param loop Event loop whose listener is readable
+ * 
+ * @details
+ *  - accept4() hands the socket over already SOCK_NONBLOCK | SOCK_CLOEXEC,
+ *    saving the two fcntl() calls per connection
+ *  - Loops until accept4() fails with EAGAIN, which is required by the
+ *    edge-triggered epoll loop, but takes at most ACCEPT_BUDGET
+ *    connections per call: during a reconnect storm the clients already
+ *    connected keep being served. accept_more then makes the loop poll
+ *    without blocking and call again after the round's other events.
+ *  - Each new socket is handed to admit_client()
+ */
+void accept_clients(EventLoop* loop){
+    struct sockaddr_in client_addr;
+    socklen_t sin_size;
+
+    loop->accept_more = 0;
+    for(int budget = ACCEPT_BUDGET; budget > 0; budget--){
+        sin_size = sizeof(client_addr);
+        int new_sock = accept4(loop->listen_sock, (struct sockaddr*)&client_addr, &sin_size,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if(new_sock == -1){
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) perror("accept() error");
+            return;
+        }
+        admit_client(loop, new_sock, &client_addr);
+    }
+    loop->accept_more = 1;
+}
+
+/**
+ * @function resume_throttled
+ * @brief Retry pending commands of throttled sessions and resume reading
+ * 
+ * @param loop Loop that was woken
+ * 
+ * @details
+ *  - Sessions are retried in the order they were throttled; entries
+ *    cleared by drop_client() are skipped
+ *  - On success the pending command is queued, input notifications are
+ *    re-enabled and handle_client_input() drains what arrived meanwhile
+ *  - Sessions whose home queue is still full stay throttled; others
+ *    homed on workers with room are resumed. The wakeup is re-armed for
+ *    the full home queues only
+ */
+void resume_throttled(EventLoop* loop){
+    Session** list = loop->throttled;
+    int list_count = loop->throttled_count;
+    loop->throttled = NULL;
+    loop->throttled_count = 0;
+    loop->throttled_size = 0;
+    unsigned long long full_homes = 0;
+
+    for(int i = 0; i < list_count; i++){
+        Session* session = list[i];
+        if(!session) continue;
+        if(enqueue_work(session, session->pending, session->pending_recv_ns, 0) == -1){
+            full_homes |= 1ULL << work_home(session);
+            push_throttled(loop, session);
+            continue;
+        }
+
+        buffer_chunk_unref(session->pending.chunk);
+        session->pending.chunk = NULL;
+        session->throttled = 0;
+        update_interest(session);
+
+        if(handle_client_input(session) == -1){
+            drop_client(session);
+        }
+    }
+
+    free(list);
+
+    if(loop->throttled_count > 0){
+        arm_throttle_wakeup(loop, full_homes);
+    }
+}
+
+/**
+ * @function flush_queued_sessions
+ * @brief Write output that workers queued for this loop's sessions
+ * 
+ * @param loop Loop that was woken
+ * 
+ * @details
+ *  - Takes the whole flush list under flush_lock, then works without it
+ *  - Each handle is acquired first: sessions closed since the reply was
+ *    queued are skipped
+ *  - flush_queued is cleared before flushing, so a reply appended during
+ *    the flush queues the session again instead of being missed
+ */
+void flush_queued_sessions(EventLoop* loop){
+    pthread_mutex_lock(&loop->flush_lock);
+    SessionHandle* list = loop->flush_list;
+    int list_count = loop->flush_count;
+    loop->flush_list = NULL;
+    loop->flush_count = 0;
+    loop->flush_size = 0;
+    pthread_mutex_unlock(&loop->flush_lock);
+
+    for(int i = 0; i < list_count; i++){
+        Session* session = session_acquire(list[i]);
+        if(!session) continue;
+
+        atomic_store(&session->flush_queued, 0);
+        if(session->active && flush_output(session) == -1){
+            drop_client(session);
+        }
+        session_release(session);
+    }
+    free(list);
+}
+
+/**
+ * @function adopt_session
+ * @brief Register a connection taken over from the previous server process
+ * 
+ * @param loop Loop the connection was assigned to
+ * @param adopted Socket and state received by the upgrade thread
+ * 
+ * @details
+ *  - Set up like admit_client() (connection table, backend registration,
+ *    timeout timer), but without a greeting and with the login state,
+ *    username and handshake/login progress carried over
+ *  - Output the previous process had not sent yet is queued first, then
+ *    the unframed input is put in rx_stash and handle_client_input()
+ *    runs the complete commands in it, so replies keep their order
+ *  - Timeouts restart from now
+ *  - A logged-in session whose username cannot be copied is taken over
+ *    logged out (there is no command to answer 500 to); its next POST
+ *    gets 221 rather than reaching post_log_append() without a name
+ */
+void adopt_session(EventLoop* loop, AdoptedSession* adopted){
+    UpgradeMsg* msg = &adopted->msg;
+    const char* input = adopted->payload + msg->name_len;
+    const char* output = input + msg->in_len;
+
+    Session* session = add_to_poll(loop, adopted->fd, msg->client_ip, msg->client_port);
+    if(!session){
+        LOG(LOG_WARN, "[UPGRADE] Could not take over client %s:%d", msg->client_ip, msg->client_port);
+        close(adopted->fd);
+        return;
+    }
+    session->framer.mode = msg->framing;
+
+    int registered = 1;
+    if(io_backend == BACKEND_EPOLL){
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = session;
+        registered = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, adopted->fd, &ev) == 0;
+    } else if(io_backend == BACKEND_URING){
+        registered = uring_arm_recv(session) == 0;
+    }
+    if(!registered){
+        perror("Failed to register a taken over client");
+        session->active = 0;
+        remove_from_poll(loop, find_session_index(loop, session));
+        return;
+    }
+
+    session->username = msg->name_len ? strndup(adopted->payload, msg->name_len) : NULL;
+    session->logged_in = msg->logged_in && session->username;
+    session->got_login = msg->got_login;
+    session->got_command = msg->got_command;
+    if(msg->logged_in && !session->username){
+        LOG(LOG_WARN, "[UPGRADE] No memory for the username of client %s:%d, taking it over logged out",
+            msg->client_ip, msg->client_port);
+    }
+    session->interest = INTEREST_READ;
+    session->accept_tick = loop->now_tick;
+    session->input_tick = loop->now_tick;
+    arm_session_timer(session);
+    LOG(LOG_INFO, "[UPGRADE] Took over client %s:%d (socket %d, loop %d) [Active: %d]",
+           session->client_ip, session->client_port, session->sockfd, loop->id, active_connections);
+
+    if((msg->out_len && (session_out_append(session, output, msg->out_len) == -1 ||
+                         flush_output(session) == -1)) ||
+       (msg->in_len && session_rx_push(session, input, msg->in_len) == -1) ||
+       handle_client_input(session) == -1){
+        drop_client(session);
+    }
+}
+
+/**
+ * @function adopt_sessions
+ * @brief Register every connection the upgrade thread queued for this loop
+ */
+void adopt_sessions(EventLoop* loop){
+    pthread_mutex_lock(&loop->adopt_lock);
+    AdoptedSession* list = loop->adopt_list;
+    int list_count = loop->adopt_count;
+    loop->adopt_list = NULL;
+    loop->adopt_count = 0;
+    loop->adopt_size = 0;
+    pthread_mutex_unlock(&loop->adopt_lock);
+
+    for(int i = 0; i < list_count; i++){
+        adopt_session(loop, &list[i]);
+        free(list[i].payload);
+    }
+    free(list);
+}
+
+/**
+ * @function handle_wakeup
+ * @brief Handle a readable wakeup_fd: adopt handed over sessions, flush
+ *        queued output, resume throttled sessions
+ * 
+ * @note With io_uring the counter was already read by the ring
+ */
+void handle_wakeup(EventLoop* loop){
+    uint64_t count;
+    if(io_backend != BACKEND_URING &&
+       read(loop->wakeup_fd, &count, sizeof(count)) == -1 && errno != EAGAIN){
+        perror("read(wakeup_fd) error");
+    }
+
+    if(upgrade_path){
+        adopt_sessions(loop);
+    }
+    flush_queued_sessions(loop);
+    if(loop->throttled_count > 0){
+        resume_throttled(loop);
+    }
+}
+
+/**
+ * @function wake_all_loops
+ * @brief wake_loop() every event loop, e.g. after upgrade_state changed
+ */
+void wake_all_loops(){
+    for(int i = 0; i < num_loops; i++){
+        wake_loop(&event_loops[i]);
+    }
+}
+
+/**
+ * @function stop_accepting
+ * @brief Take the loop's listener out of its backend for a handoff
+ * 
+ * @note io_uring: the multishot accept is cancelled; connections it
+ *       completes before the cancel lands are admitted and handed off
+ *       like the others, and accept_armed clears on its final completion
+ */
+void stop_accepting(EventLoop* loop){
+    loop->accept_more = 0;
+    if(io_backend == BACKEND_EPOLL){
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_sock, NULL);
+    } else if(io_backend == BACKEND_URING){
+        struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring);
+        if(sqe && loop->accept_armed){
+            uring_prep_cancel(sqe, uring_tag(NULL, URING_OP_ACCEPT), uring_tag(NULL, URING_OP_CANCEL));
+        }
+    } else {
+        loop->poll_fds[0].fd = ~loop->listen_sock;
+    }
+}
+
+/**
+ * @function start_accepting
+ * @brief Put the listener back after a failed handoff
+ */
+void start_accepting(EventLoop* loop){
+    if(io_backend == BACKEND_EPOLL){
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = NULL;
+        if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_sock, &ev) == -1){
+            perror("epoll_ctl() error");
+        }
+        loop->accept_more = 1;
+    } else if(io_backend == BACKEND_URING){
+        if(!loop->accept_armed) uring_arm_accept(loop);
+    } else {
+        loop->poll_fds[0].fd = loop->listen_sock;
+    }
+}
+
+/**
+ * @function session_quiescent
+ * @brief Whether a session can be handed off right now
+ * 
+ * @return 1 with no command pending or queued, no reply waiting for a
+ *         post log commit and, with io_uring, no receive or send in
+ *         flight; buffered output travels along
+ */
+int session_quiescent(Session* session){
+    if(session->throttled) return 0;
+    if(session->recv_armed || session->send_armed || session->tx_off < session->tx_len ||
+       session->tx_refs.count > 0) return 0;
+
+    pthread_mutex_lock(&session->out_lock);
+    int held = session->held_count > 0;
+    pthread_mutex_unlock(&session->out_lock);
+    if(held) return 0;
+
+    pthread_mutex_lock(&session->session_lock);
+    int idle = session->done_seq == atomic_load(&session->next_seq) &&
+               atomic_load(&session->unordered) == 0;
+    pthread_mutex_unlock(&session->session_lock);
+    return idle;
+}
+
+/**
+ * @function hand_off_session
+ * @brief Pass a quiescent session to the successor process and park it
+ * 
+ * @param session Session owned by the calling loop (session_quiescent())
+ * @return 0 if handed off, 1 if its state does not fit in one message
+ *         yet, -1 if the handoff connection failed (the session stays)
+ * 
+ * @details
+ *  - One UPGRADE_SESSION message carries the login state, the input
+ *    received but not framed yet (framer, then rx_stash) and the output
+ *    not sent yet, with the socket attached (SCM_RIGHTS); output with
+ *    references into the post log mapping is flattened into a copy first
+ *  - A sent message only sits in the socket buffer, so the session is
+ *    parked rather than closed: no timer, and off the backend (epoll
+ *    registrations belong to the connection and would report its events
+ *    here too). If the successor never confirms, end_handoff() takes it
+ *    back; otherwise the process exits without touching it
+ */
+int hand_off_session(Session* session){
+    EventLoop* loop = session->loop;
+    LineFramer* framer = &session->framer;
+    struct iovec parts[4];
+    UpgradeMsg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = UPGRADE_SESSION;
+    msg.got_command = session->got_command;
+    msg.framing = framer->mode;
+    msg.client_port = session->client_port;
+    memcpy(msg.client_ip, session->client_ip, INET_ADDRSTRLEN);
+
+    pthread_mutex_lock(&session->session_lock);
+    msg.logged_in = session->logged_in;
+    msg.got_login = session->got_login;
+    parts[0].iov_base = session->username;
+    parts[0].iov_len = session->username ? strlen(session->username) : 0;
+    pthread_mutex_unlock(&session->session_lock);
+
+    parts[1].iov_base = framer->buf ? framer->buf + framer->head : NULL;
+    parts[1].iov_len = framer->buf ? framer->tail - framer->head : 0;
+    parts[2].iov_base = session->rx_stash + session->rx_stash_off;
+    parts[2].iov_len = session->rx_stash_len - session->rx_stash_off;
+
+    pthread_mutex_lock(&session->out_lock);
+    char* flat = NULL;
+    parts[3].iov_base = session->out_data + session->out_off;
+    parts[3].iov_len = session->out_len - session->out_off;
+    if(session->out_refs.count > 0){
+        flat = out_refs_flatten(&session->out_refs, session->out_data, session->out_off,
+                                session->out_len, &parts[3].iov_len);
+        if(!flat){
+            pthread_mutex_unlock(&session->out_lock);
+            return 1;
+        }
+        parts[3].iov_base = flat;
+    }
+
+    msg.name_len = parts[0].iov_len;
+    msg.in_len = parts[1].iov_len + parts[2].iov_len;
+    msg.out_len = parts[3].iov_len;
+    if((size_t)msg.name_len + msg.in_len + msg.out_len > UPGRADE_MAX_PAYLOAD){
+        pthread_mutex_unlock(&session->out_lock);
+        free(flat);
+        return 1;
+    }
+    int sent = upgrade_send(upgrade_sock, &msg, parts, 4, session->sockfd);
+    pthread_mutex_unlock(&session->out_lock);
+    free(flat);
+    if(sent == -1) return -1;
+
+    timer_wheel_cancel(&loop->wheel, &session->timer);
+    if(io_backend == BACKEND_EPOLL){
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, session->sockfd, NULL);
+    } else if(io_backend == BACKEND_POLL){
+        int index = find_session_index(loop, session);
+        loop->poll_fds[index].fd = ~session->sockfd;
+        loop->poll_fds[index].events = 0;
+    }
+    session->interest = 0;
+    session->handed_off = 1;
+    loop->handed_count++;
+    LOG_SAMPLED(LOG_DEBUG, "[UPGRADE] Handed off client %s:%d (socket %d)",
+           session->client_ip, session->client_port, session->sockfd);
+    return 0;
+}
+
+/**
+ * @function fail_upgrade
+ * @brief Give up on the current handoff, every loop takes its sessions back
+ */
+void fail_upgrade(){
+    int expected = UPGRADE_HANDOFF;
+    if(atomic_compare_exchange_strong(&upgrade_state, &expected, UPGRADE_FAILED)){
+        LOG(LOG_ERROR, "[UPGRADE] Handoff to the new server process failed: %s", strerror(errno));
+        wake_all_loops();
+    }
+}
+
+/**
+ * @function begin_handoff
+ * @brief First handoff round of a loop: stop accepting and pause all input
+ */
+void begin_handoff(EventLoop* loop){
+    loop->handoff = 1;
+    loop->handoff_deadline_ns = metrics_now_ns() + (uint64_t)UPGRADE_DRAIN_MS * 1000000;
+    stop_accepting(loop);
+    for(int i = 0; i < loop->poll_count; i++){
+        if(loop->sessions[i]) update_interest(loop->sessions[i]);
+    }
+    LOG(LOG_INFO, "[UPGRADE] Loop %d handing off %d connections", loop->id, loop->poll_count - 2);
+}
+
+/**
+ * @function end_handoff
+ * @brief Take the loop back after a failed handoff: accept and read again
+ * 
+ * @details Parked sessions are registered with the backend again and
+ *          get their timers back; then every session resumes input
+ */
+void end_handoff(EventLoop* loop){
+    LOG(LOG_WARN, "[UPGRADE] Loop %d taking back %d handed off connections",
+           loop->id, loop->handed_count);
+    loop->handoff = 0;
+    loop->handed_count = 0;
+    start_accepting(loop);
+
+    for(int i = loop->poll_count - 1; i >= 0; i--){
+        Session* session = loop->sessions[i];
+        if(!session) continue;
+
+        if(session->handed_off){
+            session->handed_off = 0;
+            if(io_backend == BACKEND_EPOLL){
+                struct epoll_event ev;
+                ev.events = EPOLLET;
+                ev.data.ptr = session;
+                epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, session->sockfd, &ev);
+            }
+            arm_session_timer(session);
+        }
+        update_interest(session);
+        if(flush_output(session) == -1 || handle_client_input(session) == -1){
+            drop_client(session);
+        }
+    }
+}
+
+/**
+ * @function run_handoff
+ * @brief Hot upgrade work of a loop, run after every round while an upgrade is on
+ * 
+ * @param loop Event loop
+ * @return 1 when the loop is to return (everything was handed off), 0 otherwise
+ * 
+ * @details
+ *  - HANDOFF: the first round stops accepting and pauses input on every
+ *    session (begin_handoff()); each round then hands off the sessions
+ *    that have become quiescent, which needs only their in-flight
+ *    commands to finish. Sessions still busy after UPGRADE_DRAIN_MS are
+ *    dropped. A loop left with parked sessions only reports in through
+ *    upgrade_pending; the last one sends UPGRADE_DONE and waits for the
+ *    successor to echo it, confirming it received every session
+ *  - FAILED: the loop resumes (end_handoff()) and reports in through
+ *    upgrade_resumed, once per attempt
+ *  - FINISHED: the loop returns, main() then cleans up and exits
+ *  - Walks the connection table backwards: drop_client() swaps the
+ *    last entry into the freed slot
+ */
+int run_handoff(EventLoop* loop){
+    int state = atomic_load(&upgrade_state);
+    unsigned attempt = atomic_load(&upgrade_attempt);
+
+    if(state == UPGRADE_FINISHED) return 1;
+    if(state == UPGRADE_FAILED && loop->upgrade_seen != attempt){
+        loop->upgrade_seen = attempt;
+        if(loop->handoff) end_handoff(loop);
+        atomic_fetch_add(&upgrade_resumed, 1);
+    }
+    if(state != UPGRADE_HANDOFF || loop->handoff == 2) return 0;
+    if(!loop->handoff) begin_handoff(loop);
+
+    int expired = metrics_now_ns() >= loop->handoff_deadline_ns;
+    for(int i = loop->poll_count - 1; i >= 0; i--){
+        Session* session = loop->sessions[i];
+        if(!session || session->handed_off) continue;
+
+        int ret = session_quiescent(session) ? hand_off_session(session) : 1;
+        if(ret == -1){
+            fail_upgrade();
+            return 0;
+        }
+        if(ret == 1 && expired){
+            LOG(LOG_WARN, "[UPGRADE] Client %s:%d still busy after %d ms, closing it",
+                   session->client_ip, session->client_port, UPGRADE_DRAIN_MS);
+            drop_client(session);
+        }
+    }
+    if(loop->poll_count - 2 > loop->handed_count || loop->accept_armed) return 0;
+
+    loop->handoff = 2;
+    if(atomic_fetch_sub(&upgrade_pending, 1) != 1) return 0;
+
+    UpgradeMsg done;
+    int fd;
+    memset(&done, 0, sizeof(done));
+    done.type = UPGRADE_DONE;
+    if(upgrade_send(upgrade_sock, &done, NULL, 0, -1) == -1 ||
+       upgrade_recv(upgrade_sock, &done, NULL, 0, &fd) == -1 || done.type != UPGRADE_DONE){
+        fail_upgrade();
+        return 0;
+    }
+    int expected = UPGRADE_HANDOFF;
+    if(!atomic_compare_exchange_strong(&upgrade_state, &expected, UPGRADE_FINISHED)) return 0;
+    LOG(LOG_INFO, "[UPGRADE] All connections handed off, exiting");
+    wake_all_loops();
+    return 1;
+}
+
+/**
+ * @function run_poll_loop
+ * @brief Event loop based on level-triggered poll()
+ * 
+ * @param loop Event loop to run (listener in poll_fds[0], wakeup_fd in poll_fds[1])
+ * 
+ * @details
+ *  - Waits on the whole poll_fds array, then walks every index up to
+ *    poll_count to find revents
+ *  - POLLOUT flushes the session's output buffer, POLLIN reads commands
+ *  - A readable listener is served after the clients of the round, up
+ *    to ACCEPT_BUDGET connections (accept_clients())
+ *  - Fallback backend for systems without epoll (-b poll)
+ *  - Wakeup cost is O(connections) regardless of how many are ready
+ *  - The poll timeout comes from wait_timeout(); run_timers() fires
+ *    expired session timeouts after each round
+ *  - With -U, run_handoff() follows and ends the loop once a new server
+ *    process took over every connection
+ */
+void run_poll_loop(EventLoop* loop){
+    while(1){
+        int ret = poll(loop->poll_fds, loop->poll_count, wait_timeout(loop));
+        
+        if(ret == -1){
+            if(errno != EINTR) perror("poll() error");
+            continue;
+        }
+        loop->now_tick = current_tick();
+        
+        for(int i = 0; i < loop->poll_count; i++){
+            short revents = loop->poll_fds[i].revents;
+            if(!(revents & (POLLIN | POLLOUT | POLLHUP | POLLERR))) continue;
+
+            if(loop->poll_fds[i].fd == loop->listen_sock){
+                loop->accept_more = 1;
+                continue;
+            }
+            if(loop->poll_fds[i].fd == loop->wakeup_fd){
+                handle_wakeup(loop);
+                continue;
+            }
+
+            Session* session = loop->sessions[i];
+            if(!session) continue;
+
+            if((revents & POLLOUT) && flush_output(session) == -1){
+                drop_client(session);
+                i--;
+                continue;
+            }
+            if((revents & (POLLIN | POLLHUP | POLLERR)) && handle_client_input(session) == -1){
+                drop_client(session);
+                i--;
+            }
+        }
+        if(loop->accept_more) accept_clients(loop);
+        run_timers(loop);
+        if(upgrade_path && run_handoff(loop)) return;
+    }
+}
+
+/**
+ * @function run_epoll_loop
+ * @brief Event loop based on edge-triggered epoll
+ * 
+ * @param loop Event loop to run
+ * 
+ * @details
+ *  - Listening socket is registered with data.ptr = NULL, wakeup_fd with
+ *    data.ptr = &loop->wakeup_fd, every client with data.ptr = its Session,
+ *    so a ready event leads straight to the session
+ *  - epoll_wait() only returns ready descriptors: wakeup cost is O(ready)
+ *  - Edge-triggered mode: handle_client_input() and flush_output() work
+ *    until EAGAIN before returning; accept_clients() runs after the
+ *    round's client events and, when it stops at ACCEPT_BUDGET, again
+ *    after the next round (accept_more)
+ *  - Default backend (-b epoll)
+ *  - Like the poll loop, waits at most wait_timeout() and then runs
+ *    run_timers() and, with -U, run_handoff()
+ */
+void run_epoll_loop(EventLoop* loop){
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_sock, &ev) == -1){
+        perror("epoll_ctl() error");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->wakeup_fd;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd, &ev) == -1){
+        perror("epoll_ctl() error");
+        exit(1);
+    }
+
+    while(1){
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EPOLL_EVENTS, wait_timeout(loop));
+
+        if(n == -1){
+            if(errno != EINTR) perror("epoll_wait() error");
+            continue;
+        }
+        loop->now_tick = current_tick();
+
+        for(int i = 0; i < n; i++){
+            Session* session = events[i].data.ptr;
+            uint32_t revents = events[i].events;
+
+            if(!session){
+                loop->accept_more = 1;
+                continue;
+            }
+            if(events[i].data.ptr == &loop->wakeup_fd){
+                handle_wakeup(loop);
+                continue;
+            }
+            if(!session->active) continue;
+
+            if((revents & EPOLLOUT) && flush_output(session) == -1){
+                drop_client(session);
+                continue;
+            }
+            if((revents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+               handle_client_input(session) == -1){
+                drop_client(session);
+            }
+        }
+        if(loop->accept_more) accept_clients(loop);
+        run_timers(loop);
+        if(upgrade_path && run_handoff(loop)) return;
+    }
+}
+
+/**
+ * @function uring_arm_wake
+ * @brief Queue a read of wakeup_fd, completed when a worker calls wake_loop()
+ */
+void uring_arm_wake(EventLoop* loop){
+    struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring);
+    if(!sqe){
+        perror("io_uring wakeup read error");
+        return;
+    }
+    uring_prep_read(sqe, loop->wakeup_fd, &loop->wake_count, sizeof(loop->wake_count),
+                    uring_tag(NULL, URING_OP_WAKE));
+}
+
+/**
+ * @function uring_accept_done
+ * @brief Completion of the multishot accept: admit the new connection
+ * 
+ * @details
+ *  - The peer address comes from getpeername(): a multishot accept has
+ *    no per-connection address buffer
+ *  - The accept is re-armed when the kernel ends it (no IORING_CQE_F_MORE),
+ *    unless it was cancelled for a handoff
+ */
+void uring_accept_done(EventLoop* loop, int res, unsigned flags){
+    if(res >= 0){
+        struct sockaddr_in client_addr;
+        socklen_t sin_size = sizeof(client_addr);
+        if(getpeername(res, (struct sockaddr*)&client_addr, &sin_size) == 0){
+            admit_client(loop, res, &client_addr);
+        } else {
+            close(res);
+        }
+    } else if(res != -ECONNABORTED && res != -EINTR){
+        errno = -res;
+        perror("accept() error");
+    }
+    if(!(flags & IORING_CQE_F_MORE)){
+        loop->accept_armed = 0;
+        if(!loop->handoff) uring_arm_accept(loop);
+    }
+}
+
+/**
+ * @function uring_recv_done
+ * @brief Completion of a session's multishot receive
+ * 
+ * @param loop Loop owning the ring
+ * @param session Session holding the receive's reference
+ * @param res Bytes received, 0 at end of stream, -errno on failure
+ * @param flags CQE flags (buffer id, IORING_CQE_F_MORE)
+ * 
+ * @details
+ *  - Bytes are copied into the session (session_rx_push()) and the
+ *    provided buffer goes straight back to the ring, so a slow session
+ *    never holds one; handle_client_input() then frames and queues
+ *  - End of stream sets rx_eof: handle_client_input() serves the
+ *    remaining lines first and reports the close once they are framed
+ *  - ENOBUFS (the ring ran out of buffers) and ECANCELED (input
+ *    paused) just end the receive; other errors drop the client
+ *  - On the final completion the reference is dropped and the receive
+ *    re-armed if the session still wants input
+ */
+void uring_recv_done(EventLoop* loop, Session* session, int res, unsigned flags){
+    if(res > 0){
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        int failed = session->active &&
+                     session_rx_push(session, uring_buffer(&loop->ring, bid), res) == -1;
+        uring_recycle_buffer(&loop->ring, bid);
+        if(session->active && (failed || handle_client_input(session) == -1)){
+            drop_client(session);
+        }
+    } else if(res == 0){
+        session->rx_eof = 1;
+        if(session->active && handle_client_input(session) == -1){
+            drop_client(session);
+        }
+    } else if(res != -ENOBUFS && res != -ECANCELED && session->active){
+        drop_client(session);
+    }
+
+    if(!(flags & IORING_CQE_F_MORE)){
+        session->recv_armed = 0;
+        session->recv_cancel = 0;
+        if(session->active && !session->rx_eof && (session->interest & INTEREST_READ) &&
+           uring_arm_recv(session) == -1){
+            drop_client(session);
+        }
+        session_release(session);
+    }
+}
+
+/**
+ * @function uring_send_done
+ * @brief Completion of a session's send: account for it and send what is left
+ * 
+ * @details
+ *  - A short send advances tx_off (and past sent references); once
+ *    tx_data drains the output stage is recorded as in flush_output()
+ *  - flush_output() then submits the remainder or newly queued output
+ *    and resumes input below the low-water mark
+ */
+void uring_send_done(Session* session, int res){
+    session->send_armed = 0;
+
+    if(session->active && res < 0){
+        drop_client(session);
+    } else if(session->active){
+        out_refs_consume(&session->tx_refs, &session->tx_off, res);
+        metrics_add(METRIC_BYTES_OUT, res);
+        if(session->tx_off == session->tx_len && session->tx_refs.count == 0){
+            record_output_wait(session, metrics_now_ns() - session->tx_since_ns, session->tx_len);
+            session->tx_off = 0;
+            session->tx_len = 0;
+        }
+        if(flush_output(session) == -1) drop_client(session);
+    }
+    session_release(session);
+}
+
+/**
+ * @function run_uring_loop
+ * @brief Event loop based on io_uring completions
+ * 
+ * @param loop Event loop to run
+ * 
+ * @details
+ *  - One io_uring_enter() per round both submits everything queued in
+ *    the previous round (sends, re-armed receives) and waits for the
+ *    next completions, at most wait_timeout()
+ *  - Multishot accept and receive are armed once and keep completing;
+ *    received bytes land in the loop's provided buffers, so idle
+ *    connections pin no receive memory
+ *  - Completions are told apart by user_data (uring_tag()); every
+ *    session request holds a reference that its final completion drops
+ *  - Like the other loops, runs run_timers() (and run_handoff()) after each round
+ *  - Enabled with -b uring; the ring belongs to this thread only
+ */
+void run_uring_loop(EventLoop* loop){
+    Uring* ring = &loop->ring;
+
+    if(uring_enable(ring) == -1){
+        perror("io_uring enable error");
+        exit(1);
+    }
+    uring_arm_accept(loop);
+    uring_arm_wake(loop);
+
+    while(1){
+        if(uring_submit_and_wait(ring, wait_timeout(loop)) == -1 &&
+           errno != ETIME && errno != EINTR && errno != EBUSY){
+            perror("io_uring_enter() error");
+        }
+        loop->now_tick = current_tick();
+
+        struct io_uring_cqe* cqe;
+        while((cqe = uring_peek_cqe(ring))){
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(ring);
+
+            Session* session = (Session*)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+            switch(user_data & URING_OP_MASK){
+                case URING_OP_RECV:
+                    uring_recv_done(loop, session, res, flags);
+                    break;
+                case URING_OP_SEND:
+                    uring_send_done(session, res);
+                    break;
+                case URING_OP_ACCEPT:
+                    uring_accept_done(loop, res, flags);
+                    break;
+                case URING_OP_WAKE:
+                    handle_wakeup(loop);
+                    uring_arm_wake(loop);
+                    break;
+                default:
+                    break;
+            }
+        }
+        run_timers(loop);
+        if(upgrade_path && run_handoff(loop)) return;
+    }
+}
+
+/**
+ * @function create_listen_socket
+ * @brief Create a non-blocking listening socket bound to the server port
+ * 
+ * @param port TCP port to bind
+ * @return Listening socket descriptor (exits the process on failure)
+ * 
+ * @details
+ *  - Sets SO_REUSEADDR and SO_REUSEPORT so every event loop can bind its
+ *    own socket to the same port; the kernel then load-balances incoming
+ *    connections across the listeners
+ */
+int create_listen_socket(int port){
+    int listen_sock;
+    struct sockaddr_in server_addr;
+
+    if((listen_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1){
+        perror("socket() error");
+        exit(1);
+    }
+
+    int opt = 1;
+    if(setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1){
+        perror("setsockopt() error");
+        exit(1);
+    }
+    if(setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1){
+        perror("setsockopt(SO_REUSEPORT) error");
+        exit(1);
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    if(bind(listen_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1){
+        perror("bind() error");
+        exit(1);
+    }
+
+    if(listen(listen_sock, BACKLOG) == -1){
+        perror("listen() error");
+        exit(1);
+    }
+
+    if(set_nonblocking(listen_sock) == -1){
+        perror("fcntl() error");
+        exit(1);
+    }
+    return listen_sock;
+}
+
+/**
+ * @function select_io_backend
+ * @brief Settle the I/O backend once, before any event loop is set up
+ * 
+ * @details
+ *  - With -b uring, sets up and tears down a probe ring with its
+ *    provided buffers; falls back to epoll if the kernel refuses
+ *  - With epoll, probes epoll_create1() and falls back to poll
+ *  - io_backend is shared by all loops and by the worker/flush paths, so
+ *    it must not change once the first loop exists
+ */
+void select_io_backend(void){
+    if(io_backend == BACKEND_URING){
+        Uring probe;
+        if(uring_init(&probe, URING_ENTRIES, URING_CQ_ENTRIES) == -1){
+            perror("io_uring_setup() error, falling back to epoll");
+            io_backend = BACKEND_EPOLL;
+        } else if(uring_setup_buffers(&probe, URING_BGID, URING_BUFFERS, URING_BUFFER_SIZE) == -1){
+            perror("io_uring provided buffers error, falling back to epoll");
+            uring_exit(&probe);
+            io_backend = BACKEND_EPOLL;
+        } else {
+            uring_exit(&probe);
+        }
+    }
+    if(io_backend == BACKEND_EPOLL){
+        int probe = epoll_create1(0);
+        if(probe == -1){
+            perror("epoll_create1() error, falling back to poll");
+            io_backend = BACKEND_POLL;
+        } else {
+            close(probe);
+        }
+    }
+}
+
+/**
+ * @function init_event_loop
+ * @brief Allocate a loop's connection table, listener and epoll instance
+ * 
+ * @param loop Event loop to initialize
+ * @param id Loop index
+ * @param port TCP port to listen on
+ * @param listen_sock Listener inherited from the old process on a hot
+ *        upgrade, -1 to create one
+ * 
+ * @details
+ *  - poll_fds/sessions start with INITIAL_POLL_SIZE slots, slot 0 holds
+ *    the loop's own listening socket and slot 1 its wakeup eventfd
+ *  - CPU is taken from loop_cpus[id % loop_cpu_count] when -a was given
+ *  - Sets up the io_uring instance and its provided buffers with -b uring,
+ *    or the epoll instance with epoll; the backend was settled by
+ *    select_io_backend(), so a loop that cannot get its instance now
+ *    (e.g. RLIMIT_MEMLOCK hit after a few rings) is fatal rather than
+ *    silently switching the backend under the loops already set up
+ */
+void init_event_loop(EventLoop* loop, int id, int port, int listen_sock){
+    loop->id = id;
+    loop->poll_size = INITIAL_POLL_SIZE;
+    loop->poll_fds = calloc(loop->poll_size, sizeof(struct pollfd));
+    loop->sessions = calloc(loop->poll_size, sizeof(Session*));
+    
+    if(!loop->poll_fds || !loop->sessions){
+        perror("Failed to allocate initial arrays");
+        exit(1);
+    }
+    
+    for(int i = 0; i < loop->poll_size; i++){
+        loop->poll_fds[i].fd = -1;
+        loop->sessions[i] = NULL;
+    }
+    loop->fd_index = NULL;
+    loop->fd_index_size = 0;
+    pthread_mutex_init(&loop->sessions_mutex, NULL);
+
+    loop->epoll_fd = -1;
+    loop->ring.fd = -1;
+    if(io_backend == BACKEND_URING){
+        if(uring_init(&loop->ring, URING_ENTRIES, URING_CQ_ENTRIES) == -1){
+            perror("io_uring_setup() error");
+            exit(1);
+        }
+        if(uring_setup_buffers(&loop->ring, URING_BGID, URING_BUFFERS, URING_BUFFER_SIZE) == -1){
+            perror("io_uring provided buffers error");
+            exit(1);
+        }
+    } else if(io_backend == BACKEND_EPOLL){
+        loop->epoll_fd = epoll_create1(0);
+        if(loop->epoll_fd == -1){
+            perror("epoll_create1() error");
+            exit(1);
+        }
+    }
+
+    loop->cpu = loop_cpu_count > 0 ? loop_cpus[id % loop_cpu_count] : -1;
+    loop->listen_sock = listen_sock >= 0 ? listen_sock : create_listen_socket(port);
+    loop->poll_fds[0].fd = loop->listen_sock;
+    loop->poll_fds[0].events = POLLIN;
+
+    loop->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(loop->wakeup_fd == -1){
+        perror("eventfd() error");
+        exit(1);
+    }
+    loop->poll_fds[1].fd = loop->wakeup_fd;
+    loop->poll_fds[1].events = POLLIN;
+    loop->poll_count = 2;
+
+    loop->throttled = NULL;
+    loop->throttled_count = 0;
+    loop->throttled_size = 0;
+    atomic_init(&loop->has_throttled, 0);
+
+    pthread_mutex_init(&loop->flush_lock, NULL);
+    loop->flush_list = NULL;
+    loop->flush_count = 0;
+    loop->flush_size = 0;
+
+    loop->accept_more = 0;
+    loop->accept_armed = 0;
+    loop->handoff = 0;
+    loop->handed_count = 0;
+    loop->handoff_deadline_ns = 0;
+    loop->upgrade_seen = 0;
+    pthread_mutex_init(&loop->adopt_lock, NULL);
+    loop->adopt_list = NULL;
+    loop->adopt_count = 0;
+    loop->adopt_size = 0;
+
+    loop->now_tick = current_tick();
+    timer_wheel_init(&loop->wheel, loop->now_tick);
+}
+
+/**
+ * @function event_loop_thread
+ * @brief Thread entry point: pin to the loop's CPU and run its backend
+ * 
+ * @param arg Pointer to the EventLoop
+ * @return NULL, once the loop handed its connections to a new process
+ */
+void* event_loop_thread(void* arg){
+    EventLoop* loop = arg;
+
+    if(loop->cpu >= 0){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(loop->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if(err != 0){
+            fprintf(stderr, "Warning: could not pin loop %d to CPU %d: %s\n",
+                    loop->id, loop->cpu, strerror(err));
+        }
+    }
+
+    if(io_backend == BACKEND_URING){
+        run_uring_loop(loop);
+    } else if(io_backend == BACKEND_EPOLL){
+        run_epoll_loop(loop);
+    } else {
+        run_poll_loop(loop);
+    }
+    return NULL;
+}
+
+/**
+ * @function parse_cpu_list
+ * @brief Parse a comma separated CPU list such as "0,2,4-7"
+ * 
+ * @param str List to parse
+ * @param cpus Output array
+ * @param max Capacity of cpus
+ * @return Number of CPUs stored, -1 on syntax error
+ */
+int parse_cpu_list(const char* str, int* cpus, int max){
+    int count = 0;
+    const char* p = str;
+
+    while(*p){
+        char* end;
+        long first = strtol(p, &end, 10);
+        if(end == p || first < 0) return -1;
+        long last = first;
+        if(*end == '-'){
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if(end == p || last < first) return -1;
+        }
+        for(long c = first; c <= last && count < max; c++){
+            cpus[count++] = (int)c;
+        }
+        if(*end == ',') end++;
+        else if(*end != '\0') return -1;
+        p = end;
+    }
+    return count;
+}
+
+/**
+ * @function read_active_connections
+ * @brief Gauge callback for the metrics endpoint
+ */
+long read_active_connections(void){
+    return active_connections;
+}
+
+/**
+ * @function read_queue_depth
+ * @brief Gauge callback: commands waiting in all worker run queues
+ */
+long read_queue_depth(void){
+    return (long)worker_pool_depth(&worker_pool);
+}
+
+/**
+ * @function read_workers
+ * @brief Gauge callback: workers currently taking new commands
+ */
+long read_workers(void){
+    return worker_pool_active(&worker_pool);
+}
+
+/**
+ * @function read_overloaded
+ * @brief Gauge callback: 1 while admission control sheds work
+ */
+long read_overloaded(void){
+    return atomic_load(&shedding);
+}
+
+/**
+ * @function read_inflight
+ * @brief Gauge callback: commands queued or running (tracked with -I)
+ */
+long read_inflight(void){
+    return admission_inflight();
+}
+
+/**
+ * @function parse_timeouts
+ * @brief Parse "idle=300,handshake=30,login=120" (seconds) for -t
+ * 
+ * @return 0 on success, -1 on an unknown name or a value that is not
+ *         a plain number of seconds (see recv_timeout_parse())
+ * 
+ * @note Names left out keep their default; 0 disables a timeout
+ */
+int parse_timeouts(const char* spec){
+    RecvTimeoutConfig config = {RECV_TIMEOUT_IDLE, RECV_TIMEOUT_HANDSHAKE, RECV_TIMEOUT_LOGIN};
+    if(recv_timeout_parse(&config, spec) == -1) return -1;
+
+    idle_timeout_ticks = (uint64_t)config.idle * 1000 / TIMER_TICK_MS;
+    handshake_timeout_ticks = (uint64_t)config.handshake * 1000 / TIMER_TICK_MS;
+    login_timeout_ticks = (uint64_t)config.login * 1000 / TIMER_TICK_MS;
+    return 0;
+}
+
+/**
+ * @function parse_shed_target
+ * @brief Parse "target_ms[,interval_ms]" for -O
+ * 
+ * @return 0 on success, -1 if target is not positive or interval is given and not positive
+ */
+int parse_shed_target(const char* spec, uint64_t* target_ns, uint64_t* interval_ns){
+    char* end;
+    long target = strtol(spec, &end, 10);
+    long interval = DEFAULT_SHED_INTERVAL_MS;
+
+    if(end == spec || target < 1) return -1;
+    if(*end == ','){
+        char* rest = end + 1;
+        interval = strtol(rest, &end, 10);
+        if(end == rest || interval < 1) return -1;
+    }
+    if(*end != '\0') return -1;
+
+    *target_ns = (uint64_t)target * 1000000;
+    *interval_ns = (uint64_t)interval * 1000000;
+    return 0;
+}
+
+/**
+ * @function parse_workers
+ * @brief Parse "min[,max[,target_us]]" for -W
+ * 
+ * @return 0 on success, -1 unless 1 <= min <= max <= MAX_WORKERS and target_us >= 1
+ * 
+ * @note A single number gives a fixed-size pool
+ */
+int parse_workers(const char* spec){
+    char* end;
+    long min = strtol(spec, &end, 10);
+    long max = min;
+    long target = DEFAULT_SCALE_TARGET_US;
+
+    if(end == spec) return -1;
+    if(*end == ','){
+        char* rest = end + 1;
+        max = strtol(rest, &end, 10);
+        if(end == rest) return -1;
+    }
+    if(*end == ','){
+        char* rest = end + 1;
+        target = strtol(rest, &end, 10);
+        if(end == rest || target < 1) return -1;
+    }
+    if(*end != '\0' || min < 1 || max < min || max > MAX_WORKERS) return -1;
+
+    min_workers = (int)min;
+    max_workers = (int)max;
+    scale_target_ns = (uint64_t)target * 1000;
+    return 0;
+}
+
+/**
+ * @function parse_post_log
+ * @brief Parse "dir[,max_delay_us]" for -P
+ * 
+ * @return 0 on success, -1 on an empty directory or a bad delay
+ * 
+ * @note A delay of 0 commits each group as soon as the previous one is
+ *       durable; larger delays trade POST latency for fewer fdatasync()s
+ */
+int parse_post_log(char* spec){
+    char* comma = strchr(spec, ',');
+    if(comma){
+        char* end;
+        long delay = strtol(comma + 1, &end, 10);
+        if(end == comma + 1 || *end != '\0' || delay < 0 || delay > 1000000) return -1;
+        post_delay_us = (unsigned)delay;
+        *comma = '\0';
+    }
+    if(*spec == '\0') return -1;
+    post_dir = spec;
+    return 0;
+}
+
+/**
+ * @function worker_affinity
+ * @brief Build the CPU set the workers are confined to
+ * 
+ * @param set Output set
+ * @return 1 if set was filled, 0 to leave the workers unpinned
+ * 
+ * @details
+ *  - With -A the workers get exactly the listed CPUs
+ *  - Otherwise, when -a pinned the event loops, the workers get every CPU
+ *    the process may use except the loop CPUs, so commands never run on
+ *    a loop's core; if that leaves nothing they are not pinned
+ */
+int worker_affinity(cpu_set_t* set){
+    CPU_ZERO(set);
+    if(worker_cpu_count > 0){
+        for(int i = 0; i < worker_cpu_count; i++){
+            if(worker_cpus[i] < CPU_SETSIZE) CPU_SET(worker_cpus[i], set);
+        }
+        return CPU_COUNT(set) > 0;
+    }
+    if(loop_cpu_count == 0 || sched_getaffinity(0, sizeof(*set), set) == -1) return 0;
+
+    for(int i = 0; i < loop_cpu_count; i++){
+        if(loop_cpus[i] < CPU_SETSIZE) CPU_CLR(loop_cpus[i], set);
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/**
+ * @function offer_listeners
+ * @brief Open a handoff: UPGRADE_HELLO, then every loop's listening socket
+ * 
+ * @return 0 on success, -1 if the successor could not be reached
+ */
+int offer_listeners(int sock){
+    UpgradeMsg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = UPGRADE_HELLO;
+    msg.count = num_loops;
+    if(upgrade_send(sock, &msg, NULL, 0, -1) == -1) return -1;
+
+    msg.type = UPGRADE_LISTENER;
+    msg.count = 0;
+    for(int i = 0; i < num_loops; i++){
+        if(upgrade_send(sock, &msg, NULL, 0, event_loops[i].listen_sock) == -1) return -1;
+    }
+    return 0;
+}
+
+/**
+ * @function serve_upgrades
+ * @brief Wait on the -U socket for a new server process and hand everything to it
+ * 
+ * @param listen_fd Socket from upgrade_listen()
+ * 
+ * @details
+ *  - The listening sockets go first (offer_listeners()), so the new
+ *    process accepts from the same kernel queues: no connection is
+ *    refused and none queued is lost
+ *  - Then the loops hand off their sessions (run_handoff()); this thread
+ *    polls upgrade_state until they finish (the process exits) or the
+ *    handoff fails, after which it waits for every loop to resume and
+ *    serves the next attempt
+ */
+void serve_upgrades(int listen_fd){
+    struct timespec pause = { 0, UPGRADE_POLL_MS * 1000000L };
+
+    while(1){
+        int sock = upgrade_accept(listen_fd);
+        if(sock == -1){
+            LOG(LOG_WARN, "[UPGRADE] accept() error: %s", strerror(errno));
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        LOG(LOG_INFO, "[UPGRADE] New server process connected, handing off");
+        if(offer_listeners(sock) == -1){
+            LOG(LOG_WARN, "[UPGRADE] Could not pass the listeners: %s", strerror(errno));
+            close(sock);
+            continue;
+        }
+
+        upgrade_sock = sock;
+        atomic_store(&upgrade_pending, num_loops);
+        atomic_store(&upgrade_resumed, 0);
+        atomic_fetch_add(&upgrade_attempt, 1);
+        atomic_store(&upgrade_state, UPGRADE_HANDOFF);
+        wake_all_loops();
+
+        while(atomic_load(&upgrade_state) == UPGRADE_HANDOFF ||
+              (atomic_load(&upgrade_state) == UPGRADE_FAILED && atomic_load(&upgrade_resumed) < num_loops)){
+            nanosleep(&pause, NULL);
+        }
+        if(atomic_load(&upgrade_state) == UPGRADE_FINISHED) return;
+
+        LOG(LOG_WARN, "[UPGRADE] Serving the remaining connections again");
+        close(sock);
+        upgrade_sock = -1;
+        atomic_store(&upgrade_state, UPGRADE_IDLE);
+    }
+}
+
+/**
+ * @function take_over_listeners
+ * @brief Receive the running server's listening sockets (UPGRADE_HELLO + UPGRADE_LISTENER)
+ * 
+ * @param sock Connection from upgrade_connect()
+ * @param fds Filled with the listeners, in the old process's loop order
+ * @param max Capacity of fds
+ * @return Number of listeners, -1 on failure
+ */
+int take_over_listeners(int sock, int* fds, int max){
+    UpgradeMsg msg;
+    int fd;
+
+    if(upgrade_recv(sock, &msg, NULL, 0, &fd) == -1) return -1;
+    if(fd >= 0) close(fd);
+    if(msg.type != UPGRADE_HELLO || msg.count < 1 || msg.count > (uint32_t)max){
+        errno = EPROTO;
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < msg.count; i++){
+        UpgradeMsg listener;
+        if(upgrade_recv(sock, &listener, NULL, 0, &fd) == -1) return -1;
+        if(listener.type != UPGRADE_LISTENER || fd < 0){
+            if(fd >= 0) close(fd);
+            errno = EPROTO;
+            return -1;
+        }
+        fds[i] = fd;
+    }
+    return (int)msg.count;
+}
+
+/**
+ * @function queue_adoption
+ * @brief Hand a received connection to a loop (adopt_sessions())
+ * 
+ * @return 0 on success, -1 if it could not be queued (fd is then closed)
+ */
+int queue_adoption(EventLoop* loop, const UpgradeMsg* msg, const char* payload, size_t len, int fd){
+    AdoptedSession adopted;
+    adopted.msg = *msg;
+    adopted.fd = fd;
+    adopted.payload = malloc(len ? len : 1);
+    if(!adopted.payload){
+        close(fd);
+        return -1;
+    }
+    memcpy(adopted.payload, payload, len);
+
+    pthread_mutex_lock(&loop->adopt_lock);
+    if(loop->adopt_count >= loop->adopt_size){
+        int new_size = loop->adopt_size ? loop->adopt_size * 2 : INITIAL_POLL_SIZE;
+        AdoptedSession* grown = realloc(loop->adopt_list, new_size * sizeof(AdoptedSession));
+        if(!grown){
+            pthread_mutex_unlock(&loop->adopt_lock);
+            free(adopted.payload);
+            close(fd);
+            return -1;
+        }
+        loop->adopt_list = grown;
+        loop->adopt_size = new_size;
+    }
+    loop->adopt_list[loop->adopt_count++] = adopted;
+    pthread_mutex_unlock(&loop->adopt_lock);
+
+    wake_loop(loop);
+    return 0;
+}
+
+/**
+ * @function adopt_from
+ * @brief Receive the old process's sessions until UPGRADE_DONE
+ * 
+ * @details
+ *  - Sessions are spread round-robin over the loops
+ *  - UPGRADE_DONE is echoed back: the old process only exits once it
+ *    knows every session arrived
+ *  - A receive timeout only means the old process is still waiting for
+ *    a busy session; the connection closing early ends the takeover
+ *    with what arrived (the old process then keeps the rest)
+ */
+void adopt_from(int sock){
+    char* payload = malloc(UPGRADE_MAX_PAYLOAD);
+    int adopted = 0;
+
+    if(!payload){
+        perror("Hot upgrade buffer");
+        return;
+    }
+    while(1){
+        UpgradeMsg msg;
+        int fd;
+        ssize_t len = upgrade_recv(sock, &msg, payload, UPGRADE_MAX_PAYLOAD, &fd);
+
+        if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if(len == -1){
+            LOG(LOG_WARN, "[UPGRADE] Connection to the old server process lost: %s", strerror(errno));
+            break;
+        }
+        if(msg.type == UPGRADE_DONE){
+            if(upgrade_send(sock, &msg, NULL, 0, -1) == -1){
+                LOG(LOG_WARN, "[UPGRADE] Could not confirm the takeover: %s", strerror(errno));
+            }
+            break;
+        }
+        if(msg.type != UPGRADE_SESSION || fd < 0){
+            if(fd >= 0) close(fd);
+            continue;
+        }
+        if(queue_adoption(&event_loops[adopted % num_loops], &msg, payload, len, fd) == 0) adopted++;
+    }
+    LOG(LOG_INFO, "[UPGRADE] Took over %d connections from the old server process", adopted);
+    free(payload);
+}
+
+/**
+ * @function upgrade_thread
+ * @brief Hot upgrade thread (-U): take over from the old process, then serve the next upgrade
+ * 
+ * @param arg Connection to the old server process (intptr_t), -1 on a cold start
+ * @return NULL
+ * 
+ * @details The -U socket is bound only after the takeover, replacing the
+ *          old process's, so an upgrade never finds two servers listening
+ */
+void* upgrade_thread(void* arg){
+    int sock = (int)(intptr_t)arg;
+
+    if(sock >= 0){
+        adopt_from(sock);
+        close(sock);
+    }
+
+    int listen_fd = upgrade_listen(upgrade_path);
+    if(listen_fd == -1){
+        fprintf(stderr, "Warning: hot upgrade socket %s not available: %s\n", upgrade_path, strerror(errno));
+        return NULL;
+    }
+    serve_upgrades(listen_fd);
+    return NULL;
+}
+
+/**
+ * @function print_usage
+ * @brief Print command line usage
+ */
+void print_usage(){
+    printf("Usage: ./server [-b epoll|poll|uring] [-n event_loops] [-a cpu_list] [-W min[,max[,target_us]]] [-A cpu_list] [-q queue_size] [-l max_line] [-L log_level] [-S sample_rate] [-m metrics_port] [-T slow_us] [-t timeouts] [-O target_ms[,interval_ms]] [-C max_connections] [-I max_inflight] [-U socket_path] [-P dir[,max_delay_us]] Port_Number\n");
+    printf("  -b  I/O backend, uring needs io_uring with provided buffer rings (default epoll)\n");
+    printf("  -n  number of SO_REUSEPORT event loops (default 1, max %d)\n", MAX_EVENT_LOOPS);
+    printf("  -a  pin event loop i to the i-th CPU of the list, e.g. 0,1 or 0-3\n");
+    printf("  -W  worker threads, a fixed count or min,max to add workers while the mean queue wait exceeds\n");
+    printf("      target_us and retire them when idle (default %d fixed, target %d us)\n", DEFAULT_WORKERS, DEFAULT_SCALE_TARGET_US);
+    printf("  -A  run workers only on these CPUs (default: the CPUs not given to event loops with -a)\n");
+    printf("  -q  total work queue capacity, split across the max worker run queues (default %d)\n", DEFAULT_WORK_QUEUE_SIZE);
+    printf("  -l  longest command line accepted in bytes, longer lines close the connection (default %d, max %d)\n", DEFAULT_MAX_LINE, MAX_LINE_LIMIT);
+    printf("  -L  log level: error, warn, info or debug (default debug, per-message lines are debug)\n");
+    printf("  -S  log only every N-th per-message line of each thread (default 1 = all)\n");
+    printf("  -m  serve Prometheus metrics on this port at /metrics (default off)\n");
+    printf("  -t  connection timeouts in seconds, 0 disables one, e.g. idle=300,handshake=30,login=120 (the defaults)\n");
+    printf("  -T  log commands slower than this many microseconds from receipt to reply, with a per-stage split (default off)\n");
+    printf("  -O  shed load once work queue delay stays above target_ms for interval_ms (default %d): new connections\n", DEFAULT_SHED_INTERVAL_MS);
+    printf("      get 500, new commands 503 (default off, e.g. 5)\n");
+    printf("  -C  refuse connections with 500 beyond this many open ones (default unlimited)\n");
+    printf("  -I  answer 503 to commands beyond this many queued or running (default unlimited)\n");
+    printf("  -U  hot upgrade socket: if a server runs there, take over its listeners and connections,\n");
+    printf("      then wait there for the next upgrade (default off)\n");
+    printf("  -P  store posts in this directory; 120 is sent once the post is on disk, group commits wait up to\n");
+    printf("      max_delay_us for more posts to share one fdatasync (default %s, %d us)\n", DEFAULT_POST_DIR, POST_LOG_DEFAULT_DELAY_US);
+}
+
+int main(int argc, char* argv[]){
+    int opt_char;
+    int metrics_port = 0;
+    uint64_t shed_target_ns = 0;
+    uint64_t shed_interval_ns = 0;
+    unsigned max_inflight = 0;
+    while((opt_char = getopt(argc, argv, "b:n:a:W:A:q:l:L:S:m:T:t:O:C:I:U:P:")) != -1){
+        switch(opt_char){
+            case 'b':
+                if(strcmp(optarg, "epoll") == 0) io_backend = BACKEND_EPOLL;
+                else if(strcmp(optarg, "poll") == 0) io_backend = BACKEND_POLL;
+                else if(strcmp(optarg, "uring") == 0) io_backend = BACKEND_URING;
+                else { print_usage(); return 1; }
+                break;
+            case 'n':
+                num_loops = atoi(optarg);
+                if(num_loops < 1 || num_loops > MAX_EVENT_LOOPS){ print_usage(); return 1; }
+                break;
+            case 'a':
+                loop_cpu_count = parse_cpu_list(optarg, loop_cpus, MAX_EVENT_LOOPS);
+                if(loop_cpu_count <= 0){ print_usage(); return 1; }
+                break;
+            case 'W':
+                if(parse_workers(optarg) == -1){ print_usage(); return 1; }
+                break;
+            case 'A':
+                worker_cpu_count = parse_cpu_list(optarg, worker_cpus, CPU_SETSIZE);
+                if(worker_cpu_count <= 0){ print_usage(); return 1; }
+                break;
+            case 'q':
+                if(atoi(optarg) < 1){ print_usage(); return 1; }
+                work_queue_size = atoi(optarg);
+                break;
+            case 'l':
+                if(atoi(optarg) < 1 || atoi(optarg) > MAX_LINE_LIMIT){ print_usage(); return 1; }
+                session_set_max_line(atoi(optarg));
+                break;
+            case 'L':
+                if(log_parse_level(optarg) == -1){ print_usage(); return 1; }
+                log_set_level(log_parse_level(optarg));
+                break;
+            case 'S':
+                if(atoi(optarg) < 1){ print_usage(); return 1; }
+                log_set_sample_rate(atoi(optarg));
+                break;
+            case 'm':
+                metrics_port = atoi(optarg);
+                if(metrics_port < 1 || metrics_port > 65535){ print_usage(); return 1; }
+                break;
+            case 't':
+                if(parse_timeouts(optarg) == -1){
+                    fprintf(stderr, "Invalid timeouts for -t: %s\n", optarg);
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'T':
+                if(atoll(optarg) < 1){ print_usage(); return 1; }
+                slow_threshold_ns = (uint64_t)atoll(optarg) * 1000;
+                break;
+            case 'O':
+                if(parse_shed_target(optarg, &shed_target_ns, &shed_interval_ns) == -1){ print_usage(); return 1; }
+                break;
+            case 'C':
+                max_connections = atoi(optarg);
+                if(max_connections < 1){ print_usage(); return 1; }
+                break;
+            case 'I':
+                if(atoi(optarg) < 1){ print_usage(); return 1; }
+                max_inflight = atoi(optarg);
+                break;
+            case 'U':
+                upgrade_path = optarg;
+                break;
+            case 'P':
+                if(parse_post_log(optarg) == -1){ print_usage(); return 1; }
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+
+    if(optind != argc - 1){
+        print_usage();
+        return 1;
+    }
+
+    int port = atoi(argv[optind]);
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    
+    rl.rlim_cur = rl.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &rl) == 0){
+        getrlimit(RLIMIT_NOFILE, &rl);
+    } else {
+        printf("Warning: Could not increase FD limit\n");
+    }
+
+    if(account_store_init(ACCOUNT_FILE) == -1){
+        printf("Warning: no accounts loaded, USER answers 500 until %s is readable\n", ACCOUNT_FILE);
+    }
+    if(account_store_watch() == -1){
+        perror("Warning: account file watcher not started");
+    }
+
+    if(log_init() == -1){
+        perror("Failed to start log flusher");
+        exit(1);
+    }
+
+    if(post_log_open(&post_log, post_dir, post_delay_us) == -1){
+        fprintf(stderr, "Failed to open post log in %s: %s\n", post_dir, strerror(errno));
+        exit(1);
+    }
+    if(post_log.recovered || post_log.truncated){
+        printf("Post log: recovered %llu posts, cut %llu torn bytes\n",
+               (unsigned long long)post_log.recovered, (unsigned long long)post_log.truncated);
+    }
+    if(post_index_open(&post_index, &post_log) == -1){
+        fprintf(stderr, "Failed to map post log in %s: %s\n", post_dir, strerror(errno));
+        exit(1);
+    }
+    if(post_log_start(&post_log, commit_done, NULL) == -1){
+        perror("pthread_create() error");
+        exit(1);
+    }
+
+    admission_configure(shed_target_ns, shed_interval_ns, max_inflight, metrics_now_ns());
+
+    if(worker_pool_init(&worker_pool, min_workers, max_workers, work_queue_size,
+                        sizeof(WorkItem), run_work_item) == -1){
+        perror("Failed to allocate work queues");
+        exit(1);
+    }
+    worker_pool_set_steal_filter(&worker_pool, work_item_runnable);
+    cpu_set_t worker_set;
+    if(worker_affinity(&worker_set)){
+        worker_pool_set_affinity(&worker_pool, &worker_set);
+    }
+    if(worker_pool_start(&worker_pool) == -1 ||
+       worker_pool_autoscale(&worker_pool, scale_target_ns, SCALE_INTERVAL_MS) == -1){
+        perror("pthread_create() error");
+        exit(1);
+    }
+
+    int inherited[MAX_EVENT_LOOPS];
+    int inherited_count = 0;
+    int predecessor = -1;
+    if(upgrade_path){
+        predecessor = upgrade_connect(upgrade_path);
+        if(predecessor >= 0){
+            inherited_count = take_over_listeners(predecessor, inherited, MAX_EVENT_LOOPS);
+            if(inherited_count == -1){
+                perror("Hot upgrade failed");
+                exit(1);
+            }
+            if(inherited_count > num_loops){
+                num_loops = inherited_count;
+            }
+            printf("Hot upgrade: took over %d listening socket%s from the running server\n",
+                   inherited_count, inherited_count > 1 ? "s" : "");
+        } else if(errno != ENOENT && errno != ECONNREFUSED){
+            perror("Hot upgrade socket");
+            exit(1);
+        }
+    }
+
+    session_pool_reserve(max_connections ? max_connections : DEFAULT_SESSION_RESERVE);
+    select_io_backend();
+    for(int i = 0; i < num_loops; i++){
+        init_event_loop(&event_loops[i], i, port, i < inherited_count ? inherited[i] : -1);
+    }
+
+    if(metrics_port){
+        metrics_register_gauge("tcp_server_active_connections", "Open client connections",
+                               read_active_connections);
+        metrics_register_gauge("tcp_server_work_queue_depth", "Commands waiting in the worker run queues",
+                               read_queue_depth);
+        metrics_register_gauge("tcp_server_workers", "Worker threads taking new commands, resized between the -W bounds",
+                               read_workers);
+        metrics_register_gauge("tcp_server_overloaded", "1 while admission control sheds new connections and commands",
+                               read_overloaded);
+        if(max_inflight){
+            metrics_register_gauge("tcp_server_inflight_commands", "Commands queued or running, limited by -I",
+                                   read_inflight);
+        }
+        if(metrics_start_admin(metrics_port) == -1){
+            fprintf(stderr, "Failed to start metrics endpoint on port %d\n", metrics_port);
+            exit(1);
+        }
+        printf("Metrics at http://0.0.0.0:%d/metrics\n", metrics_port);
+    }
+
+    printf("Server started at port %d (%s backend, %d event loop%s, ", port,
+           backend_names[io_backend],
+           num_loops, num_loops > 1 ? "s" : "");
+    if(min_workers == max_workers){
+        printf("%d workers)\n", min_workers);
+    } else {
+        printf("%d-%d workers)\n", min_workers, max_workers);
+    }
+    fflush(stdout);
+
+    for(int i = 0; i < num_loops; i++){
+        if(pthread_create(&event_loops[i].thread, NULL, event_loop_thread, &event_loops[i]) != 0){
+            perror("pthread_create() error");
+            exit(1);
+        }
+    }
+
+    if(upgrade_path){
+        pthread_t upgrade_tid;
+        if(pthread_create(&upgrade_tid, NULL, upgrade_thread, (void*)(intptr_t)predecessor) != 0){
+            perror("pthread_create() error");
+            exit(1);
+        }
+        pthread_detach(upgrade_tid);
+    }
+
+    for(int i = 0; i < num_loops; i++){
+        pthread_join(event_loops[i].thread, NULL);
+    }
+
+    for(int i = 0; i < num_loops; i++){
+        close(event_loops[i].listen_sock);
+        if(event_loops[i].epoll_fd != -1) close(event_loops[i].epoll_fd);
+        if(event_loops[i].ring.fd != -1) uring_exit(&event_loops[i].ring);
+        close(event_loops[i].wakeup_fd);
+        free(event_loops[i].poll_fds);
+        free(event_loops[i].sessions);
+        free(event_loops[i].fd_index);
+        free(event_loops[i].throttled);
+        free(event_loops[i].flush_list);
+    }
+    post_log_close(&post_log);
+    post_index_close(&post_index);
+    log_shutdown();
     return 0;
 }
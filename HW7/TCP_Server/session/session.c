@@ -0,0 +1,775 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "session.h"
+#include "../metrics/metrics.h"
+
+/*
+ * Sessions are stored in fixed-size chunks that are allocated on demand
+ * and never moved or freed, so session_acquire() can index them without
+ * a lock while other threads create sessions.
+ */
+static Session* session_chunks[MAX_SESSION_CHUNKS];
+static atomic_uint session_slot_count = 0;
+
+static uint32_t* free_slots = NULL;
+static int free_count = 0;
+static int free_size = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t max_line_len = DEFAULT_MAX_LINE;
+
+static Session* slot_at(uint32_t slot){
+    return &session_chunks[slot / SESSION_CHUNK_SIZE][slot % SESSION_CHUNK_SIZE];
+}
+
+/**
+ * @function session_set_max_line
+ * @brief Set the longest command line accepted from a client
+ *
+ * @note Call before the first session_create(): every slot's framer is
+ *       sized once, when the slot is first used
+ */
+void session_set_max_line(size_t max_line){
+    max_line_len = max_line;
+}
+
+/**
+ * @function new_slot
+ * @brief Extend the pool by one slot and initialize it
+ *
+ * @return The new slot, NULL if the pool is exhausted or out of memory
+ *
+ * @details
+ *  - Allocates a new chunk of SESSION_CHUNK_SIZE slots when needed
+ *  - session_lock, order_cond, out_lock and the line framer are
+ *    initialized once per slot and reused by every session in it
+ *  - The framer starts without a buffer; session_rx_refill() attaches a
+ *    pool chunk on the first read
+ *
+ * @thread_safety Caller holds pool_mutex
+ */
+static Session* new_slot(void){
+    uint32_t slot = atomic_load(&session_slot_count);
+    uint32_t chunk = slot / SESSION_CHUNK_SIZE;
+
+    if(chunk >= MAX_SESSION_CHUNKS) return NULL;
+    if(!session_chunks[chunk]){
+        session_chunks[chunk] = calloc(SESSION_CHUNK_SIZE, sizeof(Session));
+        if(!session_chunks[chunk]) return NULL;
+    }
+
+    Session* session = slot_at(slot);
+    session->slot = slot;
+    atomic_init(&session->generation, 0);
+    pthread_mutex_init(&session->session_lock, NULL);
+    pthread_cond_init(&session->order_cond, NULL);
+    pthread_mutex_init(&session->out_lock, NULL);
+    line_framer_init(&session->framer, max_line_len, "\r\n");
+    line_framer_detach(&session->framer);
+    session->rx_chunk = NULL;
+    atomic_store(&session_slot_count, slot + 1);
+    return session;
+}
+
+/**
+ * @function push_free_slot
+ * @brief Put a slot on the free list, growing it as needed
+ *
+ * @return 0 on success, -1 if the list could not be grown
+ *
+ * @thread_safety Caller holds pool_mutex
+ */
+static int push_free_slot(uint32_t slot){
+    if(free_count >= free_size){
+        int new_size = free_size ? free_size * 2 : SESSION_CHUNK_SIZE;
+        uint32_t* grown = realloc(free_slots, new_size * sizeof(uint32_t));
+        if(!grown){
+            perror("realloc free_slots failed");
+            return -1;
+        }
+        free_slots = grown;
+        free_size = new_size;
+    }
+    free_slots[free_count++] = slot;
+    return 0;
+}
+
+/**
+ * @function session_pool_reserve
+ * @brief Set up slots ahead of time so a connection storm does not have to
+ *
+ * @param count Slots the pool should hold, free or in use
+ * @return Number of slots in the pool afterwards
+ *
+ * @details
+ *  - Every new slot is initialized (which also faults its memory in)
+ *    and put on the free list, so session_create() only pops it
+ *  - Call after session_set_max_line(), before the loops start
+ */
+uint32_t session_pool_reserve(uint32_t count){
+    pthread_mutex_lock(&pool_mutex);
+    while(atomic_load(&session_slot_count) < count){
+        Session* session = new_slot();
+        if(!session || push_free_slot(session->slot) == -1) break;
+    }
+    uint32_t total = atomic_load(&session_slot_count);
+    pthread_mutex_unlock(&pool_mutex);
+    return total;
+}
+
+/**
+ * @function session_create
+ * @brief Take a free slot from the pool and return it as a live session
+ *
+ * @return Session with refs = 1 (the owner's reference), NULL if the pool is exhausted
+ *
+ * @details
+ *  - Reuses a released or reserved slot if one is available, otherwise
+ *    extends the pool with new_slot()
+ *  - Bumps the slot's generation again, so handles to the previous
+ *    session stay stale, including one taken with session_handle() by a
+ *    worker that still held a reference after session_close(): a live
+ *    session's generation is never the one its slot had while closed
+ *  - Command sequence numbers restart at 0, the output buffer (and the
+ *    io_uring receive stash and send buffer) is empty and the timeout
+ *    timer is disarmed
+ *  - Caller initializes the connection fields (sockfd, username, ...)
+ *
+ * @thread_safety Slot allocation is protected by pool_mutex
+ */
+Session* session_create(void){
+    Session* session = NULL;
+
+    pthread_mutex_lock(&pool_mutex);
+    if(free_count > 0){
+        session = slot_at(free_slots[--free_count]);
+    } else {
+        session = new_slot();
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if(session){
+        atomic_fetch_add(&session->generation, 1);
+        session->next_seq = 0;
+        session->done_seq = 0;
+        atomic_store(&session->unordered, 0);
+        session->out_off = 0;
+        session->out_len = 0;
+        session->out_refs.count = 0;
+        session->out_refs.sent = 0;
+        session->out_refs.bytes = 0;
+        atomic_store(&session->flush_queued, 0);
+        session->want_write = 0;
+        session->out_paused = 0;
+        session->interest = 0;
+        timer_node_init(&session->timer);
+        session->got_command = 0;
+        session->got_login = 0;
+        session->rx_stash_off = 0;
+        session->rx_stash_len = 0;
+        session->rx_eof = 0;
+        session->recv_armed = 0;
+        session->recv_cancel = 0;
+        session->tx_off = 0;
+        session->tx_len = 0;
+        session->tx_refs.count = 0;
+        session->tx_refs.sent = 0;
+        session->tx_refs.bytes = 0;
+        session->send_armed = 0;
+        session->work_home = 0;
+        session->work_home_active = 0;
+        session->handed_off = 0;
+        session->post_lsn = 0;
+        atomic_store(&session->refs, 1);
+    }
+    return session;
+}
+
+/**
+ * @function session_handle
+ * @brief Build a handle for the session's current generation
+ *
+ * @note After session_close() the handle is stale from the start, since
+ *       session_create() moves the slot past the closed generation
+ */
+SessionHandle session_handle(Session* session){
+    SessionHandle handle;
+    handle.slot = session->slot;
+    handle.generation = atomic_load(&session->generation);
+    return handle;
+}
+
+/**
+ * @function session_acquire
+ * @brief Turn a handle back into a session, taking a reference
+ *
+ * @param handle Handle taken with session_handle()
+ * @return Session pointer that stays valid until session_release(), or
+ *         NULL if the session has been closed since the handle was taken
+ *
+ * @details
+ *  - Increments refs only while it is non-zero, so a fully released
+ *    slot can never be revived by a late worker
+ *  - Compares the slot's generation with the handle's afterwards; on a
+ *    mismatch the reference is dropped again and NULL is returned
+ *
+ * @thread_safety Lock-free
+ */
+Session* session_acquire(SessionHandle handle){
+    if(handle.slot >= atomic_load(&session_slot_count)) return NULL;
+
+    Session* session = slot_at(handle.slot);
+    int refs = atomic_load(&session->refs);
+    do {
+        if(refs == 0) return NULL;
+    } while(!atomic_compare_exchange_weak(&session->refs, &refs, refs + 1));
+
+    if(atomic_load(&session->generation) != handle.generation){
+        session_release(session);
+        return NULL;
+    }
+    return session;
+}
+
+/**
+ * @function session_release
+ * @brief Drop a reference; the last one recycles the slot
+ *
+ * @details
+ *  - When refs reaches zero the session has been closed by its loop and
+ *    no worker uses it anymore:
+ *    + The socket is closed here, so its fd number cannot be reused by a
+ *      new connection while a worker may still reply on it
+ *    + username is freed, the receive chunk and a pending command's
+ *      chunk are returned to the buffer pool (queued commands hold
+ *      their own chunk references)
+ *    + Parked replies are dropped
+ *    + The output buffer is kept for the next session in this slot
+ *      unless it grew beyond OUTPUT_KEEP_SIZE, as are the io_uring
+ *      receive stash and send buffer
+ *    + The slot is pushed on the free list
+ */
+void session_release(Session* session){
+    if(atomic_fetch_sub(&session->refs, 1) != 1) return;
+
+    if(session->sockfd >= 0) close(session->sockfd);
+    session->sockfd = -1;
+    free(session->username);
+    session->username = NULL;
+    buffer_chunk_unref(session->pending.chunk);
+    session->pending.chunk = NULL;
+    buffer_chunk_unref(session->rx_chunk);
+    session->rx_chunk = NULL;
+    line_framer_detach(&session->framer);
+    for(int i = 0; i < session->held_count; i++) free(session->held[i].data);
+    session->held_count = 0;
+    session->held_ordered = 0;
+    session->held_bytes = 0;
+    if(session->out_cap > OUTPUT_KEEP_SIZE){
+        free(session->out_data);
+        session->out_data = NULL;
+        session->out_cap = 0;
+    }
+    if(session->tx_cap > OUTPUT_KEEP_SIZE){
+        free(session->tx_data);
+        session->tx_data = NULL;
+        session->tx_cap = 0;
+    }
+    if(session->rx_stash_cap > OUTPUT_KEEP_SIZE){
+        free(session->rx_stash);
+        session->rx_stash = NULL;
+        session->rx_stash_cap = 0;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    push_free_slot(session->slot);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/**
+ * @function session_close
+ * @brief Invalidate all handles to the session and drop the owner's reference
+ *
+ * @details
+ *  - Bumps the generation, so queued work for this session is cancelled
+ *    when a worker tries to acquire it
+ *  - Work already running keeps its reference; resources are reclaimed
+ *    by whichever session_release() comes last
+ */
+void session_close(Session* session){
+    atomic_fetch_add(&session->generation, 1);
+    session_release(session);
+}
+
+/**
+ * @function session_rx_refill
+ * @brief Give the session's framer a fresh receive chunk
+ *
+ * @param session Session owned by the calling loop
+ * @return 0 on success, -1 if no chunk could be allocated
+ *
+ * @details
+ *  - Called when the framer reports ENOBUFS: no chunk yet, or the
+ *    current one is full
+ *  - The unread partial line moves to the new chunk; lines already
+ *    queued keep the old chunk alive through their own references
+ *  - A binary frame longer than a pooled chunk gets a large chunk of
+ *    its own (line_framer_buffer_size())
+ */
+int session_rx_refill(Session* session){
+    BufferChunk* chunk = buffer_chunk_alloc_large(line_framer_buffer_size(&session->framer));
+    if(!chunk) return -1;
+
+    if(line_framer_attach(&session->framer, chunk->data, chunk->size) == -1){
+        buffer_chunk_unref(chunk);
+        return -1;
+    }
+    buffer_chunk_unref(session->rx_chunk);
+    session->rx_chunk = chunk;
+    return 0;
+}
+
+/**
+ * @function session_rx_push
+ * @brief Take bytes delivered by an io_uring receive completion
+ *
+ * @param session Session owned by the calling loop
+ * @param data Bytes received (a provided buffer the caller recycles next)
+ * @param len Number of bytes
+ * @return 0 on success, -1 if the stash could not be grown
+ *
+ * @details
+ *  - While nothing is stashed the bytes go straight into the framer's
+ *    receive chunk, so the common case costs one copy, like recv()
+ *  - What the chunk has no room for (or everything, once bytes are
+ *    stashed, to keep their order) is appended to rx_stash;
+ *    session_rx_next() feeds it to the framer as lines are consumed
+ *  - rx_stash grows by doubling from BUFF_SIZE; it only holds what
+ *    arrives while input is paused or a chunk fills up, because the
+ *    loop cancels the receive as soon as input is paused
+ */
+int session_rx_push(Session* session, const char* data, size_t len){
+    if(session->rx_stash_off == session->rx_stash_len){
+        session->rx_stash_off = 0;
+        session->rx_stash_len = 0;
+        ssize_t n = line_framer_push(&session->framer, data, len);
+        if(n > 0){
+            data += n;
+            len -= n;
+        }
+    }
+    if(len == 0) return 0;
+
+    if(session->rx_stash_len + len > session->rx_stash_cap && session->rx_stash_off > 0){
+        memmove(session->rx_stash, session->rx_stash + session->rx_stash_off,
+                session->rx_stash_len - session->rx_stash_off);
+        session->rx_stash_len -= session->rx_stash_off;
+        session->rx_stash_off = 0;
+    }
+    if(session->rx_stash_len + len > session->rx_stash_cap){
+        size_t new_cap = session->rx_stash_cap ? session->rx_stash_cap : BUFF_SIZE;
+        while(new_cap < session->rx_stash_len + len) new_cap *= 2;
+        char* grown = realloc(session->rx_stash, new_cap);
+        if(!grown) return -1;
+        session->rx_stash = grown;
+        session->rx_stash_cap = new_cap;
+    }
+    memcpy(session->rx_stash + session->rx_stash_len, data, len);
+    session->rx_stash_len += len;
+    return 0;
+}
+
+/**
+ * @function session_rx_next
+ * @brief line_framer_read_line() for input delivered by session_rx_push()
+ *
+ * @param session Session owned by the calling loop
+ * @param line Set to the line (NUL-terminated, in the receive chunk)
+ * @param len Set to the line length, delimiter excluded
+ * @return 1 if a line was returned, 0 once the peer closed the
+ *         connection and every byte was framed, -1 with errno EAGAIN
+ *         when no complete line is buffered, or as line_framer_next()
+ *         and line_framer_push() fail (ENOBUFS: refill the chunk)
+ */
+int session_rx_next(Session* session, char** line, size_t* len){
+    while(1){
+        int ret = line_framer_next(&session->framer, line, len);
+        if(ret != 0) return ret;
+
+        if(session->rx_stash_off == session->rx_stash_len){
+            if(session->rx_eof) return 0;
+            errno = EAGAIN;
+            return -1;
+        }
+        ssize_t n = line_framer_push(&session->framer, session->rx_stash + session->rx_stash_off,
+                                     session->rx_stash_len - session->rx_stash_off);
+        if(n == -1) return -1;
+        session->rx_stash_off += n;
+    }
+}
+
+/**
+ * @function session_out_append_locked
+ * @brief Append bytes to the session's output buffer
+ *
+ * @param session Session (caller holds a reference and out_lock)
+ * @param data Bytes to append
+ * @param len Number of bytes
+ * @return 0 on success, -1 if the buffer could not be grown
+ *
+ * @details
+ *  - Sent bytes at the front are reclaimed with memmove() before growing
+ *    (references behind them move along)
+ *  - The buffer doubles from OUTPUT_INITIAL_SIZE as needed
+ *  - Appending to an empty buffer stamps out_since_ns, the start of the
+ *    output stage timed by the loop when it drains the buffer
+ *  - A reply made of several pieces is appended under one out_lock
+ *    hold, so replies of commands running at the same time (tagged,
+ *    out of order) never interleave
+ */
+int session_out_append_locked(Session* session, const char* data, size_t len){
+    if(session->out_len + len > session->out_cap && session->out_off > 0){
+        memmove(session->out_data, session->out_data + session->out_off,
+                session->out_len - session->out_off);
+        for(int i = 0; i < session->out_refs.count; i++){
+            session->out_refs.items[i].at -= session->out_off;
+        }
+        session->out_len -= session->out_off;
+        session->out_off = 0;
+    }
+
+    if(session->out_len + len > session->out_cap){
+        size_t new_cap = session->out_cap ? session->out_cap : OUTPUT_INITIAL_SIZE;
+        while(new_cap < session->out_len + len) new_cap *= 2;
+        char* grown = realloc(session->out_data, new_cap);
+        if(!grown) return -1;
+        session->out_data = grown;
+        session->out_cap = new_cap;
+    }
+
+    if(session->out_len == session->out_off && session->out_refs.count == 0){
+        session->out_since_ns = metrics_now_ns();
+    }
+    memcpy(session->out_data + session->out_len, data, len);
+    session->out_len += len;
+    return 0;
+}
+
+/**
+ * @function session_out_append
+ * @brief session_out_append_locked() for a reply in one piece
+ *
+ * @thread_safety Protected by session->out_lock
+ */
+int session_out_append(Session* session, const char* data, size_t len){
+    pthread_mutex_lock(&session->out_lock);
+    int ret = session_out_append_locked(session, data, len);
+    pthread_mutex_unlock(&session->out_lock);
+    return ret;
+}
+
+/**
+ * @function session_out_append_ref_locked
+ * @brief Queue bytes for the client without copying them
+ *
+ * @param session Session (caller holds a reference and out_lock)
+ * @param data Bytes that stay valid until the process exits
+ * @param len Number of bytes
+ * @return 0 on success, -1 if the reference list could not be grown
+ *
+ * @details
+ *  - The bytes go out after everything appended so far, in the same
+ *    sendmsg() as the buffered bytes around them
+ *  - Below OUTPUT_REF_MIN bytes a copy is cheaper than the extra iovec
+ *    entry, so short data is appended like session_out_append_locked()
+ */
+int session_out_append_ref_locked(Session* session, const char* data, size_t len){
+    if(len < OUTPUT_REF_MIN) return session_out_append_locked(session, data, len);
+
+    OutRefs* refs = &session->out_refs;
+    if(refs->count == refs->cap){
+        int new_cap = refs->cap ? refs->cap * 2 : 16;
+        OutRef* grown = realloc(refs->items, new_cap * sizeof(OutRef));
+        if(!grown) return -1;
+        refs->items = grown;
+        refs->cap = new_cap;
+    }
+
+    if(session->out_len == session->out_off && refs->count == 0){
+        session->out_since_ns = metrics_now_ns();
+    }
+    refs->items[refs->count].at = session->out_len;
+    refs->items[refs->count].data = data;
+    refs->items[refs->count].len = len;
+    refs->count++;
+    refs->bytes += len;
+    return 0;
+}
+
+/**
+ * @function session_out_append_ref
+ * @brief session_out_append_ref_locked() for a reply in one piece
+ *
+ * @thread_safety Protected by session->out_lock
+ */
+int session_out_append_ref(Session* session, const char* data, size_t len){
+    pthread_mutex_lock(&session->out_lock);
+    int ret = session_out_append_ref_locked(session, data, len);
+    pthread_mutex_unlock(&session->out_lock);
+    return ret;
+}
+
+/**
+ * @function session_out_mark
+ * @brief Remember where the next reply starts, for session_out_park()
+ *        and session_out_rollback()
+ *
+ * @note Caller holds out_lock from the mark until the reply is parked
+ *       or left in place; compacting the buffer meanwhile keeps the
+ *       unsent byte count, so the mark stays valid
+ */
+void session_out_mark(Session* session, OutMark* mark){
+    mark->pending = session->out_len - session->out_off;
+    mark->refs = session->out_refs.count;
+}
+
+/**
+ * @function session_out_rollback
+ * @brief Drop whatever was appended since mark
+ *
+ * @param session Session (caller holds a reference and out_lock)
+ * @param mark Taken before the reply was appended
+ *
+ * @details Used when a reply of several pieces fails partway: sending
+ *          the pieces that made it would leave the client with a short
+ *          LIST or a frame whose header promises more bytes than follow
+ */
+void session_out_rollback(Session* session, const OutMark* mark){
+    OutRefs* refs = &session->out_refs;
+    for(int i = mark->refs; i < refs->count; i++) refs->bytes -= refs->items[i].len;
+    refs->count = mark->refs;
+    session->out_len = session->out_off + mark->pending;
+}
+
+/**
+ * @function session_out_park
+ * @brief Take the reply appended since mark out of the output buffer
+ *
+ * @param session Session (caller holds a reference and out_lock)
+ * @param mark Taken before the reply was appended
+ * @param lsn Post log record the reply waits for, 0 for none
+ * @param ordered 1 if it must also wait for the ordered replies before it
+ * @return 0 on success, -1 if out of memory: the reply is dropped, as
+ *         a reply that cannot be appended is, rather than sent early
+ *
+ * @details
+ *  - The reply is copied, references included, into an entry of held,
+ *    and the buffer is cut back to the mark, so whatever is appended
+ *    next is not held back by it
+ *  - An ordered reply with nothing to wait for of its own joins the last
+ *    entry if that is ordered too; it would be released with it anyway
+ */
+int session_out_park(Session* session, const OutMark* mark, uint64_t lsn, int ordered){
+    OutRefs* refs = &session->out_refs;
+    OutRefs tail = {refs->items + mark->refs, refs->count - mark->refs, 0, 0, 0};
+    size_t start = session->out_off + mark->pending;
+    for(int i = 0; i < tail.count; i++) tail.bytes += tail.items[i].len;
+
+    HeldReply* last = session->held_count ? &session->held[session->held_count - 1] : NULL;
+    int join = ordered && lsn == 0 && last && last->ordered;
+    size_t len;
+    char* flat = out_refs_flatten(&tail, session->out_data, start, session->out_len, &len);
+    int ret = flat ? 0 : -1;
+
+    session_out_rollback(session, mark);
+    if(ret == -1) return -1;
+
+    if(!join && session->held_count == session->held_cap){
+        int new_cap = session->held_cap ? session->held_cap * 2 : 8;
+        HeldReply* grown = realloc(session->held, new_cap * sizeof(HeldReply));
+        if(!grown){
+            free(flat);
+            return -1;
+        }
+        session->held = grown;
+        session->held_cap = new_cap;
+    }
+
+    if(join){
+        char* grown = realloc(last->data, last->len + len);
+        if(!grown){
+            free(flat);
+            return -1;
+        }
+        memcpy(grown + last->len, flat, len);
+        free(flat);
+        last->data = grown;
+        last->len += len;
+    } else {
+        HeldReply* entry = &session->held[session->held_count++];
+        entry->lsn = lsn;
+        entry->ordered = ordered;
+        entry->data = flat;
+        entry->len = len;
+        if(ordered) session->held_ordered++;
+    }
+    session->held_bytes += len;
+    return 0;
+}
+
+/**
+ * @function session_out_release
+ * @brief Move parked replies that may go out now into the output buffer
+ *
+ * @param session Session (caller holds a reference and out_lock)
+ * @param durable Last post log record on disk
+ * @return 0 on success, -1 if the buffer could not be grown (the rest
+ *         stays parked)
+ *
+ * @details
+ *  - A tagged reply goes once its record is durable; an ordered one
+ *    also needs every ordered reply before it gone, so the first ordered
+ *    entry still waiting keeps the ordered ones behind it
+ *  - Released replies are appended in the order they were parked
+ */
+int session_out_release(Session* session, uint64_t durable){
+    int kept = 0;
+    int blocked = 0;
+    int ret = 0;
+
+    for(int i = 0; i < session->held_count; i++){
+        HeldReply* entry = &session->held[i];
+        int wait = entry->lsn > durable || (entry->ordered && blocked) || ret == -1;
+        if(!wait && session_out_append_locked(session, entry->data, entry->len) == -1){
+            ret = -1;
+            wait = 1;
+        }
+        if(wait){
+            if(entry->ordered) blocked = 1;
+            session->held[kept++] = *entry;
+            continue;
+        }
+        session->held_bytes -= entry->len;
+        if(entry->ordered) session->held_ordered--;
+        free(entry->data);
+    }
+    session->held_count = kept;
+    return ret;
+}
+
+/**
+ * @function session_out_pending
+ * @brief Number of buffered bytes not yet written to the socket
+ *
+ * @note Parked replies count as well
+ *
+ * @thread_safety Protected by session->out_lock
+ */
+size_t session_out_pending(Session* session){
+    pthread_mutex_lock(&session->out_lock);
+    size_t pending = session->out_len - session->out_off + session->out_refs.bytes +
+                     session->held_bytes;
+    pthread_mutex_unlock(&session->out_lock);
+    return pending;
+}
+
+/**
+ * @function out_refs_iov
+ * @brief Describe unsent output as an iovec: buffer runs and references in order
+ *
+ * @param refs References of the buffer
+ * @param data Buffer
+ * @param off First unsent byte of data
+ * @param len Bytes used in data
+ * @param iov Filled with up to max entries
+ * @return Entries filled in (0 when nothing is pending)
+ */
+int out_refs_iov(const OutRefs* refs, const char* data, size_t off, size_t len,
+                 struct iovec* iov, int max){
+    int n = 0;
+    for(int i = 0; i < refs->count && n < max; i++){
+        const OutRef* ref = &refs->items[i];
+        if(ref->at > off){
+            iov[n].iov_base = (void*)(data + off);
+            iov[n].iov_len = ref->at - off;
+            off = ref->at;
+            if(++n == max) return n;
+        }
+        size_t skip = i == 0 ? refs->sent : 0;
+        iov[n].iov_base = (void*)(ref->data + skip);
+        iov[n].iov_len = ref->len - skip;
+        n++;
+    }
+    if(n < max && off < len){
+        iov[n].iov_base = (void*)(data + off);
+        iov[n].iov_len = len - off;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @function out_refs_consume
+ * @brief Account for n bytes written from the front of the output
+ *
+ * @param refs References of the buffer; fully sent ones are removed
+ * @param off First unsent byte of the buffer, advanced past sent bytes
+ * @param n Bytes the socket took
+ */
+void out_refs_consume(OutRefs* refs, size_t* off, size_t n){
+    while(n > 0){
+        if(refs->count == 0 || *off < refs->items[0].at){
+            size_t run = refs->count ? refs->items[0].at - *off : n;
+            size_t take = n < run ? n : run;
+            *off += take;
+            n -= take;
+            continue;
+        }
+
+        OutRef* ref = &refs->items[0];
+        size_t left = ref->len - refs->sent;
+        size_t take = n < left ? n : left;
+        refs->sent += take;
+        refs->bytes -= take;
+        n -= take;
+        if(refs->sent == ref->len){
+            refs->count--;
+            memmove(&refs->items[0], &refs->items[1], refs->count * sizeof(OutRef));
+            refs->sent = 0;
+        }
+    }
+}
+
+/**
+ * @function out_refs_flatten
+ * @brief Copy unsent output, references included, into one new buffer
+ *
+ * @param total Set to the number of bytes copied
+ * @return malloc()ed buffer (caller frees), NULL when out of memory
+ *
+ * @note For the rare cases that need plain bytes (a hot upgrade handoff)
+ */
+char* out_refs_flatten(const OutRefs* refs, const char* data, size_t off, size_t len, size_t* total){
+    *total = len - off + refs->bytes;
+    char* flat = malloc(*total ? *total : 1);
+    if(!flat) return NULL;
+
+    size_t pos = 0;
+    for(int i = 0; i < refs->count; i++){
+        const OutRef* ref = &refs->items[i];
+        if(ref->at > off){
+            memcpy(flat + pos, data + off, ref->at - off);
+            pos += ref->at - off;
+            off = ref->at;
+        }
+        size_t skip = i == 0 ? refs->sent : 0;
+        memcpy(flat + pos, ref->data + skip, ref->len - skip);
+        pos += ref->len - skip;
+    }
+    memcpy(flat + pos, data + off, len - off);
+    return flat;
+}
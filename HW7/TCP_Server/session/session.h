@@ -0,0 +1,270 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "framer/line_framer.h"
+#include "../buffer/buffer_pool.h"
+#include "../timer/timer_wheel.h"
+
+#define BUFF_SIZE 4096
+#define SESSION_CHUNK_SIZE 1024
+#define MAX_SESSION_CHUNKS 4096
+#define OUTPUT_INITIAL_SIZE 256
+#define OUTPUT_KEEP_SIZE 65536
+#define OUTPUT_REF_MIN 256
+#define OUTPUT_MAX_IOV 128
+#define DEFAULT_MAX_LINE (BUFF_SIZE - 1)
+#define MAX_LINE_LIMIT (BUFFER_CHUNK_SIZE / 2 - 2)
+
+typedef struct EventLoop EventLoop;
+
+/**
+ * @struct SessionHandle
+ * @brief Reference to a session that stays safe after the session is closed
+ *
+ * @member slot Index of the session in the session pool
+ * @member generation Generation of the slot when the handle was taken
+ *
+ * @note A handle is stale once its session is closed: the slot's
+ *       generation moves on and session_acquire() returns NULL.
+ */
+typedef struct {
+    uint32_t slot;
+    uint32_t generation;
+} SessionHandle;
+
+/**
+ * @struct OutRef
+ * @brief Output bytes sent in place from memory the session does not own
+ *
+ * @member at Offset in the output buffer the bytes go out in front of
+ * @member data First byte; must stay valid until the process exits
+ *         (mapped post log segments)
+ * @member len Number of bytes
+ */
+typedef struct {
+    size_t at;
+    const char* data;
+    size_t len;
+} OutRef;
+
+/**
+ * @struct OutRefs
+ * @brief The OutRef entries of one output buffer, oldest first
+ *
+ * @member items Entries
+ * @member count Entries in use
+ * @member cap Allocated entries
+ * @member sent Bytes of items[0] already written
+ * @member bytes Unsent bytes over all entries
+ */
+typedef struct {
+    OutRef* items;
+    int count;
+    int cap;
+    size_t sent;
+    size_t bytes;
+} OutRefs;
+
+/**
+ * @struct HeldReply
+ * @brief A reply parked until it may go out (session_out_park())
+ *
+ * @member lsn Post log record it waits for, 0 if it only waits for order
+ * @member ordered 1 for the reply of an untagged command: it also waits
+ *         for every ordered reply parked before it
+ * @member data Copy of the reply, references included
+ * @member len Bytes in data
+ */
+typedef struct {
+    uint64_t lsn;
+    int ordered;
+    char* data;
+    size_t len;
+} HeldReply;
+
+/**
+ * @struct OutMark
+ * @brief Where a reply starts in the output, taken with session_out_mark()
+ *
+ * @member pending Unsent buffered bytes in front of the reply
+ * @member refs References in front of the reply
+ */
+typedef struct {
+    size_t pending;
+    int refs;
+} OutMark;
+
+/**
+ * @struct Session
+ * @brief Structure to store client session state with integrated buffer management
+ * 
+ * @member logged_in Flag indicating if user is authenticated (1 = logged in, 0 = not)
+ * @member username Dynamically allocated username (NULL if not logged in)
+ * @member sockfd Socket file descriptor for this client connection
+ * @member client_ip Client IP address in dotted-decimal notation
+ * @member client_port Client port number
+ * @member active Flag indicating if session is active (1 = active, 0 = disconnected)
+ * @member framer Splits the input into command lines, reading into rx_chunk
+ * @member rx_chunk Pool chunk currently receiving input (the session's reference)
+ * @member session_lock Mutex for protecting session state during command processing
+ * @member loop Event loop that owns this connection
+ * @member pending Command that did not fit in the work queue (chunk NULL if none)
+ * @member pending_recv_ns When the pending command was framed (metrics_now_ns())
+ * @member throttled 1 while reading is paused because the work queue is full
+ * @member throttled_at Index of the session in its loop's throttled list while throttled
+ * @member slot Index of this session in the session pool
+ * @member generation Current generation of the slot, bumped by session_create() and session_close()
+ * @member refs References held by the owning loop and by workers
+ * @member next_seq Sequence number for the next queued command (written by the loop thread)
+ * @member done_seq Sequence number of the next command allowed to run
+ * @member unordered Tagged commands queued or running; they take no
+ *         sequence number and run as soon as a worker has them
+ * @member order_cond Signalled when done_seq advances or the session closes
+ * @member out_lock Protects the output buffer (workers append, the loop sends)
+ * @member out_data Output buffer holding replies not yet written to the socket
+ * @member out_off Offset of the first unsent byte in out_data
+ * @member out_len Bytes used in out_data (unsent data is out_off .. out_len)
+ * @member out_cap Allocated size of out_data
+ * @member out_since_ns When the oldest unsent byte was appended
+ * @member out_refs Bytes interleaved with out_data that are sent from
+ *         where they are (session_out_append_ref())
+ * @member post_lsn Newest post log record of the session's POSTs (tagged
+ *         ones may finish out of order; protected by out_lock)
+ * @member held Replies parked until their record is durable or the
+ *         ordered replies before them went out, oldest first; out_data
+ *         itself is never held back (protected by out_lock)
+ * @member held_count Entries in use
+ * @member held_cap Allocated entries
+ * @member held_ordered Ordered entries among them
+ * @member held_bytes Bytes over all entries
+ * @member flush_queued 1 while the session is on its loop's flush list
+ * @member want_write 1 while the loop waits for POLLOUT (loop thread only)
+ * @member out_paused 1 while input is paused by the output high-water mark (loop thread only)
+ * @member interest Events currently registered for the socket (loop thread only)
+ * @member timer Timeout timer in the owning loop's wheel (loop thread only)
+ * @member accept_tick Loop tick at which the connection was accepted
+ * @member input_tick Loop tick of the last complete command received
+ * @member got_command 1 once the first complete command arrived
+ * @member got_login 1 once USER first succeeded (protected by session_lock)
+ * @member rx_stash Received bytes the framer had no room for yet (io_uring backend)
+ * @member rx_stash_off Offset of the first byte not yet given to the framer
+ * @member rx_stash_len Bytes used in rx_stash
+ * @member rx_stash_cap Allocated size of rx_stash
+ * @member rx_eof 1 once the peer closed its side (io_uring backend)
+ * @member recv_armed 1 while a multishot receive is in flight (io_uring backend)
+ * @member recv_cancel 1 while that receive is being cancelled to pause input
+ * @member tx_data Output handed to the kernel, swapped with out_data (io_uring backend)
+ * @member tx_off Offset of the first byte not yet sent from tx_data
+ * @member tx_len Bytes used in tx_data
+ * @member tx_cap Allocated size of tx_data
+ * @member tx_since_ns out_since_ns of the bytes in tx_data
+ * @member tx_refs out_refs of the bytes in tx_data
+ * @member tx_iov Vector of a send with references in flight (allocated on first use)
+ * @member tx_msg Message header of that send (IORING_OP_SENDMSG)
+ * @member send_armed 1 while a send of tx_data is in flight (io_uring backend)
+ * @member work_home Worker the session's commands are queued on (loop thread only)
+ * @member work_home_active Pool size work_home was picked for (0 = not picked yet)
+ * @member handed_off 1 once passed to a successor process on a hot upgrade,
+ *         kept unregistered until the successor confirms (loop thread only)
+ * 
+ * @note In this event-driven architecture, each session manages its own receive buffer
+ * @note Sessions live in pool slots that are recycled, never freed, so a
+ *       stale reference can always be checked against the generation
+ */
+typedef struct {
+    int logged_in;
+    char* username;
+    int sockfd;
+    char client_ip[INET_ADDRSTRLEN];
+    int client_port;
+    int active;
+    LineFramer framer;
+    BufferChunk* rx_chunk;
+    pthread_mutex_t session_lock;
+    EventLoop* loop;
+    BufferSlice pending;
+    uint64_t pending_recv_ns;
+    int throttled;
+    int throttled_at;
+    uint32_t slot;
+    atomic_uint generation;
+    atomic_int refs;
+    atomic_uint next_seq;
+    uint32_t done_seq;
+    atomic_uint unordered;
+    pthread_cond_t order_cond;
+    pthread_mutex_t out_lock;
+    char* out_data;
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+    uint64_t out_since_ns;
+    OutRefs out_refs;
+    uint64_t post_lsn;
+    HeldReply* held;
+    int held_count;
+    int held_cap;
+    int held_ordered;
+    size_t held_bytes;
+    atomic_int flush_queued;
+    int want_write;
+    int out_paused;
+    unsigned interest;
+    TimerNode timer;
+    uint64_t accept_tick;
+    uint64_t input_tick;
+    int got_command;
+    int got_login;
+    char* rx_stash;
+    size_t rx_stash_off;
+    size_t rx_stash_len;
+    size_t rx_stash_cap;
+    int rx_eof;
+    int recv_armed;
+    int recv_cancel;
+    char* tx_data;
+    size_t tx_off;
+    size_t tx_len;
+    size_t tx_cap;
+    uint64_t tx_since_ns;
+    OutRefs tx_refs;
+    struct iovec* tx_iov;
+    struct msghdr tx_msg;
+    int send_armed;
+    int work_home;
+    int work_home_active;
+    int handed_off;
+} Session;
+
+void session_set_max_line(size_t max_line);
+uint32_t session_pool_reserve(uint32_t count);
+Session* session_create(void);
+SessionHandle session_handle(Session* session);
+Session* session_acquire(SessionHandle handle);
+void session_release(Session* session);
+void session_close(Session* session);
+int session_rx_refill(Session* session);
+int session_rx_push(Session* session, const char* data, size_t len);
+int session_rx_next(Session* session, char** line, size_t* len);
+int session_out_append(Session* session, const char* data, size_t len);
+int session_out_append_ref(Session* session, const char* data, size_t len);
+int session_out_append_locked(Session* session, const char* data, size_t len);
+int session_out_append_ref_locked(Session* session, const char* data, size_t len);
+void session_out_mark(Session* session, OutMark* mark);
+void session_out_rollback(Session* session, const OutMark* mark);
+int session_out_park(Session* session, const OutMark* mark, uint64_t lsn, int ordered);
+int session_out_release(Session* session, uint64_t durable);
+size_t session_out_pending(Session* session);
+int out_refs_iov(const OutRefs* refs, const char* data, size_t off, size_t len,
+                 struct iovec* iov, int max);
+void out_refs_consume(OutRefs* refs, size_t* off, size_t n);
+char* out_refs_flatten(const OutRefs* refs, const char* data, size_t off, size_t len, size_t* total);
+
+#endif
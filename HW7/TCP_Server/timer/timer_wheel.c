@@ -0,0 +1,183 @@
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_BITS)
+#define MAX_DELTA ((1ull << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1)
+
+static void list_init(TimerNode* head){
+    head->prev = head;
+    head->next = head;
+}
+
+static void list_append(TimerNode* head, TimerNode* node){
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void list_unlink(TimerNode* node){
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+/**
+ * @function timer_wheel_init
+ * @brief Empty wheel whose clock starts at tick now
+ */
+void timer_wheel_init(TimerWheel* wheel, uint64_t now){
+    wheel->now = now;
+    wheel->count = 0;
+    for(int level = 0; level < TIMER_WHEEL_LEVELS; level++){
+        for(int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++){
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+/**
+ * @function timer_node_init
+ * @brief Mark a node as not armed
+ */
+void timer_node_init(TimerNode* node){
+    node->prev = NULL;
+    node->next = NULL;
+    node->expires = TIMER_NEVER;
+}
+
+int timer_node_armed(const TimerNode* node){
+    return node->prev != NULL;
+}
+
+/**
+ * @function place
+ * @brief Link a node into the slot matching its distance from now
+ */
+static void place(TimerWheel* wheel, TimerNode* node){
+    uint64_t delta = node->expires - wheel->now;
+    int level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1 && delta >> LEVEL_SHIFT(level + 1)){
+        level++;
+    }
+    int slot = (node->expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    list_append(&wheel->slots[level][slot], node);
+}
+
+/**
+ * @function timer_wheel_add
+ * @brief Arm (or re-arm) a timer
+ *
+ * @param wheel Wheel
+ * @param node Timer, armed or not
+ * @param expires Absolute tick; ticks not after wheel->now fire on the
+ *                next advance, ticks beyond the wheel's range are clamped
+ */
+void timer_wheel_add(TimerWheel* wheel, TimerNode* node, uint64_t expires){
+    if(timer_node_armed(node)) timer_wheel_cancel(wheel, node);
+
+    if(expires <= wheel->now) expires = wheel->now + 1;
+    if(expires - wheel->now > MAX_DELTA) expires = wheel->now + MAX_DELTA;
+    node->expires = expires;
+    place(wheel, node);
+    wheel->count++;
+}
+
+/**
+ * @function timer_wheel_cancel
+ * @brief Disarm a timer; a no-op if it is not armed
+ */
+void timer_wheel_cancel(TimerWheel* wheel, TimerNode* node){
+    if(!timer_node_armed(node)) return;
+    list_unlink(node);
+    wheel->count--;
+}
+
+/**
+ * @function cascade
+ * @brief Move every timer of one upper-level slot to the levels below
+ */
+static void cascade(TimerWheel* wheel, int level){
+    TimerNode* head = &wheel->slots[level][(wheel->now >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    TimerNode moved;
+    list_init(&moved);
+
+    if(head->next == head) return;
+    moved.next = head->next;
+    moved.prev = head->prev;
+    moved.next->prev = &moved;
+    moved.prev->next = &moved;
+    list_init(head);
+
+    while(moved.next != &moved){
+        TimerNode* node = moved.next;
+        list_unlink(node);
+        place(wheel, node);
+    }
+}
+
+/**
+ * @function timer_wheel_advance
+ * @brief Run the clock forward to tick now, firing what expires
+ *
+ * @param wheel Wheel
+ * @param now Current tick
+ * @param expire Called for each expired timer, already disarmed; it may
+ *               re-arm the node or arm and cancel others
+ * @param arg Passed to expire
+ * @return Number of timers fired
+ *
+ * @details
+ *  - Steps one tick at a time; at each wrap of a level the matching
+ *    slot of the level above is cascaded down
+ *  - With no timers armed the clock jumps straight to now
+ */
+size_t timer_wheel_advance(TimerWheel* wheel, uint64_t now, TimerCallback expire, void* arg){
+    size_t fired = 0;
+
+    while(wheel->now < now){
+        if(wheel->count == 0){
+            wheel->now = now;
+            break;
+        }
+
+        wheel->now++;
+        for(int level = 1; level < TIMER_WHEEL_LEVELS; level++){
+            if(wheel->now & ((1ull << LEVEL_SHIFT(level)) - 1)) break;
+            cascade(wheel, level);
+        }
+
+        TimerNode* head = &wheel->slots[0][wheel->now & SLOT_MASK];
+        while(head->next != head){
+            TimerNode* node = head->next;
+            list_unlink(node);
+            wheel->count--;
+            fired++;
+            expire(node, arg);
+        }
+    }
+    return fired;
+}
+
+/**
+ * @function timer_wheel_next_tick
+ * @brief Tick at which the loop should next call timer_wheel_advance()
+ *
+ * @return The first non-empty level-0 slot before the next level-0 wrap,
+ *         else the wrap itself (where upper levels cascade), or
+ *         TIMER_NEVER when no timer is armed
+ *
+ * @note Lets a loop with only far-off timers sleep until the next
+ *       cascade instead of waking every tick
+ */
+uint64_t timer_wheel_next_tick(const TimerWheel* wheel){
+    if(wheel->count == 0) return TIMER_NEVER;
+
+    uint64_t wrap = (wheel->now | SLOT_MASK) + 1;
+    for(uint64_t tick = wheel->now + 1; tick < wrap; tick++){
+        const TimerNode* head = &wheel->slots[0][tick & SLOT_MASK];
+        if(head->next != head) return tick;
+    }
+    return wrap;
+}
@@ -0,0 +1,57 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_NEVER UINT64_MAX
+
+/**
+ * @struct TimerNode
+ * @brief Timer embedded in the object it times (intrusive list link)
+ *
+ * @member prev Previous node in the slot list, NULL while not armed
+ * @member next Next node in the slot list
+ * @member expires Absolute tick at which the timer fires
+ */
+typedef struct TimerNode {
+    struct TimerNode* prev;
+    struct TimerNode* next;
+    uint64_t expires;
+} TimerNode;
+
+/**
+ * @struct TimerWheel
+ * @brief Hierarchical timing wheel
+ *
+ * @member now Last tick processed by timer_wheel_advance()
+ * @member count Number of armed timers
+ * @member slots Circular list heads; level l holds timers expiring
+ *               within TIMER_WHEEL_SLOTS^(l+1) ticks, slot by the
+ *               l-th group of TIMER_WHEEL_BITS bits of the expiry tick
+ *
+ * @note Arm and cancel are O(1). A timer is moved down one level each
+ *       time the level below wraps, so it is touched at most
+ *       TIMER_WHEEL_LEVELS times before it fires.
+ * @note Not thread-safe: one wheel per event loop, used by its thread.
+ */
+typedef struct {
+    uint64_t now;
+    size_t count;
+    TimerNode slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} TimerWheel;
+
+typedef void (*TimerCallback)(TimerNode* node, void* arg);
+
+void timer_wheel_init(TimerWheel* wheel, uint64_t now);
+void timer_node_init(TimerNode* node);
+int timer_node_armed(const TimerNode* node);
+void timer_wheel_add(TimerWheel* wheel, TimerNode* node, uint64_t expires);
+void timer_wheel_cancel(TimerWheel* wheel, TimerNode* node);
+size_t timer_wheel_advance(TimerWheel* wheel, uint64_t now, TimerCallback expire, void* arg);
+uint64_t timer_wheel_next_tick(const TimerWheel* wheel);
+
+#endif
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "upgrade.h"
+
+#define UPGRADE_MAX_PARTS 8
+
+/*
+ * Hot upgrade transport. The running server listens on a Unix
+ * SOCK_SEQPACKET socket; a new server process connects to it and
+ * receives the listening sockets and then the client connections, each
+ * as one message whose descriptor travels as SCM_RIGHTS ancillary data.
+ * Sequenced packets keep message boundaries, so a descriptor always
+ * arrives together with the state it belongs to.
+ */
+
+/**
+ * @function set_timeouts
+ * @brief Bound every send and receive on a handoff connection
+ *
+ * @note A stuck peer then fails the handoff instead of stalling an event loop
+ */
+static void set_timeouts(int fd){
+    struct timeval timeout = {
+        .tv_sec = UPGRADE_IO_TIMEOUT_MS / 1000,
+        .tv_usec = (UPGRADE_IO_TIMEOUT_MS % 1000) * 1000
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/**
+ * @function socket_address
+ * @brief Fill a sockaddr_un for path
+ *
+ * @return 0 on success, -1 with errno ENAMETOOLONG
+ */
+static int socket_address(struct sockaddr_un* addr, const char* path){
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * @function upgrade_listen
+ * @brief Listen for a successor process on a Unix socket
+ *
+ * @param path Socket path
+ * @return Listening descriptor, -1 on failure
+ *
+ * @note A file left at path is replaced: either a crashed server's
+ *       socket or the predecessor's, which has finished its handoff
+ */
+int upgrade_listen(const char* path){
+    struct sockaddr_un addr;
+    if(socket_address(&addr, path) == -1) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(fd == -1) return -1;
+
+    unlink(path);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1){
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @function upgrade_accept
+ * @brief Accept a successor's connection
+ *
+ * @return Connected descriptor with send/receive timeouts, -1 on failure
+ */
+int upgrade_accept(int listen_fd){
+    int fd;
+    do {
+        fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    } while(fd == -1 && errno == EINTR);
+    if(fd != -1) set_timeouts(fd);
+    return fd;
+}
+
+/**
+ * @function upgrade_connect
+ * @brief Ask the server listening at path to hand its connections over
+ *
+ * @return Connected descriptor, -1 on failure (errno ENOENT or
+ *         ECONNREFUSED when no server is running there)
+ */
+int upgrade_connect(const char* path){
+    struct sockaddr_un addr;
+    if(socket_address(&addr, path) == -1) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(fd == -1) return -1;
+
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1){
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    set_timeouts(fd);
+    return fd;
+}
+
+/**
+ * @function upgrade_send
+ * @brief Send one handoff message, optionally with a descriptor
+ *
+ * @param sock Handoff connection
+ * @param msg Fixed part; its length fields must add up to the parts
+ * @param parts Payload pieces, sent back to back without copying
+ * @param count Number of parts (at most UPGRADE_MAX_PARTS - 1)
+ * @param fd Descriptor to pass, -1 for none
+ * @return 0 on success, -1 on failure
+ *
+ * @note The descriptor is duplicated into the receiver; the caller
+ *       still owns (and eventually closes) its own copy
+ */
+int upgrade_send(int sock, const UpgradeMsg* msg, const struct iovec* parts, int count, int fd){
+    struct iovec iov[UPGRADE_MAX_PARTS];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr mh;
+
+    if(count > UPGRADE_MAX_PARTS - 1){
+        errno = EINVAL;
+        return -1;
+    }
+    iov[0].iov_base = (void*)msg;
+    iov[0].iov_len = sizeof(*msg);
+    for(int i = 0; i < count; i++) iov[i + 1] = parts[i];
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = count + 1;
+    if(fd >= 0){
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while(n == -1 && errno == EINTR);
+    return n == -1 ? -1 : 0;
+}
+
+/**
+ * @function upgrade_recv
+ * @brief Receive one handoff message
+ *
+ * @param sock Handoff connection
+ * @param msg Filled with the fixed part
+ * @param payload Filled with the payload
+ * @param cap Size of payload (UPGRADE_MAX_PAYLOAD)
+ * @param fd Set to the passed descriptor (close-on-exec), -1 if none
+ * @return Payload length, -1 on failure (errno ECONNRESET when the
+ *         sender went away, EPROTO on a malformed message)
+ */
+ssize_t upgrade_recv(int sock, UpgradeMsg* msg, char* payload, size_t cap, int* fd){
+    struct iovec iov[2];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr mh;
+
+    iov[0].iov_base = msg;
+    iov[0].iov_len = sizeof(*msg);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = cap;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while(n == -1 && errno == EINTR);
+
+    *fd = -1;
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)){
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if(n == 0){
+        errno = ECONNRESET;
+        return -1;
+    }
+    if(n == -1) return -1;
+
+    size_t len = (size_t)n - sizeof(*msg);
+    if((size_t)n < sizeof(*msg) || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+       (uint64_t)msg->name_len + msg->in_len + msg->out_len != len){
+        if(*fd >= 0) close(*fd);
+        *fd = -1;
+        errno = EPROTO;
+        return -1;
+    }
+    msg->client_ip[INET_ADDRSTRLEN - 1] = '\0';
+    return (ssize_t)len;
+}
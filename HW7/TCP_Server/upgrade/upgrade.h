@@ -0,0 +1,66 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#define UPGRADE_MAX_PAYLOAD 131072
+#define UPGRADE_IO_TIMEOUT_MS 5000
+
+/**
+ * @enum UpgradeType
+ * @brief Messages sent from the running server to its successor
+ *
+ * @member UPGRADE_HELLO Handoff accepted; count listening sockets follow
+ * @member UPGRADE_LISTENER One listening socket (attached descriptor)
+ * @member UPGRADE_SESSION One client connection (attached descriptor) and its state
+ * @member UPGRADE_DONE Every connection has been handed off; the receiver
+ *         echoes it back and the sender exits
+ */
+typedef enum {
+    UPGRADE_HELLO = 1,
+    UPGRADE_LISTENER,
+    UPGRADE_SESSION,
+    UPGRADE_DONE
+} UpgradeType;
+
+/**
+ * @struct UpgradeMsg
+ * @brief Fixed part of a handoff message, followed by name_len + in_len + out_len payload bytes
+ *
+ * @member type UpgradeType
+ * @member count Listeners that follow (UPGRADE_HELLO)
+ * @member logged_in Session state (UPGRADE_SESSION)
+ * @member got_command 1 once the client sent a complete command
+ * @member got_login 1 once USER succeeded on the connection
+ * @member framing LineFramerMode of the connection (still
+ *         LINE_FRAMER_DETECT if the client has not sent a byte yet)
+ * @member client_port Peer port
+ * @member client_ip Peer address in dotted-decimal notation
+ * @member name_len Length of the username (0 if not logged in)
+ * @member in_len Received bytes not yet framed into commands
+ * @member out_len Reply bytes not yet written to the socket
+ */
+typedef struct {
+    uint32_t type;
+    uint32_t count;
+    int32_t logged_in;
+    int32_t got_command;
+    int32_t got_login;
+    int32_t framing;
+    int32_t client_port;
+    char client_ip[INET_ADDRSTRLEN];
+    uint32_t name_len;
+    uint32_t in_len;
+    uint32_t out_len;
+} UpgradeMsg;
+
+int upgrade_listen(const char* path);
+int upgrade_accept(int listen_fd);
+int upgrade_connect(const char* path);
+int upgrade_send(int sock, const UpgradeMsg* msg, const struct iovec* parts, int count, int fd);
+ssize_t upgrade_recv(int sock, UpgradeMsg* msg, char* payload, size_t cap, int* fd);
+
+#endif
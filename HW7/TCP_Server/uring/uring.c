@@ -0,0 +1,344 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/*
+ * No liburing: the three io_uring system calls are made directly and the
+ * shared rings are read and written with acquire/release atomics, the
+ * same protocol liburing follows.
+ */
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p){
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, void* arg, size_t argsz){
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args){
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * @function uring_init
+ * @brief Create a ring and map its queues
+ *
+ * @param ring Ring to initialize
+ * @param entries SQ size (rounded up to a power of two by the kernel)
+ * @param cq_entries CQ size; multishot requests post many completions
+ *                   per submission, so it is sized well above entries
+ * @return 0 on success, -1 with errno set (ENOSYS when the kernel lacks
+ *         a feature the server relies on)
+ *
+ * @details
+ *  - Asks for SINGLE_ISSUER | DEFER_TASKRUN (completion work runs only
+ *    when the loop waits, on its own thread) and retries without them
+ *    on kernels that predate them
+ *  - Such a ring is created disabled: the thread that calls
+ *    uring_enable() becomes its only submitter
+ *  - Requires IORING_FEAT_SINGLE_MMAP, NODROP (a full CQ is not lost)
+ *    and EXT_ARG (a timeout on io_uring_enter() for the timer wheel)
+ */
+int uring_init(Uring* ring, unsigned entries, unsigned cq_entries){
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+              IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED;
+    p.cq_entries = cq_entries;
+    ring->fd = sys_io_uring_setup(entries, &p);
+    ring->disabled = ring->fd != -1;
+    if(ring->fd == -1 && errno == EINVAL){
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+        ring->fd = sys_io_uring_setup(entries, &p);
+    }
+    if(ring->fd == -1) return -1;
+
+    unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if((p.features & required) != required){
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->ring_ptr == MAP_FAILED){
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED){
+        munmap(ring->ring_ptr, ring->ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char* base = ring->ring_ptr;
+    ring->sq_head = (unsigned*)(base + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(base + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(base + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(base + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned*)(base + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(base + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(base + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+
+    /* SQ slot i always submits sqes[i], so entries are filled in place */
+    for(unsigned i = 0; i < p.sq_entries; i++) ring->sq_array[i] = i;
+    return 0;
+}
+
+/**
+ * @function uring_enable
+ * @brief Start a ring created disabled, owned by the calling thread from now on
+ *
+ * @return 0 on success (or if the ring was never disabled), -1 with errno set
+ */
+int uring_enable(Uring* ring){
+    if(!ring->disabled) return 0;
+    if(sys_io_uring_register(ring->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) == -1) return -1;
+    ring->disabled = 0;
+    return 0;
+}
+
+/**
+ * @function uring_exit
+ * @brief Unmap the queues and provided buffers and close the ring
+ */
+void uring_exit(Uring* ring){
+    if(ring->buf_base){
+        munmap(ring->buf_base, (size_t)ring->buf_count * ring->buf_size);
+        munmap(ring->buf_ring, ring->buf_count * sizeof(struct io_uring_buf));
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/**
+ * @function uring_setup_buffers
+ * @brief Register a ring of provided buffers for multishot receives
+ *
+ * @param ring Ring
+ * @param bgid Buffer group id named by uring_prep_recv_multishot()
+ * @param count Number of buffers, a power of two
+ * @param size Bytes per buffer
+ * @return 0 on success, -1 with errno set
+ *
+ * @note The kernel picks a buffer per completion; the owner hands it
+ *       back with uring_recycle_buffer() once the bytes are consumed
+ */
+int uring_setup_buffers(Uring* ring, uint16_t bgid, unsigned count, unsigned size){
+    size_t ring_bytes = count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buf_ring == MAP_FAILED) return -1;
+
+    ring->buf_base = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buf_base == MAP_FAILED){
+        munmap(ring->buf_ring, ring_bytes);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+    if(sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1){
+        munmap(ring->buf_base, (size_t)count * size);
+        munmap(ring->buf_ring, ring_bytes);
+        return -1;
+    }
+
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_tail = 0;
+    ring->bgid = bgid;
+    for(unsigned bid = 0; bid < count; bid++) uring_recycle_buffer(ring, bid);
+    return 0;
+}
+
+char* uring_buffer(Uring* ring, unsigned bid){
+    return ring->buf_base + (size_t)bid * ring->buf_size;
+}
+
+/**
+ * @function uring_recycle_buffer
+ * @brief Hand a provided buffer back to the kernel
+ */
+void uring_recycle_buffer(Uring* ring, unsigned bid){
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * @function uring_get_sqe
+ * @brief Next free submission entry, zeroed
+ *
+ * @return Entry to fill, NULL only if the SQ is full and cannot be submitted
+ *
+ * @note A full SQ is submitted on the spot, so a loop can queue any
+ *       number of requests while handling one batch of completions
+ */
+struct io_uring_sqe* uring_get_sqe(Uring* ring){
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if(ring->sqe_tail - head >= ring->sq_entries){
+        if(uring_submit(ring) == -1) return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if(ring->sqe_tail - head >= ring->sq_entries){
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/**
+ * @function flush_sq
+ * @brief Publish queued entries to the kernel and count them
+ */
+static unsigned flush_sq(Uring* ring){
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    return ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @function uring_submit
+ * @brief Submit queued entries without waiting
+ *
+ * @return Number of entries submitted, -1 with errno set
+ */
+int uring_submit(Uring* ring){
+    unsigned pending = flush_sq(ring);
+    if(pending == 0) return 0;
+    return sys_io_uring_enter(ring->fd, pending, 0, 0, NULL, 0);
+}
+
+/**
+ * @function uring_submit_and_wait
+ * @brief Submit queued entries and wait for at least one completion
+ *
+ * @param ring Ring
+ * @param timeout_ms Longest wait, -1 to wait indefinitely
+ * @return Number of entries submitted, -1 with errno set (ETIME when the
+ *         timeout expired, EINTR on a signal)
+ *
+ * @note Submitting and waiting share one io_uring_enter(): replies queued
+ *       while handling the last batch leave with the next wait
+ */
+int uring_submit_and_wait(Uring* ring, int timeout_ms){
+    unsigned pending = flush_sq(ring);
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void* argp = NULL;
+    size_t argsz = 0;
+
+    if(timeout_ms >= 0){
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    return sys_io_uring_enter(ring->fd, pending, 1, flags, argp, argsz);
+}
+
+/**
+ * @function uring_peek_cqe
+ * @brief Oldest unconsumed completion, NULL if there is none
+ */
+struct io_uring_cqe* uring_peek_cqe(Uring* ring){
+    unsigned head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**
+ * @function uring_cqe_seen
+ * @brief Release the completion returned by uring_peek_cqe()
+ */
+void uring_cqe_seen(Uring* ring){
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe* sqe, int fd, uint64_t user_data){
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe* sqe, int fd, uint16_t bgid, uint64_t user_data){
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_send(struct io_uring_sqe* sqe, int fd, const void* buf, size_t len, uint64_t user_data){
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe* sqe, int fd, const struct msghdr* msg, uint64_t user_data){
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_read(struct io_uring_sqe* sqe, int fd, void* buf, size_t len, uint64_t user_data){
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t target, uint64_t user_data){
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
@@ -0,0 +1,81 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/**
+ * @struct Uring
+ * @brief io_uring instance driven through the raw system calls
+ *
+ * @member fd Ring file descriptor
+ * @member sq_head Kernel-owned SQ head (entries consumed)
+ * @member sq_tail SQ tail published to the kernel
+ * @member sq_mask SQ index mask
+ * @member sq_array SQ index array (slot i submits sqes[sq_array[i]])
+ * @member sqes Submission queue entries
+ * @member sq_entries Number of SQ entries
+ * @member sqe_tail Local SQ tail, ahead of *sq_tail by the unsubmitted entries
+ * @member cq_head CQ head published to the kernel
+ * @member cq_tail Kernel-owned CQ tail
+ * @member cq_mask CQ index mask
+ * @member cqes Completion queue entries
+ * @member ring_ptr Shared SQ/CQ ring mapping
+ * @member ring_size Size of ring_ptr
+ * @member sqes_size Size of the sqes mapping
+ * @member buf_ring Provided-buffer ring registered with uring_setup_buffers()
+ * @member buf_base Memory carved into the provided buffers
+ * @member buf_count Number of provided buffers (a power of two)
+ * @member buf_size Size of each provided buffer
+ * @member buf_tail Local buffer ring tail, published by uring_recycle_buffer()
+ * @member bgid Buffer group id of buf_ring
+ * @member disabled 1 until uring_enable() (rings created with SINGLE_ISSUER)
+ *
+ * @note Not thread-safe: one ring per event loop, used by its thread
+ */
+typedef struct {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring* buf_ring;
+    char* buf_base;
+    unsigned buf_count;
+    unsigned buf_size;
+    uint16_t buf_tail;
+    uint16_t bgid;
+    int disabled;
+} Uring;
+
+int uring_init(Uring* ring, unsigned entries, unsigned cq_entries);
+int uring_enable(Uring* ring);
+void uring_exit(Uring* ring);
+int uring_setup_buffers(Uring* ring, uint16_t bgid, unsigned count, unsigned size);
+struct io_uring_sqe* uring_get_sqe(Uring* ring);
+int uring_submit(Uring* ring);
+int uring_submit_and_wait(Uring* ring, int timeout_ms);
+struct io_uring_cqe* uring_peek_cqe(Uring* ring);
+void uring_cqe_seen(Uring* ring);
+char* uring_buffer(Uring* ring, unsigned bid);
+void uring_recycle_buffer(Uring* ring, unsigned bid);
+
+void uring_prep_accept_multishot(struct io_uring_sqe* sqe, int fd, uint64_t user_data);
+void uring_prep_recv_multishot(struct io_uring_sqe* sqe, int fd, uint16_t bgid, uint64_t user_data);
+void uring_prep_send(struct io_uring_sqe* sqe, int fd, const void* buf, size_t len, uint64_t user_data);
+void uring_prep_sendmsg(struct io_uring_sqe* sqe, int fd, const struct msghdr* msg, uint64_t user_data);
+void uring_prep_read(struct io_uring_sqe* sqe, int fd, void* buf, size_t len, uint64_t user_data);
+void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t target, uint64_t user_data);
+
+#endif
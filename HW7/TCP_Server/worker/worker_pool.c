@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#include "worker_pool.h"
+#include "../log/log.h"
+
+/* Worker running on the calling thread (NULL outside the pool) */
+static _Thread_local Worker* current_worker;
+
+/**
+ * @function now_ns
+ * @brief Monotonic clock in nanoseconds
+ */
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @function steal_work
+ * @brief Try to take one item from another worker's run queue
+ *
+ * @param self Idle worker
+ * @param item Destination buffer
+ * @return 0 if an item was stolen, -1 if every other queue is empty
+ *
+ * @details
+ *  - Victims are scanned round-robin starting after self, so thieves
+ *    spread over different queues
+ *  - Retired workers are scanned too, which helps them drain what was
+ *    queued on them before they were retired
+ *  - With a steal filter only an item the filter accepts is taken from
+ *    the head of a victim's queue; otherwise the next victim is tried
+ */
+static int steal_work(Worker* self, void* item){
+    WorkerPool* pool = self->pool;
+    int started = atomic_load_explicit(&pool->started, memory_order_acquire);
+
+    for(int i = 1; i < started; i++){
+        Worker* victim = &pool->workers[(self->id + i) % started];
+        if(pool->steal_filter){
+            if(mpmc_queue_try_pop_if(&victim->queue, item, pool->steal_filter) == 0) return 0;
+        } else if(mpmc_queue_try_pop(&victim->queue, item) == 0){
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @function worker_main
+ * @brief Worker loop: local queue first, then steal, then sleep
+ *
+ * @details
+ *  - Every push to the local queue posts wake, so a push that races
+ *    with going to sleep is never missed
+ *  - While sleeping the worker's idle bit is set; a producer that finds
+ *    a backlog on another queue clears the bit and wakes it to steal
+ *  - A retired worker (id >= active_workers) only drains its own queue
+ *    and neither steals nor advertises itself as idle; the scaler posts
+ *    wake when it is activated again
+ */
+static void* worker_main(void* arg){
+    Worker* self = arg;
+    WorkerPool* pool = self->pool;
+    unsigned long long bit = 1ULL << self->id;
+    void* item = malloc(pool->item_size);
+
+    if(!item){
+        perror("worker item buffer");
+        return NULL;
+    }
+    current_worker = self;
+
+    while(1){
+        int active = self->id < atomic_load_explicit(&pool->active_workers, memory_order_acquire);
+
+        if(mpmc_queue_try_pop(&self->queue, item) == 0 || (active && steal_work(self, item) == 0)){
+            uint64_t start_ns = now_ns();
+            pool->handler(item);
+            atomic_fetch_add_explicit(&self->busy_ns, now_ns() - start_ns, memory_order_relaxed);
+            continue;
+        }
+
+        if(active) atomic_fetch_or(&pool->idle_mask, bit);
+        while(sem_wait(&self->wake) == -1 && errno == EINTR);
+        atomic_fetch_and(&pool->idle_mask, ~bit);
+    }
+    return NULL;
+}
+
+/**
+ * @function start_worker
+ * @brief Create the thread of the next unstarted worker
+ *
+ * @return 0 on success, -1 if pthread_create() failed
+ *
+ * @note Called by worker_pool_start() and then only by the scaler thread
+ */
+static int start_worker(WorkerPool* pool){
+    int id = atomic_load(&pool->started);
+    Worker* w = &pool->workers[id];
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pool->has_cpus && pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &pool->cpus) != 0){
+        LOG(LOG_WARN, "[SCALE] Could not pin worker %d to the requested CPUs", id);
+    }
+    int err = pthread_create(&w->thread, &attr, worker_main, w);
+    pthread_attr_destroy(&attr);
+    if(err != 0) return -1;
+
+    atomic_store_explicit(&pool->started, id + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * @function worker_pool_init
+ * @brief Allocate workers and their run queues
+ *
+ * @param pool Pool to initialize
+ * @param min_workers Workers started by worker_pool_start() (1 .. max_workers)
+ * @param max_workers Most workers the pool may grow to (.. MAX_WORKERS)
+ * @param total_capacity Total queued items, split evenly across max_workers
+ * @param item_size Size of one item in bytes
+ * @param handler Function run for every item
+ * @return 0 on success, -1 on failure
+ *
+ * @note Queues for all max_workers are allocated here, so growing the
+ *       pool later only creates a thread
+ */
+int worker_pool_init(WorkerPool* pool, int min_workers, int max_workers, size_t total_capacity,
+                     size_t item_size, WorkHandler handler){
+    if(min_workers < 1 || max_workers < min_workers || max_workers > MAX_WORKERS) return -1;
+
+    size_t per_worker = total_capacity / max_workers;
+    if(per_worker < 2) per_worker = 2;
+
+    pool->workers = calloc(max_workers, sizeof(Worker));
+    if(!pool->workers) return -1;
+    pool->min_workers = min_workers;
+    pool->max_workers = max_workers;
+    pool->item_size = item_size;
+    pool->handler = handler;
+    pool->steal_filter = NULL;
+    pool->has_cpus = 0;
+    pool->target_ns = 0;
+    pool->interval_ms = 0;
+    atomic_init(&pool->started, 0);
+    atomic_init(&pool->active_workers, min_workers);
+    atomic_init(&pool->idle_mask, 0);
+
+    for(int i = 0; i < max_workers; i++){
+        Worker* w = &pool->workers[i];
+        w->id = i;
+        w->pool = pool;
+        atomic_init(&w->wait_ns, 0);
+        atomic_init(&w->waits, 0);
+        atomic_init(&w->busy_ns, 0);
+        if(mpmc_queue_init(&w->queue, per_worker, item_size) == -1 ||
+           sem_init(&w->wake, 0, 0) == -1){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @function worker_pool_set_affinity
+ * @brief Restrict worker threads to a set of CPUs
+ *
+ * @param pool Worker pool
+ * @param cpus CPUs the workers may run on, NULL to clear
+ *
+ * @note Applies to workers started afterwards; call before worker_pool_start()
+ */
+void worker_pool_set_affinity(WorkerPool* pool, const cpu_set_t* cpus){
+    pool->has_cpus = cpus != NULL;
+    if(cpus) pool->cpus = *cpus;
+}
+
+/**
+ * @function worker_pool_set_steal_filter
+ * @brief Limit work stealing to the items a filter accepts
+ *
+ * @param pool Worker pool
+ * @param filter Called with an item at the head of another worker's
+ *        queue; nonzero lets an idle worker take it. NULL steals anything
+ *
+ * @note Call before worker_pool_start(); items refused to thieves are
+ *       run by their home worker
+ */
+void worker_pool_set_steal_filter(WorkerPool* pool, WorkFilter filter){
+    pool->steal_filter = filter;
+}
+
+/**
+ * @function worker_pool_start
+ * @brief Start one detached thread for each of the min_workers workers
+ */
+int worker_pool_start(WorkerPool* pool){
+    for(int i = 0; i < pool->min_workers; i++){
+        if(start_worker(pool) == -1) return -1;
+    }
+    return 0;
+}
+
+/**
+ * @function scale_to
+ * @brief Grow or shrink the active worker set by one
+ *
+ * @param pool Worker pool
+ * @param active New number of active workers
+ * @return 0 on success, -1 if a needed thread could not be started
+ *
+ * @details
+ *  - Growing starts the worker's thread the first time it is needed,
+ *    then posts its wake so it starts stealing right away
+ *  - Shrinking only lowers active_workers: new items stop being homed on
+ *    the retired worker, which finishes its own queue and goes to sleep
+ */
+static int scale_to(WorkerPool* pool, int active){
+    int grow = active > atomic_load(&pool->active_workers);
+
+    if(active > atomic_load(&pool->started) && start_worker(pool) == -1) return -1;
+    atomic_store_explicit(&pool->active_workers, active, memory_order_release);
+    if(grow) sem_post(&pool->workers[active - 1].wake);
+    return 0;
+}
+
+/**
+ * @function scaler_main
+ * @brief Autoscaler loop: resize the pool from the measured queue wait
+ *
+ * @details Every interval_ms the per-worker counters are sampled and
+ *  - one worker is added when the mean queue wait exceeds target_ns
+ *  - one worker is retired after SCALE_DOWN_INTERVALS consecutive
+ *    intervals in which the mean wait stayed under a quarter of the
+ *    target and the others could have absorbed its load (busy time
+ *    below half of (active - 1) workers' worth of the interval)
+ */
+static void* scaler_main(void* arg){
+    WorkerPool* pool = arg;
+    uint64_t last_wait[MAX_WORKERS] = {0};
+    uint64_t last_waits[MAX_WORKERS] = {0};
+    uint64_t last_busy[MAX_WORKERS] = {0};
+    uint64_t last_ns = now_ns();
+    int quiet = 0;
+    struct timespec interval = {
+        .tv_sec = pool->interval_ms / 1000,
+        .tv_nsec = (long)(pool->interval_ms % 1000) * 1000000L
+    };
+
+    while(1){
+        nanosleep(&interval, NULL);
+
+        uint64_t now = now_ns();
+        uint64_t elapsed = now - last_ns;
+        uint64_t wait = 0, waits = 0, busy = 0;
+        int started = atomic_load(&pool->started);
+        last_ns = now;
+
+        for(int i = 0; i < started; i++){
+            Worker* w = &pool->workers[i];
+            uint64_t v;
+            v = atomic_load_explicit(&w->wait_ns, memory_order_relaxed);
+            wait += v - last_wait[i];
+            last_wait[i] = v;
+            v = atomic_load_explicit(&w->waits, memory_order_relaxed);
+            waits += v - last_waits[i];
+            last_waits[i] = v;
+            v = atomic_load_explicit(&w->busy_ns, memory_order_relaxed);
+            busy += v - last_busy[i];
+            last_busy[i] = v;
+        }
+
+        int active = atomic_load(&pool->active_workers);
+        uint64_t mean = waits ? wait / waits : 0;
+
+        if(mean > pool->target_ns && active < pool->max_workers){
+            quiet = 0;
+            if(scale_to(pool, active + 1) == -1){
+                LOG(LOG_WARN, "[SCALE] Could not start worker %d: %s", active, strerror(errno));
+                continue;
+            }
+            LOG(LOG_INFO, "[SCALE] workers %d -> %d [mean queue wait %llu us, %llu items]",
+                active, active + 1, (unsigned long long)mean / 1000, (unsigned long long)waits);
+        } else if(mean < pool->target_ns / 4 && active > pool->min_workers &&
+                  busy < (uint64_t)(active - 1) * elapsed / 2){
+            if(++quiet < SCALE_DOWN_INTERVALS) continue;
+            quiet = 0;
+            scale_to(pool, active - 1);
+            LOG(LOG_INFO, "[SCALE] workers %d -> %d [mean queue wait %llu us, busy %llu%%]",
+                active, active - 1, (unsigned long long)mean / 1000,
+                (unsigned long long)(busy * 100 / (elapsed * active)));
+        } else {
+            quiet = 0;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @function worker_pool_autoscale
+ * @brief Start the scaler thread that resizes the pool between its bounds
+ *
+ * @param pool Started worker pool
+ * @param target_ns Mean queue wait the scaler tries to stay under
+ * @param interval_ms How often the scaler samples and decides
+ * @return 0 on success (or if min_workers == max_workers, nothing to do),
+ *         -1 if the thread could not be created
+ *
+ * @note Queue waits are only known if the handler reports them with
+ *       worker_pool_note_wait()
+ */
+int worker_pool_autoscale(WorkerPool* pool, uint64_t target_ns, unsigned interval_ms){
+    if(pool->min_workers == pool->max_workers) return 0;
+
+    pool->target_ns = target_ns;
+    pool->interval_ms = interval_ms ? interval_ms : 1;
+    if(pthread_create(&pool->scaler, NULL, scaler_main, pool) != 0) return -1;
+    pthread_detach(pool->scaler);
+    return 0;
+}
+
+/**
+ * @function worker_pool_submit
+ * @brief Push an item to the run queue of a worker
+ *
+ * @param pool Worker pool
+ * @param home Worker index; new work belongs on the first
+ *             worker_pool_active() workers
+ * @param item Item to copy into the queue
+ * @return 0 if queued, -1 if the home queue is full
+ *
+ * @details
+ *  - Posts the home worker's semaphore, so even a retired home worker
+ *    runs the item
+ *  - If the home queue already had a backlog and some other active
+ *    worker is idle, that worker is woken as well so it can steal
+ */
+int worker_pool_submit(WorkerPool* pool, int home, const void* item){
+    Worker* w = &pool->workers[home];
+
+    if(mpmc_queue_try_push(&w->queue, item) == -1) return -1;
+    sem_post(&w->wake);
+
+    if(mpmc_queue_size(&w->queue) > 1){
+        int active = atomic_load_explicit(&pool->active_workers, memory_order_relaxed);
+        unsigned long long mask = active >= 64 ? ~0ULL : (1ULL << active) - 1;
+        unsigned long long idle = atomic_load(&pool->idle_mask) & mask & ~(1ULL << home);
+        while(idle){
+            int thief = __builtin_ctzll(idle);
+            unsigned long long bit = 1ULL << thief;
+            if(atomic_fetch_and(&pool->idle_mask, ~bit) & bit){
+                sem_post(&pool->workers[thief].wake);
+                break;
+            }
+            idle &= ~bit;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @function worker_pool_note_wait
+ * @brief Report how long the item being handled sat in its queue
+ *
+ * @param wait_ns Queue wait of the item
+ *
+ * @note Called from the handler; feeds the autoscaler. Does nothing when
+ *       called outside a worker thread
+ */
+void worker_pool_note_wait(uint64_t wait_ns){
+    Worker* w = current_worker;
+    if(!w) return;
+    atomic_fetch_add_explicit(&w->wait_ns, wait_ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->waits, 1, memory_order_relaxed);
+}
+
+/**
+ * @function worker_pool_has_room
+ * @brief Return 1 if the run queue of at least one of the given workers has free space
+ *
+ * @param pool Worker pool
+ * @param homes Bit i set to check worker i (the home passed to worker_pool_submit())
+ *
+ * @note Only the listed queues count: an item is never submitted to a
+ *       queue other than its home, so room elsewhere does not help it
+ */
+int worker_pool_has_room(WorkerPool* pool, unsigned long long homes){
+    while(homes){
+        int i = __builtin_ctzll(homes);
+        MpmcQueue* q = &pool->workers[i].queue;
+        if(mpmc_queue_size(q) < mpmc_queue_capacity(q)) return 1;
+        homes &= homes - 1;
+    }
+    return 0;
+}
+
+/**
+ * @function worker_pool_depth
+ * @brief Total number of queued items across all run queues (approximate)
+ */
+size_t worker_pool_depth(WorkerPool* pool){
+    size_t depth = 0;
+    int started = atomic_load_explicit(&pool->started, memory_order_acquire);
+    for(int i = 0; i < started; i++){
+        depth += mpmc_queue_size(&pool->workers[i].queue);
+    }
+    return depth;
+}
+
+/**
+ * @function worker_pool_active
+ * @brief Number of workers new items are currently homed on
+ */
+int worker_pool_active(WorkerPool* pool){
+    return atomic_load_explicit(&pool->active_workers, memory_order_relaxed);
+}
@@ -0,0 +1,95 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "../queue/mpmc_queue.h"
+
+#define MAX_WORKERS 64
+#define SCALE_DOWN_INTERVALS 4
+
+typedef void (*WorkHandler)(void* item);
+typedef int (*WorkFilter)(const void* item);
+
+typedef struct WorkerPool WorkerPool;
+
+/**
+ * @struct Worker
+ * @brief One pool thread with its own run queue
+ *
+ * @member id Worker index, also its bit in WorkerPool.idle_mask
+ * @member queue Local run queue; event loops push items homed here
+ * @member wake Posted when work is pushed to queue or a steal is requested
+ * @member thread Thread running worker_main() (once started)
+ * @member pool Back pointer to the pool
+ * @member wait_ns Sum of the queue waits reported with worker_pool_note_wait()
+ * @member waits Number of waits in wait_ns
+ * @member busy_ns Time spent in the handler
+ *
+ * @note The counters are only written by the worker itself and read by
+ *       the scaler, so they sit on their own cache line
+ */
+typedef struct {
+    int id;
+    MpmcQueue queue;
+    sem_t wake;
+    pthread_t thread;
+    WorkerPool* pool;
+    _Alignas(CACHE_LINE_SIZE) atomic_ullong wait_ns;
+    atomic_ullong waits;
+    atomic_ullong busy_ns;
+} Worker;
+
+/**
+ * @struct WorkerPool
+ * @brief Elastic set of workers with per-worker run queues and work stealing
+ *
+ * @member workers Worker array (max_workers entries, queues allocated up front)
+ * @member min_workers Fewest workers the scaler keeps active
+ * @member max_workers Most workers the scaler may activate
+ * @member item_size Size of one queued item
+ * @member handler Called by a worker for every item it runs
+ * @member steal_filter Items a worker may steal (NULL: any)
+ * @member cpus CPUs the worker threads may run on
+ * @member has_cpus 1 when cpus was set with worker_pool_set_affinity()
+ * @member scaler Thread running the autoscaler (worker_pool_autoscale())
+ * @member target_ns Mean queue wait above which the scaler adds a worker
+ * @member interval_ms How often the scaler decides
+ * @member started Number of worker threads created so far
+ * @member active_workers Workers that new items are homed on (a prefix of workers)
+ * @member idle_mask Bit i set while worker i is about to sleep
+ */
+struct WorkerPool {
+    Worker* workers;
+    int min_workers;
+    int max_workers;
+    size_t item_size;
+    WorkHandler handler;
+    WorkFilter steal_filter;
+    cpu_set_t cpus;
+    int has_cpus;
+    pthread_t scaler;
+    uint64_t target_ns;
+    unsigned interval_ms;
+    atomic_int started;
+    _Alignas(CACHE_LINE_SIZE) atomic_int active_workers;
+    _Alignas(CACHE_LINE_SIZE) atomic_ullong idle_mask;
+};
+
+int worker_pool_init(WorkerPool* pool, int min_workers, int max_workers, size_t total_capacity,
+                     size_t item_size, WorkHandler handler);
+void worker_pool_set_affinity(WorkerPool* pool, const cpu_set_t* cpus);
+void worker_pool_set_steal_filter(WorkerPool* pool, WorkFilter filter);
+int worker_pool_start(WorkerPool* pool);
+int worker_pool_autoscale(WorkerPool* pool, uint64_t target_ns, unsigned interval_ms);
+int worker_pool_submit(WorkerPool* pool, int home, const void* item);
+void worker_pool_note_wait(uint64_t wait_ns);
+int worker_pool_has_room(WorkerPool* pool, unsigned long long homes);
+size_t worker_pool_depth(WorkerPool* pool);
+int worker_pool_active(WorkerPool* pool);
+
+#endif
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "TCP_Server/protocol/bin_protocol.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_USER "admin"
+#define RECV_TIMEOUT_MS 3000
+#define MAX_REPLY 1024
+
+/*
+ * Protocol checks against a running server (start it with a long group
+ * commit delay, e.g. ./server -P posts,200000 5500, so a POST's reply
+ * visibly waits for its commit):
+ *  - a tagged command sent after a POST is answered before the POST's
+ *    120, while an untagged one still comes after it
+ *  - a binary POST with a BIN_MAX_PAYLOAD article is accepted, one with
+ *    a byte more closes the connection
+ */
+
+struct sockaddr_in server_addr;
+const char* valid_user = DEFAULT_USER;
+int failures = 0;
+
+/**
+ * @function fail
+ * @brief Report a failed check
+ */
+void fail(const char* test, const char* what){
+    printf("%s test fail! %s\n", test, what);
+    failures++;
+}
+
+/**
+ * @function connect_server
+ * @brief Connect and consume the 100 greeting
+ *
+ * @return Socket with a receive timeout, -1 on error
+ */
+int connect_server(void){
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock == -1){
+        perror("socket() error");
+        return -1;
+    }
+
+    struct timeval tv = {RECV_TIMEOUT_MS / 1000, (RECV_TIMEOUT_MS % 1000) * 1000};
+    char greeting[5];
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+       connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1 ||
+       recv(sock, greeting, sizeof(greeting), MSG_WAITALL) != sizeof(greeting) ||
+       memcmp(greeting, "100\r\n", sizeof(greeting)) != 0){
+        perror("connect() error");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * @function send_all
+ * @brief send() until every byte is written
+ */
+int send_all(int sock, const char* data, size_t len){
+    while(len > 0){
+        ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @function recv_line
+ * @brief Read one text reply, delimiter stripped
+ *
+ * @return Line length, -1 on timeout, error or a closed connection
+ *
+ * @note Reads a byte at a time: replies are short and the test must not
+ *       consume bytes of the next one
+ */
+int recv_line(int sock, char* line, size_t size){
+    size_t len = 0;
+    while(len + 1 < size){
+        if(recv(sock, line + len, 1, 0) != 1) return -1;
+        len++;
+        if(len >= 2 && line[len - 2] == '\r' && line[len - 1] == '\n'){
+            line[len - 2] = '\0';
+            return (int)len - 2;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @function recv_frame
+ * @brief Read one binary reply; its payload is skipped
+ *
+ * @return 0 with the header filled in, -1 on timeout, error or close
+ */
+int recv_frame(int sock, BinHeader* header){
+    char data[BIN_HEADER_SIZE];
+    char skip[MAX_REPLY];
+
+    if(recv(sock, data, sizeof(data), MSG_WAITALL) != sizeof(data)) return -1;
+    bin_header_decode(data, header);
+    for(uint32_t left = header->length; left > 0;){
+        size_t n = left < sizeof(skip) ? left : sizeof(skip);
+        if(recv(sock, skip, n, MSG_WAITALL) != (ssize_t)n) return -1;
+        left -= n;
+    }
+    return 0;
+}
+
+/**
+ * @function send_frame
+ * @brief Send a binary request with a payload of len bytes
+ */
+int send_frame(int sock, uint8_t opcode, uint32_t id, const char* payload, uint32_t len){
+    char header[BIN_HEADER_SIZE];
+    bin_header_encode(header, opcode, 0, id, len);
+    if(send_all(sock, header, sizeof(header)) == -1) return -1;
+    return len ? send_all(sock, payload, len) : 0;
+}
+
+/**
+ * @function connection_closed
+ * @brief Whether the server closes the connection without replying
+ */
+int connection_closed(int sock){
+    char byte;
+    ssize_t n = recv(sock, &byte, 1, 0);
+    return n == 0 || (n == -1 && (errno == ECONNRESET || errno == EPIPE));
+}
+
+/**
+ * @function test_tagged_reply
+ * @brief A tagged reply must not wait behind a POST that awaits its commit
+ *
+ * @details Sends POST, "#t GET 0" and "GET 0" in one segment. The POST's
+ *          120 is held until the group commit; the tagged 240 overtakes
+ *          it and the untagged 240 keeps its place behind it
+ */
+void test_tagged_reply(void){
+    char request[256];
+    char line[MAX_REPLY];
+    int sock = connect_server();
+    if(sock == -1){
+        fail("Tagged reply", "cannot connect");
+        return;
+    }
+
+    snprintf(request, sizeof(request), "USER %s\r\n", valid_user);
+    if(send_all(sock, request, strlen(request)) == -1 || recv_line(sock, line, sizeof(line)) == -1 ||
+       strcmp(line, "110") != 0){
+        fail("Tagged reply", "USER was not accepted (use -u with a valid account)");
+        close(sock);
+        return;
+    }
+
+    const char* pipeline = "POST tagged reply test\r\n#t GET 0\r\nGET 0\r\n";
+    const char* expected[] = {"#t 240", "120", "240"};
+    if(send_all(sock, pipeline, strlen(pipeline)) == -1){
+        fail("Tagged reply", "send() failed");
+        close(sock);
+        return;
+    }
+    for(int i = 0; i < 3; i++){
+        if(recv_line(sock, line, sizeof(line)) == -1){
+            fail("Tagged reply", "reply missing");
+            break;
+        }
+        if(strncmp(line, expected[i], strlen(expected[i])) != 0){
+            printf("  reply %d: \"%s\", expected \"%s...\"\n", i + 1, line, expected[i]);
+            fail("Tagged reply", "replies out of order (is the server's -P delay long enough?)");
+            break;
+        }
+    }
+    close(sock);
+}
+
+/**
+ * @function test_binary_frame_limit
+ * @brief Frames up to BIN_MAX_PAYLOAD are served, longer ones close the connection
+ */
+void test_binary_frame_limit(void){
+    BinHeader reply;
+    char* article = malloc(BIN_MAX_PAYLOAD + 1);
+    if(!article){
+        fail("Binary frame", "out of memory");
+        return;
+    }
+    memset(article, 'a', BIN_MAX_PAYLOAD + 1);
+
+    int sock = connect_server();
+    if(sock == -1){
+        fail("Binary frame", "cannot connect");
+    } else {
+        if(send_frame(sock, BIN_OP_USER, 1, valid_user, strlen(valid_user)) == -1 ||
+           recv_frame(sock, &reply) == -1 || reply.flags != 110){
+            fail("Binary frame", "USER was not accepted (use -u with a valid account)");
+        } else if(send_frame(sock, BIN_OP_POST, 2, article, BIN_MAX_PAYLOAD) == -1 ||
+                  recv_frame(sock, &reply) == -1 || reply.id != 2 || reply.flags != 120){
+            fail("Binary frame", "POST of BIN_MAX_PAYLOAD bytes was not accepted");
+        }
+        close(sock);
+    }
+
+    sock = connect_server();
+    if(sock == -1){
+        fail("Binary frame", "cannot connect");
+    } else {
+        send_frame(sock, BIN_OP_POST, 3, article, BIN_MAX_PAYLOAD + 1);
+        if(!connection_closed(sock)){
+            fail("Binary frame", "oversized frame did not close the connection");
+        }
+        close(sock);
+    }
+    free(article);
+}
+
+void print_usage(){
+    printf("Usage: ./protocol_test [-H host] [-u user] Port_Number\n");
+    printf("  -H  server address (default %s)\n", DEFAULT_HOST);
+    printf("  -u  valid account (default %s)\n", DEFAULT_USER);
+    printf("  Start the server with a long commit delay, e.g. -P posts,200000\n");
+}
+
+int main(int argc, char* argv[]){
+    const char* host = DEFAULT_HOST;
+    int opt_char;
+
+    while((opt_char = getopt(argc, argv, "H:u:")) != -1){
+        switch(opt_char){
+            case 'H': host = optarg; break;
+            case 'u': valid_user = optarg; break;
+            default: print_usage(); return 1;
+        }
+    }
+    if(optind != argc - 1){
+        print_usage();
+        return 1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[optind]));
+    if(inet_pton(AF_INET, host, &server_addr.sin_addr) != 1){
+        print_usage();
+        return 1;
+    }
+
+    test_tagged_reply();
+    test_binary_frame_limit();
+
+    if(failures == 0) printf("All protocol tests passed\n");
+    return failures ? 1 : 0;
+}
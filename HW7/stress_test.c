@@ -1,154 +1,839 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <string.h>
-#include <unistd.h>
-#include <errno.h>
 
-#define SERVER_IP "127.0.0.1"
-#define BUFF_SIZE 2048
-#define MAX_TEST_CONNS 2000  // Test v?i 2000 k?t n?i!
+#include "framer/line_framer.h"
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        printf("Usage: %s <server_port>\n", argv[1]);
-        return 1;
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_CONNECTIONS 100
+#define DEFAULT_DURATION 10
+#define DEFAULT_MIX "post=80,user=10,bad=5,bye=5"
+#define DEFAULT_USER "admin"
+#define MAX_THREADS 64
+#define MAX_DEPTH 1024
+#define OPEN_LOOP_BACKLOG 256
+#define MAX_EVENTS 256
+#define MAX_REPLY_LINE 1024
+#define MAX_REQUEST_LEN 64
+#define CONNECT_TIMEOUT_MS 10000
+#define CONNECT_BATCH 32
+#define HIST_SUB_BUCKETS 16
+#define HIST_MAX_MSB 39
+#define HIST_BUCKETS ((HIST_MAX_MSB - 3) * HIST_SUB_BUCKETS + HIST_SUB_BUCKETS)
+#define CODE_SLOTS 1000
+
+/**
+ * @enum RequestType
+ * @brief Commands the generator sends, picked at random by weight
+ */
+typedef enum {
+    REQ_USER,       /* USER with the configured valid account */
+    REQ_BAD_USER,   /* USER with an account that does not exist */
+    REQ_POST,
+    REQ_BYE,
+    REQ_TYPE_COUNT
+} RequestType;
+
+typedef enum {
+    CONN_CONNECTING,
+    CONN_GREETING,
+    CONN_RUNNING,
+    CONN_CLOSED
+} ConnState;
+
+/**
+ * @struct Conn
+ * @brief One client connection driven by a generator thread
+ *
+ * @member stamps Ring of request timestamps: [head, sent) are on the
+ *                wire awaiting replies, [sent, tail) are scheduled but
+ *                held back by the pipeline depth (open loop only)
+ * @member out Formatted requests not yet accepted by the socket
+ *
+ * @note Latency is measured from the timestamp in the ring to the recv()
+ *       that brought the reply. In open-loop mode the stamp is the time
+ *       the request was scheduled, not sent; a server that falls behind
+ *       is charged for the wait (no coordinated omission). In closed-loop
+ *       mode it is the time conn_pump() sent it
+ */
+typedef struct {
+    int fd;
+    ConnState state;
+    LineFramer framer;
+    uint64_t* stamps;
+    uint32_t ring_mask;
+    uint32_t head;
+    uint32_t sent;
+    uint32_t tail;
+    char* out;
+    size_t out_off;
+    size_t out_len;
+} Conn;
+
+/**
+ * @struct Stats
+ * @brief Counters and latency histogram of one thread, merged at the end
+ */
+typedef struct {
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t latency_sum;
+    uint64_t latency_max;
+    uint64_t sent;
+    uint64_t completed;
+    uint64_t dropped;
+    uint64_t unanswered;
+    uint64_t connected;
+    uint64_t rejected;
+    uint64_t connect_failed;
+    uint64_t disconnects;
+    uint64_t codes[CODE_SLOTS];
+    uint64_t other_replies;
+    uint64_t connect_start_ns;
+    uint64_t connect_end_ns;
+} Stats;
+
+/**
+ * @struct Generator
+ * @brief A generator thread and the connections it owns
+ */
+typedef struct {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    Conn* conns;
+    int conn_count;
+    int running;
+    uint64_t rng;
+    uint64_t interval_ns;
+    uint64_t next_send_ns;
+    int next_conn;
+    Stats stats;
+} Generator;
+
+struct sockaddr_in server_addr;
+int num_connections = DEFAULT_CONNECTIONS;
+int num_threads = 0;
+int duration_s = DEFAULT_DURATION;
+int depth = 1;
+double rate = 0;
+const char* valid_user = DEFAULT_USER;
+const char* mix_spec = DEFAULT_MIX;
+const char* format = "text";
+int storm = 0;
+unsigned mix_weights[REQ_TYPE_COUNT];
+unsigned mix_total = 0;
+
+Generator generators[MAX_THREADS];
+pthread_barrier_t start_barrier;
+uint64_t run_start_ns;
+uint64_t run_end_ns;
+
+static const char* request_names[REQ_TYPE_COUNT] = {"user", "bad", "post", "bye"};
+
+uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* xorshift64*, one state per thread */
+uint64_t next_random(uint64_t* state){
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ull;
+}
+
+/**
+ * @function hist_index
+ * @brief Bucket of a latency in the log-linear (HDR-style) layout
+ *
+ * @note Same layout as the server's metrics histograms: 16 sub-buckets
+ *       per power of two, so a bucket is at most 6.25% wide
+ */
+int hist_index(uint64_t value){
+    if(value < HIST_SUB_BUCKETS) return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    if(msb > HIST_MAX_MSB) return HIST_BUCKETS - 1;
+    return (msb - 3) * HIST_SUB_BUCKETS + (int)((value >> (msb - 4)) & (HIST_SUB_BUCKETS - 1));
+}
+
+uint64_t hist_upper(int index){
+    if(index < HIST_SUB_BUCKETS) return (uint64_t)index + 1;
+    int group = index / HIST_SUB_BUCKETS;
+    int sub = index % HIST_SUB_BUCKETS;
+    return ((uint64_t)(HIST_SUB_BUCKETS + sub + 1)) << (group - 1);
+}
+
+/**
+ * @function hist_quantile
+ * @brief Upper edge of the bucket holding the q-th quantile, in ns
+ */
+uint64_t hist_quantile(const Stats* stats, double q){
+    if(stats->completed == 0) return 0;
+    uint64_t rank = (uint64_t)(q * stats->completed);
+    if(rank >= stats->completed) rank = stats->completed - 1;
+    uint64_t seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        seen += stats->hist[i];
+        if(seen > rank){
+            uint64_t upper = hist_upper(i);
+            return upper < stats->latency_max ? upper : stats->latency_max;
+        }
     }
+    return stats->latency_max;
+}
 
-    int serverPort = atoi(argv[1]);
-    struct sockaddr_in serverAddr;
-    int clients[MAX_TEST_CONNS];
-    int numConnected = 0;
-    int numRejected = 0;
-    char rBuff[BUFF_SIZE];
-    
-    bzero(&serverAddr, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(serverPort);
-    serverAddr.sin_addr.s_addr = inet_addr(SERVER_IP);
-
-    printf("=== STRESS TEST: Testing 1100 concurrent connections ===\n");
-    printf("Server: %s:%d\n", SERVER_IP, serverPort);
-    printf("Expected: First 1024 accepted, remaining rejected\n\n");
-
-    // T?o 1100 k?t n?i ? test gi?i h?n
-    for (int i = 0; i < MAX_TEST_CONNS; i++) {
-        clients[i] = socket(AF_INET, SOCK_STREAM, 0);
-        if (clients[i] == -1) {
-            perror("socket() error");
-            break;
-        }
-
-        // Set timeout ? trnh b? treo
-        struct timeval tv;
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        setsockopt(clients[i], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-        setsockopt(clients[i], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-
-        if (connect(clients[i], (struct sockaddr *)&serverAddr, sizeof(serverAddr)) == -1) {
-            printf("[%04d] Connect failed: %s\n", i+1, strerror(errno));
-            close(clients[i]);
-            clients[i] = -1;
-            break;
-        }
-
-        // Nh?n response t? server
-        int ret = recv(clients[i], rBuff, BUFF_SIZE, 0);
-        if (ret <= 0) {
-            printf("[%04d] No response from server\n", i+1);
-            close(clients[i]);
-            clients[i] = -1;
-            numRejected++;
-        } else {
-            rBuff[ret] = '\0';
-            
-            // Ki?m tra xem c b? reject khng
-            if (strstr(rBuff, "500") != NULL) {
-                printf("[%04d] REJECTED by server: %s", i+1, rBuff);
-                close(clients[i]);
-                clients[i] = -1;
-                numRejected++;
-            } else if (strstr(rBuff, "100") != NULL) {
-                numConnected++;
-                if ((i+1) % 100 == 0 || i < 10 || i >= MAX_TEST_CONNS - 10) {
-                    printf("[%04d] ACCEPTED: %s", i+1, rBuff);
+/**
+ * @function parse_mix
+ * @brief Parse "post=80,user=10,bad=5,bye=5" into mix_weights
+ *
+ * @return 0 on success, -1 on an unknown name or an all-zero mix
+ */
+int parse_mix(const char* spec){
+    char copy[256];
+    strncpy(copy, spec, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    memset(mix_weights, 0, sizeof(mix_weights));
+    mix_total = 0;
+
+    for(char* tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")){
+        char* eq = strchr(tok, '=');
+        if(!eq) return -1;
+        *eq = '\0';
+        int type = -1;
+        for(int i = 0; i < REQ_TYPE_COUNT; i++){
+            if(strcmp(tok, request_names[i]) == 0) type = i;
+        }
+        if(type == -1 || atoi(eq + 1) < 0) return -1;
+        mix_weights[type] = atoi(eq + 1);
+        mix_total += mix_weights[type];
+    }
+    return mix_total > 0 ? 0 : -1;
+}
+
+/**
+ * @function format_request
+ * @brief Write a random request of the configured mix into buf
+ *
+ * @return Number of bytes written
+ */
+int format_request(Generator* gen, char* buf){
+    unsigned pick = next_random(&gen->rng) % mix_total;
+    int type = 0;
+    while(pick >= mix_weights[type]){
+        pick -= mix_weights[type];
+        type++;
+    }
+
+    switch(type){
+        case REQ_USER:
+            return snprintf(buf, MAX_REQUEST_LEN, "USER %.40s\r\n", valid_user);
+        case REQ_BAD_USER:
+            return snprintf(buf, MAX_REQUEST_LEN, "USER nosuchuser%u\r\n",
+                            (unsigned)(next_random(&gen->rng) % 100000));
+        case REQ_POST:
+            return snprintf(buf, MAX_REQUEST_LEN, "POST load test message\r\n");
+        default:
+            return snprintf(buf, MAX_REQUEST_LEN, "BYE\r\n");
+    }
+}
+
+/**
+ * @function conn_close
+ * @brief Close a connection; requests still on the wire count as unanswered
+ */
+void conn_close(Generator* gen, Conn* conn){
+    if(conn->state == CONN_CLOSED) return;
+    if(conn->state == CONN_RUNNING){
+        gen->stats.unanswered += conn->sent - conn->head;
+        gen->running--;
+    }
+    close(conn->fd);
+    conn->fd = -1;
+    conn->state = CONN_CLOSED;
+}
+
+/**
+ * @function conn_pump
+ * @brief Put scheduled requests on the wire, up to the pipeline depth
+ *
+ * @return 0 if the connection is still usable, -1 if it was closed
+ *
+ * @details
+ *  - Requests in [sent, tail) are formatted into conn->out while fewer
+ *    than depth are awaiting replies, then out is written with one send()
+ *  - In closed-loop mode the requests formatted here are stamped with
+ *    the clock just before that send()
+ *  - Bytes the socket does not take stay in out until EPOLLOUT
+ */
+int conn_pump(Generator* gen, Conn* conn){
+    if(conn->out_off == conn->out_len){
+        conn->out_off = 0;
+        conn->out_len = 0;
+    }
+
+    uint32_t first = conn->sent;
+    while(conn->sent != conn->tail && conn->sent - conn->head < (uint32_t)depth){
+        if(conn->out_len + MAX_REQUEST_LEN > (size_t)depth * MAX_REQUEST_LEN){
+            memmove(conn->out, conn->out + conn->out_off, conn->out_len - conn->out_off);
+            conn->out_len -= conn->out_off;
+            conn->out_off = 0;
+        }
+        conn->out_len += format_request(gen, conn->out + conn->out_len);
+        conn->sent++;
+        gen->stats.sent++;
+    }
+    if(rate == 0 && first != conn->sent){
+        uint64_t send_ns = now_ns();
+        for(uint32_t i = first; i != conn->sent; i++){
+            conn->stamps[i & conn->ring_mask] = send_ns;
+        }
+    }
+
+    while(conn->out_off < conn->out_len){
+        ssize_t n = send(conn->fd, conn->out + conn->out_off,
+                         conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if(n > 0){
+            conn->out_off += n;
+            continue;
+        }
+        if(n == -1 && errno == EINTR) continue;
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        conn_close(gen, conn);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @function conn_schedule
+ * @brief Queue one request stamped with its intended send time
+ *
+ * @return 0 if queued, -1 if the connection's backlog is full
+ */
+int conn_schedule(Conn* conn, uint64_t stamp){
+    if(conn->tail - conn->head > conn->ring_mask) return -1;
+    conn->stamps[conn->tail & conn->ring_mask] = stamp;
+    conn->tail++;
+    return 0;
+}
+
+/**
+ * @function conn_top_up
+ * @brief Closed loop: keep depth requests outstanding on the connection
+ *
+ * @note now only decides whether the run is over; conn_pump() stamps
+ *       the requests when it sends them
+ */
+int conn_top_up(Generator* gen, Conn* conn, uint64_t now){
+    if(now >= run_end_ns) return 0;
+    while(conn->tail - conn->head < (uint32_t)depth){
+        conn_schedule(conn, now);
+    }
+    return conn_pump(gen, conn);
+}
+
+/**
+ * @function record_reply
+ * @brief Match a reply line to the oldest outstanding request
+ *
+ * @param now Time of the recv() that brought the line
+ */
+void record_reply(Generator* gen, Conn* conn, const char* line, uint64_t now){
+    Stats* stats = &gen->stats;
+
+    if(line[0] >= '0' && line[0] <= '9' && line[1] >= '0' && line[1] <= '9' &&
+       line[2] >= '0' && line[2] <= '9'){
+        stats->codes[(line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0')]++;
+    } else {
+        stats->other_replies++;
+    }
+
+    if(conn->head == conn->sent) return;
+    uint64_t stamp = conn->stamps[conn->head & conn->ring_mask];
+    conn->head++;
+
+    if(stamp < run_start_ns || now > run_end_ns) return;
+    uint64_t latency = now - stamp;
+    stats->hist[hist_index(latency)]++;
+    stats->latency_sum += latency;
+    if(latency > stats->latency_max) stats->latency_max = latency;
+    stats->completed++;
+}
+
+/**
+ * @function conn_readable
+ * @brief Consume every reply line currently available
+ *
+ * @details
+ *  - The first line is the greeting: 100 starts the connection, anything
+ *    else (500 when the server is full) counts as rejected
+ *  - In closed-loop mode each reply immediately schedules a replacement
+ *  - The clock is read after every recv(), so replies to requests sent
+ *    from inside this loop are timed when they actually arrive rather
+ *    than at the epoll_wait() that started it
+ */
+void conn_readable(Generator* gen, Conn* conn){
+    char* line;
+    size_t len;
+    uint64_t recv_ns = now_ns();
+
+    while(conn->state == CONN_GREETING || conn->state == CONN_RUNNING){
+        int ret = line_framer_next(&conn->framer, &line, &len);
+        if(ret == 0){
+            ssize_t n = line_framer_fill(&conn->framer, conn->fd);
+            recv_ns = now_ns();
+            if(n > 0) continue;
+            ret = (int)n;
+        }
+        if(ret == 1){
+            if(conn->state == CONN_GREETING){
+                if(strncmp(line, "100", 3) == 0){
+                    conn->state = CONN_RUNNING;
+                    gen->stats.connected++;
+                    gen->running++;
+                } else {
+                    gen->stats.rejected++;
+                    conn_close(gen, conn);
                 }
-            } else {
-                printf("[%04d] Unknown response: %s", i+1, rBuff);
-                numConnected++;
+                continue;
             }
+            record_reply(gen, conn, line, recv_ns);
+            if(rate == 0 && conn_top_up(gen, conn, recv_ns) == -1) return;
+            continue;
+        }
+        if(ret == -1 && errno == EINTR) continue;
+        if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+        if(conn->state == CONN_GREETING) gen->stats.rejected++;
+        else gen->stats.disconnects++;
+        conn_close(gen, conn);
+    }
+}
+
+/**
+ * @function conn_writable
+ * @brief Finish a non-blocking connect or continue a partial send
+ */
+void conn_writable(Generator* gen, Conn* conn){
+    if(conn->state == CONN_CONNECTING){
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err != 0){
+            gen->stats.connect_failed++;
+            conn_close(gen, conn);
+            return;
+        }
+        conn->state = CONN_GREETING;
+        return;
+    }
+    if(conn->state == CONN_RUNNING) conn_pump(gen, conn);
+}
+
+/**
+ * @function conn_open
+ * @brief Start a non-blocking connect and register the socket
+ *
+ * @return 0 on success, -1 if the socket could not be created
+ */
+int conn_open(Generator* gen, Conn* conn){
+    conn->state = CONN_CLOSED;
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(conn->fd == -1) return -1;
+
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if(connect(conn->fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1 &&
+       errno != EINPROGRESS){
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    conn->state = CONN_CONNECTING;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if(epoll_ctl(gen->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1){
+        close(conn->fd);
+        conn->fd = -1;
+        conn->state = CONN_CLOSED;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @function poll_events
+ * @brief One epoll_wait() round over a generator's connections
+ *
+ * @return Time after the wait, which drives the open-loop schedule
+ */
+uint64_t poll_events(Generator* gen, int timeout_ms){
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(gen->epoll_fd, events, MAX_EVENTS, timeout_ms);
+    uint64_t now = now_ns();
+
+    for(int i = 0; i < n; i++){
+        Conn* conn = events[i].data.ptr;
+        if(events[i].events & EPOLLOUT) conn_writable(gen, conn);
+        if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+            if(conn->state == CONN_CONNECTING) conn_writable(gen, conn);
+            conn_readable(gen, conn);
         }
+    }
+    return now;
+}
 
-        // Delay nh? ? trnh qu t?i server
-        usleep(5000); // 5ms
+/**
+ * @function issue_scheduled
+ * @brief Open loop: schedule every request whose send time has come
+ *
+ * @details
+ *  - Requests are spread round-robin over the running connections
+ *  - A request whose connection backlog is full (the server is far
+ *    behind) is counted as dropped instead of stalling the schedule
+ */
+void issue_scheduled(Generator* gen, uint64_t now){
+    while(gen->next_send_ns <= now && gen->next_send_ns < run_end_ns){
+        Conn* conn = NULL;
+        for(int tries = 0; tries < gen->conn_count && !conn; tries++){
+            Conn* c = &gen->conns[gen->next_conn];
+            gen->next_conn = (gen->next_conn + 1) % gen->conn_count;
+            if(c->state == CONN_RUNNING) conn = c;
+        }
+
+        if(!conn || conn_schedule(conn, gen->next_send_ns) == -1){
+            gen->stats.dropped++;
+        } else {
+            conn_pump(gen, conn);
+        }
+        gen->next_send_ns += gen->interval_ns;
     }
+}
 
-    printf("\n=== RESULTS ===\n");
-    printf("Total attempts:    %d\n", MAX_TEST_CONNS);
-    printf("Accepted:          %d\n", numConnected);
-    printf("Rejected:          %d\n", numRejected);
-    printf("Expected accepted: 1024\n");
-    printf("Expected rejected: %d\n", MAX_TEST_CONNS - 1024);
+/**
+ * @function generator_thread
+ * @brief Connect, wait for every thread, then drive load until the end
+ *
+ * @details
+ *  - Connect phase: at most CONNECT_BATCH sockets per thread are
+ *    connecting or waiting for their greeting at once, so the server's
+ *    accept backlog is not overrun; the phase is bounded by
+ *    CONNECT_TIMEOUT_MS
+ *  - With -s (storm) every socket connects at once, like clients
+ *    reconnecting after a failover; the phase's length gives the
+ *    server's accept rate
+ *  - A barrier starts every thread's measured run at the same instant:
+ *    the first wait ends the connect phase, main() then sets the run
+ *    window and the second wait releases everyone
+ *  - Requests still outstanding when the window closes are not
+ *    counted as unanswered
+ *  - Closed loop keeps depth requests outstanding per connection;
+ *    open loop sends at rate / threads per thread
+ */
+void* generator_thread(void* arg){
+    Generator* gen = arg;
+    uint64_t deadline = now_ns() + (uint64_t)CONNECT_TIMEOUT_MS * 1000000;
+    int batch = storm ? gen->conn_count : CONNECT_BATCH;
 
-    if (numConnected == 1024 && numRejected == MAX_TEST_CONNS - 1024) {
-        printf("\n? TEST PASSED: Server correctly limits to 1024 connections\n");
-    } else if (numConnected >= 1024) {
-        printf("\n??  WARNING: Server accepted more than 1024 connections\n");
+    gen->stats.connect_start_ns = now_ns();
+    int opened = 0;
+    while(now_ns() < deadline){
+        int pending = 0;
+        for(int i = 0; i < opened; i++){
+            ConnState s = gen->conns[i].state;
+            if(s == CONN_CONNECTING || s == CONN_GREETING) pending++;
+        }
+        while(opened < gen->conn_count && pending < batch){
+            if(conn_open(gen, &gen->conns[opened++]) == -1) gen->stats.connect_failed++;
+            else pending++;
+        }
+        if(pending == 0) break;
+        poll_events(gen, 100);
+    }
+    gen->stats.connect_end_ns = now_ns();
+    gen->stats.connect_failed += gen->conn_count - opened;
+    for(int i = 0; i < gen->conn_count; i++){
+        ConnState s = gen->conns[i].state;
+        if(s == CONN_CONNECTING || s == CONN_GREETING){
+            gen->stats.connect_failed++;
+            conn_close(gen, &gen->conns[i]);
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    pthread_barrier_wait(&start_barrier);
+    uint64_t now = now_ns();
+
+    if(rate == 0){
+        for(int i = 0; i < gen->conn_count; i++){
+            if(gen->conns[i].state == CONN_RUNNING) conn_top_up(gen, &gen->conns[i], now);
+        }
     } else {
-        printf("\n? TEST FAILED: Server behavior unexpected\n");
+        gen->interval_ns = (uint64_t)(1e9 * num_threads / rate);
+        if(gen->interval_ns == 0) gen->interval_ns = 1;
+        gen->next_send_ns = run_start_ns + gen->interval_ns * gen->id / num_threads;
+    }
+
+    while(now < run_end_ns && (gen->running > 0 || rate > 0)){
+        int timeout_ms = (run_end_ns - now) / 1000000 + 1;
+        if(rate > 0){
+            timeout_ms = gen->next_send_ns > now ? (gen->next_send_ns - now) / 1000000 : 0;
+        }
+        if(timeout_ms > 100) timeout_ms = 100;
+
+        now = poll_events(gen, timeout_ms);
+        if(rate > 0) issue_scheduled(gen, now);
     }
 
-    // Test thm: ng m?t vi k?t n?i v th? k?t n?i m?i
-    printf("\n=== TESTING SLOT RELEASE ===\n");
-    printf("Closing 10 connections...\n");
-    int closed = 0;
-    for (int i = 0; i < MAX_TEST_CONNS && closed < 10; i++) {
-        if (clients[i] != -1) {
-            close(clients[i]);
-            clients[i] = -1;
-            closed++;
+    for(int i = 0; i < gen->conn_count; i++){
+        Conn* conn = &gen->conns[i];
+        conn->head = conn->sent;
+        conn_close(gen, conn);
+    }
+    return NULL;
+}
+
+void merge_stats(Stats* total, const Stats* s){
+    for(int i = 0; i < HIST_BUCKETS; i++) total->hist[i] += s->hist[i];
+    for(int i = 0; i < CODE_SLOTS; i++) total->codes[i] += s->codes[i];
+    total->latency_sum += s->latency_sum;
+    if(s->latency_max > total->latency_max) total->latency_max = s->latency_max;
+    total->sent += s->sent;
+    total->completed += s->completed;
+    total->dropped += s->dropped;
+    total->unanswered += s->unanswered;
+    total->connected += s->connected;
+    total->rejected += s->rejected;
+    total->connect_failed += s->connect_failed;
+    total->disconnects += s->disconnects;
+    total->other_replies += s->other_replies;
+    if(!total->connect_start_ns || s->connect_start_ns < total->connect_start_ns){
+        total->connect_start_ns = s->connect_start_ns;
+    }
+    if(s->connect_end_ns > total->connect_end_ns) total->connect_end_ns = s->connect_end_ns;
+}
+
+/**
+ * @function print_report
+ * @brief Print the merged results as text, one CSV row or a JSON object
+ *
+ * @note Latencies are in microseconds; quantiles are upper bucket edges
+ * @note The accept rate is connections greeted per second of the
+ *       connect phase (first connect() to last greeting, all threads)
+ */
+void print_report(const Stats* s){
+    double seconds = duration_s;
+    double throughput = s->completed / seconds;
+    double mean = s->completed ? s->latency_sum / (double)s->completed / 1000 : 0;
+    double p50 = hist_quantile(s, 0.5) / 1000.0;
+    double p90 = hist_quantile(s, 0.9) / 1000.0;
+    double p99 = hist_quantile(s, 0.99) / 1000.0;
+    double p999 = hist_quantile(s, 0.999) / 1000.0;
+    double max = s->latency_max / 1000.0;
+    const char* mode = rate > 0 ? "open" : "closed";
+    double connect_ms = (s->connect_end_ns - s->connect_start_ns) / 1e6;
+    double accept_rate = connect_ms > 0 ? s->connected / (connect_ms / 1000) : 0;
+
+    if(strcmp(format, "csv") == 0){
+        printf("mode,rate,connections,connected,rejected,connect_failed,depth,duration_s,"
+               "sent,completed,throughput,mean_us,p50_us,p90_us,p99_us,p999_us,max_us,"
+               "dropped,unanswered,disconnects,connect_ms,accept_rate\n");
+        printf("%s,%.0f,%d,%llu,%llu,%llu,%d,%d,%llu,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%llu,%llu,%llu,%.1f,%.1f\n",
+               mode, rate, num_connections, (unsigned long long)s->connected,
+               (unsigned long long)s->rejected, (unsigned long long)s->connect_failed,
+               depth, duration_s, (unsigned long long)s->sent, (unsigned long long)s->completed,
+               throughput, mean, p50, p90, p99, p999, max, (unsigned long long)s->dropped,
+               (unsigned long long)s->unanswered, (unsigned long long)s->disconnects,
+               connect_ms, accept_rate);
+        return;
+    }
+
+    if(strcmp(format, "json") == 0){
+        printf("{\"mode\":\"%s\",\"rate\":%.0f,\"connections\":%d,\"connected\":%llu,"
+               "\"rejected\":%llu,\"connect_failed\":%llu,\"depth\":%d,\"duration_s\":%d,"
+               "\"mix\":\"%s\",\"sent\":%llu,\"completed\":%llu,\"throughput\":%.1f,"
+               "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+               "\"p999\":%.1f,\"max\":%.1f},\"dropped\":%llu,\"unanswered\":%llu,"
+               "\"disconnects\":%llu,\"connect_ms\":%.1f,\"accept_rate\":%.1f,\"replies\":{",
+               mode, rate, num_connections, (unsigned long long)s->connected,
+               (unsigned long long)s->rejected, (unsigned long long)s->connect_failed,
+               depth, duration_s, mix_spec, (unsigned long long)s->sent,
+               (unsigned long long)s->completed, throughput, mean, p50, p90, p99, p999, max,
+               (unsigned long long)s->dropped, (unsigned long long)s->unanswered,
+               (unsigned long long)s->disconnects, connect_ms, accept_rate);
+        int first = 1;
+        for(int i = 0; i < CODE_SLOTS; i++){
+            if(!s->codes[i]) continue;
+            printf("%s\"%03d\":%llu", first ? "" : ",", i, (unsigned long long)s->codes[i]);
+            first = 0;
         }
+        printf("}}\n");
+        return;
+    }
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &server_addr.sin_addr, ip, sizeof(ip));
+    printf("Target %s:%d, %d threads, %d connections (%llu up, %llu rejected, %llu failed)\n",
+           ip, ntohs(server_addr.sin_port), num_threads, num_connections,
+           (unsigned long long)s->connected, (unsigned long long)s->rejected,
+           (unsigned long long)s->connect_failed);
+    printf("Connect phase%s: %.1f ms, %.1f connections/s accepted\n",
+           storm ? " (storm)" : "", connect_ms, accept_rate);
+    if(rate > 0) printf("Open loop at %.0f req/s", rate);
+    else printf("Closed loop");
+    printf(", pipeline depth %d, mix %s\n", depth, mix_spec);
+    printf("%d s: %llu requests completed, %.1f req/s\n", duration_s,
+           (unsigned long long)s->completed, throughput);
+    printf("Latency (us): mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           mean, p50, p90, p99, p999, max);
+    printf("Dropped (backlog full) %llu, unanswered %llu, disconnects %llu\n",
+           (unsigned long long)s->dropped, (unsigned long long)s->unanswered,
+           (unsigned long long)s->disconnects);
+    printf("Replies:");
+    for(int i = 0; i < CODE_SLOTS; i++){
+        if(s->codes[i]) printf(" %03d=%llu", i, (unsigned long long)s->codes[i]);
     }
+    if(s->other_replies) printf(" other=%llu", (unsigned long long)s->other_replies);
+    printf("\n");
+}
 
-    sleep(1); // ?i server x? l? disconnect
+void print_usage(){
+    printf("Usage: ./stress_test [-H host] [-c connections] [-t threads] [-d seconds] [-P depth] [-r rate] [-m mix] [-u user] [-o text|csv|json] [-s] Port_Number\n");
+    printf("  -H  server address (default %s)\n", DEFAULT_HOST);
+    printf("  -c  connections (default %d)\n", DEFAULT_CONNECTIONS);
+    printf("  -t  generator threads (default: online CPUs, at most %d)\n", MAX_THREADS);
+    printf("  -d  measured run length in seconds (default %d)\n", DEFAULT_DURATION);
+    printf("  -P  requests in flight per connection (default 1, max %d)\n", MAX_DEPTH);
+    printf("  -r  open loop: total requests per second; 0 = closed loop (default 0)\n");
+    printf("  -m  request mix by weight over user, bad, post, bye (default %s)\n", DEFAULT_MIX);
+    printf("  -u  valid account used by USER requests (default %s)\n", DEFAULT_USER);
+    printf("  -o  report format (default text)\n");
+    printf("  -s  connection storm: open all connections at once, not %d per thread at a time\n", CONNECT_BATCH);
+}
 
-    printf("Attempting 10 new connections...\n");
-    int newConnected = 0;
-    for (int i = 0; i < 10; i++) {
-        int newSock = socket(AF_INET, SOCK_STREAM, 0);
-        struct timeval tv;
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        setsockopt(newSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+int main(int argc, char* argv[]){
+    const char* host = DEFAULT_HOST;
+    int opt_char;
 
-        if (connect(newSock, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) == 0) {
-            int ret = recv(newSock, rBuff, BUFF_SIZE, 0);
-            if (ret > 0 && strstr(rBuff, "100") != NULL) {
-                newConnected++;
-                printf("[NEW %d] Accepted - slot was released correctly\n", i+1);
-            }
-            close(newSock);
+    while((opt_char = getopt(argc, argv, "H:c:t:d:P:r:m:u:o:s")) != -1){
+        switch(opt_char){
+            case 'H': host = optarg; break;
+            case 'c': num_connections = atoi(optarg); break;
+            case 't': num_threads = atoi(optarg); break;
+            case 'd': duration_s = atoi(optarg); break;
+            case 'P': depth = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'm': mix_spec = optarg; break;
+            case 'u': valid_user = optarg; break;
+            case 'o': format = optarg; break;
+            case 's': storm = 1; break;
+            default: print_usage(); return 1;
         }
     }
 
-    if (newConnected == 10) {
-        printf("\n? SLOT RELEASE TEST PASSED\n");
-    } else {
-        printf("\n??  Only %d/10 new connections accepted\n", newConnected);
+    if(optind != argc - 1 || num_connections < 1 || duration_s < 1 || depth < 1 ||
+       depth > MAX_DEPTH || rate < 0 || parse_mix(mix_spec) == -1 ||
+       (strcmp(format, "text") != 0 && strcmp(format, "csv") != 0 && strcmp(format, "json") != 0)){
+        print_usage();
+        return 1;
     }
 
-    // ng t?t c? k?t n?i c?n l?i
-    printf("\nCleaning up...\n");
-    for (int i = 0; i < MAX_TEST_CONNS; i++) {
-        if (clients[i] != -1) {
-            close(clients[i]);
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[optind]));
+    if(inet_pton(AF_INET, host, &server_addr.sin_addr) != 1){
+        fprintf(stderr, "Invalid address %s\n", host);
+        return 1;
+    }
+
+    if(num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+    if(num_threads > num_connections) num_threads = num_connections;
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    uint32_t ring_size = 1;
+    while(ring_size < (uint32_t)depth + (rate > 0 ? OPEN_LOOP_BACKLOG : 0)) ring_size *= 2;
+
+    for(int t = 0; t < num_threads; t++){
+        Generator* gen = &generators[t];
+        memset(gen, 0, sizeof(*gen));
+        gen->id = t;
+        gen->rng = 0x9E3779B97F4A7C15ull * (t + 1);
+        gen->conn_count = num_connections / num_threads + (t < num_connections % num_threads);
+        gen->conns = calloc(gen->conn_count, sizeof(Conn));
+        gen->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if(!gen->conns || gen->epoll_fd == -1){
+            perror("Failed to set up generator");
+            return 1;
+        }
+        for(int i = 0; i < gen->conn_count; i++){
+            Conn* conn = &gen->conns[i];
+            conn->fd = -1;
+            conn->state = CONN_CLOSED;
+            conn->ring_mask = ring_size - 1;
+            conn->stamps = malloc(ring_size * sizeof(uint64_t));
+            conn->out = malloc((size_t)depth * MAX_REQUEST_LEN);
+            if(!conn->stamps || !conn->out || line_framer_init(&conn->framer, MAX_REPLY_LINE, "\r\n") == -1){
+                perror("Failed to allocate connection");
+                return 1;
+            }
         }
     }
 
-    printf("Test completed.\n");
+    pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+    for(int t = 0; t < num_threads; t++){
+        if(pthread_create(&generators[t].thread, NULL, generator_thread, &generators[t]) != 0){
+            perror("pthread_create() error");
+            return 1;
+        }
+    }
+
+    run_end_ns = UINT64_MAX;
+    pthread_barrier_wait(&start_barrier);
+    run_start_ns = now_ns();
+    run_end_ns = run_start_ns + (uint64_t)duration_s * 1000000000ull;
+    pthread_barrier_wait(&start_barrier);
+
+    Stats total;
+    memset(&total, 0, sizeof(total));
+    for(int t = 0; t < num_threads; t++){
+        pthread_join(generators[t].thread, NULL);
+        merge_stats(&total, &generators[t].stats);
+    }
+    print_report(&total);
+
+    for(int t = 0; t < num_threads; t++){
+        for(int i = 0; i < generators[t].conn_count; i++){
+            line_framer_destroy(&generators[t].conns[i].framer);
+            free(generators[t].conns[i].stamps);
+            free(generators[t].conns[i].out);
+        }
+        free(generators[t].conns);
+        close(generators[t].epoll_fd);
+    }
     return 0;
 }
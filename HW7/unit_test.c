@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "framer/line_framer.h"
+#include "postlog/post_log.h"
+#include "postlog/post_index.h"
+#include "TCP_Server/timer/timer_wheel.h"
+#include "TCP_Server/session/session.h"
+
+#define FRAME_MAGIC 0xB7
+#define FRAME_HEADER 12
+#define FRAME_LENGTH_AT 8
+#define TEST_TIMERS 8
+
+/*
+ * Unit tests for the server modules that run without sockets or a
+ * server process. Every check that fails prints its location; the exit
+ * status is 1 if any did (make check).
+ */
+
+int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)){ \
+        printf("  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while(0)
+
+/**
+ * @function put_frame_header
+ * @brief Write a frame header in the layout the framer is told about
+ */
+void put_frame_header(char* out, uint32_t payload){
+    memset(out, 0, FRAME_HEADER);
+    out[0] = (char)FRAME_MAGIC;
+    out[FRAME_LENGTH_AT] = (char)(payload >> 24);
+    out[FRAME_LENGTH_AT + 1] = (char)(payload >> 16);
+    out[FRAME_LENGTH_AT + 2] = (char)(payload >> 8);
+    out[FRAME_LENGTH_AT + 3] = (char)payload;
+}
+
+/**
+ * @function test_framer_lines
+ * @brief Lines split across pushes, an empty line and a line over the limit
+ */
+void test_framer_lines(void){
+    LineFramer f;
+    char* line;
+    size_t len;
+
+    printf("framer: lines\n");
+    CHECK(line_framer_init(&f, 16, "\r\n") == 0);
+
+    CHECK(line_framer_push(&f, "USER a\r\nPO", 10) == 10);
+    CHECK(line_framer_next(&f, &line, &len) == 1);
+    CHECK(len == 6 && strcmp(line, "USER a") == 0);
+    CHECK(line_framer_next(&f, &line, &len) == 0);
+
+    CHECK(line_framer_push(&f, "ST x\r", 5) == 5);
+    CHECK(line_framer_next(&f, &line, &len) == 0);
+    CHECK(line_framer_push(&f, "\n\r\n", 3) == 3);
+    CHECK(line_framer_next(&f, &line, &len) == 1);
+    CHECK(len == 6 && strcmp(line, "POST x") == 0);
+    CHECK(line_framer_next(&f, &line, &len) == 1);
+    CHECK(len == 0 && line[0] == '\0');
+
+    CHECK(line_framer_push(&f, "0123456789abcdefg\r\n", 19) == 19);
+    errno = 0;
+    CHECK(line_framer_next(&f, &line, &len) == -1 && errno == EMSGSIZE);
+    line_framer_destroy(&f);
+}
+
+/**
+ * @function test_framer_frames
+ * @brief Frames longer than a line, the frame limit and the buffer size hint
+ */
+void test_framer_frames(void){
+    LineFramer f;
+    char* frame;
+    size_t len;
+    char data[FRAME_HEADER + 200];
+
+    printf("framer: frames\n");
+    CHECK(line_framer_init(&f, 16, "\r\n") == 0);
+    line_framer_detect_frames(&f, FRAME_MAGIC, FRAME_HEADER, FRAME_LENGTH_AT, 100);
+
+    /* a frame of 100 payload bytes is longer than a line, in two pushes */
+    put_frame_header(data, 100);
+    memset(data + FRAME_HEADER, 'p', 100);
+    CHECK(line_framer_push(&f, data, 30) == 30);
+    CHECK(line_framer_next(&f, &frame, &len) == 0);
+    CHECK(f.mode == LINE_FRAMER_FRAMES);
+    CHECK(line_framer_push(&f, data + 30, FRAME_HEADER + 70) == FRAME_HEADER + 70);
+    CHECK(line_framer_next(&f, &frame, &len) == 1);
+    CHECK(len == FRAME_HEADER + 100 && memcmp(frame, data, len) == 0);
+
+    /* one byte over the limit is refused as soon as the header is in */
+    put_frame_header(data, 101);
+    CHECK(line_framer_push(&f, data, FRAME_HEADER) == FRAME_HEADER);
+    errno = 0;
+    CHECK(line_framer_next(&f, &frame, &len) == -1 && errno == EMSGSIZE);
+    line_framer_destroy(&f);
+
+    /* external buffers: the hint asks for room for the whole frame */
+    char small[36];
+    char large[FRAME_HEADER + 100];
+    CHECK(line_framer_init(&f, 16, "\r\n") == 0);
+    line_framer_detect_frames(&f, FRAME_MAGIC, FRAME_HEADER, FRAME_LENGTH_AT, 100);
+    line_framer_detach(&f);
+    CHECK(line_framer_buffer_size(&f) == sizeof(small));
+    CHECK(line_framer_attach(&f, small, sizeof(small)) == 0);
+
+    put_frame_header(data, 100);
+    memset(data + FRAME_HEADER, 'q', 100);
+    CHECK(line_framer_push(&f, data, FRAME_HEADER + 100) == sizeof(small));
+    CHECK(line_framer_next(&f, &frame, &len) == 0);
+    CHECK(line_framer_buffer_size(&f) == FRAME_HEADER + 100);
+    errno = 0;
+    CHECK(line_framer_attach(&f, small, sizeof(small)) == -1 && errno == EINVAL);
+    CHECK(line_framer_attach(&f, large, sizeof(large)) == 0);
+    CHECK(line_framer_push(&f, data + sizeof(small), FRAME_HEADER + 100 - sizeof(small)) ==
+          (ssize_t)(FRAME_HEADER + 100 - sizeof(small)));
+    CHECK(line_framer_next(&f, &frame, &len) == 1);
+    CHECK(len == FRAME_HEADER + 100 && memcmp(frame, data, len) == 0);
+    CHECK(line_framer_buffer_size(&f) == sizeof(small));
+    line_framer_detach(&f);
+}
+
+/**
+ * @function remove_dir
+ * @brief Delete a test directory and the segment files in it
+ */
+void remove_dir(const char* dir){
+    DIR* d = opendir(dir);
+    if(!d) return;
+
+    struct dirent* entry;
+    char path[POST_LOG_PATH_MAX];
+    while((entry = readdir(d))){
+        if(entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+/**
+ * @function crash_after_posts
+ * @brief In a child process: append posts, damage the log, die without closing it
+ *
+ * @param dir Log directory
+ * @param count Posts appended and made durable
+ * @param torn Bytes of a half-written record appended after them
+ * @param flip Offset of a byte to corrupt in the segment, -1 for none
+ * @return 0 if the child got that far
+ *
+ * @details The child exits with the segment still *.log.open, which is
+ *          what a crash mid-group leaves behind
+ */
+int crash_after_posts(const char* dir, int count, size_t torn, long flip){
+    pid_t pid = fork();
+    if(pid == -1) return -1;
+    if(pid > 0){
+        int status;
+        if(waitpid(pid, &status, 0) == -1) return -1;
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+    }
+
+    PostLog log;
+    if(post_log_open(&log, dir, 0) == -1 || post_log_start(&log, NULL, NULL) == -1) _exit(1);
+
+    uint64_t lsn = 0;
+    for(int i = 0; i < count; i++){
+        char body[32];
+        int len = snprintf(body, sizeof(body), "post %d", i);
+        lsn = post_log_append(&log, "tester", body, len);
+        if(lsn == 0) _exit(1);
+    }
+    if(post_log_wait(&log, lsn) == -1) _exit(1);
+
+    char path[POST_LOG_PATH_MAX];
+    post_log_segment_path(&log, log.segment, 1, path, sizeof(path));
+    int fd = open(path, O_WRONLY);
+    if(fd == -1) _exit(1);
+    if(torn){
+        PostRecord rec = {POST_LOG_MAGIC, 0, 0, 6, 100};
+        char half[sizeof(rec) + 100];
+        memset(half, 'x', sizeof(half));
+        memcpy(half, &rec, sizeof(rec));
+        if(torn > sizeof(half) || pwrite(fd, half, torn, log.segment_size) != (ssize_t)torn) _exit(1);
+    }
+    if(flip >= 0){
+        char byte = '#';
+        if(pwrite(fd, &byte, 1, flip) != 1) _exit(1);
+    }
+    fsync(fd);
+    _exit(0);
+}
+
+/**
+ * @function test_post_log_torn_record
+ * @brief A torn tail is cut on open, intact records stay readable
+ */
+void test_post_log_torn_record(void){
+    char dir[] = "/tmp/unit_test_posts_XXXXXX";
+    PostLog log;
+    PostIndex index;
+    PostView views[POST_INDEX_LIST_MAX];
+    size_t record = sizeof(PostRecord) + strlen("tester") + strlen("post 0");
+
+    printf("post log: torn record\n");
+    CHECK(mkdtemp(dir) != NULL);
+    CHECK(crash_after_posts(dir, 3, sizeof(PostRecord) + 40, -1) == 0);
+
+    CHECK(post_log_open(&log, dir, 0) == 0);
+    CHECK(log.recovered == 3);
+    CHECK(log.truncated == sizeof(PostRecord) + 40);
+    CHECK(post_log_start(&log, NULL, NULL) == 0);
+    CHECK(post_index_open(&index, &log) == 0);
+    CHECK(post_index_list(&index, "tester", views, POST_INDEX_LIST_MAX) == 3);
+
+    /* appends continue in a new segment and are indexed with the old ones */
+    uint64_t lsn = post_log_append(&log, "tester", "post 3", 6);
+    CHECK(lsn != 0 && post_log_wait(&log, lsn) == 0);
+    post_index_refresh(&index);
+    CHECK(post_index_list(&index, "tester", views, POST_INDEX_LIST_MAX) == 4);
+    post_index_close(&index);
+    post_log_close(&log);
+    remove_dir(dir);
+
+    /* a corrupt record cuts the segment there, the records before it survive */
+    printf("post log: corrupt record\n");
+    char dir2[] = "/tmp/unit_test_posts_XXXXXX";
+    CHECK(mkdtemp(dir2) != NULL);
+    CHECK(crash_after_posts(dir2, 3, 0, (long)(record + sizeof(PostRecord) + 2)) == 0);
+    CHECK(post_log_open(&log, dir2, 0) == 0);
+    CHECK(log.recovered == 1);
+    CHECK(log.truncated == 2 * record);
+    CHECK(post_log_start(&log, NULL, NULL) == 0);
+    post_log_close(&log);
+    remove_dir(dir2);
+}
+
+/**
+ * @struct TimerCase
+ * @brief Timer under test and the tick it fired at (0: not fired)
+ */
+typedef struct {
+    TimerNode node;
+    uint64_t fired_at;
+} TimerCase;
+
+/**
+ * @function timer_fired
+ * @brief Expiry callback: note the tick the timer fired at
+ */
+void timer_fired(TimerNode* node, void* arg){
+    TimerWheel* wheel = arg;
+    ((TimerCase*)node)->fired_at = wheel->now;
+}
+
+/**
+ * @function test_timer_wheel
+ * @brief Timers on every level fire on their tick; cancelled ones never do
+ *
+ * @details The clock is driven the way the event loop drives it: each
+ *          advance goes to timer_wheel_next_tick(), so a hint that
+ *          skipped past a timer would show up as a late firing
+ */
+void test_timer_wheel(void){
+    static const uint64_t expires[TEST_TIMERS] = {1, 3, 63, 64, 65, 4096, 4161, 262300};
+    TimerWheel wheel;
+    TimerCase cases[TEST_TIMERS];
+
+    printf("timer wheel\n");
+    timer_wheel_init(&wheel, 0);
+    for(int i = 0; i < TEST_TIMERS; i++){
+        timer_node_init(&cases[i].node);
+        cases[i].fired_at = 0;
+        timer_wheel_add(&wheel, &cases[i].node, expires[i]);
+    }
+    timer_wheel_cancel(&wheel, &cases[4].node);
+    CHECK(!timer_node_armed(&cases[4].node));
+    CHECK(wheel.count == TEST_TIMERS - 1);
+
+    /* re-arming moves a timer */
+    timer_wheel_add(&wheel, &cases[1].node, 70);
+
+    int steps = 0;
+    while(wheel.count > 0 && steps++ < 100000){
+        uint64_t next = timer_wheel_next_tick(&wheel);
+        CHECK(next > wheel.now);
+        timer_wheel_advance(&wheel, next, timer_fired, &wheel);
+    }
+    CHECK(wheel.count == 0);
+    CHECK(timer_wheel_next_tick(&wheel) == TIMER_NEVER);
+    for(int i = 0; i < TEST_TIMERS; i++){
+        uint64_t want = i == 4 ? 0 : i == 1 ? 70 : expires[i];
+        if(cases[i].fired_at != want){
+            printf("  timer %d fired at %llu, expected %llu\n", i,
+                   (unsigned long long)cases[i].fired_at, (unsigned long long)want);
+        }
+        CHECK(cases[i].fired_at == want);
+    }
+}
+
+/**
+ * @function out_equals
+ * @brief Whether the session's unsent output is exactly text
+ */
+int out_equals(Session* session, const char* text){
+    size_t len = session->out_len - session->out_off;
+    return len == strlen(text) && memcmp(session->out_data + session->out_off, text, len) == 0;
+}
+
+/**
+ * @function append_reply
+ * @brief Append a reply and park it, as the server does for a reply that must wait
+ */
+void append_reply(Session* session, const char* text, int park, uint64_t lsn, int ordered){
+    OutMark mark;
+    session_out_mark(session, &mark);
+    CHECK(session_out_append_locked(session, text, strlen(text)) == 0);
+    if(park) CHECK(session_out_park(session, &mark, lsn, ordered) == 0);
+}
+
+/**
+ * @function test_parked_replies
+ * @brief A reply waiting for its post to commit does not hold back tagged replies
+ *
+ * @details Mirrors a pipeline of POST, #a GET, BYE, #b POST: the POST's
+ *          120 waits for record 5, the tagged 140 goes out at once, the
+ *          221 queues behind the 120 and the tagged 120 waits only for
+ *          its own record 7
+ */
+void test_parked_replies(void){
+    printf("session: parked replies\n");
+    Session* session = session_create();
+    CHECK(session != NULL);
+    if(!session) return;
+
+    pthread_mutex_lock(&session->out_lock);
+    append_reply(session, "120 5\r\n", 1, 5, 1);
+    append_reply(session, "#a 140 1 tester hi\r\n", 0, 0, 0);
+    append_reply(session, "221\r\n", 1, 0, 1);
+    append_reply(session, "#b 120 7\r\n", 1, 7, 0);
+
+    CHECK(out_equals(session, "#a 140 1 tester hi\r\n"));
+    CHECK(session->held_count == 2);
+    CHECK(session->held_bytes == strlen("120 5\r\n221\r\n#b 120 7\r\n"));
+
+    CHECK(session_out_release(session, 4) == 0);
+    CHECK(out_equals(session, "#a 140 1 tester hi\r\n"));
+
+    CHECK(session_out_release(session, 6) == 0);
+    CHECK(out_equals(session, "#a 140 1 tester hi\r\n120 5\r\n221\r\n"));
+    CHECK(session->held_count == 1 && session->held_ordered == 0);
+
+    /* an ordered reply with nothing to wait for now goes straight out */
+    append_reply(session, "130\r\n", 0, 0, 1);
+    CHECK(session_out_release(session, 7) == 0);
+    CHECK(out_equals(session, "#a 140 1 tester hi\r\n120 5\r\n221\r\n130\r\n#b 120 7\r\n"));
+    CHECK(session->held_count == 0 && session->held_bytes == 0);
+    pthread_mutex_unlock(&session->out_lock);
+
+    session->sockfd = -1;
+    session_close(session);
+}
+
+/**
+ * @function test_out_rollback
+ * @brief A reply cut short is removed whole, referenced articles included
+ */
+void test_out_rollback(void){
+    printf("session: reply rollback\n");
+    static char article[OUTPUT_REF_MIN * 2];
+    Session* session = session_create();
+    CHECK(session != NULL);
+    if(!session) return;
+
+    memset(article, 'a', sizeof(article));
+    pthread_mutex_lock(&session->out_lock);
+    CHECK(session_out_append_locked(session, "240\r\n", 5) == 0);
+
+    OutMark mark;
+    session_out_mark(session, &mark);
+    CHECK(session_out_append_locked(session, "150 2\r\n1 ", 9) == 0);
+    CHECK(session_out_append_ref_locked(session, article, sizeof(article)) == 0);
+    CHECK(session_out_append_locked(session, "\r\n", 2) == 0);
+    CHECK(session->out_refs.count == 1);
+
+    session_out_rollback(session, &mark);
+    CHECK(out_equals(session, "240\r\n"));
+    CHECK(session->out_refs.count == 0 && session->out_refs.bytes == 0);
+
+    /* what follows the rollback goes out right behind the earlier reply */
+    CHECK(session_out_append_locked(session, "500\r\n", 5) == 0);
+    CHECK(out_equals(session, "240\r\n500\r\n"));
+    pthread_mutex_unlock(&session->out_lock);
+
+    session->sockfd = -1;
+    session_close(session);
+}
+
+int main(void){
+    test_framer_lines();
+    test_framer_frames();
+    test_post_log_torn_record();
+    test_timer_wheel();
+    test_parked_replies();
+    test_out_rollback();
+
+    if(failures){
+        printf("%d check%s failed\n", failures, failures > 1 ? "s" : "");
+    } else {
+        printf("All unit tests passed\n");
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,391 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "line_framer.h"
+
+/**
+ * @function line_framer_init
+ * @brief Prepare a framer for lines of at most max_line bytes
+ *
+ * @param f Framer to initialize
+ * @param max_line Longest line accepted, delimiter excluded (at least 1)
+ * @param delim Delimiter string, 1 to LINE_FRAMER_MAX_DELIM bytes
+ * @return 0 on success, -1 with errno EINVAL on bad arguments
+ *
+ * @details
+ *  - The buffer is sized for two maximal frames, so after one memmove()
+ *    of a partial line there is always room for at least one more frame
+ *  - Nothing is allocated until the first line_framer_fill()
+ */
+int line_framer_init(LineFramer* f, size_t max_line, const char* delim){
+    size_t delim_len = strlen(delim);
+
+    if(max_line == 0 || delim_len == 0 || delim_len > LINE_FRAMER_MAX_DELIM){
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(f->delim, delim, delim_len);
+    f->delim_len = delim_len;
+    f->max_line = max_line;
+    f->cap = 2 * (max_line + delim_len);
+    f->buf = NULL;
+    f->head = 0;
+    f->tail = 0;
+    f->scan = 0;
+    f->external = 0;
+    f->mode = LINE_FRAMER_LINES;
+    f->frame_magic = 0;
+    f->frame_header = 0;
+    f->frame_length_at = 0;
+    f->frame_max = 0;
+    return 0;
+}
+
+/**
+ * @function line_framer_destroy
+ * @brief Release the receive buffer (external buffers are left to the caller)
+ */
+void line_framer_destroy(LineFramer* f){
+    if(!f->external) free(f->buf);
+    f->buf = NULL;
+    line_framer_reset(f);
+}
+
+/**
+ * @function line_framer_reset
+ * @brief Drop buffered bytes but keep the allocation (for a new connection)
+ */
+void line_framer_reset(LineFramer* f){
+    f->head = 0;
+    f->tail = 0;
+    f->scan = 0;
+}
+
+/**
+ * @function line_framer_attach
+ * @brief Continue framing in a caller-supplied buffer
+ *
+ * @param f Framer
+ * @param buf New buffer, owned by the caller
+ * @param cap Size of buf, at least line_framer_buffer_size()
+ * @return 0 on success, -1 with errno EINVAL if buf is too small
+ *
+ * @details
+ *  - The unread partial line, if any, is copied to the start of buf;
+ *    lines already returned stay where they are in the old buffer
+ *  - An internally allocated buffer is freed; the framer stays in
+ *    external mode from now on
+ */
+int line_framer_attach(LineFramer* f, char* buf, size_t cap){
+    if(cap < line_framer_buffer_size(f)){
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t used = f->tail - f->head;
+    if(used > 0) memcpy(buf, f->buf + f->head, used);
+    if(!f->external) free(f->buf);
+
+    f->buf = buf;
+    f->cap = cap;
+    f->scan -= f->head;
+    f->tail = used;
+    f->head = 0;
+    f->external = 1;
+    return 0;
+}
+
+/**
+ * @function line_framer_detach
+ * @brief Forget the external buffer and drop buffered bytes
+ *
+ * @details
+ *  - Used when a connection ends or before the first attach: the next
+ *    line_framer_fill() fails with ENOBUFS until a buffer is attached
+ */
+void line_framer_detach(LineFramer* f){
+    if(!f->external) free(f->buf);
+    f->buf = NULL;
+    f->cap = 0;
+    f->external = 1;
+    line_framer_reset(f);
+}
+
+/**
+ * @function line_framer_detect_frames
+ * @brief Let the first byte of the stream choose between lines and frames
+ *
+ * @param f Framer, before anything was received on the connection
+ * @param magic First byte of every frame; must not start a line
+ * @param header_len Fixed header size of a frame (below max_line + delim_len)
+ * @param length_at Offset of the big-endian uint32 payload length in the
+ *        header (at most header_len - 4)
+ * @param max_payload Longest frame payload accepted, independent of
+ *        max_line
+ *
+ * @details
+ *  - Called per connection: the choice sticks until the next call,
+ *    line_framer_reset() keeps it
+ *  - An internal buffer is regrown on the next fill to hold two maximal
+ *    frames; external buffers are sized by the caller from
+ *    line_framer_buffer_size()
+ */
+void line_framer_detect_frames(LineFramer* f, uint8_t magic, size_t header_len, size_t length_at,
+                               size_t max_payload){
+    f->mode = LINE_FRAMER_DETECT;
+    f->frame_magic = magic;
+    f->frame_header = header_len;
+    f->frame_length_at = length_at;
+    f->frame_max = max_payload;
+    if(!f->external && 2 * (header_len + max_payload) > f->cap){
+        free(f->buf);
+        f->buf = NULL;
+        f->cap = 2 * (header_len + max_payload);
+        line_framer_reset(f);
+    }
+}
+
+/**
+ * @function frame_length
+ * @brief Payload length of the frame header at head (header complete)
+ */
+static size_t frame_length(const LineFramer* f){
+    const unsigned char* p = (const unsigned char*)f->buf + f->head + f->frame_length_at;
+    return (size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3];
+}
+
+/**
+ * @function line_framer_buffer_size
+ * @brief Smallest buffer line_framer_attach() accepts right now
+ *
+ * @return Twice the longest line (delimiter included), or more when the
+ *         unread bytes start a frame whose header announces a longer one
+ *
+ * @details The unread bytes move to the new buffer, so it must hold the
+ *          whole frame they start; once that frame is returned the
+ *          caller can go back to ordinary buffers
+ */
+size_t line_framer_buffer_size(const LineFramer* f){
+    size_t size = 2 * (f->max_line + f->delim_len);
+
+    if(f->mode == LINE_FRAMER_FRAMES && f->buf && f->tail - f->head >= f->frame_header){
+        size_t payload = frame_length(f);
+        if(payload <= f->frame_max && f->frame_header + payload > size){
+            size = f->frame_header + payload;
+        }
+    }
+    return size;
+}
+
+/**
+ * @function next_frame
+ * @brief line_framer_next() for length-prefixed frames
+ *
+ * @return As line_framer_next(); -1 with errno EPROTO when the bytes at
+ *         head do not start with the frame magic (the stream lost sync),
+ *         EMSGSIZE when the payload exceeds frame_max
+ */
+static int next_frame(LineFramer* f, char** frame, size_t* len){
+    size_t avail = f->tail - f->head;
+    if(avail < f->frame_header) return 0;
+
+    const unsigned char* header = (const unsigned char*)f->buf + f->head;
+    if(header[0] != f->frame_magic){
+        errno = EPROTO;
+        return -1;
+    }
+
+    size_t payload = frame_length(f);
+    if(payload > f->frame_max){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if(avail < f->frame_header + payload) return 0;
+
+    *frame = f->buf + f->head;
+    *len = f->frame_header + payload;
+    f->head += *len;
+    f->scan = f->head;
+    if(f->head == f->tail && !f->external) line_framer_reset(f);
+    return 1;
+}
+
+/**
+ * @function line_framer_next
+ * @brief Return the next complete line already in the buffer
+ *
+ * @param f Framer
+ * @param line Set to the start of the line (NUL-terminated, in place)
+ * @param len Set to the line length, delimiter excluded
+ * @return 1 if a line was returned, 0 if more data is needed,
+ *         -1 with errno EMSGSIZE if the line exceeds max_line
+ *         (in frame mode: a frame, see next_frame())
+ *
+ * @details
+ *  - memchr() looks for the delimiter's first byte starting at f->scan,
+ *    so every received byte is scanned once, however the line arrives
+ *  - After a failed search f->scan stops delim_len - 1 bytes before the
+ *    end: a delimiter split across two recv() calls is still found
+ *  - Once an internal buffer is empty the offsets restart at 0, which
+ *    keeps the common one-line-per-recv case free of memmove()
+ */
+int line_framer_next(LineFramer* f, char** line, size_t* len){
+    size_t delim_len = f->delim_len;
+
+    if(f->mode == LINE_FRAMER_DETECT){
+        if(f->tail == f->head) return 0;
+        f->mode = (uint8_t)f->buf[f->head] == f->frame_magic ? LINE_FRAMER_FRAMES : LINE_FRAMER_LINES;
+    }
+    if(f->mode == LINE_FRAMER_FRAMES) return next_frame(f, line, len);
+
+    while(f->tail - f->scan >= delim_len){
+        char* p = memchr(f->buf + f->scan, f->delim[0], f->tail - f->scan - delim_len + 1);
+        if(!p){
+            f->scan = f->tail - delim_len + 1;
+            break;
+        }
+
+        size_t pos = p - f->buf;
+        if(memcmp(p + 1, f->delim + 1, delim_len - 1) != 0){
+            f->scan = pos + 1;
+            continue;
+        }
+
+        size_t line_len = pos - f->head;
+        if(line_len > f->max_line){
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        *p = '\0';
+        *line = f->buf + f->head;
+        *len = line_len;
+        f->head = pos + delim_len;
+        f->scan = f->head;
+        if(f->head == f->tail && !f->external) line_framer_reset(f);
+        return 1;
+    }
+
+    if(f->tail - f->head >= f->max_line + delim_len){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @function make_room
+ * @brief Ensure there is free space at the end of the buffer
+ *
+ * @return 0 when f->tail < f->cap, -1 with errno ENOBUFS when an external
+ *         buffer is missing or full, EMSGSIZE when a partial line fills
+ *         the whole internal buffer, or errno from malloc()
+ *
+ * @details
+ *  - Allocates the buffer on first use
+ *  - When the free space at the end is used up, the unread partial line
+ *    (shorter than one frame, or line_framer_next() would have failed)
+ *    is moved to the front with one memmove()
+ */
+static int make_room(LineFramer* f){
+    if(f->external){
+        if(!f->buf || f->tail == f->cap){
+            errno = ENOBUFS;
+            return -1;
+        }
+    } else if(!f->buf){
+        f->buf = malloc(f->cap);
+        if(!f->buf) return -1;
+    }
+
+    if(f->tail == f->cap){
+        size_t used = f->tail - f->head;
+        memmove(f->buf, f->buf + f->head, used);
+        f->scan -= f->head;
+        f->tail = used;
+        f->head = 0;
+    }
+    if(f->tail == f->cap){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @function line_framer_fill
+ * @brief Receive more bytes from a socket into the framer
+ *
+ * @param f Framer
+ * @param sockfd Socket to read from (blocking or non-blocking)
+ * @return Bytes received, 0 if the peer closed the connection, -1 on
+ *         error with errno from recv() (EAGAIN on a drained
+ *         non-blocking socket, ENOBUFS when an external buffer is
+ *         missing or full)
+ *
+ * @note Invalidates line slices returned earlier, unless the buffer is external
+ */
+ssize_t line_framer_fill(LineFramer* f, int sockfd){
+    if(make_room(f) == -1) return -1;
+
+    ssize_t n = recv(sockfd, f->buf + f->tail, f->cap - f->tail, 0);
+    if(n > 0) f->tail += n;
+    return n;
+}
+
+/**
+ * @function line_framer_push
+ * @brief Append bytes that were received elsewhere (e.g. by io_uring)
+ *
+ * @param f Framer
+ * @param data Received bytes
+ * @param len Number of bytes
+ * @return Bytes taken, possibly fewer than len when the buffer fills up;
+ *         -1 with errno as for line_framer_fill() when nothing fits
+ *
+ * @note The caller keeps what was not taken and pushes it again after
+ *       draining lines or attaching a new external buffer
+ */
+ssize_t line_framer_push(LineFramer* f, const char* data, size_t len){
+    if(make_room(f) == -1) return -1;
+
+    size_t n = f->cap - f->tail;
+    if(n > len) n = len;
+    memcpy(f->buf + f->tail, data, n);
+    f->tail += n;
+    return (ssize_t)n;
+}
+
+/**
+ * @function line_framer_read_line
+ * @brief Return the next line, receiving from the socket as needed
+ *
+ * @param f Framer
+ * @param sockfd Socket to read from
+ * @param line Set to the line (NUL-terminated, valid until the next call)
+ * @param len Set to the line length, delimiter excluded
+ * @return 1 if a line was returned (it may be empty), 0 if the peer
+ *         closed the connection, -1 on error (errno EAGAIN when a
+ *         non-blocking socket has no complete line yet, EMSGSIZE when
+ *         the line is too long, ENOBUFS when an external buffer is
+ *         missing or full)
+ *
+ * @details
+ *  - Serves lines already buffered before calling recv() again, so
+ *    pipelined commands cost one recv() per segment, not per line
+ *  - Drop-in replacement for the recv_until_delim() helpers: blocking
+ *    callers loop until a line arrives, non-blocking callers keep the
+ *    partial line buffered and retry on the next readiness event
+ */
+int line_framer_read_line(LineFramer* f, int sockfd, char** line, size_t* len){
+    while(1){
+        int ret = line_framer_next(f, line, len);
+        if(ret != 0) return ret;
+
+        ssize_t n = line_framer_fill(f, sockfd);
+        if(n <= 0) return (int)n;
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef LINE_FRAMER_H
+#define LINE_FRAMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LINE_FRAMER_MAX_DELIM 8
+
+/**
+ * @enum LineFramerMode
+ * @brief How the byte stream is split
+ *
+ * @member LINE_FRAMER_LINES Delimited lines
+ * @member LINE_FRAMER_FRAMES Length-prefixed frames (line_framer_detect_frames())
+ * @member LINE_FRAMER_DETECT Undecided: the first byte received picks
+ *         frames if it is the frame magic, lines otherwise
+ */
+typedef enum {
+    LINE_FRAMER_LINES,
+    LINE_FRAMER_FRAMES,
+    LINE_FRAMER_DETECT
+} LineFramerMode;
+
+/**
+ * @struct LineFramer
+ * @brief Receive buffer that splits a byte stream into delimited lines
+ *
+ * @member buf Receive buffer (allocated on the first fill)
+ * @member cap Size of buf, twice the longest line + delimiter (internal
+ *            buffer) or as attached
+ * @member head Offset of the first byte not yet returned as a line
+ * @member tail Offset one past the last received byte
+ * @member scan Offset where the next delimiter search starts; bytes
+ *              between head and scan are known not to start a delimiter
+ * @member max_line Longest line accepted, delimiter excluded
+ * @member delim Delimiter bytes (e.g. "\r\n")
+ * @member delim_len Number of bytes in delim
+ * @member external 1 when buf is supplied by the caller (line_framer_attach())
+ * @member mode LineFramerMode; kept by line_framer_reset()
+ * @member frame_magic First byte of every frame
+ * @member frame_header Fixed header size of a frame
+ * @member frame_length_at Offset of the payload length (big-endian
+ *         uint32) in the header
+ * @member frame_max Longest frame payload accepted
+ *
+ * @note buf is linear, not a wrapping ring: a line that wrapped around
+ *       the end could not be handed out as one slice. Unread bytes are
+ *       moved to the front instead, at most one frame per buffer's worth
+ *       of input (see make_room()).
+ * @note Lines are returned as slices of buf, NUL-terminated in place
+ *       (the delimiter's first byte is overwritten). A slice stays valid
+ *       until the next line_framer_fill(), which may move unread bytes
+ *       to the front of buf.
+ * @note With an external buffer bytes are never moved or overwritten
+ *       once received, so slices stay valid as long as the caller keeps
+ *       the buffer; a full buffer makes line_framer_fill() fail with
+ *       ENOBUFS and the caller attaches a new one.
+ * @note A frame is returned whole, header included and not
+ *       NUL-terminated. Its payload has its own limit (frame_max), which
+ *       may exceed max_line; line_framer_buffer_size() tells how big a
+ *       buffer the frame being received needs.
+ */
+typedef struct {
+    char* buf;
+    size_t cap;
+    size_t head;
+    size_t tail;
+    size_t scan;
+    size_t max_line;
+    char delim[LINE_FRAMER_MAX_DELIM];
+    size_t delim_len;
+    int external;
+    int mode;
+    uint8_t frame_magic;
+    size_t frame_header;
+    size_t frame_length_at;
+    size_t frame_max;
+} LineFramer;
+
+int line_framer_init(LineFramer* f, size_t max_line, const char* delim);
+void line_framer_destroy(LineFramer* f);
+void line_framer_reset(LineFramer* f);
+int line_framer_attach(LineFramer* f, char* buf, size_t cap);
+void line_framer_detach(LineFramer* f);
+void line_framer_detect_frames(LineFramer* f, uint8_t magic, size_t header_len, size_t length_at,
+                               size_t max_payload);
+size_t line_framer_buffer_size(const LineFramer* f);
+int line_framer_next(LineFramer* f, char** line, size_t* len);
+ssize_t line_framer_fill(LineFramer* f, int sockfd);
+ssize_t line_framer_push(LineFramer* f, const char* data, size_t len);
+int line_framer_read_line(LineFramer* f, int sockfd, char** line, size_t* len);
+
+#endif
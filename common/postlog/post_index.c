@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "post_index.h"
+
+#define POST_INDEX_INITIAL_SIZE 64
+
+/*
+ * Read side of the post log. Every segment is mapped read-only once, at
+ * its largest possible size, and stays mapped: segments are append-only
+ * and never deleted, so a pointer into a mapping stays valid for the life
+ * of the index and replies can be sent straight from it.
+ *
+ * A post's id is its location, segment number << 32 | record offset, so
+ * it never changes across restarts. The id index is the sorted offset
+ * array of each segment (4 bytes per post); the per-user index lists the
+ * ids of each author (8 bytes per post).
+ *
+ * Records become visible once durable: the segment the log appends to is
+ * indexed up to post_log_position(). Segments another process still
+ * appends to (the predecessor during a hot upgrade) are followed by file
+ * size until that process lets go of them.
+ */
+
+/**
+ * @function hash_name
+ * @brief FNV-1a hash of a username
+ */
+static uint64_t hash_name(const char* name, size_t len){
+    uint64_t h = 1469598103934665603ull;
+    for(size_t i = 0; i < len; i++){
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * @function author_slot
+ * @brief Slot of name in the author table, or the empty slot it would take
+ */
+static PostAuthor* author_slot(PostAuthor* table, size_t cap, const char* name, size_t len){
+    size_t mask = cap - 1;
+    size_t slot = hash_name(name, len) & mask;
+    while(table[slot].name){
+        if(strlen(table[slot].name) == len && memcmp(table[slot].name, name, len) == 0) break;
+        slot = (slot + 1) & mask;
+    }
+    return &table[slot];
+}
+
+/**
+ * @function find_author
+ * @brief Look an author up, adding it when create is set
+ *
+ * @return The author, NULL if absent (or out of memory when creating)
+ *
+ * @note The table doubles at half load, so probes stay short
+ */
+static PostAuthor* find_author(PostIndex* index, const char* name, size_t len, int create){
+    if(index->author_cap == 0 && !create) return NULL;
+
+    if(create && (index->author_count + 1) * 2 > index->author_cap){
+        size_t new_cap = index->author_cap ? index->author_cap * 2 : POST_INDEX_INITIAL_SIZE;
+        PostAuthor* table = calloc(new_cap, sizeof(PostAuthor));
+        if(!table) return NULL;
+        for(size_t i = 0; i < index->author_cap; i++){
+            PostAuthor* a = &index->authors[i];
+            if(a->name) *author_slot(table, new_cap, a->name, strlen(a->name)) = *a;
+        }
+        free(index->authors);
+        index->authors = table;
+        index->author_cap = new_cap;
+    }
+
+    PostAuthor* a = author_slot(index->authors, index->author_cap, name, len);
+    if(a->name || !create) return a->name ? a : NULL;
+
+    a->name = strndup(name, len);
+    if(!a->name) return NULL;
+    index->author_count++;
+    return a;
+}
+
+/**
+ * @function find_segment
+ * @brief Binary search of the segment table by number
+ */
+static PostSegment* find_segment(PostIndex* index, unsigned number){
+    int lo = 0, hi = index->segment_count - 1;
+    while(lo <= hi){
+        int mid = (lo + hi) / 2;
+        if(index->segments[mid].number == number) return &index->segments[mid];
+        if(index->segments[mid].number < number) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return NULL;
+}
+
+/**
+ * @function view_at
+ * @brief Describe the record at offset off of seg
+ *
+ * @note Records are packed, so the header is copied out rather than
+ *       read through a misaligned pointer
+ */
+static void view_at(const PostSegment* seg, uint32_t off, PostView* view){
+    PostRecord rec;
+    memcpy(&rec, seg->base + off, sizeof(rec));
+    view->id = (uint64_t)seg->number << 32 | off;
+    view->time_ns = rec.time_ns;
+    view->user = seg->base + off + sizeof(rec);
+    view->user_len = rec.user_len;
+    view->body = view->user + rec.user_len;
+    view->body_len = rec.body_len;
+}
+
+/**
+ * @function scan_segment
+ * @brief Index the complete records of seg below limit bytes
+ *
+ * @details Stops at a partial record (still being written) and at
+ *          anything that is not a record header, so only whole records
+ *          are ever handed out
+ */
+static void scan_segment(PostIndex* index, PostSegment* seg, size_t limit){
+    if(limit > POST_LOG_SEGMENT_BYTES) limit = POST_LOG_SEGMENT_BYTES;
+
+    while(seg->indexed + sizeof(PostRecord) <= limit){
+        PostRecord rec;
+        memcpy(&rec, seg->base + seg->indexed, sizeof(rec));
+        if(rec.magic != POST_LOG_MAGIC || rec.user_len > POST_LOG_MAX_FIELD ||
+           rec.body_len > POST_LOG_MAX_FIELD) break;
+        size_t need = sizeof(rec) + rec.user_len + rec.body_len;
+        if(seg->indexed + need > limit) break;
+
+        if(seg->count == seg->cap){
+            size_t new_cap = seg->cap ? seg->cap * 2 : POST_INDEX_INITIAL_SIZE;
+            uint32_t* grown = realloc(seg->offsets, new_cap * sizeof(uint32_t));
+            if(!grown) break;
+            seg->offsets = grown;
+            seg->cap = new_cap;
+        }
+
+        PostAuthor* author = find_author(index, seg->base + seg->indexed + sizeof(rec), rec.user_len, 1);
+        if(!author) break;
+        if(author->count == author->cap){
+            size_t new_cap = author->cap ? author->cap * 2 : 16;
+            uint64_t* grown = realloc(author->ids, new_cap * sizeof(uint64_t));
+            if(!grown) break;
+            author->ids = grown;
+            author->cap = new_cap;
+        }
+
+        seg->offsets[seg->count++] = (uint32_t)seg->indexed;
+        author->ids[author->count++] = (uint64_t)seg->number << 32 | seg->indexed;
+        index->posts++;
+        seg->indexed += need;
+    }
+}
+
+/**
+ * @function add_segment
+ * @brief Map segment number, keeping the table sorted
+ *
+ * @return The segment (valid until the next add_segment()), NULL on failure
+ *
+ * @note The sealed name is tried first, then the open one, then the
+ *       sealed one again in case the writer renamed it in between
+ */
+static PostSegment* add_segment(PostIndex* index, unsigned number){
+    PostSegment* seg = find_segment(index, number);
+    if(seg) return seg;
+
+    char path[POST_LOG_PATH_MAX];
+    int fd = -1;
+    for(int attempt = 0; attempt < 3 && fd == -1; attempt++){
+        post_log_segment_path(index->log, number, attempt == 1, path, sizeof(path));
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if(fd == -1) return NULL;
+
+    void* base = mmap(NULL, POST_LOG_SEGMENT_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED){
+        close(fd);
+        return NULL;
+    }
+
+    if(index->segment_count == index->segment_cap){
+        int new_cap = index->segment_cap ? index->segment_cap * 2 : POST_INDEX_INITIAL_SIZE;
+        PostSegment* grown = realloc(index->segments, new_cap * sizeof(PostSegment));
+        if(!grown){
+            munmap(base, POST_LOG_SEGMENT_BYTES);
+            close(fd);
+            return NULL;
+        }
+        index->segments = grown;
+        index->segment_cap = new_cap;
+    }
+
+    int pos = index->segment_count;
+    while(pos > 0 && index->segments[pos - 1].number > number) pos--;
+    memmove(&index->segments[pos + 1], &index->segments[pos],
+            (index->segment_count - pos) * sizeof(PostSegment));
+    index->segment_count++;
+
+    seg = &index->segments[pos];
+    memset(seg, 0, sizeof(*seg));
+    seg->number = number;
+    seg->fd = fd;
+    seg->base = base;
+    return seg;
+}
+
+/**
+ * @function settle_segment
+ * @brief Catch up with a segment this process does not append to
+ *
+ * @details
+ *  - Indexes it up to its current file size
+ *  - If no process holds its lock any more it cannot grow: a last scan
+ *    and its descriptor is closed. Otherwise it is counted as foreign
+ *    and followed on every refresh
+ */
+static void settle_segment(PostIndex* index, PostSegment* seg){
+    struct stat st;
+    if(seg->fd == -1 || fstat(seg->fd, &st) == -1) return;
+    scan_segment(index, seg, st.st_size);
+
+    if(flock(seg->fd, LOCK_SH | LOCK_NB) == 0){
+        if(fstat(seg->fd, &st) == 0) scan_segment(index, seg, st.st_size);
+        close(seg->fd);
+        seg->fd = -1;
+        if(seg->foreign){
+            seg->foreign = 0;
+            atomic_fetch_sub(&index->foreign, 1);
+        }
+    } else if(errno == EWOULDBLOCK && !seg->foreign){
+        seg->foreign = 1;
+        atomic_fetch_add(&index->foreign, 1);
+    }
+}
+
+/**
+ * @function scan_directory
+ * @brief Map segments not seen yet and settle all but the log's own
+ */
+static void scan_directory(PostIndex* index){
+    DIR* d = opendir(index->log->dir);
+    if(!d) return;
+
+    struct dirent* entry;
+    while((entry = readdir(d))){
+        unsigned number;
+        int end = 0;
+        if(sscanf(entry->d_name, "posts-%8u.log%n", &number, &end) != 1 || end == 0) continue;
+        if(number == index->own) continue;
+
+        PostSegment* seg = add_segment(index, number);
+        if(seg) settle_segment(index, seg);
+    }
+    closedir(d);
+}
+
+/**
+ * @function post_index_open
+ * @brief Map and index every segment of an open post log
+ *
+ * @param index Index to initialize
+ * @param log Log opened with post_log_open()
+ * @return 0 on success, -1 on failure
+ *
+ * @note Startup cost is one pass over the headers of all stored posts
+ *       (the payload pages are never touched); CRCs were checked when
+ *       the segments were written or recovered
+ */
+int post_index_open(PostIndex* index, PostLog* log){
+    memset(index, 0, sizeof(*index));
+    index->log = log;
+    atomic_init(&index->foreign, 0);
+    if(pthread_rwlock_init(&index->lock, NULL) != 0) return -1;
+
+    size_t size;
+    post_log_position(log, &index->own, &size);
+    scan_directory(index);
+    if(!add_segment(index, index->own)) return -1;
+    post_index_refresh(index);
+    return 0;
+}
+
+/**
+ * @function post_index_refresh
+ * @brief Index records that became durable since the last call
+ *
+ * @details
+ *  - Meant to run after every group commit (the log's notify callback)
+ *  - When the log moved to a new segment the previous one is finished
+ *    from its final size
+ *  - While foreign segments exist the directory is rescanned as well, as
+ *    the other process may also have started a new segment
+ */
+void post_index_refresh(PostIndex* index){
+    unsigned own;
+    size_t size;
+
+    pthread_rwlock_wrlock(&index->lock);
+    post_log_position(index->log, &own, &size);
+    if(own != index->own){
+        PostSegment* previous = find_segment(index, index->own);
+        if(previous) settle_segment(index, previous);
+        index->own = own;
+        add_segment(index, own);
+    }
+
+    PostSegment* seg = find_segment(index, own);
+    if(seg) scan_segment(index, seg, size);
+    if(atomic_load(&index->foreign)) scan_directory(index);
+    pthread_rwlock_unlock(&index->lock);
+}
+
+/**
+ * @function post_index_get
+ * @brief Find a post by id
+ *
+ * @return 1 and view filled if found, 0 otherwise
+ *
+ * @details Two binary searches: the segment by number, then the record
+ *          offset; an id that does not point at a record start is not found
+ */
+int post_index_get(PostIndex* index, uint64_t id, PostView* view){
+    if(atomic_load(&index->foreign)) post_index_refresh(index);
+
+    int found = 0;
+    uint32_t off = (uint32_t)id;
+
+    pthread_rwlock_rdlock(&index->lock);
+    PostSegment* seg = find_segment(index, (unsigned)(id >> 32));
+    if(seg){
+        size_t lo = 0, hi = seg->count;
+        while(lo < hi){
+            size_t mid = (lo + hi) / 2;
+            if(seg->offsets[mid] < off) lo = mid + 1;
+            else hi = mid;
+        }
+        if(lo < seg->count && seg->offsets[lo] == off){
+            view_at(seg, off, view);
+            found = 1;
+        }
+    }
+    pthread_rwlock_unlock(&index->lock);
+    return found;
+}
+
+/**
+ * @function post_index_list
+ * @brief A user's latest posts, newest first
+ *
+ * @param user Author
+ * @param views Filled with up to max posts
+ * @return Number of posts filled in (0 for an unknown user)
+ */
+int post_index_list(PostIndex* index, const char* user, PostView* views, int max){
+    if(atomic_load(&index->foreign)) post_index_refresh(index);
+
+    int n = 0;
+    pthread_rwlock_rdlock(&index->lock);
+    PostAuthor* author = find_author(index, user, strlen(user), 0);
+    while(author && n < max && (size_t)n < author->count){
+        uint64_t id = author->ids[author->count - 1 - n];
+        view_at(find_segment(index, (unsigned)(id >> 32)), (uint32_t)id, &views[n]);
+        n++;
+    }
+    pthread_rwlock_unlock(&index->lock);
+    return n;
+}
+
+/**
+ * @function post_index_close
+ * @brief Unmap every segment and free the indexes
+ *
+ * @warning Views handed out earlier point into the mappings and become
+ *          invalid here
+ */
+void post_index_close(PostIndex* index){
+    for(int i = 0; i < index->segment_count; i++){
+        PostSegment* seg = &index->segments[i];
+        munmap((void*)seg->base, POST_LOG_SEGMENT_BYTES);
+        if(seg->fd != -1) close(seg->fd);
+        free(seg->offsets);
+    }
+    for(size_t i = 0; i < index->author_cap; i++){
+        free(index->authors[i].name);
+        free(index->authors[i].ids);
+    }
+    free(index->segments);
+    free(index->authors);
+    pthread_rwlock_destroy(&index->lock);
+}
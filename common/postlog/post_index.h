@@ -0,0 +1,104 @@
+#ifndef POST_INDEX_H
+#define POST_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "post_log.h"
+
+#define POST_INDEX_LIST_MAX 100
+
+/**
+ * @struct PostSegment
+ * @brief One mapped segment and the offsets of the records indexed in it
+ *
+ * @member number Segment number (posts-<number>.log)
+ * @member fd Open while the segment may still grow, -1 once final
+ * @member base Read-only mapping of POST_LOG_SEGMENT_BYTES, kept until
+ *         post_index_close(), so pointers into it never go stale
+ * @member indexed Bytes scanned so far (a record boundary)
+ * @member offsets Start of every indexed record, ascending
+ * @member count Entries in offsets
+ * @member cap Allocated entries
+ * @member foreign 1 while another process (hot upgrade) appends to it
+ */
+typedef struct {
+    unsigned number;
+    int fd;
+    const char* base;
+    size_t indexed;
+    uint32_t* offsets;
+    size_t count;
+    size_t cap;
+    int foreign;
+} PostSegment;
+
+/**
+ * @struct PostAuthor
+ * @brief Ids of one user's posts, in the order they were indexed
+ */
+typedef struct {
+    char* name;
+    uint64_t* ids;
+    size_t count;
+    size_t cap;
+} PostAuthor;
+
+/**
+ * @struct PostView
+ * @brief A post as found in the mapping (nothing is copied)
+ *
+ * @member id Post id: segment number << 32 | offset of its record
+ * @member time_ns When it was appended (CLOCK_REALTIME)
+ * @member user Author, user_len bytes, not NUL-terminated
+ * @member body Article, body_len bytes, not NUL-terminated
+ */
+typedef struct {
+    uint64_t id;
+    uint64_t time_ns;
+    const char* user;
+    size_t user_len;
+    const char* body;
+    size_t body_len;
+} PostView;
+
+/**
+ * @struct PostIndex
+ * @brief Read side of a post log: mapped segments, an id index and a per-user index
+ *
+ * @member log Log whose durable records are indexed
+ * @member lock Readers look up, post_index_refresh() adds records
+ * @member segments Segments sorted by number
+ * @member segment_count Entries in segments
+ * @member segment_cap Allocated entries
+ * @member own Number of the segment the log appends to (indexed up to its durable size)
+ * @member authors Open-addressing hash table by name (author_cap slots, a power of two)
+ * @member author_count Used slots
+ * @member author_cap Slot count
+ * @member foreign Segments another process still appends to; while
+ *         non-zero, lookups refresh first
+ * @member posts Records indexed
+ */
+typedef struct {
+    PostLog* log;
+    pthread_rwlock_t lock;
+    PostSegment* segments;
+    int segment_count;
+    int segment_cap;
+    unsigned own;
+    PostAuthor* authors;
+    size_t author_count;
+    size_t author_cap;
+    atomic_int foreign;
+    uint64_t posts;
+} PostIndex;
+
+int post_index_open(PostIndex* index, PostLog* log);
+void post_index_refresh(PostIndex* index);
+int post_index_get(PostIndex* index, uint64_t id, PostView* view);
+int post_index_list(PostIndex* index, const char* user, PostView* views, int max);
+void post_index_close(PostIndex* index);
+
+#endif
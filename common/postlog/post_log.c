@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "post_log.h"
+
+/*
+ * Posts are appended to numbered segment files in one directory:
+ * posts-00000001.log, posts-00000002.log, ... A segment being written is
+ * named *.log.open and held with flock(); it is renamed to *.log (sealed)
+ * when full or when the log is closed. A *.log.open file nobody holds is
+ * what a crash left behind: post_log_open() validates it record by
+ * record, cuts a torn tail and seals it.
+ *
+ * Appenders only copy their record into a staging buffer. One committer
+ * thread takes whatever was staged as a group, writes it with one write()
+ * and makes it durable with one fdatasync(). While it syncs, new records
+ * stage into the other buffer and form the next group.
+ */
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @function crc_init
+ * @brief Build the CRC-32 (IEEE 802.3, reflected) lookup table
+ */
+static void crc_init(void){
+    for(uint32_t i = 0; i < 256; i++){
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++){
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+/**
+ * @function crc_update
+ * @brief Continue a CRC-32 over len more bytes (start and finish with ~0)
+ */
+static uint32_t crc_update(uint32_t crc, const void* data, size_t len){
+    const unsigned char* p = data;
+    for(size_t i = 0; i < len; i++){
+        crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/**
+ * @function record_crc
+ * @brief CRC of a record: header after the crc field, then the payload
+ */
+static uint32_t record_crc(const PostRecord* rec, const char* payload){
+    uint32_t crc = ~0u;
+    crc = crc_update(crc, (const char*)rec + offsetof(PostRecord, time_ns),
+                     sizeof(*rec) - offsetof(PostRecord, time_ns));
+    crc = crc_update(crc, payload, (size_t)rec->user_len + rec->body_len);
+    return ~crc;
+}
+
+static uint64_t clock_ns(clockid_t clock){
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @function post_log_segment_path
+ * @brief Path of segment n, sealed or still open
+ */
+void post_log_segment_path(const PostLog* log, unsigned n, int open, char* path, size_t size){
+    snprintf(path, size, "%s/posts-%08u.log%s", log->dir, n, open ? ".open" : "");
+}
+
+/**
+ * @function seal_segment
+ * @brief Rename an open segment to its sealed name and persist the rename
+ *
+ * @param fd Descriptor of the segment, closed here (which drops its lock)
+ */
+static int seal_segment(PostLog* log, unsigned n, int fd){
+    char from[POST_LOG_PATH_MAX];
+    char to[POST_LOG_PATH_MAX];
+    post_log_segment_path(log, n, 1, from, sizeof(from));
+    post_log_segment_path(log, n, 0, to, sizeof(to));
+
+    int ret = rename(from, to) == -1 || fsync(log->dir_fd) == -1 ? -1 : 0;
+    close(fd);
+    return ret;
+}
+
+/**
+ * @function recover_segment
+ * @brief Validate a segment left open by a process that died
+ *
+ * @return 0 if recovered or still in use by a running process, -1 on failure
+ *
+ * @details
+ *  - A segment another process still holds (a predecessor during a hot
+ *    upgrade) is left alone
+ *  - Records are checked in order (magic, lengths, CRC); the file is cut
+ *    at the first bad one: a group interrupted mid-write was never
+ *    acknowledged, so nothing durable is lost
+ */
+static int recover_segment(PostLog* log, unsigned n){
+    char path[POST_LOG_PATH_MAX];
+    post_log_segment_path(log, n, 1, path, sizeof(path));
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if(fd == -1) return -1;
+    if(flock(fd, LOCK_EX | LOCK_NB) == -1){
+        close(fd);
+        return errno == EWOULDBLOCK ? 0 : -1;
+    }
+
+    struct stat st;
+    char* payload = malloc(2 * POST_LOG_MAX_FIELD);
+    if(!payload || fstat(fd, &st) == -1){
+        free(payload);
+        close(fd);
+        return -1;
+    }
+
+    off_t off = 0;
+    for(;;){
+        PostRecord rec;
+        if(pread(fd, &rec, sizeof(rec), off) != (ssize_t)sizeof(rec)) break;
+        if(rec.magic != POST_LOG_MAGIC || rec.user_len > POST_LOG_MAX_FIELD ||
+           rec.body_len > POST_LOG_MAX_FIELD) break;
+        size_t len = (size_t)rec.user_len + rec.body_len;
+        if(pread(fd, payload, len, off + sizeof(rec)) != (ssize_t)len) break;
+        if(record_crc(&rec, payload) != rec.crc) break;
+        off += sizeof(rec) + len;
+        log->recovered++;
+    }
+    free(payload);
+
+    if(off < st.st_size){
+        log->truncated += st.st_size - off;
+        if(ftruncate(fd, off) == -1 || fdatasync(fd) == -1){
+            close(fd);
+            return -1;
+        }
+    }
+    return seal_segment(log, n, fd);
+}
+
+/**
+ * @function open_segment
+ * @brief Create the next segment to append to, numbered from n upwards
+ *
+ * @note Numbers a concurrent process (hot upgrade) took first are
+ *       skipped: O_EXCL catches its open segment, the access() check
+ *       one it already sealed
+ */
+static int open_segment(PostLog* log, unsigned n){
+    char path[POST_LOG_PATH_MAX];
+    char sealed[POST_LOG_PATH_MAX];
+    int fd;
+    for(;; n++){
+        post_log_segment_path(log, n, 1, path, sizeof(path));
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+        if(fd == -1 && errno != EEXIST) return -1;
+        if(fd == -1) continue;
+
+        post_log_segment_path(log, n, 0, sealed, sizeof(sealed));
+        if(access(sealed, F_OK) == -1) break;
+        unlink(path);
+        close(fd);
+    }
+    if(flock(fd, LOCK_EX) == -1 || fsync(log->dir_fd) == -1){
+        close(fd);
+        return -1;
+    }
+    log->fd = fd;
+    log->segment = n;
+    log->segment_size = 0;
+    atomic_store(&log->durable_pos, (uint64_t)n << 32);
+    return 0;
+}
+
+/**
+ * @function scan_segments
+ * @brief Recover crashed segments and find the highest segment number
+ *
+ * @return Highest number in use (0 for an empty directory), -1 on failure
+ */
+static long scan_segments(PostLog* log){
+    DIR* d = opendir(log->dir);
+    if(!d) return -1;
+
+    long last = 0;
+    struct dirent* entry;
+    while((entry = readdir(d))){
+        unsigned n;
+        int end = 0;
+        if(sscanf(entry->d_name, "posts-%8u.log%n", &n, &end) != 1 || end == 0) continue;
+        if(n > last) last = n;
+        if(strcmp(entry->d_name + end, ".open") == 0 && recover_segment(log, n) == -1){
+            closedir(d);
+            return -1;
+        }
+    }
+    closedir(d);
+    return last;
+}
+
+/**
+ * @function post_log_open
+ * @brief Open (creating if needed) the post log in dir
+ *
+ * @param log Log to initialize
+ * @param dir Segment directory
+ * @param delay_us Longest time a group waits for more records (0 = commit
+ *        as soon as the committer is free)
+ * @return 0 on success, -1 with errno set on failure
+ *
+ * @details
+ *  - Segments a crashed process left open are recovered first
+ *    (recovered/truncated tell what was found)
+ *  - Appends always go to a new segment, so two processes sharing the
+ *    directory during a hot upgrade never write the same file
+ */
+int post_log_open(PostLog* log, const char* dir, unsigned delay_us){
+    pthread_once(&crc_once, crc_init);
+    memset(log, 0, sizeof(*log));
+    log->fd = -1;
+    log->dir_fd = -1;
+    log->delay_ns = (uint64_t)delay_us * 1000;
+    atomic_init(&log->durable_lsn, 0);
+    atomic_init(&log->durable_pos, 0);
+    atomic_init(&log->failed, 0);
+    atomic_init(&log->commits, 0);
+
+    if(mkdir(dir, 0755) == -1 && errno != EEXIST) return -1;
+    log->dir = strdup(dir);
+    log->stage = malloc(POST_LOG_STAGE_BYTES);
+    log->spare = malloc(POST_LOG_STAGE_BYTES);
+    if(!log->dir || !log->stage || !log->spare) goto fail;
+
+    log->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(log->dir_fd == -1) goto fail;
+
+    long last = scan_segments(log);
+    if(last == -1 || open_segment(log, (unsigned)last + 1) == -1) goto fail;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log->ready, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&log->done, NULL);
+    pthread_mutex_init(&log->lock, NULL);
+    return 0;
+
+fail:;
+    int err = errno;
+    if(log->dir_fd != -1) close(log->dir_fd);
+    free(log->dir);
+    free(log->stage);
+    free(log->spare);
+    errno = err;
+    return -1;
+}
+
+/**
+ * @function write_group
+ * @brief Append one group to the current segment and make it durable
+ *
+ * @details A group that would overflow a non-empty segment starts the
+ *          next one, so records never straddle two segments
+ */
+static int write_group(PostLog* log, const char* data, size_t len){
+    if(log->segment_size && log->segment_size + len > POST_LOG_SEGMENT_BYTES){
+        if(seal_segment(log, log->segment, log->fd) == -1) return -1;
+        log->fd = -1;
+        if(open_segment(log, log->segment + 1) == -1) return -1;
+    }
+
+    size_t off = 0;
+    while(off < len){
+        ssize_t n = write(log->fd, data + off, len - off);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        off += n;
+    }
+    log->segment_size += len;
+    if(fdatasync(log->fd) == -1) return -1;
+    atomic_store(&log->durable_pos, (uint64_t)log->segment << 32 | log->segment_size);
+    return 0;
+}
+
+/**
+ * @function committer_main
+ * @brief Committer thread: one write() and one fdatasync() per group
+ *
+ * @details
+ *  - Once a record is staged, waits up to delay_ns from its arrival for
+ *    more (less when half the staging buffer fills), then swaps the
+ *    buffers and commits the group outside the lock
+ *  - Advances durable_lsn to the group's last record, wakes
+ *    post_log_wait() callers and runs the notify callback
+ *  - A failed write or fdatasync is final: the state of the page cache
+ *    is unknown afterwards, so the log stops accepting records and
+ *    reports the failure instead of retrying
+ */
+static void* committer_main(void* arg){
+    PostLog* log = arg;
+
+    pthread_mutex_lock(&log->lock);
+    for(;;){
+        while(!log->stop && log->stage_len == 0){
+            pthread_cond_wait(&log->ready, &log->lock);
+        }
+        if(log->stage_len == 0) break;
+
+        uint64_t deadline_ns = log->staged_ns + log->delay_ns;
+        while(!log->stop && log->stage_len < POST_LOG_STAGE_BYTES / 2 &&
+              clock_ns(CLOCK_MONOTONIC) < deadline_ns){
+            struct timespec ts = {
+                .tv_sec = deadline_ns / 1000000000ull,
+                .tv_nsec = deadline_ns % 1000000000ull
+            };
+            pthread_cond_timedwait(&log->ready, &log->lock, &ts);
+        }
+
+        char* group = log->stage;
+        size_t len = log->stage_len;
+        uint64_t last_lsn = log->next_lsn;
+        log->stage = log->spare;
+        log->spare = group;
+        log->stage_len = 0;
+        pthread_cond_broadcast(&log->done);
+        pthread_mutex_unlock(&log->lock);
+
+        int failed = write_group(log, group, len) == -1;
+        if(failed){
+            perror("post log commit failed");
+            atomic_store(&log->failed, 1);
+        } else {
+            atomic_store(&log->durable_lsn, last_lsn);
+            atomic_fetch_add(&log->commits, 1);
+        }
+
+        pthread_mutex_lock(&log->lock);
+        pthread_cond_broadcast(&log->done);
+        pthread_mutex_unlock(&log->lock);
+        if(log->notify) log->notify(log->notify_ctx, atomic_load(&log->durable_lsn), failed);
+        pthread_mutex_lock(&log->lock);
+        if(failed) break;
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+/**
+ * @function post_log_start
+ * @brief Start the committer thread
+ *
+ * @param notify Called from the committer after each group (may be NULL)
+ * @param ctx Passed to notify
+ */
+int post_log_start(PostLog* log, PostLogNotify notify, void* ctx){
+    log->notify = notify;
+    log->notify_ctx = ctx;
+    return pthread_create(&log->thread, NULL, committer_main, log) == 0 ? 0 : -1;
+}
+
+/**
+ * @function post_log_append
+ * @brief Stage one post for the next group commit
+ *
+ * @param user Author
+ * @param body Article, body_len bytes
+ * @return Sequence number of the record (1, 2, ...), 0 if the log failed,
+ *         is closing or a field exceeds POST_LOG_MAX_FIELD
+ *
+ * @details
+ *  - The record is built and checksummed before taking the lock; inside
+ *    it is one memcpy() into the staging buffer
+ *  - Blocks only while the staging buffer is full (the committer is
+ *    behind by a whole buffer)
+ *  - The record is durable once post_log_durable() reaches the returned
+ *    number (or post_log_wait() returns 0)
+ */
+uint64_t post_log_append(PostLog* log, const char* user, const char* body, size_t body_len){
+    size_t user_len = strlen(user);
+    if(user_len > POST_LOG_MAX_FIELD || body_len > POST_LOG_MAX_FIELD) return 0;
+
+    PostRecord rec;
+    rec.magic = POST_LOG_MAGIC;
+    rec.time_ns = clock_ns(CLOCK_REALTIME);
+    rec.user_len = user_len;
+    rec.body_len = body_len;
+    uint32_t crc = ~0u;
+    crc = crc_update(crc, (const char*)&rec + offsetof(PostRecord, time_ns),
+                     sizeof(rec) - offsetof(PostRecord, time_ns));
+    crc = crc_update(crc, user, user_len);
+    rec.crc = ~crc_update(crc, body, body_len);
+
+    size_t need = sizeof(rec) + user_len + body_len;
+    uint64_t lsn = 0;
+
+    pthread_mutex_lock(&log->lock);
+    while(!log->stop && !atomic_load(&log->failed) &&
+          log->stage_len + need > POST_LOG_STAGE_BYTES){
+        pthread_cond_wait(&log->done, &log->lock);
+    }
+    if(!log->stop && !atomic_load(&log->failed)){
+        char* p = log->stage + log->stage_len;
+        memcpy(p, &rec, sizeof(rec));
+        memcpy(p + sizeof(rec), user, user_len);
+        memcpy(p + sizeof(rec) + user_len, body, body_len);
+
+        size_t before = log->stage_len;
+        if(before == 0) log->staged_ns = clock_ns(CLOCK_MONOTONIC);
+        log->stage_len += need;
+        lsn = ++log->next_lsn;
+        if(before == 0 || (before < POST_LOG_STAGE_BYTES / 2 &&
+                           log->stage_len >= POST_LOG_STAGE_BYTES / 2)){
+            pthread_cond_signal(&log->ready);
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    return lsn;
+}
+
+/**
+ * @function post_log_wait
+ * @brief Block until record lsn is durable
+ *
+ * @return 0 once it is on disk, -1 if the log failed first
+ */
+int post_log_wait(PostLog* log, uint64_t lsn){
+    pthread_mutex_lock(&log->lock);
+    while(atomic_load(&log->durable_lsn) < lsn && !atomic_load(&log->failed)){
+        pthread_cond_wait(&log->done, &log->lock);
+    }
+    int ret = atomic_load(&log->durable_lsn) >= lsn ? 0 : -1;
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
+
+/**
+ * @function post_log_durable
+ * @brief Sequence number of the last record on disk (lock-free)
+ */
+uint64_t post_log_durable(PostLog* log){
+    return atomic_load(&log->durable_lsn);
+}
+
+/**
+ * @function post_log_position
+ * @brief Segment currently appended to and its size on disk
+ *
+ * @note Both come from one atomic, so a reader never pairs a new segment
+ *       with the old segment's size
+ */
+void post_log_position(PostLog* log, unsigned* segment, size_t* size){
+    uint64_t pos = atomic_load(&log->durable_pos);
+    *segment = (unsigned)(pos >> 32);
+    *size = (size_t)(pos & 0xffffffffu);
+}
+
+/**
+ * @function post_log_failed
+ * @brief 1 once a commit failed and the log stopped accepting records
+ */
+int post_log_failed(PostLog* log){
+    return atomic_load(&log->failed);
+}
+
+/**
+ * @function post_log_close
+ * @brief Commit what is staged, stop the committer and seal the segment
+ *
+ * @note Appends racing with close return 0 (not stored)
+ */
+void post_log_close(PostLog* log){
+    pthread_mutex_lock(&log->lock);
+    log->stop = 1;
+    pthread_cond_broadcast(&log->ready);
+    pthread_cond_broadcast(&log->done);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->thread, NULL);
+
+    if(log->fd != -1) seal_segment(log, log->segment, log->fd);
+    close(log->dir_fd);
+    pthread_cond_destroy(&log->ready);
+    pthread_cond_destroy(&log->done);
+    pthread_mutex_destroy(&log->lock);
+    free(log->dir);
+    free(log->stage);
+    free(log->spare);
+}
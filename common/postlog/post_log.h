@@ -0,0 +1,115 @@
+#ifndef POST_LOG_H
+#define POST_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define POST_LOG_MAGIC 0x54534f50u
+#define POST_LOG_SEGMENT_BYTES (64u << 20)
+#define POST_LOG_STAGE_BYTES (1u << 20)
+#define POST_LOG_MAX_FIELD 65535
+#define POST_LOG_DEFAULT_DELAY_US 1000
+#define POST_LOG_PATH_MAX 4096
+
+/**
+ * @struct PostRecord
+ * @brief On-disk header of one post, followed by user_len + body_len bytes
+ *
+ * @member magic POST_LOG_MAGIC, marks the start of a record
+ * @member crc CRC-32 of everything after this field, payload included
+ * @member time_ns Wall clock time of the append (CLOCK_REALTIME)
+ * @member user_len Length of the author's username
+ * @member body_len Length of the article
+ *
+ * @note Fields are host byte order: segments are read back by the host
+ *       that wrote them
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;
+    uint64_t time_ns;
+    uint32_t user_len;
+    uint32_t body_len;
+} PostRecord;
+
+/**
+ * @brief Called by the committer after every group commit
+ *
+ * @param ctx Pointer given to post_log_start()
+ * @param durable_lsn Every record up to this sequence number is on disk
+ * @param failed 1 once a write or fdatasync failed: later records never
+ *               become durable
+ */
+typedef void (*PostLogNotify)(void* ctx, uint64_t durable_lsn, int failed);
+
+/**
+ * @struct PostLog
+ * @brief Append-only segmented log of posts with group commit
+ *
+ * @member dir Directory holding the segments (owned copy)
+ * @member dir_fd Open descriptor of dir, fsync()ed when segments are
+ *         created or sealed
+ * @member fd Segment currently appended to
+ * @member segment Number of that segment
+ * @member segment_size Bytes written to it
+ * @member delay_ns Longest time the first record of a group waits for others
+ * @member lock Protects the staging buffers, next_lsn and stop
+ * @member ready Signals the committer: records staged, or stop
+ * @member done Signals appenders: a group was taken (stage space) or committed
+ * @member stage Buffer appenders copy records into
+ * @member stage_len Bytes used in stage
+ * @member spare Buffer the committer is writing, swapped with stage per group
+ * @member staged_ns When the first record of the staged group arrived
+ * @member next_lsn Sequence number of the last record appended
+ * @member durable_lsn Sequence number of the last record on disk
+ * @member durable_pos Segment number (high 32 bits) and size (low 32 bits)
+ *         of the segment appended to, up to the last record on disk
+ * @member failed 1 once a write or fdatasync failed
+ * @member stop 1 once post_log_close() asked the committer to finish
+ * @member thread Committer thread
+ * @member notify Optional callback after each commit
+ * @member notify_ctx Argument for notify
+ * @member recovered Records found intact in a crashed segment by post_log_open()
+ * @member truncated Torn bytes cut from the end of such segments
+ * @member commits Group commits so far (one fdatasync each)
+ */
+typedef struct {
+    char* dir;
+    int dir_fd;
+    int fd;
+    unsigned segment;
+    size_t segment_size;
+    uint64_t delay_ns;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t done;
+    char* stage;
+    size_t stage_len;
+    char* spare;
+    uint64_t staged_ns;
+    uint64_t next_lsn;
+    atomic_ullong durable_lsn;
+    atomic_ullong durable_pos;
+    atomic_int failed;
+    int stop;
+    pthread_t thread;
+    PostLogNotify notify;
+    void* notify_ctx;
+    uint64_t recovered;
+    uint64_t truncated;
+    atomic_ullong commits;
+} PostLog;
+
+int post_log_open(PostLog* log, const char* dir, unsigned delay_us);
+int post_log_start(PostLog* log, PostLogNotify notify, void* ctx);
+uint64_t post_log_append(PostLog* log, const char* user, const char* body, size_t body_len);
+int post_log_wait(PostLog* log, uint64_t lsn);
+uint64_t post_log_durable(PostLog* log);
+void post_log_position(PostLog* log, unsigned* segment, size_t* size);
+void post_log_segment_path(const PostLog* log, unsigned n, int open, char* path, size_t size);
+int post_log_failed(PostLog* log);
+void post_log_close(PostLog* log);
+
+#endif
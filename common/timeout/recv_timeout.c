@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "recv_timeout.h"
+
+static uint64_t now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * @function recv_timeout_parse
+ * @brief Parse "idle=300,handshake=30,login=120" (seconds)
+ *
+ * @param config Updated on success; names left out keep their value
+ * @param spec Comma-separated name=seconds pairs
+ * @return 0 on success, -1 on an unknown name, a bad value or a spec
+ *         too long to be one (config is then left unchanged)
+ *
+ * @details A value must be decimal digits only: "idle=", "idle=abc",
+ *          "idle=-1" and "idle=5s" are rejected rather than read as 0 or 5
+ */
+int recv_timeout_parse(RecvTimeoutConfig* config, const char* spec){
+    char copy[128];
+    if(strlen(spec) >= sizeof(copy)) return -1;
+    strcpy(copy, spec);
+    RecvTimeoutConfig parsed = *config;
+
+    for(char* tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")){
+        char* eq = strchr(tok, '=');
+        if(!eq || eq[1] < '0' || eq[1] > '9') return -1;
+        *eq = '\0';
+
+        char* end;
+        errno = 0;
+        unsigned long value = strtoul(eq + 1, &end, 10);
+        if(*end != '\0' || errno == ERANGE || value > UINT_MAX) return -1;
+        unsigned seconds = (unsigned)value;
+
+        if(strcmp(tok, "idle") == 0) parsed.idle = seconds;
+        else if(strcmp(tok, "handshake") == 0) parsed.handshake = seconds;
+        else if(strcmp(tok, "login") == 0) parsed.login = seconds;
+        else return -1;
+    }
+    *config = parsed;
+    return 0;
+}
+
+/**
+ * @function recv_timeout_init
+ * @brief Start the handshake and login clocks of a just-accepted connection
+ */
+void recv_timeout_init(RecvTimeout* t, const RecvTimeoutConfig* config){
+    t->config = config;
+    t->accepted_ms = now_ms();
+    t->command_ms = t->accepted_ms;
+    t->got_command = 0;
+    t->got_login = 0;
+    t->armed_ms = 0;
+    t->reason = NULL;
+}
+
+/**
+ * @function recv_timeout_arm
+ * @brief Set the receive timeout for the next recv() to the nearest deadline
+ *
+ * @param t Connection deadlines
+ * @param sockfd Blocking socket about to be read
+ * @param logged_in 1 if the connection is logged in; once seen, the
+ *                  login deadline is gone for good (BYE does not restore it)
+ * @return 0 when the socket is ready to be read, -1 with errno ETIMEDOUT
+ *         if a deadline has already passed, or errno from setsockopt()
+ *
+ * @details
+ *  - Candidates are the idle timeout from the last complete command, the
+ *    handshake deadline until the first command and the login deadline
+ *    until USER first succeeds
+ *  - Call it before every recv(), not once per line: the timeout is what
+ *    is left of the deadline, so a line read over several recv() calls
+ *    still has to complete in time
+ *  - setsockopt() is only called when the value changes
+ *  - Clears errno on success so recv_timeout_expired() can tell a
+ *    timed-out read from a closed connection
+ */
+int recv_timeout_arm(RecvTimeout* t, int sockfd, int logged_in){
+    const RecvTimeoutConfig* c = t->config;
+    uint64_t now = now_ms();
+    uint64_t elapsed = now - t->accepted_ms;
+    long wait_ms = 0;
+    t->reason = NULL;
+    if(logged_in) t->got_login = 1;
+
+    if(c->idle){
+        wait_ms = (long)c->idle * 1000 - (long)(now - t->command_ms);
+        t->reason = "idle";
+    }
+    if(!t->got_command && c->handshake){
+        long left = (long)c->handshake * 1000 - (long)elapsed;
+        if(!t->reason || left < wait_ms){ wait_ms = left; t->reason = "handshake"; }
+    }
+    if(!t->got_login && c->login){
+        long left = (long)c->login * 1000 - (long)elapsed;
+        if(!t->reason || left < wait_ms){ wait_ms = left; t->reason = "login"; }
+    }
+
+    if(t->reason && wait_ms <= 0){
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    if(wait_ms != t->armed_ms){
+        struct timeval tv;
+        tv.tv_sec = wait_ms / 1000;
+        tv.tv_usec = (wait_ms % 1000) * 1000;
+        if(setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) return -1;
+        t->armed_ms = wait_ms;
+    }
+    errno = 0;
+    return 0;
+}
+
+/**
+ * @function recv_timeout_command
+ * @brief Note that a command was read, ending the handshake deadline
+ *        and restarting the idle timeout
+ */
+void recv_timeout_command(RecvTimeout* t){
+    t->got_command = 1;
+    t->command_ms = now_ms();
+}
+
+/**
+ * @function recv_timeout_expired
+ * @brief Name the timeout behind a failed arm or read, if any
+ *
+ * @return "idle", "handshake" or "login" when errno says the read timed
+ *         out (EAGAIN from SO_RCVTIMEO, ETIMEDOUT from recv_timeout_arm()),
+ *         NULL when the connection failed or was closed for another reason
+ */
+const char* recv_timeout_expired(const RecvTimeout* t){
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT) return t->reason;
+    return NULL;
+}
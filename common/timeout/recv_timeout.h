@@ -0,0 +1,59 @@
+#ifndef RECV_TIMEOUT_H
+#define RECV_TIMEOUT_H
+
+#include <stdint.h>
+
+#define RECV_TIMEOUT_IDLE 300
+#define RECV_TIMEOUT_HANDSHAKE 30
+#define RECV_TIMEOUT_LOGIN 120
+
+/**
+ * @struct RecvTimeoutConfig
+ * @brief Connection timeouts in seconds, 0 disables one
+ *
+ * @member idle Longest time from one complete command to the next
+ * @member handshake Longest time from accept to the first command
+ * @member login Longest time from accept to the first successful USER
+ */
+typedef struct {
+    unsigned idle;
+    unsigned handshake;
+    unsigned login;
+} RecvTimeoutConfig;
+
+/**
+ * @struct RecvTimeout
+ * @brief Deadlines of one blocking connection, enforced with SO_RCVTIMEO
+ *
+ * @member config Timeouts shared by every connection
+ * @member accepted_ms Monotonic time of the accept, in milliseconds
+ * @member command_ms Monotonic time the last complete command was read
+ *                    (the accept until the first one)
+ * @member got_command 1 once a first command was read
+ * @member got_login 1 once the connection was seen logged in
+ * @member armed_ms SO_RCVTIMEO currently set on the socket, 0 for none
+ * @member reason Timeout that fires if the pending read times out
+ *
+ * @note A thread blocked in recv() cannot be woken by a timer, so the
+ *       nearest deadline becomes the receive timeout of the next read.
+ *       Every deadline is absolute: re-arming before each recv() only
+ *       waits for what is left, so bytes trickled without a complete
+ *       line cannot push any of them back
+ */
+typedef struct {
+    const RecvTimeoutConfig* config;
+    uint64_t accepted_ms;
+    uint64_t command_ms;
+    int got_command;
+    int got_login;
+    long armed_ms;
+    const char* reason;
+} RecvTimeout;
+
+int recv_timeout_parse(RecvTimeoutConfig* config, const char* spec);
+void recv_timeout_init(RecvTimeout* t, const RecvTimeoutConfig* config);
+int recv_timeout_arm(RecvTimeout* t, int sockfd, int logged_in);
+void recv_timeout_command(RecvTimeout* t);
+const char* recv_timeout_expired(const RecvTimeout* t);
+
+#endif